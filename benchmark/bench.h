@@ -0,0 +1,85 @@
+#ifndef BCACHE_FS_BENCHMARK_BENCH_HEADER
+#define BCACHE_FS_BENCHMARK_BENCH_HEADER
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Benchmark harness
+// -------------------------------------------------------------------
+//  Every operation is timed, results are printed as one JSON object per
+//  line so runs can be compared by a script
+//
+//      {"name": "lookup_inodes", "ops": 1000, "seconds": 0.01, "ops_per_s": ...,
+//       "items_per_s": ..., "mb_per_s": ..., "p50_us": ..., "p90_us": ..., "p99_us": ..., "max_us": ...}
+//
+//  items are what the benchmark processes (keys, paths), bytes are the bytes read.
+//
+struct BenchResult {
+    std::string         name;
+    uint64_t            items = 0;
+    uint64_t            bytes = 0;
+    std::vector<double> latencies; // seconds, one per operation
+
+    double seconds() const {
+        double total = 0;
+        for (auto latency: latencies) {
+            total += latency;
+        }
+        return total;
+    }
+
+    double percentile(std::vector<double> const &sorted, double p) const {
+        if (sorted.empty()) {
+            return 0;
+        }
+        auto index = (std::size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+
+    void report(FILE *out = stdout) const {
+        auto sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+
+        auto total = std::max(seconds(), 1e-12);
+        auto us    = [&](double p) { return percentile(sorted, p) * 1e6; };
+        auto max   = sorted.empty() ? 0 : sorted.back() * 1e6;
+
+        fprintf(out,
+                "{\"name\": \"%s\", \"ops\": %zu, \"seconds\": %.6f, \"ops_per_s\": %.1f, \"items_per_s\": %.1f, "
+                "\"mb_per_s\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}\n",
+                name.c_str(), sorted.size(), total, (double)sorted.size() / total, (double)items / total,
+                (double)bytes / total / (1024.0 * 1024.0), us(50), us(90), us(99), max);
+        fflush(out);
+    }
+};
+
+struct Bench {
+    public:
+    Bench(std::string name) { _result.name = std::move(name); }
+
+    // time a single operation, fun returns the number of items it processed
+    template <typename Fun>
+    void op(Fun fun) {
+        auto start = std::chrono::steady_clock::now();
+        auto items = fun();
+        auto end   = std::chrono::steady_clock::now();
+
+        _result.items += (uint64_t)items;
+        _result.latencies.push_back(std::chrono::duration<double>(end - start).count());
+    }
+
+    void add_bytes(uint64_t bytes) { _result.bytes += bytes; }
+
+    BenchResult const &result() const { return _result; }
+
+    ~Bench() { _result.report(); }
+
+    private:
+    BenchResult _result;
+};
+
+#endif
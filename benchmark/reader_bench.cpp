@@ -0,0 +1,250 @@
+#include "bench.h"
+
+#include "batch.h"
+#include "bcachefs.h"
+#include "logger.h"
+#include "manifest.h"
+#include "walker.h"
+
+#include <iostream>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Reader benchmarks
+// -------------------------------------------------------------------
+//  reader_bench <image> [manifest] [samples]
+//
+//  The manifest is built next to the image if it is missing or stale.
+//  Cold reads evict the image from the page cache before they start.
+
+static char const *const btree_names[] = {
+#define x(name, nr) #name,
+    BCH_BTREE_IDS()
+#undef x
+};
+
+// evict the clean pages of the file from the page cache
+static void drop_cache(std::string const &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+template <typename T>
+static void shuffle(Array<T> &items, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    for (auto n = items.size(); n > 1; --n) {
+        std::swap(items[n - 1], items[rng() % n]);
+    }
+}
+
+static void bench_scans(BCacheFSReader const &reader) {
+    for (auto type: {BTREE_ID_extents, BTREE_ID_inodes, BTREE_ID_dirents}) {
+        Bench bench(std::string("scan_") + btree_names[type]);
+
+        for (int i = 0; i < 3; ++i) {
+            bench.op([&]() {
+                auto     iter  = reader.iterator(type);
+                uint64_t count = 0;
+
+                for (auto key = iter.next_key(); key != nullptr; key = iter.next_key()) {
+                    count += 1;
+                }
+                return count;
+            });
+        }
+    }
+}
+
+// the same scans through for_each_key, the keys come one bset at a time
+static void bench_span_scans(BCacheFSReader const &reader) {
+    for (auto type: {BTREE_ID_extents, BTREE_ID_inodes, BTREE_ID_dirents}) {
+        Bench bench(std::string("span_scan_") + btree_names[type]);
+
+        for (int i = 0; i < 3; ++i) {
+            bench.op([&]() {
+                uint64_t count = 0;
+                reader.for_each_key(type, [&](KeySpan keys) { count += keys.size(); });
+                return count;
+            });
+        }
+    }
+}
+
+// full path of every entry, one readdir per directory
+static void bench_walk(BCacheFSReader const &reader) {
+    for (unsigned threads: {1u, 8u}) {
+        Bench bench("walk_tree_" + std::to_string(threads));
+
+        for (int i = 0; i < 3; ++i) {
+            bench.op([&]() { return walk_tree(reader, WalkOptions{threads}).entries.size(); });
+        }
+    }
+}
+
+static void bench_lookups(BCacheFSReader const &reader, std::size_t samples) {
+    Array<BPos> positions;
+    {
+        auto iter = reader.iterator(BTREE_ID_inodes);
+        for (auto key = iter.next_key(); key != nullptr; key = iter.next_key()) {
+            positions.push_back(iter.local(key).p);
+        }
+    }
+
+    shuffle(positions, 0);
+    positions.resize(std::min(positions.size(), samples));
+
+    Array<BTreeKey> keys;
+    keys.reserve(positions.size());
+    {
+        Bench bench("lookup_inodes");
+        for (auto &pos: positions) {
+            bench.op([&]() {
+                keys.push_back(reader.find(BTREE_ID_inodes, pos));
+                return 1;
+            });
+        }
+    }
+
+    // keys found above keep their node alive
+    Bench    bench("parse_bkey");
+    uint64_t checksum = 0;
+
+    for (int i = 0; i < 100; ++i) {
+        bench.op([&]() {
+            for (auto &key: keys) {
+                auto format = key.node ? &key.node->format : nullptr;
+                checksum += parse_bkey(key.key, format).p.offset;
+            }
+            return keys.size();
+        });
+    }
+
+    // keep the decode from being optimized out
+    if (checksum == 1) {
+        std::cerr << checksum << "\n";
+    }
+}
+
+static void bench_paths(Manifest const &manifest, std::size_t samples) {
+    Array<std::string_view> paths;
+    for (uint64_t i = 0; i < manifest.size(); ++i) {
+        paths.push_back(manifest.path(i));
+    }
+
+    shuffle(paths, 1);
+    paths.resize(std::min(paths.size(), samples));
+
+    Bench bench("resolve_path");
+    for (auto &path: paths) {
+        bench.op([&]() { return manifest.find(path) >= 0 ? 1 : 0; });
+    }
+}
+
+static void bench_reads(BCacheFSReader const &reader, Manifest const &manifest, std::string const &image,
+                        std::size_t samples) {
+    Array<uint64_t> small;
+    Array<uint64_t> large;
+
+    for (uint64_t i = 0; i < manifest.size(); ++i) {
+        auto &file = manifest.file(i);
+
+        if (file.size > 0 && file.size <= 64 * 1024) {
+            small.push_back(file.inode);
+        } else if (file.size >= 1024 * 1024) {
+            large.push_back(file.inode);
+        }
+    }
+
+    shuffle(small, 2);
+    shuffle(large, 3);
+    small.resize(std::min(small.size(), samples));
+    large.resize(std::min(large.size(), samples / 16 + 1));
+
+    auto read_files = [&](std::string const &name, Array<uint64_t> const &inodes) {
+        Bench bench(name);
+        for (auto inode: inodes) {
+            bench.op([&]() {
+                auto data = reader.read_file(inode);
+                bench.add_bytes(data.size());
+                return 1;
+            });
+        }
+    };
+
+    for (auto set: {std::make_pair("small", &small), std::make_pair("large", &large)}) {
+        if (set.second->empty()) {
+            continue;
+        }
+
+        drop_cache(image);
+        read_files(std::string("read_") + set.first + "_cold", *set.second);
+        read_files(std::string("read_") + set.first + "_warm", *set.second);
+    }
+
+    if (small.empty()) {
+        return;
+    }
+
+    // the same small files fetched 256 at a time with merged reads
+    drop_cache(image);
+    Bench bench("read_many_small_cold");
+
+    for (std::size_t i = 0; i < small.size(); i += 256) {
+        Array<uint64_t>       batch(small.begin() + i, small.begin() + std::min(small.size(), i + 256));
+        Array<Array<uint8_t>> out;
+
+        bench.op([&]() {
+            auto stats = read_many(reader, batch, out);
+            bench.add_bytes(stats.bytes);
+            return batch.size();
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: reader_bench <image> [manifest] [samples]\n";
+        return 1;
+    }
+
+    // results go to stdout, keep it clean
+    bcachefs::set_log_level(bcachefs::LogLevel::ERROR);
+
+    std::string image         = argv[1];
+    std::string manifest_path = argc > 2 ? argv[2] : image + ".manifest";
+    std::size_t samples       = argc > 3 ? std::stoul(argv[3]) : 10000;
+
+    BCacheFSReader reader(image);
+    if (!reader.valid()) {
+        std::cerr << "could not read " << image << "\n";
+        return 1;
+    }
+
+    bench_scans(reader);
+    bench_span_scans(reader);
+    bench_walk(reader);
+    bench_lookups(reader, samples);
+
+    {
+        auto manifest = std::make_unique<Manifest>(manifest_path);
+
+        if (!manifest->valid() || manifest->is_stale(reader)) {
+            manifest.reset();
+            if (!Manifest::build(reader, manifest_path)) {
+                return 1;
+            }
+            manifest = std::make_unique<Manifest>(manifest_path);
+        }
+
+        bench_paths(*manifest, samples);
+        bench_reads(reader, *manifest, image, samples);
+    }
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include "async.h"
+#include "batch.h"
+#include "logger.h"
+
+#include <new>
+
+// Frame allocator
+// -------------------------------------------------------------------
+//  Power of 2 size classes from 64 bytes to 16 KiB, bigger frames use the heap.
+//  Freed frames go to the free list of the thread that frees them.
+namespace {
+constexpr std::size_t FRAME_MIN_BITS = 6;
+constexpr std::size_t FRAME_MAX_BITS = 14;
+constexpr std::size_t FRAME_CLASSES  = FRAME_MAX_BITS - FRAME_MIN_BITS + 1;
+
+struct FreeFrame {
+    FreeFrame *next;
+};
+
+struct FrameCache {
+    FreeFrame *lists[FRAME_CLASSES] = {};
+
+    ~FrameCache() {
+        for (auto &list: lists) {
+            while (list != nullptr) {
+                auto frame = list;
+                list       = frame->next;
+                ::operator delete(frame);
+            }
+        }
+    }
+};
+
+thread_local FrameCache frame_cache;
+
+std::size_t frame_class(std::size_t size) {
+    std::size_t bits = FRAME_MIN_BITS;
+    while (((std::size_t)1 << bits) < size) {
+        bits += 1;
+    }
+    return bits - FRAME_MIN_BITS;
+}
+} // namespace
+
+void *frame_allocate(std::size_t size) {
+    if (size > ((std::size_t)1 << FRAME_MAX_BITS)) {
+        return ::operator new(size);
+    }
+
+    auto  cls  = frame_class(size);
+    auto &list = frame_cache.lists[cls];
+
+    if (list != nullptr) {
+        auto frame = list;
+        list       = frame->next;
+        return frame;
+    }
+
+    return ::operator new((std::size_t)1 << (cls + FRAME_MIN_BITS));
+}
+
+void frame_deallocate(void *ptr, std::size_t size) {
+    if (size > ((std::size_t)1 << FRAME_MAX_BITS)) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    auto frame  = (FreeFrame *)ptr;
+    auto &list  = frame_cache.lists[frame_class(size)];
+    frame->next = list;
+    list        = frame;
+}
+
+// Event loop
+// -------------------------------------------------------------------
+
+// Fire and forget coroutine owning a spawned task, destroys itself when done
+struct EventLoop::Detached {
+    struct promise_type: FramePromise {
+        Detached            get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never  final_suspend() noexcept { return {}; }
+        void                return_void() {}
+        void                unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+EventLoop::Detached EventLoop::detach(EventLoop &loop, Task<void> task) {
+    std::exception_ptr error;
+    try {
+        co_await task;
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(loop._ready_mutex);
+    loop._pending -= 1;
+
+    if (error && !loop._error) {
+        loop._error = error;
+    }
+}
+
+EventLoop::EventLoop(unsigned io_threads) {
+    io_threads = std::max(1u, io_threads);
+
+    for (unsigned i = 0; i < io_threads; ++i) {
+        _io_threads.emplace_back([this]() { io_worker(); });
+    }
+}
+
+EventLoop::~EventLoop() {
+    {
+        std::lock_guard<std::mutex> lock(_io_mutex);
+        _stop = true;
+    }
+    _io_cond.notify_all();
+
+    for (auto &thread: _io_threads) {
+        thread.join();
+    }
+}
+
+void EventLoop::spawn(Task<void> task) {
+    auto detached = detach(*this, std::move(task));
+    {
+        std::lock_guard<std::mutex> lock(_ready_mutex);
+        _pending += 1;
+    }
+    schedule(detached.handle);
+}
+
+void EventLoop::schedule(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(_ready_mutex);
+        _ready.push_back(handle);
+    }
+    _ready_cond.notify_one();
+}
+
+void EventLoop::run() {
+    // swapped with _ready, both keep their capacity
+    Array<std::coroutine_handle<>> batch;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_ready_mutex);
+            _ready_cond.wait(lock, [this]() { return !_ready.empty() || _pending == 0; });
+
+            if (_ready.empty()) {
+                if (_error) {
+                    std::rethrow_exception(std::exchange(_error, nullptr));
+                }
+                return;
+            }
+            std::swap(batch, _ready);
+        }
+
+        for (auto handle: batch) {
+            handle.resume();
+        }
+        batch.clear();
+    }
+}
+
+void EventLoop::submit(IoOperation *op) {
+    op->next = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_io_mutex);
+        if (_io_tail != nullptr) {
+            _io_tail->next = op;
+        } else {
+            _io_head = op;
+        }
+        _io_tail = op;
+    }
+    _io_cond.notify_one();
+}
+
+void EventLoop::io_worker() {
+    for (;;) {
+        IoOperation *op = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(_io_mutex);
+            _io_cond.wait(lock, [this]() { return _io_head != nullptr || _stop; });
+
+            if (_io_head == nullptr) {
+                return;
+            }
+
+            op       = _io_head;
+            _io_head = op->next;
+            if (_io_head == nullptr) {
+                _io_tail = nullptr;
+            }
+        }
+
+        op->execute();
+        schedule(op->handle);
+    }
+}
+
+// Async reader
+// -------------------------------------------------------------------
+Task<KeyView const *> AsyncCursor::next() {
+    if (_index == _span.size()) {
+        auto iterator = _iterator.get();
+        _span         = co_await _loop.offload([iterator]() { return iterator->next_span(); });
+        _index        = 0;
+
+        if (_span.empty()) {
+            co_return nullptr;
+        }
+    }
+    co_return &_span[_index++];
+}
+
+Task<uint64_t> AsyncReader::read(uint64_t offset, void *buffer, uint64_t size) {
+    auto reader = &_reader;
+    co_return co_await _loop.offload([=]() { return reader->read(offset, buffer, size); });
+}
+
+Task<Array<uint8_t>> AsyncReader::read_file(uint64_t inode, uint32_t snapshot) {
+    auto     reader  = &_reader;
+    uint64_t size    = 0;
+    auto     extents = co_await _loop.offload([=, &size]() { return reader->file_extents(inode, snapshot, size); });
+
+    Array<uint8_t>      data(size);
+    Array<BatchSegment> segments;
+    segments.reserve(extents.size());
+
+    for (auto &ext: extents) {
+        segments.push_back({ext.offset, ext.size, data.data() + ext.file_offset});
+    }
+
+    co_await _loop.offload([&]() { return read_segments(*reader, segments); });
+    co_return data;
+}
+
+Task<BTreeKey> AsyncReader::find(BTreeType type, BPos pos) {
+    auto reader = &_reader;
+    co_return co_await _loop.offload([=]() { return reader->find(type, pos); });
+}
+
+AsyncCursor AsyncReader::cursor(BTreeType type, BPos min, BPos max, uint32_t snapshot) {
+    return AsyncCursor(_loop, new BTreeIterator(_reader.iterator(type, min, max, snapshot)));
+}
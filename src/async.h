@@ -0,0 +1,299 @@
+#ifndef BCACHE_FS_SRC_ASYNC_HEADER
+#define BCACHE_FS_SRC_ASYNC_HEADER
+
+#include "bcachefs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Coroutines
+// -------------------------------------------------------------------
+//  Awaitable reads, lookups and cursors
+//
+//      Task<Array<uint8_t>> fetch(AsyncReader &reader, uint64_t inode) {
+//          auto data = co_await reader.read_file(inode);
+//          co_return data;
+//      }
+//
+//  Coroutines run on the thread calling EventLoop::run, blocking work
+//  (preads, node loads) is handed to a pool of I/O threads and the
+//  coroutine is resumed on the loop once it is done. Thousands of
+//  coroutines can be waiting, they only cost their frame, but this is
+//  not kernel async I/O: at most io_threads blocking operations are
+//  running at the same time.
+//
+//  An exception thrown by an operation or a task is rethrown in its
+//  awaiter, one escaping a spawned task is rethrown by EventLoop::run.
+//
+//  Frames are allocated from per thread free lists, once warm suspending
+//  and resuming a coroutine does not touch the heap.
+//
+
+// Frame allocator
+// -------------------------------------------------------------------
+void *frame_allocate(std::size_t size);
+void  frame_deallocate(void *ptr, std::size_t size);
+
+struct FramePromise {
+    static void *operator new(std::size_t size) { return frame_allocate(size); }
+    static void  operator delete(void *ptr, std::size_t size) { frame_deallocate(ptr, size); }
+};
+
+// Task
+// -------------------------------------------------------------------
+//  Lazy coroutine, starts when awaited and resumes its awaiter when done
+template <typename T>
+struct Task;
+
+namespace detail {
+template <typename T>
+struct TaskValue {
+    std::optional<T>   value;
+    std::exception_ptr error;
+
+    void return_value(T v) { value.emplace(std::move(v)); }
+
+    T result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskValue<void> {
+    std::exception_ptr error;
+
+    void return_void() {}
+
+    void result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+template <typename T>
+struct TaskPromise: FramePromise, TaskValue<T> {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        // symmetric transfer, resuming the awaiter does not grow the stack
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<TaskPromise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    Task<T> get_return_object();
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter        final_suspend() noexcept { return {}; }
+    void                unhandled_exception() { this->error = std::current_exception(); }
+};
+} // namespace detail
+
+template <typename T = void>
+struct Task {
+    public:
+    using promise_type = detail::TaskPromise<T>;
+    using Handle       = std::coroutine_handle<promise_type>;
+
+    explicit Task(Handle handle): _handle(handle) {}
+
+    Task(Task &&other) noexcept: _handle(std::exchange(other._handle, nullptr)) {}
+
+    Task(Task const &) = delete;
+    Task &operator=(Task const &) = delete;
+
+    ~Task() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        _handle.promise().continuation = awaiter;
+        return _handle;
+    }
+
+    T await_resume() { return _handle.promise().result(); }
+
+    private:
+    Handle _handle;
+};
+
+template <typename T>
+Task<T> detail::TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+// Event loop
+// -------------------------------------------------------------------
+struct EventLoop;
+
+// Blocking operation executed by an I/O thread, it lives in the frame of the awaiting coroutine
+struct IoOperation {
+    virtual ~IoOperation() = default;
+
+    virtual void execute() = 0;
+
+    std::coroutine_handle<> handle;
+    IoOperation *           next = nullptr;
+};
+
+struct EventLoop {
+    public:
+    EventLoop(unsigned io_threads = 16);
+
+    ~EventLoop();
+
+    EventLoop(EventLoop const &) = delete;
+    EventLoop &operator=(EventLoop const &) = delete;
+
+    // Start a coroutine, it runs during the next call to run
+    void spawn(Task<void> task);
+
+    // Run the coroutines until all of them are done
+    // rethrows the first exception that escaped a spawned coroutine
+    void run();
+
+    // Run a coroutine and the ones it spawns until all of them are done
+    template <typename T>
+    T run(Task<T> task) {
+        if constexpr (std::is_void_v<T>) {
+            spawn(std::move(task));
+            run();
+        } else {
+            std::optional<T> result;
+            spawn(store(std::move(task), result));
+            run();
+            return std::move(*result);
+        }
+    }
+
+    // resume the coroutine on the loop, safe to call from any thread
+    void schedule(std::coroutine_handle<> handle);
+
+    // execute the operation on an I/O thread then resume its coroutine on the loop
+    void submit(IoOperation *op);
+
+    // Awaitable running fun on an I/O thread
+    template <typename Fun>
+    auto offload(Fun fun);
+
+    private:
+    template <typename T>
+    static Task<void> store(Task<T> task, std::optional<T> &out) {
+        out.emplace(co_await task);
+    }
+
+    struct Detached;
+    static Detached detach(EventLoop &loop, Task<void> task);
+
+    void io_worker();
+
+    private:
+    std::mutex                      _ready_mutex;
+    std::condition_variable         _ready_cond;
+    Array<std::coroutine_handle<>>  _ready;
+    uint64_t                        _pending = 0; // spawned coroutines not done yet
+    std::exception_ptr              _error;       // first exception that escaped a spawned coroutine
+
+    std::mutex              _io_mutex;
+    std::condition_variable _io_cond;
+    IoOperation *           _io_head = nullptr;
+    IoOperation *           _io_tail = nullptr;
+    bool                    _stop    = false;
+    Array<std::thread>      _io_threads;
+};
+
+template <typename Fun>
+struct OffloadOperation: IoOperation {
+    using Result = std::invoke_result_t<Fun &>;
+
+    OffloadOperation(EventLoop &loop, Fun fun): loop(loop), fun(std::move(fun)) {}
+
+    // exceptions must not escape the I/O thread, they are rethrown in the awaiter
+    void execute() override {
+        try {
+            result.emplace(fun());
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> awaiter) {
+        handle = awaiter;
+        loop.submit(this);
+    }
+
+    Result await_resume() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*result);
+    }
+
+    EventLoop &           loop;
+    Fun                   fun;
+    std::optional<Result> result;
+    std::exception_ptr    error;
+};
+
+template <typename Fun>
+auto EventLoop::offload(Fun fun) {
+    return OffloadOperation<Fun>(*this, std::move(fun));
+}
+
+// Async reader
+// -------------------------------------------------------------------
+struct AsyncCursor {
+    public:
+    AsyncCursor(EventLoop &loop, BTreeIterator *iterator): _loop(loop), _iterator(iterator) {}
+
+    // next key of the range, nullptr once done, the view stays valid until the next call
+    // the keys of a node are decoded by a single I/O operation, the others are returned without leaving the loop.
+    // The iterator is not thread safe, next must not be called again before it returns
+    Task<KeyView const *> next();
+
+    private:
+    EventLoop &                    _loop;
+    std::unique_ptr<BTreeIterator> _iterator;
+    KeySpan                        _span;
+    std::size_t                    _index = 0;
+};
+
+struct AsyncReader {
+    public:
+    AsyncReader(BCacheFSReader const &reader, EventLoop &loop): _reader(reader), _loop(loop) {}
+
+    Task<uint64_t> read(uint64_t offset, void *buffer, uint64_t size);
+
+    Task<Array<uint8_t>> read_file(uint64_t inode, uint32_t snapshot = 0);
+
+    Task<BTreeKey> find(BTreeType type, BPos pos);
+
+    AsyncCursor cursor(BTreeType type, BPos min = POS_MIN, BPos max = SPOS_MAX, uint32_t snapshot = 0);
+
+    private:
+    BCacheFSReader const &_reader;
+    EventLoop &           _loop;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "batch.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+
+#include <climits>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+BatchStats read_segments(BCacheFSReader const &reader, Array<BatchSegment> &segments, BatchOptions const &options) {
+    TRACE_SPAN("read_segments");
+    BatchStats stats;
+
+    std::sort(segments.begin(), segments.end(), [](BatchSegment const &a, BatchSegment const &b) {
+        return a.offset < b.offset;
+    });
+
+    // every gap is at most options.gap bytes, they can all share the same scratch buffer
+    Array<uint8_t>      scratch(options.gap);
+    Array<struct iovec> iov;
+    iov.reserve(std::min<std::size_t>(IOV_MAX, segments.size() * 2));
+
+    std::size_t i = 0;
+    while (i < segments.size()) {
+        uint64_t start = segments[i].offset;
+        uint64_t end   = start;
+        iov.clear();
+
+        for (; i < segments.size(); ++i) {
+            auto &seg = segments[i];
+
+            // overlapping segments (shared extents) cannot be scattered by the same read
+            if (!iov.empty() && (seg.offset < end || seg.offset - end > options.gap ||
+                                 seg.offset + seg.size - start > options.max_read || iov.size() + 2 > IOV_MAX)) {
+                break;
+            }
+
+            if (seg.offset > end) {
+                iov.push_back({scratch.data(), seg.offset - end});
+                stats.wasted += seg.offset - end;
+            }
+
+            iov.push_back({seg.buffer, seg.size});
+            end = seg.offset + seg.size;
+        }
+
+        auto expected = end - start;
+        auto size     = reader.read_vector(start, iov.data(), int(iov.size()));
+        if (size != expected) {
+            warn("short read at {}: {} out of {} bytes", start, size, expected);
+        }
+
+        stats.reads += 1;
+        stats.bytes += size;
+    }
+
+    debug("read {} segments in {} reads ({} bytes, {} wasted)", segments.size(), stats.reads, stats.bytes,
+          stats.wasted);
+    return stats;
+}
+
+BatchStats read_many(BCacheFSReader const &reader, Array<uint64_t> const &inodes, Array<Array<uint8_t>> &out,
+                     BatchOptions const &options) {
+    Array<Array<Extend>> extents(inodes.size());
+    std::size_t          count = 0;
+
+    // buffers must be allocated before the segments point into them
+    auto found = reader.find_inodes(inodes);
+    out.resize(inodes.size());
+    for (std::size_t i = 0; i < inodes.size(); ++i) {
+        uint64_t size = 0;
+        extents[i]    = reader.file_extents(found[i], 0, size);
+        count += extents[i].size();
+        out[i].assign(size, 0);
+    }
+
+    Array<BatchSegment> segments;
+    segments.reserve(count);
+
+    for (std::size_t i = 0; i < inodes.size(); ++i) {
+        for (auto &ext: extents[i]) {
+            segments.push_back({ext.offset, ext.size, out[i].data() + ext.file_offset});
+        }
+    }
+
+    return read_segments(reader, segments, options);
+}
+
+BatchStats read_many(BCacheFSReader const &reader, Manifest const &manifest, Array<std::string_view> const &paths,
+                     Array<Array<uint8_t>> &out, BatchOptions const &options) {
+    Array<int64_t> files(paths.size());
+
+    out.resize(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        files[i] = manifest.find(paths[i]);
+
+        if (files[i] < 0) {
+            warn("{} not found in the manifest", paths[i]);
+            out[i].clear();
+            continue;
+        }
+
+        out[i].assign(manifest.file(files[i]).size, 0);
+    }
+
+    Array<BatchSegment> segments;
+
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        if (files[i] < 0) {
+            continue;
+        }
+
+        // extents are sector aligned, the last one can go past the end of the file
+        uint64_t size = out[i].size();
+        for (auto ext = manifest.extents_begin(files[i]); ext != manifest.extents_end(files[i]); ++ext) {
+            if (ext->file_offset >= size) {
+                continue;
+            }
+            auto bytes = std::min(ext->size, size - ext->file_offset);
+            segments.push_back({ext->offset, bytes, out[i].data() + ext->file_offset});
+        }
+    }
+
+    return read_segments(reader, segments, options);
+}
@@ -0,0 +1,49 @@
+#ifndef BCACHE_FS_SRC_BATCH_HEADER
+#define BCACHE_FS_SRC_BATCH_HEADER
+
+#include "bcachefs.h"
+#include "manifest.h"
+
+#include <string_view>
+
+// Batched reads
+// -------------------------------------------------------------------
+//  The extents of every file of the batch are sorted by their offset on
+//  disk, extents that are close to each other are merged into a single
+//  read which is scattered into the file buffers with preadv.
+//  The bytes between two merged extents are read into a scratch buffer.
+//
+struct BatchOptions {
+    // extents separated by at most gap bytes are read together
+    uint64_t gap = 64 * 1024;
+
+    // a merged read does not grow past this size
+    uint64_t max_read = 16 * 1024 * 1024;
+};
+
+struct BatchStats {
+    uint64_t reads  = 0; // number of preadv issued
+    uint64_t bytes  = 0; // bytes read from disk
+    uint64_t wasted = 0; // bytes read into the scratch buffer
+};
+
+// A chunk of a file to read
+struct BatchSegment {
+    uint64_t offset; // offset on disk in bytes
+    uint64_t size;
+    uint8_t *buffer;
+};
+
+// Read the segments, merging the ones that are close to each other
+// the segments are reordered by disk offset
+BatchStats read_segments(BCacheFSReader const &reader, Array<BatchSegment> &segments, BatchOptions const &options = {});
+
+// out[i] receives the content of inodes[i], holes are left zeroed
+BatchStats read_many(BCacheFSReader const &reader, Array<uint64_t> const &inodes, Array<Array<uint8_t>> &out,
+                     BatchOptions const &options = {});
+
+// out[i] receives the content of paths[i], missing files are left empty
+BatchStats read_many(BCacheFSReader const &reader, Manifest const &manifest, Array<std::string_view> const &paths,
+                     Array<Array<uint8_t>> &out, BatchOptions const &options = {});
+
+#endif
@@ -1,17 +1,36 @@
 #include "bcachefs.h"
+#include "checksum.h"
 #include "logger.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <iostream>
+#include <numeric>
 
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+#include <aio.h>
+#include <unistd.h>
 
 // ========================================================================================
 
-BCacheFSReader::BCacheFSReader(String const &file) {
-    _file   = fopen(file.c_str(), "rb");
+BCacheFSReader::BCacheFSReader(String const &file, bool replay) {
+    _file = fopen(file.c_str(), "rb");
+    if (_file == nullptr) {
+        error("could not open {}", file);
+        return;
+    }
+
     _sblock = read_superblock();
+    if (_sblock == nullptr) {
+        error("{} does not have a valid superblock", file);
+        return;
+    }
+
+    _nodes = std::make_unique<NodePool>(btree_node_size());
 
     // Get the location of the different BTrees
     // bch_sb_field_clean entry is written on clean shutdown
@@ -26,61 +45,155 @@ BCacheFSReader::BCacheFSReader(String const &file) {
     // - clean
     // - last one look like a dummy struct
     auto field = (const SuperBlockFieldClean *)find_superblock_field(BCH_SB_FIELD_clean);
-    assert(field != nullptr);
-
-    debug("Look for journal entry");
-    // on my example I have the entries below
-    // - usage
-    // - usage
-    // - usage
-    // - usage
-    // - usage
-    // - data_usage
-    // - data_usage
-    // - deb_usage
-    // - clock
-    // - clock
-    // - btree_root extents
-    // - btree_root inodes
-    // - btree_root dirents
-    // - btree_root alloc
-    _btree_roots = find_journal_entries(field);
+
+    if (field == nullptr) {
+        // the image was not cleanly unmounted
+        // the btree roots are only in the journal
+        warn("superblock field clean not found, replaying the journal");
+        replay_journal();
+    } else if (replay) {
+        _btree_roots = find_journal_entries(field);
+        replay_journal();
+    }
+
+    if (field == nullptr || replay) {
+        for (int i = 0; i < BTREE_ID_NR; ++i) {
+            if (_journal.roots[i] != nullptr) {
+                _btree_roots[i] = _journal.roots[i];
+            }
+        }
+    } else {
+        debug("Look for journal entry");
+        // on my example I have the entries below
+        // - usage
+        // - usage
+        // - usage
+        // - usage
+        // - usage
+        // - data_usage
+        // - data_usage
+        // - deb_usage
+        // - clock
+        // - clock
+        // - btree_root extents
+        // - btree_root inodes
+        // - btree_root dirents
+        // - btree_root alloc
+        _btree_roots = find_journal_entries(field);
+    }
+
+    // an image without roots cannot be read, every iterator would be empty
+    _valid = std::any_of(_btree_roots.begin(), _btree_roots.end(), [](auto root) { return root != nullptr; });
+    if (!_valid) {
+        error("no btree root found in the superblock nor in the journal");
+        return;
+    }
+
+    load_snapshots();
 }
 
 BCacheFSReader::~BCacheFSReader() {
-    fclose(_file);
+    if (_file != nullptr) {
+        fclose(_file);
+    }
     free(_sblock);
 }
 
-// Load the superblock in 2 phases
-//  - first phase reads only enough to be able to extract the full size of the superblock
-//  - second phase reallocate the superblock using its full size
+// Read all the copies of the superblock listed in the layout and keep the newest valid one
+//  - the layout (sector 7) gives the location of the copies and their maximum size
+//  - all the copies are read with a single batched I/O
 Superblock *BCacheFSReader::read_superblock() {
     debug(">>> Reading superblock");
-    // Read the superblock at 4096 | 0x1000
-    auto size = sizeof(Superblock);
 
-    Superblock *block = (Superblock *)malloc(size);
-    fseek(_file, BCH_SB_SECTOR * BCH_SECTOR_SIZE, SEEK_SET);
-    fread(block, size, 1, _file);
+    struct bch_sb_layout layout;
+    Array<uint64_t>      offsets;
+    uint64_t             size = 0;
+
+    auto layout_size = read(BCH_SB_LAYOUT_SECTOR * BCH_SECTOR_SIZE, &layout, sizeof(layout));
+
+    if (layout_size == sizeof(layout) && memcmp(&layout.magic, &BCACHE_MAGIC, sizeof(BCACHE_MAGIC)) == 0 &&
+        layout.nr_superblocks > 0 && layout.nr_superblocks <= sizeof(layout.sb_offset) / sizeof(uint64_t) &&
+        layout.sb_max_size_bits < 32) {
+        offsets.assign(layout.sb_offset, layout.sb_offset + layout.nr_superblocks);
+        size = (uint64_t)BCH_SECTOR_SIZE << layout.sb_max_size_bits;
+    } else {
+        warn("superblock layout is invalid, reading the primary superblock only");
+        offsets.push_back(BCH_SB_SECTOR);
+        size = (uint64_t)BCH_SECTOR_SIZE << BCH_SB_MAX_SIZE_BITS;
+    }
+
+    debug("reading {} superblocks of {} bytes", offsets.size(), size);
 
-    // Realloc the superblock now we have all the data to allocate the true size
-    assert(memcmp(&block->magic, &BCACHE_MAGIC, sizeof(BCACHE_MAGIC)) == 0);
-    size = sizeof(struct bch_sb) + block->u64s * BCH_U64S_SIZE;
+    Array<Superblock *>   blocks(offsets.size(), nullptr);
+    Array<struct aiocb>   requests(offsets.size());
+    Array<struct aiocb *> list(offsets.size());
 
-    block = (Superblock *)realloc(block, size);
-    fseek(_file, BCH_SB_SECTOR * BCH_SECTOR_SIZE, SEEK_SET);
-    fread(block, size, 1, _file);
+    for (std::size_t i = 0; i < offsets.size(); ++i) {
+        blocks[i] = (Superblock *)calloc(1, size);
+
+        memset(&requests[i], 0, sizeof(struct aiocb));
+        requests[i].aio_fildes     = fileno(_file);
+        requests[i].aio_buf        = blocks[i];
+        requests[i].aio_nbytes     = size;
+        requests[i].aio_offset     = (off_t)(offsets[i] * BCH_SECTOR_SIZE);
+        requests[i].aio_lio_opcode = LIO_READ;
+        list[i]                    = &requests[i];
+    }
+
+    // a failed read shows up as an invalid superblock
+    lio_listio(LIO_WAIT, list.data(), (int)list.size(), nullptr);
+
+    Superblock *best = nullptr;
+
+    for (std::size_t i = 0; i < offsets.size(); ++i) {
+        auto block = blocks[i];
+        auto bytes = aio_return(&requests[i]);
+
+        bool valid = bytes >= (ssize_t)sizeof(Superblock) &&
+                     memcmp(&block->magic, &BCACHE_MAGIC, sizeof(BCACHE_MAGIC)) == 0 &&
+                     sizeof(Superblock) + block->u64s * BCH_U64S_SIZE <= (uint64_t)bytes;
+
+        // the checksum covers everything after the csum field
+        if (valid) {
+            auto start = (uint8_t const *)block + sizeof(struct bch_csum);
+            auto end   = (uint8_t const *)block + sizeof(Superblock) + block->u64s * BCH_U64S_SIZE;
+            auto type  = (unsigned)extract_bitflag(block->flags[0], 2, 8);
+
+            valid = verify_checksum(type, block->csum, start, (std::size_t)(end - start));
+        }
+
+        if (!valid) {
+            warn("superblock at sector {} is invalid", offsets[i]);
+            free(block);
+            continue;
+        }
+
+        debug("superblock at sector {} (seq: {})", offsets[i], block->seq);
+        if (best == nullptr || block->seq > best->seq) {
+            free(best);
+            best = block;
+        } else {
+            free(block);
+        }
+    }
+
+    if (best == nullptr) {
+        return nullptr;
+    }
+
+    // release the unused part of the buffer
+    best = (Superblock *)realloc(best, sizeof(Superblock) + best->u64s * BCH_U64S_SIZE);
 
     debug("<<< Read superblock");
-    return block;
+    return best;
 }
 
 SuperBlockFieldBase const *BCacheFSReader::find_superblock_field(SuperBlockFieldType type) const {
     auto iter = FieldIterator<SuperBlockFieldBase>((const uint8_t *)_sblock + sizeof(Superblock));
-    auto end  = FieldIterator<SuperBlockFieldBase>((const uint8_t *)_sblock + _sblock->u64s * BCH_U64S_SIZE);
+    auto end  = FieldIterator<SuperBlockFieldBase>((const uint8_t *)_sblock + sizeof(Superblock) +
+                                                  _sblock->u64s * BCH_U64S_SIZE);
 
-    for (; iter != end; ++iter) {
+    for (; iter < end && iter->u64s > 0; ++iter) {
         debug("(size: {}) (type: {}) looking for {}", iter->u64s, iter->type, type);
 
         if (iter->type == type) {
@@ -109,41 +222,851 @@ BTreePtr const *BCacheFSReader::find_btree_root(JournalSetEntry const *entry) co
         ++cursor;
     }
 
-    debug("BTree root: (unused: {}) (offset: {})", cursor->start->unused, cursor->start->offset);
-    return *cursor;
+    debug("BTree root: (unused: {}) (offset: {})", cursor->start->unused, cursor->start->offset);
+    return *cursor;
+}
+
+Array<JournalSetEntry const *> BCacheFSReader::find_journal_entries(SuperBlockFieldClean const *field) const {
+
+    auto iter = FieldIterator<JournalSetEntry>((uint8_t const *)field + sizeof(SuperBlockFieldClean));
+    auto end  = FieldIterator<JournalSetEntry>((uint8_t const *)field + field->field.u64s * BCH_U64S_SIZE);
+
+    Array<JournalSetEntry const *> out(BTREE_ID_NR);
+    auto                           type = BCH_JSET_ENTRY_btree_root;
+
+    for (; iter < end; ++iter) {
+        debug("(size: {}) (type: {}) looking for {}", iter->u64s, iter->type, type);
+
+        if (iter->type == type && iter->btree_id < BTREE_ID_NR) {
+            out[iter->btree_id] = *iter;
+        }
+
+        if (iter->u64s <= 0) {
+            break;
+        }
+    }
+
+    return out;
+}
+
+BTreeIterator BCacheFSReader::iterator(BTreeType type) const { return iterator(type, POS_MIN, SPOS_MAX); }
+
+BTreeIterator BCacheFSReader::iterator(BTreeType type, BPos const &min, BPos const &max, uint32_t snapshot) const {
+    return make_iterator(type, min, max, snapshot, ~0ULL);
+}
+
+BTreeIterator BCacheFSReader::iterator(BTreeType type, KeyFilter const &filter, uint32_t snapshot) const {
+    auto min = POS_MIN;
+    auto max = SPOS_MAX;
+
+    if (filter.min_inode != 0 || filter.max_inode != ~0ULL) {
+        if (type == BTREE_ID_inodes && _sblock->version >= BCH_METADATA_VERSION_INODE_BTREE_CHANGE) {
+            min = POS(0, filter.min_inode);
+            max = SPOS(0, filter.max_inode, ~0U);
+        } else {
+            min = POS(filter.min_inode, 0);
+            max = SPOS(filter.max_inode, ~0ULL, ~0U);
+        }
+    }
+
+    return make_iterator(type, min, max, snapshot, filter.types);
+}
+
+BTreeIterator BCacheFSReader::make_iterator(BTreeType  type,
+                                            BPos const &min,
+                                            BPos const &max,
+                                            uint32_t    snapshot,
+                                            uint64_t    types,
+                                            NodeCache * cache) const {
+    auto entry = _btree_roots[type];
+
+    // a btree without a root has no keys, the iterator is empty
+    auto btree_ptr = entry != nullptr ? find_btree_root(entry) : nullptr;
+
+    std::shared_ptr<SnapshotFilter> filter;
+    if (snapshot != 0) {
+        filter = std::make_shared<SnapshotFilter>(snapshot_ancestors(snapshot));
+    }
+
+    //
+    return BTreeIterator(*this, btree_ptr, type, min, max, filter, _journal.find(type), true, types, cache);
+}
+
+void BCacheFSReader::load_snapshots() {
+    if (_btree_roots[BTREE_ID_snapshots] == nullptr) {
+        debug("no snapshot tree");
+        return;
+    }
+
+    auto iter = iterator(BTREE_ID_snapshots);
+    auto bkey = iter.next_key();
+
+    while (bkey != nullptr) {
+        if (bkey->type == KEY_TYPE_snapshot) {
+            auto local = iter.local(bkey);
+            auto value = (BSnapshot const *)iter.value(bkey);
+
+            _snapshot_parents[(uint32_t)local.p.offset] = value->parent;
+        }
+        bkey = iter.next_key();
+    }
+    debug("loaded {} snapshots", _snapshot_parents.size());
+}
+
+Array<uint32_t> BCacheFSReader::snapshot_ancestors(uint32_t snapshot) const {
+    // keys written before snapshots existed use 0, they are visible everywhere
+    Array<uint32_t> ancestors = {0};
+
+    while (snapshot != 0) {
+        ancestors.push_back(snapshot);
+
+        auto parent = _snapshot_parents.find(snapshot);
+        if (parent == _snapshot_parents.end()) {
+            break;
+        }
+
+        // parents always have a bigger id, this protects us against cycles
+        if (parent->second != 0 && parent->second <= snapshot) {
+            error("snapshot {} has an invalid parent {}", snapshot, parent->second);
+            break;
+        }
+        snapshot = parent->second;
+    }
+
+    return ancestors;
+}
+
+uint64_t BCacheFSReader::read(uint64_t offset, void *buffer, uint64_t size) const {
+    uint64_t total = 0;
+    if (_file == nullptr) {
+        return total;
+    }
+
+    while (total < size) {
+        auto n = pread(fileno(_file), (uint8_t *)buffer + total, size - total, (off_t)(offset + total));
+        if (n <= 0) {
+            break;
+        }
+        total += (uint64_t)n;
+    }
+
+    auto &metrics = _metrics.local();
+    metrics.add(metrics.bytes_read, total);
+    return total;
+}
+
+uint64_t BCacheFSReader::read_vector(uint64_t offset, struct iovec *iov, int count) const {
+    uint64_t total = 0;
+    if (_file == nullptr) {
+        return total;
+    }
+
+    while (count > 0) {
+        auto n = preadv(fileno(_file), iov, count, (off_t)(offset + total));
+        if (n <= 0) {
+            break;
+        }
+        total += (uint64_t)n;
+
+        // short read, skip the buffers that were filled
+        auto left = (uint64_t)n;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov += 1;
+            count -= 1;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    auto &metrics = _metrics.local();
+    metrics.add(metrics.bytes_read, total);
+    return total;
+}
+
+NodeRef BCacheFSReader::load_btree_node(BTreePtr const *ptr, NodeCache *cache) const {
+    if (cache != nullptr) {
+        uint64_t offset = ptr->start->offset * BCH_SECTOR_SIZE;
+        NodeRef  node;
+
+        if (!cache->find(offset, node)) {
+            node = load_btree_node(ptr);
+            cache->insert(offset, node);
+        }
+        return node;
+    }
+
+    TRACE_SPAN("load_btree_node");
+    auto &metrics = _metrics.local();
+    auto  timer   = ScopedTimer(metrics.node_read);
+
+    auto node = _nodes->acquire();
+    if (!node) {
+        return node;
+    }
+
+    // a short read leaves the end of a recycled buffer with the content of another node
+    uint64_t offset = ptr->start->offset * BCH_SECTOR_SIZE;
+    if (read(offset, node.get(), btree_node_size()) != btree_node_size()) {
+        error("short read of the btree node at {}", offset);
+        return NodeRef();
+    }
+
+    auto id = extract_bitflag(node->flags, 0, 4);
+    if (id < BTREE_ID_NR) {
+        metrics.add(metrics.nodes_loaded[id], 1);
+    }
+
+    return node;
+}
+
+// Find the key in the nodes then let the journal override it,
+// a deletion hides the older versions of its position so the search goes on after it
+BTreeKey BCacheFSReader::find(BTreeType type, BPos const &pos) const {
+    auto entry = _btree_roots[type];
+    if (entry == nullptr) {
+        return BTreeKey();
+    }
+
+    auto &metrics = _metrics.local();
+    auto  timer   = ScopedTimer(metrics.lookup);
+    metrics.add(metrics.lookups, 1);
+
+    auto root    = find_btree_root(entry);
+    auto overlay = _journal.find(type);
+    auto at      = pos;
+
+    while (true) {
+        auto result = find_in_nodes(root, at);
+
+        // keys replayed from the journal are newer than the ones in the nodes
+        if (overlay != nullptr) {
+            auto item = overlay->lower_bound(at);
+
+            if (item != overlay->end() && (!result || bpos_cmp(item->first, result.local.p) <= 0)) {
+                auto key = item->second.key;
+                result   = BTreeKey{nullptr, item->second.offset, key, parse_bkey(key, nullptr)};
+            }
+        }
+
+        if (!result || !bkey_is_deletion(result.key->type)) {
+            return result;
+        }
+
+        if (bpos_cmp(result.local.p, SPOS_MAX) == 0) {
+            return BTreeKey();
+        }
+        at = bpos_successor(result.local.p);
+    }
+}
+
+// Walk down the tree, in an interior node the key of a child is the largest key it holds
+// so the child we are looking for is the one with the smallest key >= pos
+BTreeKey BCacheFSReader::find_in_nodes(BTreePtr const *root, BPos const &pos) const {
+    auto &metrics = _metrics.local();
+
+    auto at          = pos;
+    auto node_max    = SPOS_MAX; // key of the node in its parent
+    auto node_offset = root->start->offset * BCH_SECTOR_SIZE;
+    auto node        = load_btree_node(root);
+
+    while (node) {
+        metrics.add(metrics.lookup_depth, 1);
+
+        BKey const *      best = nullptr;
+        struct bkey_local best_local;
+
+        auto bsets = BSetIterator(node.get(), btree_node_size());
+        auto bset  = bsets.next(btree_block_size());
+
+        while (bset != nullptr) {
+            auto keys = BKeyIterator(bset);
+            auto key  = keys.next();
+
+            while (key != nullptr) {
+                auto local = parse_bkey(key, &node->format);
+
+                // newer bsets override older ones for the same position
+                if (bpos_cmp(local.p, at) >= 0 && (best == nullptr || bpos_cmp(local.p, best_local.p) <= 0)) {
+                    best       = key;
+                    best_local = local;
+                }
+
+                key = keys.next();
+            }
+            bset = bsets.next(btree_block_size());
+        }
+
+        if (best == nullptr) {
+            // the key of a node can be bigger than the keys it holds, the next key lives in the next node
+            if (bpos_cmp(node_max, SPOS_MAX) == 0) {
+                break;
+            }
+
+            at          = bpos_successor(node_max);
+            node_max    = SPOS_MAX;
+            node_offset = root->start->offset * BCH_SECTOR_SIZE;
+            node        = load_btree_node(root);
+            continue;
+        }
+
+        if (best->type != KEY_TYPE_btree_ptr_v2) {
+            auto key_offset = node_offset + (uint64_t)((uint8_t const *)best - (uint8_t const *)node.get());
+            return BTreeKey{node, key_offset, best, best_local};
+        }
+
+        // node is kept alive until the child is loaded
+        auto child  = (BTreePtr const *)get_value(node.get(), best);
+        node_max    = best_local.p;
+        node_offset = child->start->offset * BCH_SECTOR_SIZE;
+        node        = load_btree_node(child);
+    }
+
+    return BTreeKey();
+}
+
+DirectoryCursor BCacheFSReader::readdir(uint64_t dir, uint64_t offset, uint32_t snapshot, NodeCache *cache) const {
+    auto iter = make_iterator(BTREE_ID_dirents, POS(dir, offset), SPOS(dir, ~0ULL, ~0U), snapshot,
+                              KeyFilter{KEY_TYPE_dirent}.types, cache);
+    return DirectoryCursor(std::move(iter), dir, offset);
+}
+
+bool DirectoryCursor::next(DirectoryEntry &entry) {
+    auto key = _iter.next_key();
+    if (key == nullptr) {
+        return false;
+    }
+
+    entry   = _iter.directory(key);
+    _offset = entry.offset + 1;
+    return true;
+}
+
+Array<KeyRange> BCacheFSReader::partition(BTreeType type, uint64_t n) const {
+    TRACE_SPAN("partition");
+    auto entry = _btree_roots[type];
+    if (entry == nullptr || n == 0) {
+        return Array<KeyRange>();
+    }
+
+    auto root = find_btree_root(entry);
+
+    // a single leaf cannot be split without reading it
+    if (entry->level == 0) {
+        return Array<KeyRange>{KeyRange{POS_MIN, SPOS_MAX, (uint64_t)root->sectors_written * BCH_SECTOR_SIZE, 1}};
+    }
+
+    Array<KeyRange> leaves;
+    collect_leaves(root, leaves);
+
+    if (leaves.empty()) {
+        return Array<KeyRange>();
+    }
+
+    uint64_t total = 0;
+    for (auto &leaf: leaves) {
+        total += leaf.bytes;
+    }
+
+    // close a range once it reaches its share of the bytes,
+    // every range gets at least one leaf
+    Array<KeyRange> ranges;
+    KeyRange        range{POS_MIN, SPOS_MAX};
+    uint64_t        seen = 0;
+
+    for (std::size_t i = 0; i < leaves.size(); ++i) {
+        auto &leaf = leaves[i];
+        seen += leaf.bytes;
+        range.bytes += leaf.bytes;
+        range.leaves += 1;
+
+        auto leaves_left = leaves.size() - i - 1;
+        auto ranges_left = n - ranges.size() - 1;
+        auto share       = (unsigned __int128)seen * n >= (unsigned __int128)(ranges.size() + 1) * total;
+
+        if (ranges_left > 0 && leaves_left > 0 && (share || leaves_left <= ranges_left)) {
+            range.max = leaf.max;
+            ranges.push_back(range);
+            range = KeyRange{leaves[i + 1].min, SPOS_MAX};
+        }
+    }
+
+    ranges.push_back(range);
+    return ranges;
+}
+
+void BCacheFSReader::collect_leaves(BTreePtr const *ptr, Array<KeyRange> &leaves) const {
+    auto node = load_btree_node(ptr);
+    if (!node) {
+        return;
+    }
+
+    struct Child {
+        BPos        p;
+        uint32_t    bset;
+        BKey const *key;
+    };
+
+    Array<Child> children;
+    uint32_t     index = 0;
+    auto         bsets = BSetIterator(node.get(), btree_node_size());
+
+    for (auto bset = bsets.next(btree_block_size()); bset != nullptr; bset = bsets.next(btree_block_size())) {
+        auto keys = BKeyIterator(bset);
+
+        for (auto key = keys.next(); key != nullptr; key = keys.next()) {
+            children.push_back(Child{parse_bkey(key, &node->format).p, index, key});
+        }
+        index += 1;
+    }
+
+    // newer bsets override older ones for the same position
+    std::sort(children.begin(), children.end(), [](Child const &a, Child const &b) {
+        auto cmp = bpos_cmp(a.p, b.p);
+        return cmp != 0 ? cmp < 0 : a.bset > b.bset;
+    });
+
+    auto level = extract_bitflag(node->flags, 4, 8);
+
+    for (std::size_t i = 0; i < children.size(); ++i) {
+        auto &child = children[i];
+
+        if ((i > 0 && bpos_cmp(child.p, children[i - 1].p) == 0) || child.key->type != KEY_TYPE_btree_ptr_v2) {
+            continue;
+        }
+
+        auto value = (BTreePtr const *)get_value(node.get(), child.key);
+
+        if (level == 1) {
+            leaves.push_back(KeyRange{value->min_key, child.p, (uint64_t)value->sectors_written * BCH_SECTOR_SIZE, 1});
+        } else {
+            collect_leaves(value, leaves);
+        }
+    }
+}
+
+namespace {
+// Offset of the data of an extent on disk and the checksum of its region, false if the data is compressed
+// a front trimmed extent starts crc.offset sectors inside its region
+bool extent_data(BExtendPtr const *ptr, ExtentCrc const &crc, uint64_t &offset, ExtentChecksum &checksum) {
+    if (crc.compression_type != 0) {
+        return false;
+    }
+
+    offset   = (ptr->offset + crc.offset) * BCH_SECTOR_SIZE;
+    checksum = ExtentChecksum{};
+
+    if (crc.csum_type != BCH_CSUM_none) {
+        checksum.offset = ptr->offset * BCH_SECTOR_SIZE;
+        checksum.size   = crc.compressed_size * BCH_SECTOR_SIZE;
+        checksum.csum   = crc.csum;
+        checksum.type   = crc.csum_type;
+    }
+    return true;
+}
+} // namespace
+
+Array<Extend>
+BCacheFSReader::resolve_reflink(uint64_t inode, uint64_t idx, uint64_t sectors, uint64_t file_offset) const {
+    TRACE_SPAN("resolve_reflink");
+    Array<Extend> out;
+
+    while (sectors > 0) {
+        IndirectExtent indirect;
+
+        auto &metrics = _metrics.local();
+        auto  cached  = _reflink_cache.find(idx, indirect);
+        metrics.add(cached ? metrics.cache_hits : metrics.cache_misses, 1);
+
+        if (!cached) {
+            // reflink keys are indexed by the end of the indirect extent
+            auto found = find(BTREE_ID_reflink, POS(0, idx + 1));
+
+            if (!found || found.local.p.offset - found.local.size > idx) {
+                error("missing indirect extent for idx {}", idx);
+                break;
+            }
+
+            auto value     = (uint8_t const *)get_value(found.node.get(), found.key);
+            auto value_end = (uint8_t const *)found.key + found.local.u64s * BCH_U64S_SIZE;
+
+            indirect.start = found.local.p.offset - found.local.size;
+            indirect.end   = found.local.p.offset;
+
+            if (found.key->type == KEY_TYPE_reflink_v) {
+                auto crc = ExtentCrc{};
+                auto ptr = find_extent_ptr((uint8_t const *)((BReflinkV const *)value)->start, value_end, &crc);
+                if (ptr == nullptr) {
+                    error("indirect extent {} has no pointer", idx);
+                    break;
+                }
+                if (!extent_data(ptr, crc, indirect.offset, indirect.checksum)) {
+                    error("indirect extent {} is compressed ({}), it cannot be read", idx, crc.compression_type);
+                    break;
+                }
+                indirect.size = found.local.size * BCH_SECTOR_SIZE;
+
+            } else if (found.key->type == KEY_TYPE_indirect_inline_data) {
+                auto data       = ((BIndirectInlineData const *)value)->data;
+                indirect.offset = found.key_offset + (uint64_t)(data - (uint8_t const *)found.key);
+                indirect.size   = (uint64_t)(value_end - data);
+
+            } else {
+                error("unexpected key type {} in the reflink btree", found.key->type);
+                break;
+            }
+
+            _reflink_cache.insert(indirect);
+        }
+
+        auto skip = idx - indirect.start;
+        auto len  = std::min(sectors, indirect.end - idx);
+
+        auto ext        = Extend{};
+        ext.inode       = inode;
+        ext.file_offset = file_offset * BCH_SECTOR_SIZE;
+        ext.offset      = indirect.offset + skip * BCH_SECTOR_SIZE;
+        ext.checksum    = indirect.checksum;
+
+        // inline data is not sector aligned, it can end before the sectors of its key
+        ext.size = std::min(len * BCH_SECTOR_SIZE, indirect.size - std::min(indirect.size, skip * BCH_SECTOR_SIZE));
+        out.push_back(ext);
+
+        idx += len;
+        sectors -= len;
+        file_offset += len;
+    }
+
+    return out;
+}
+
+namespace {
+// An extent replayed from the journal, without data it is a deletion
+struct JournalExtent {
+    uint64_t seq;
+    Extend   extent;
+    bool     hole;
+};
+
+// Remove [start, end) from the extents, the ones partially inside are trimmed or split in two
+void punch_extents(Array<Extend> &extents, uint64_t start, uint64_t end) {
+    Array<Extend> kept;
+    kept.reserve(extents.size() + 1);
+
+    for (auto &ext: extents) {
+        auto ext_end = ext.file_offset + ext.size;
+
+        if (ext_end <= start || ext.file_offset >= end) {
+            kept.push_back(ext);
+            continue;
+        }
+
+        if (ext.file_offset < start) {
+            auto head = ext;
+            head.size = start - ext.file_offset;
+            kept.push_back(head);
+        }
+
+        if (ext_end > end) {
+            auto cut         = end - ext.file_offset;
+            auto tail        = ext;
+            tail.file_offset = end;
+            tail.offset      = ext.offset + cut;
+            tail.size        = ext_end - end;
+            kept.push_back(tail);
+        }
+    }
+
+    extents.swap(kept);
+}
+
+// the last extent is sector aligned, it can go past the end of the file
+// without a size the file ends with its last extent
+void trim_extents(Array<Extend> &extents, uint64_t &size) {
+    if (size == 0) {
+        for (auto &ext: extents) {
+            size = std::max(size, ext.file_offset + ext.size);
+        }
+        return;
+    }
+
+    while (!extents.empty() && extents.back().file_offset >= size) {
+        extents.pop_back();
+    }
+    for (auto &ext: extents) {
+        ext.size = std::min(ext.size, size - ext.file_offset);
+    }
+}
+} // namespace
+
+uint64_t BCacheFSReader::file_size(uint64_t inode, uint32_t snapshot) const {
+    if (!valid()) {
+        return 0;
+    }
+
+    auto iter = iterator(BTREE_ID_inodes, KeyFilter({KEY_TYPE_inode}, inode, inode), snapshot);
+    auto key  = iter.next_key();
+    return key != nullptr ? iter.inode(key).size : 0;
+}
+
+Array<Extend> BCacheFSReader::file_extents(uint64_t inode, uint32_t snapshot) const {
+    uint64_t size = 0;
+    return file_extents(inode, snapshot, size);
+}
+
+Array<Extend> BCacheFSReader::file_extents(uint64_t inode, uint32_t snapshot, uint64_t &size) const {
+    TRACE_SPAN("file_extents");
+    auto out = collect_extents(inode, snapshot);
+    size     = file_size(inode, snapshot);
+    trim_extents(out, size);
+    return out;
+}
+
+Array<Extend> BCacheFSReader::file_extents(Inode const &inode, uint32_t snapshot, uint64_t &size) const {
+    TRACE_SPAN("file_extents");
+    auto out = collect_extents(inode.inode, snapshot);
+    size     = inode.size;
+    trim_extents(out, size);
+    return out;
+}
+
+Array<Inode> BCacheFSReader::find_inodes(Array<uint64_t> const &inodes, uint32_t snapshot) const {
+    Array<Inode> out(inodes.size());
+    if (!valid()) {
+        return out;
+    }
+
+    Array<std::size_t> order(inodes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return inodes[a] < inodes[b]; });
+
+    for (std::size_t begin = 0; begin < order.size();) {
+        // a run of inodes close enough to be in the same few leaves
+        auto end = begin + 1;
+        while (end < order.size() && inodes[order[end]] - inodes[order[end - 1]] <= FIND_INODES_GAP) {
+            end += 1;
+        }
+
+        auto filter = KeyFilter({KEY_TYPE_inode}, inodes[order[begin]], inodes[order[end - 1]]);
+        auto iter   = iterator(BTREE_ID_inodes, filter, snapshot);
+        auto key    = iter.next_key();
+
+        for (auto i = begin; i < end; ++i) {
+            auto wanted = inodes[order[i]];
+            out[order[i]] = Inode{wanted, 0, 0};
+
+            while (key != nullptr && iter.inode(key).inode < wanted) {
+                key = iter.next_key();
+            }
+            if (key != nullptr && iter.inode(key).inode == wanted) {
+                out[order[i]] = iter.inode(key);
+            }
+        }
+        begin = end;
+    }
+    return out;
+}
+
+Array<Extend> BCacheFSReader::collect_extents(uint64_t inode, uint32_t snapshot) const {
+    Array<Extend>        out;
+    Array<JournalExtent> journal;
+
+    // extents are indexed by their end, so the keys of this file are all inside the inode range
+    auto min  = POS(inode, 0);
+    auto max  = SPOS(inode, ~0ULL, ~0U);
+    auto iter = iterator(BTREE_ID_extents, min, max, snapshot);
+    auto bkey = iter.next_key();
+
+    auto overlay = _journal.find(BTREE_ID_extents);
+
+    while (bkey != nullptr) {
+        if (bkey->type == KEY_TYPE_extent || bkey->type == KEY_TYPE_inline_data || bkey->type == KEY_TYPE_reflink_p) {
+            auto exts = iter.extends(bkey);
+
+            auto replayed = iter.journal_key(bkey);
+            if (replayed != nullptr) {
+                for (auto &ext: exts) {
+                    journal.push_back(JournalExtent{replayed->seq, ext, false});
+                }
+            } else {
+                out.insert(out.end(), exts.begin(), exts.end());
+            }
+        }
+        bkey = iter.next_key();
+    }
+
+    // the keys of the journal were not trimmed when they were written, newer keys hide what they overlap
+    if (overlay != nullptr) {
+        auto filter = SnapshotFilter(snapshot_ancestors(snapshot));
+
+        for (auto item = overlay->lower_bound(min); item != overlay->end() && bpos_cmp(item->first, max) <= 0; ++item) {
+            auto key = item->second.key;
+
+            if (!bkey_is_deletion(key->type) || key->size == 0 ||
+                (snapshot != 0 && !filter.is_visible(key->p.snapshot))) {
+                continue;
+            }
+
+            auto start = (key->p.offset - key->size) * BCH_SECTOR_SIZE;
+            journal.push_back(JournalExtent{item->second.seq,
+                                            Extend{inode, start, 0, (uint64_t)key->size * BCH_SECTOR_SIZE}, true});
+        }
+
+        std::stable_sort(journal.begin(), journal.end(),
+                         [](JournalExtent const &a, JournalExtent const &b) { return a.seq < b.seq; });
+
+        for (auto &item: journal) {
+            punch_extents(out, item.extent.file_offset, item.extent.file_offset + item.extent.size);
+
+            if (!item.hole) {
+                out.push_back(item.extent);
+            }
+        }
+    }
+
+    std::sort(out.begin(), out.end(), [](Extend const &a, Extend const &b) { return a.file_offset < b.file_offset; });
+    return out;
+}
+
+Array<uint8_t> BCacheFSReader::read_file(uint64_t inode, uint32_t snapshot) const {
+    TRACE_SPAN("read_file");
+    auto timer = ScopedTimer(_metrics.local().file_read);
+
+    uint64_t size    = 0;
+    auto     extents = file_extents(inode, snapshot, size);
+
+    // holes are left zeroed
+    Array<uint8_t> data(size);
+    for (auto &ext: extents) {
+        read(ext.offset, data.data() + ext.file_offset, ext.size);
+    }
+
+    return data;
+}
+
+// SnapshotFilter
+// -------------------------------------------------------------------
+SnapshotFilter::SnapshotFilter(Array<uint32_t> ancestors): _ancestors(std::move(ancestors)) {
+    std::sort(_ancestors.begin(), _ancestors.end());
+}
+
+bool SnapshotFilter::is_visible(uint32_t snapshot) const {
+    return std::binary_search(_ancestors.begin(), _ancestors.end(), snapshot);
+}
+
+bool SnapshotFilter::overlaps(uint32_t min, uint32_t max) const {
+    auto item = std::lower_bound(_ancestors.begin(), _ancestors.end(), min);
+    return item != _ancestors.end() && *item <= max;
+}
+
+bool SnapshotFilter::accept(BKey const *key, struct bkey_local const &local) {
+    if (!is_visible(local.p.snapshot)) {
+        return false;
+    }
+
+    // versions are sorted by snapshot, children have smaller ids than their parents
+    // so the first visible version is the one of the closest ancestor
+    if (_has_last && _last_inode == local.p.inode && _last_offset == local.p.offset) {
+        return false;
+    }
+
+    _has_last    = true;
+    _last_inode  = local.p.inode;
+    _last_offset = local.p.offset;
+
+    // the closest version is a deletion, the key does not exist in this snapshot
+    return !bkey_is_deletion(key->type);
+}
+
+bool SnapshotFilter::skip(BPos const &min, BPos const &max) const {
+    // the node holds multiple positions, we need to look inside
+    if (min.inode != max.inode || min.offset != max.offset) {
+        return false;
+    }
+
+    // all the versions inside the node are older versions of a position we returned
+    if (_has_last && _last_inode == min.inode && _last_offset == min.offset) {
+        return true;
+    }
+
+    return !overlaps(min.snapshot, max.snapshot);
+}
+
+// ReflinkCache
+// -------------------------------------------------------------------
+bool ReflinkCache::find(uint64_t idx, IndirectExtent &out) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto item = _extents.upper_bound(idx);
+    if (item == _extents.end() || item->second.extent.start > idx) {
+        return false;
+    }
+
+    _ages.splice(_ages.begin(), _ages, item->second.age);
+    out = item->second.extent;
+    return true;
 }
 
-Array<JournalSetEntry const *> BCacheFSReader::find_journal_entries(SuperBlockFieldClean const *field) const {
+void ReflinkCache::insert(IndirectExtent const &ext) {
+    std::lock_guard<std::mutex> lock(_mutex);
 
-    auto iter = FieldIterator<JournalSetEntry>((uint8_t const *)field + sizeof(SuperBlockFieldClean));
-    auto end  = FieldIterator<JournalSetEntry>((uint8_t const *)field + field->field.u64s * BCH_U64S_SIZE);
+    if (_extents.count(ext.end) > 0) {
+        return;
+    }
 
-    Array<JournalSetEntry const *> out(BTREE_ID_NR);
-    auto                           type = BCH_JSET_ENTRY_btree_root;
+    if (_extents.size() >= _capacity && !_ages.empty()) {
+        _extents.erase(_ages.back());
+        _ages.pop_back();
+    }
 
-    for (; iter < end; ++iter) {
-        debug("(size: {}) (type: {}) looking for {}", iter->u64s, iter->type, type);
+    _ages.push_front(ext.end);
+    _extents[ext.end] = Entry{ext, _ages.begin()};
+}
 
-        if (iter->type == type) {
-            out[iter->btree_id] = *iter;
+bool NodeCache::find(uint64_t offset, NodeRef &out) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (;;) {
+        auto item = _nodes.find(offset);
+        if (item == _nodes.end()) {
+            // the caller loads it
+            _nodes[offset] = Entry();
+            return false;
         }
 
-        if (iter->u64s <= 0) {
-            break;
+        if (!item->second.loading) {
+            _ages.splice(_ages.begin(), _ages, item->second.age);
+            out = item->second.node;
+            return true;
         }
-    }
 
-    return out;
+        _loaded.wait(lock);
+    }
 }
 
-BTreeIterator BCacheFSReader::iterator(BTreeType type) const {
-    auto entry = _btree_roots[type];
+void NodeCache::insert(uint64_t offset, NodeRef const &node) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
 
-    debug("Look for the btree ptr pointing to the node {} {}", entry->btree_id, type);
-    auto btree_ptr = find_btree_root(entry);
+        if (!node) {
+            _nodes.erase(offset);
+        } else {
+            if (_ages.size() >= _capacity && !_ages.empty()) {
+                _nodes.erase(_ages.back());
+                _ages.pop_back();
+            }
 
-    //
-    return BTreeIterator(*this, btree_ptr, type);
+            _ages.push_front(offset);
+            auto &entry   = _nodes[offset];
+            entry.node    = node;
+            entry.loading = false;
+            entry.age     = _ages.begin();
+        }
+    }
+    _loaded.notify_all();
 }
 
 // ========================================================================================
@@ -155,7 +1078,7 @@ BTreeIterator BCacheFSReader::iterator(BTreeType type) const {
 BKeyIterator::BKeyIterator(BSet const *bset) {
     assert(bset != nullptr);
     iter = (uint8_t const *)bset + sizeof(BSet);
-    end  = (uint8_t const *)(bset + bset->u64s * BCH_U64S_SIZE);
+    end  = (uint8_t const *)bset + sizeof(BSet) + bset->u64s * BCH_U64S_SIZE;
 }
 
 BKey const *BKeyIterator::next() {
@@ -202,7 +1125,8 @@ uint8_t const *BSetIterator::offset(uint64_t block_size) {
     // standard next
     _cb += sizeof(BSet) + v->u64s * BCH_U64S_SIZE;
 
-    _cb += block_size - (uint64_t)_cb % block_size +
+    // the next bset starts on the next block, a bset ending on a block is followed right away
+    _cb += (block_size - (uint64_t)_cb % block_size) % block_size +
            // skip btree_node_entry csum
            sizeof(struct bch_csum);
 
@@ -211,41 +1135,77 @@ uint8_t const *BSetIterator::offset(uint64_t block_size) {
 }
 
 BSet const *BSetIterator::next(uint64_t block_size) {
-    // this does not get executed, why
-    if (iter >= end) {
-        return nullptr;
-    }
+    // empty bsets are skipped
+    while (iter < end) {
+        auto val     = *iter;
+        iter.current = offset(block_size);
 
-    auto val     = *iter;
-    iter.current = offset(block_size);
-
-    if (val->u64s == 0) {
-        return next(block_size);
+        if (val->u64s != 0) {
+            return val;
+        }
     }
 
-    return val;
+    return nullptr;
 }
 
 // BTreeIterator
 // -------------------------------------------------------------------
-BTreeIterator::BTreeIterator(BCacheFSReader const &reader, const BTreePtr *root_ptr, BTreeType type):
-    _reader(reader), _type(type), _ptr(root_ptr) {
+BTreeIterator::BTreeIterator(
+    BCacheFSReader const &          reader,
+    const BTreePtr *                root_ptr,
+    BTreeType                       type,
+    BPos const &                    min,
+    BPos const &                    max,
+    std::shared_ptr<SnapshotFilter> snapshot,
+    JournalOverlay::Keys const *    overlay,
+    bool                            sorted,
+    uint64_t                        types,
+    NodeCache *                     cache):
+    _reader(reader),
+    _type(type), _min(min), _max(max),
+    _ranged(bpos_cmp(min, POS_MIN) != 0 || bpos_cmp(max, SPOS_MAX) != 0), _snapshot(snapshot),
+    _sort(sorted || snapshot != nullptr || overlay != nullptr), _types(types), _cache(cache),
+    _overlay(overlay), _keys_decoded(reader._metrics, &MetricsShard::keys_decoded) {
+
+    if (_overlay != nullptr) {
+        _overlay_iter = _overlay->lower_bound(_min);
+    }
 
-    debug("load the btree node");
-    _iter = load_btree_node(root_ptr);
+    if (root_ptr != nullptr) {
+        debug("load the btree node");
+        push_node(root_ptr);
+    }
+}
+
+bool BTreeIterator::push_node(BTreePtr const *ptr) {
+    if (_depth == BTREE_ITER_MAX_DEPTH) {
+        error("btree deeper than {} levels", BTREE_ITER_MAX_DEPTH);
+        return false;
+    }
 
-    assert(_iter);
+    auto node = _reader.load_btree_node(ptr, _cache);
+    if (!node) {
+        return false;
+    }
 
-    // // BCacheFS_iter_next_bset
-    _bset_iterator = BSetIterator(_iter.get(), _reader.btree_node_size());
+    auto &cursor        = _levels[_depth];
+    cursor.bsets        = BSetIterator(node.get(), _reader.btree_node_size());
+    cursor.keys         = BKeyIterator();
+    cursor.node         = std::move(node);
+    cursor.ptr          = ptr;
+    cursor.level        = (uint32_t)extract_bitflag(cursor.node->flags, 4, 8);
+    cursor.merging      = false;
+    cursor.source_count = 0;
+    cursor.overflow.clear();
+
+    _depth += 1;
+    return true;
 }
 
 BValue const *get_value(BTreeNode const *node, const BKey *key) {
-    auto format = node->format;
-
     uint8_t key_u64s = 0;
     if (key->format == KEY_FORMAT_LOCAL_BTREE) {
-        key_u64s = format.key_u64s;
+        key_u64s = node->format.key_u64s;
     } else {
         key_u64s = BKEY_U64s;
     }
@@ -253,52 +1213,294 @@ BValue const *get_value(BTreeNode const *node, const BKey *key) {
     return (BValue const *)((uint8_t const *)key + key_u64s * BCH_U64S_SIZE);
 }
 
-BKey const *BTreeIterator::_next_key() {
-    if (has_children()) {
-        BTreeIterator *nodeiter = &_children[_children.size() - 1];
-        auto           key      = nodeiter->_next_key();
+bool BTreeIterator::in_range(BTreeNode const *node, BKey const *key) {
+    if (!_ranged && !_snapshot) {
+        return true;
+    }
 
-        // That node is over, get next key
-        if (key == nullptr) {
-            _children.pop_back();
-            return _next_key();
+    auto local = parse_bkey(key, &node->format);
+
+    if (key->type == KEY_TYPE_btree_ptr_v2) {
+        // the child holds the keys inside [min_key, p]
+        auto value = (const BTreePtr *)get_value(node, key);
+
+        if (bpos_cmp(local.p, _min) < 0 || bpos_cmp(value->min_key, _max) > 0) {
+            return false;
+        }
+        return !_snapshot || !_snapshot->skip(value->min_key, local.p);
+    }
+
+    if (bpos_cmp(local.p, _min) < 0 || bpos_cmp(local.p, _max) > 0) {
+        return false;
+    }
+
+    // with a journal the versions are picked once the keys are merged, see next_merged_key
+    return !_snapshot || _overlay != nullptr || _snapshot->accept(key, local);
+}
+
+BKey const *BTreeIterator::next_node_key(BTreeCursor &cursor) {
+    if (_sort) {
+        if (!cursor.merging) {
+            start_merge(cursor);
+        }
+        return next_merged_node_key(cursor);
+    }
+
+    while (true) {
+        // get next key in the current bset
+        auto key = cursor.keys.next();
+
+        if (key != nullptr) {
+            return key;
+        }
+        debug("fetching next bset");
+
+        // _key == null that means
+        //  1. we need to find the first bset
+        //  2. we a have reached the end of the previous bset
+        auto bset = cursor.bsets.next(_reader.btree_block_size());
+
+        if (bset == nullptr) {
+            debug("bset is done");
+            return nullptr;
+        }
+
+        debug("iterate through a bset: {} {}", INT(bset), bset->u64s);
+        cursor.keys = BKeyIterator(bset);
+    }
+}
+
+void BTreeIterator::start_merge(BTreeCursor &cursor) {
+    TRACE_SPAN("merge_bsets");
+    auto format = &cursor.node->format;
+    auto bset   = cursor.bsets.next(_reader.btree_block_size());
+
+    while (bset != nullptr) {
+        if (cursor.source_count == BTREE_ITER_MAX_BSETS && cursor.overflow.empty()) {
+            cursor.overflow.assign(cursor.inline_sources, cursor.inline_sources + BTREE_ITER_MAX_BSETS);
+        }
+
+        BSetCursor source;
+        source.keys = BKeyIterator(bset);
+        source.key  = source.keys.next();
+
+        if (source.key != nullptr) {
+            source.pos = parse_bkey(source.key, format).p;
+        }
+
+        if (cursor.overflow.empty()) {
+            cursor.inline_sources[cursor.source_count] = source;
+        } else {
+            cursor.overflow.push_back(source);
         }
 
+        cursor.source_count += 1;
+        bset = cursor.bsets.next(_reader.btree_block_size());
+    }
+
+    cursor.merging = true;
+}
+
+BKey const *BTreeIterator::next_merged_node_key(BTreeCursor &cursor) {
+    auto sources = cursor.sources();
+
+    // a single bset has nothing to merge, its keys are not decoded
+    if (cursor.source_count == 1) {
+        auto key = sources[0].key;
+        if (key != nullptr) {
+            sources[0].key = sources[0].keys.next();
+        }
         return key;
     }
 
-    // get next key in the current bset
-    auto key = _key_iterator.next();
+    BSetCursor *best = nullptr;
 
-    if (key != nullptr) {
+    // each bset is sorted but they overlap, on ties the newest bset wins
+    for (uint32_t i = 0; i < cursor.source_count; ++i) {
+        auto &source = sources[i];
+        if (source.key != nullptr && (best == nullptr || bpos_cmp(source.pos, best->pos) <= 0)) {
+            best = &source;
+        }
+    }
+
+    if (best == nullptr) {
+        return nullptr;
+    }
+
+    auto key = best->key;
+    auto pos = best->pos;
+
+    // the older versions of the key are skipped
+    for (uint32_t i = 0; i < cursor.source_count; ++i) {
+        auto &source = sources[i];
+
+        if (source.key != nullptr && bpos_cmp(source.pos, pos) == 0) {
+            source.key = source.keys.next();
+
+            if (source.key != nullptr) {
+                source.pos = parse_bkey(source.key, &cursor.node->format).p;
+            }
+        }
+    }
+    return key;
+}
+
+BKey const *BTreeIterator::_next_key() {
+    // keys outside of the range are skipped in a loop, children are pushed on the cursor stack
+    while (_depth > 0) {
+        auto &cursor = top();
+        auto  key    = next_node_key(cursor);
+
+        // That node is over, go back to its parent
+        if (key == nullptr) {
+            cursor.node.reset();
+            _depth -= 1;
+            _keys_decoded.flush();
+            continue;
+        }
+
+        if (early_type_skip(key) || !in_range(cursor.node.get(), key)) {
+            continue;
+        }
 
         // we are pointing to another btree
         if (key->type == KEY_TYPE_btree_ptr_v2) {
             debug("entering a new node");
-            auto value = get_value(_iter.get(), (const BKey *)key);
-            _children.emplace_back(_reader, (const BTreePtr *)value, _type);
-            return _next_key();
+            auto value = (BTreePtr const *)get_value(cursor.node.get(), key);
+
+            if (!push_node(value)) {
+                _depth = 0;
+                return nullptr;
+            }
+            continue;
+        }
+
+        // the journal keys can be closer versions, next_merged_key filters the merged keys
+        if (_snapshot && _overlay != nullptr) {
+            return key;
+        }
+
+        // deletions only hide the older versions of their key
+        if (!accepts(key->type) || bkey_is_deletion(key->type)) {
+            continue;
         }
 
         return key;
     }
-    debug("fetching next bset");
 
-    // _key == null that means
-    //  1. we need to find the first bset
-    //  2. we a have reached the end of the previous bset
-    auto bset = _bset_iterator.next(_reader.btree_block_size());
+    return nullptr;
+}
 
-    if (bset != nullptr) {
-        debug("iterate through a bset: {} {}", INT(bset), bset->u64s);
-        _key_iterator = BKeyIterator(bset);
-        return _next_key();
+KeySpan BTreeIterator::next_span() {
+    if (_overlay != nullptr) {
+        return next_merged_span();
     }
 
-    debug("bset is done");
-    // _bset is null
-    // we finished our current node
-    return nullptr;
+    _span.clear();
+
+    while (_depth > 0) {
+        auto &cursor = top();
+
+        if (cursor.level > 0) {
+            auto key = next_node_key(cursor);
+
+            if (key == nullptr) {
+                cursor.node.reset();
+                _depth -= 1;
+                _keys_decoded.flush();
+            } else if (key->type == KEY_TYPE_btree_ptr_v2 && in_range(cursor.node.get(), key)) {
+                if (!push_node((BTreePtr const *)get_value(cursor.node.get(), key))) {
+                    _depth = 0;
+                }
+            }
+            continue;
+        }
+
+        // a leaf, the keys of a whole bset (node when merging) are decoded in one go
+        auto btree = cursor.node.get();
+        auto base  = cursor.ptr->start->offset * BCH_SECTOR_SIZE;
+
+        auto add = [&](BKey const *key) {
+            if (early_type_skip(key)) {
+                return;
+            }
+
+            auto local = parse_bkey(key, &btree->format);
+
+            if (_ranged && (bpos_cmp(local.p, _min) < 0 || bpos_cmp(local.p, _max) > 0)) {
+                return;
+            }
+
+            if (_snapshot && (!_snapshot->accept(key, local) || !accepts(key->type))) {
+                return;
+            }
+
+            if (bkey_is_deletion(key->type)) {
+                return;
+            }
+
+            _span.push_back(KeyView{key, get_value(btree, key), local, base + INT(key) - INT(btree)});
+        };
+
+        if (_sort) {
+            if (!cursor.merging) {
+                start_merge(cursor);
+            }
+
+            for (auto key = next_merged_node_key(cursor); key != nullptr; key = next_merged_node_key(cursor)) {
+                add(key);
+            }
+        } else {
+            for (auto key = cursor.keys.next(); key != nullptr; key = cursor.keys.next()) {
+                add(key);
+            }
+        }
+
+        // the span points inside the node, it is released on the next call
+        if (!_span.empty()) {
+            break;
+        }
+
+        auto bset = _sort ? nullptr : cursor.bsets.next(_reader.btree_block_size());
+
+        if (bset == nullptr) {
+            cursor.node.reset();
+            _depth -= 1;
+            _keys_decoded.flush();
+        } else {
+            cursor.keys = BKeyIterator(bset);
+        }
+    }
+
+    _keys_decoded.add(_span.size());
+    return KeySpan(_span);
+}
+
+KeySpan BTreeIterator::next_merged_span() {
+    TRACE_SPAN("merge_journal");
+    _span.clear();
+    _span_node.reset();
+
+    while (true) {
+        auto key = _pending != nullptr ? std::exchange(_pending, nullptr) : next_key();
+        if (key == nullptr) {
+            break;
+        }
+
+        // the span ends with its node, the node of the next key is kept for the next span
+        auto btree = node(key);
+        if (btree != nullptr && btree != _span_node.get()) {
+            if (_span_node) {
+                _pending = key;
+                break;
+            }
+            _span_node = top().node;
+        }
+
+        _span.push_back(view(key));
+    }
+
+    return KeySpan(_span);
 }
 
 uint64_t benz_uintXX_as_uint64(const uint8_t *bytes, uint8_t sizeof_uint) {
@@ -379,82 +1581,299 @@ struct bkey_local parse_bkey(const struct bkey *bkey, const struct bkey_format *
     return ret;
 }
 
+BKey const *BTreeIterator::next_key() {
+    auto key = _overlay == nullptr ? _next_key() : next_merged_key();
+
+    if (key != nullptr) {
+        _keys_decoded.add(1);
+    }
+    return key;
+}
+
+BKey const *BTreeIterator::next_merged_key() {
+    while (true) {
+        // we keep the next key of the nodes around until the journal keys before it are consumed
+        if (!_disk_ready) {
+            _disk_key   = _next_key();
+            _disk_ready = true;
+            _current    = nullptr;
+
+            if (_disk_key != nullptr) {
+                _disk_pos = local(_disk_key).p;
+            }
+        }
+
+        auto journal_done = _overlay_iter == _overlay->end() || bpos_cmp(_overlay_iter->first, _max) > 0;
+        auto cmp          = !journal_done && _disk_key != nullptr ? bpos_cmp(_overlay_iter->first, _disk_pos) : -1;
+
+        if (journal_done || cmp > 0) {
+            _current    = nullptr;
+            _disk_ready = false;
+
+            // with snapshots every version is returned by _next_key, the closest one is picked here
+            if (_disk_key != nullptr && _snapshot &&
+                (!_snapshot->accept(_disk_key, local(_disk_key)) || !accepts(_disk_key->type))) {
+                continue;
+            }
+            return _disk_key;
+        }
+
+        // the journal key is newer than the key in the node
+        if (cmp == 0) {
+            _disk_ready = false;
+        }
+
+        _current = &_overlay_iter->second;
+        ++_overlay_iter;
+
+        auto key     = _current->key;
+        auto visible = _snapshot ? _snapshot->accept(key, parse_bkey(key, nullptr)) : !bkey_is_deletion(key->type);
+
+        if (!visible || !accepts(key->type)) {
+            continue;
+        }
+
+        return key;
+    }
+}
+
+BTreeNode const *BTreeIterator::node(BKey const *key) {
+    if (_current != nullptr && _current->key == key) {
+        return nullptr;
+    }
+    return _depth > 0 ? top().node.get() : nullptr;
+}
+
+struct bkey_local BTreeIterator::local(BKey const *key) {
+    auto btree = node(key);
+    return parse_bkey(key, btree != nullptr ? &btree->format : nullptr);
+}
+
+BValue const *BTreeIterator::value(BKey const *key) { return get_value(node(key), key); }
+
+KeyView BTreeIterator::view(BKey const *key) {
+    auto btree = node(key);
+
+    if (btree == nullptr) {
+        return KeyView{key, get_value(nullptr, key), parse_bkey(key, nullptr), _current->offset};
+    }
+
+    auto &cursor = top();
+    auto  offset = cursor.ptr->start->offset * BCH_SECTOR_SIZE + INT(key) - INT(btree);
+    return KeyView{key, get_value(btree, key), parse_bkey(key, &btree->format), offset};
+}
+
 DirectoryEntry BTreeIterator::directory(BKey const *key) {
     if (!key) {
         error("null key");
         return DirectoryEntry();
     }
+    return decode_dirent(view(key));
+}
+
+Inode BTreeIterator::inode(BKey const *key) {
+    if (!key) {
+        error("null key");
+        return Inode();
+    }
+    return decode_inode(view(key));
+}
+
+Extend BTreeIterator::extend(BKey const *key) {
+    auto exts = extends(key);
+
+    if (exts.empty()) {
+        return Extend();
+    }
+
+    return exts[0];
+}
+
+Array<Extend> BTreeIterator::extends(BKey const *key) {
+    if (!key) {
+        error("null key");
+        return Array<Extend>();
+    }
+    return _reader.extends(view(key));
+}
 
-    if (key->type != KEY_TYPE_dirent) {
+DirectoryEntry decode_dirent(KeyView const &view) {
+    if (view.key->type != KEY_TYPE_dirent) {
         error("not a directory");
         return DirectoryEntry();
     }
 
-    auto iter  = iterator();
-    auto btree = iter._iter.get();
-    auto value = (BDirEnt const *)get_value(btree, key);
-    auto local = parse_bkey(key, &btree->format);
+    auto value = (BDirEnt const *)view.value;
+
+    // bch2_dirent_name_bytes: the name fills the value and is padded with NULs to a multiple of 8 bytes
+    auto end  = (uint8_t const *)view.key + view.key->u64s * BCH_U64S_SIZE;
+    auto size = end > value->d_name ? (uint32_t)(end - value->d_name) : 0;
 
     return DirectoryEntry{
-        .parent_inode = local.p.inode,
+        .parent_inode = view.local.p.inode,
         .inode        = value->d_inum,
+        .offset       = view.local.p.offset,
         .type         = value->d_type,
         .name         = value->d_name,
+        .name_size    = (uint32_t)strnlen((const char *)value->d_name, size),
     };
 }
 
-Extend BTreeIterator::extend(BKey const *key) {
-    if (!key) {
-        error("null key");
-        return Extend();
+// bch2_varint_decode: the number of trailing 1 bits of the first byte is the length of the integer
+static int decode_varint(uint8_t const *in, uint8_t const *end, uint64_t &out) {
+    unsigned bytes = in < end ? (unsigned)__builtin_ctz(~(unsigned)*in) + 1 : 1;
+
+    if (in + bytes > end) {
+        return -1;
     }
 
-    if (key->type != KEY_TYPE_extent && key->type != KEY_TYPE_inline_data) {
-        error("not a directory");
-        return Extend();
+    if (bytes < 9) {
+        uint64_t v = 0;
+        memcpy(&v, in, bytes);
+        out = v >> bytes;
+    } else {
+        memcpy(&out, in + 1, sizeof(out));
+    }
+    return (int)bytes;
+}
+
+Inode decode_inode(KeyView const &view) {
+    if (view.key->type != KEY_TYPE_inode) {
+        error("not an inode");
+        return Inode();
+    }
+
+    auto value = (BInode const *)view.value;
+    auto local = view.local;
+    auto end   = (uint8_t const *)view.key + local.u64s * BCH_U64S_SIZE;
+
+    // older versions index the inodes by p.inode, newer ones by p.offset
+    auto out = Inode{local.p.inode != 0 ? local.p.inode : local.p.offset, value->bi_mode, 0};
+
+    // Only the varint encoding is supported
+    // fields are: atime, ctime, mtime, otime (96 bits, 2 varints each) then size
+    bool new_varint = extract_bitflag(value->bi_flags, 31, 32);
+    auto nr_fields  = extract_bitflag(value->bi_flags, 24, 31);
+
+    if (!new_varint || nr_fields < 5) {
+        return out;
+    }
+
+    uint8_t const *in = value->fields;
+    uint64_t       v  = 0;
+
+    for (int i = 0; i < 9; ++i) {
+        auto bytes = decode_varint(in, end, v);
+        if (bytes < 0) {
+            return out;
+        }
+        in += bytes;
+    }
+
+    out.size = v;
+    return out;
+}
+
+Array<Extend> BCacheFSReader::extends(KeyView const &view) const {
+    auto key = view.key;
+
+    if (key->type != KEY_TYPE_extent && key->type != KEY_TYPE_inline_data && key->type != KEY_TYPE_reflink_p) {
+        error("not an extent");
+        return Array<Extend>();
     }
 
-    auto iter  = iterator();
-    auto btree = iter._iter.get();
-    auto local = parse_bkey(key, &btree->format);
+    auto local = view.local;
     auto ext   = Extend{};
-    auto val   = get_value(btree, key);
+    auto val   = view.value;
+    auto end   = (const uint8_t *)key + local.u64s * BCH_U64S_SIZE;
+
+    ext.inode       = local.p.inode;
+    ext.file_offset = (local.p.offset - local.size) * BCH_SECTOR_SIZE;
 
     if (key->type == KEY_TYPE_extent) {
         debug("extend - extend ptr");
 
-        auto value      = (BExtendPtr const *)val;
-        ext.file_offset = (key->p.offset - key->size) * BCH_SECTOR_SIZE;
-        ext.offset      = value->offset * BCH_SECTOR_SIZE;
-        ext.size        = key->size * BCH_SECTOR_SIZE;
+        auto crc   = ExtentCrc{};
+        auto value = find_extent_ptr((const uint8_t *)val, end, &crc);
+        if (value == nullptr) {
+            error("extent without pointer");
+            return Array<Extend>();
+        }
+        if (!extent_data(value, crc, ext.offset, ext.checksum)) {
+            error("extent of inode {} at {} is compressed ({}), it cannot be read", ext.inode, ext.file_offset,
+                  crc.compression_type);
+            return Array<Extend>();
+        }
+        ext.size = local.size * BCH_SECTOR_SIZE;
 
     } else if (key->type == KEY_TYPE_inline_data) {
         debug("extend - inline data");
-        ext.file_offset = (key->p.offset - key->size) * BCH_SECTOR_SIZE;
-        ext.offset      = 0;
-        ext.size        = key->u64s * BCH_U64S_SIZE;
 
-        //
-        auto     start  = _ptr->start->offset * BCH_SECTOR_SIZE;
-        uint64_t offset = (uint64_t)((const uint8_t *)val - (const uint8_t *)btree) + start;
+        // the data follows the key, wherever the key lives (node or journal bucket)
+        ext.offset = view.offset + (uint64_t)((const uint8_t *)val - (const uint8_t *)key);
+        ext.size   = (uint64_t)(end - (const uint8_t *)val);
 
-        ext.offset = offset;
-        ext.size -= (uint64_t)((const uint8_t *)val - (const uint8_t *)key);
-    } else {
+    } else if (key->type == KEY_TYPE_reflink_p) {
+        debug("extend - reflink ptr");
+
+        auto value = (BReflinkP const *)val;
+        return resolve_reflink(local.p.inode, value->idx, local.size, local.p.offset - local.size);
     }
 
-    return ext;
+    return Array<Extend>{ext};
 }
 
-std::shared_ptr<BTreeNode> BTreeIterator::load_btree_node(BTreePtr const *ptr) {
-    auto size       = _reader.btree_node_size();
-    auto btree_node = malloc(size);
-
-    uint64_t offset = ptr->start->offset * BCH_SECTOR_SIZE;
-    fseek(_reader._file, (long)offset, SEEK_SET);
-    fread(btree_node, size, 1, _reader._file);
+BExtendPtr const *find_extent_ptr(uint8_t const *start, uint8_t const *end, ExtentCrc *crc) {
+    while (start < end) {
+        auto entry = (union bch_extent_entry const *)start;
+        if (entry->type == 0) {
+            return nullptr;
+        }
 
-    return std::shared_ptr<BTreeNode>((BTreeNode *)btree_node, free);
+        // the type of an entry is the position of its lowest set bit
+        auto type = __builtin_ctzl(entry->type);
+
+        switch (type) {
+        case BCH_EXTENT_ENTRY_ptr:
+            return (BExtendPtr const *)start;
+        // sizes are stored minus 1
+        case BCH_EXTENT_ENTRY_crc32: {
+            auto entry = (struct bch_extent_crc32 const *)start;
+            if (crc != nullptr) {
+                *crc = ExtentCrc{entry->_compressed_size + 1u, entry->_uncompressed_size + 1u, entry->offset,
+                                 (uint8_t)entry->csum_type, (uint8_t)entry->compression_type,
+                                 bch_csum{entry->csum, 0}};
+            }
+            start += sizeof(struct bch_extent_crc32);
+            break;
+        }
+        case BCH_EXTENT_ENTRY_crc64: {
+            auto entry = (struct bch_extent_crc64 const *)start;
+            if (crc != nullptr) {
+                *crc = ExtentCrc{entry->_compressed_size + 1u, entry->_uncompressed_size + 1u, entry->offset,
+                                 (uint8_t)entry->csum_type, (uint8_t)entry->compression_type,
+                                 bch_csum{entry->csum_lo, entry->csum_hi}};
+            }
+            start += sizeof(struct bch_extent_crc64);
+            break;
+        }
+        case BCH_EXTENT_ENTRY_crc128: {
+            auto entry = (struct bch_extent_crc128 const *)start;
+            if (crc != nullptr) {
+                *crc = ExtentCrc{entry->_compressed_size + 1u, entry->_uncompressed_size + 1u, entry->offset,
+                                 (uint8_t)entry->csum_type, (uint8_t)entry->compression_type, entry->csum};
+            }
+            start += sizeof(struct bch_extent_crc128);
+            break;
+        }
+        case BCH_EXTENT_ENTRY_stripe_ptr:
+            start += sizeof(struct bch_extent_stripe_ptr);
+            break;
+        default:
+            return nullptr;
+        }
+    }
+    return nullptr;
 }
 
 BSet const *next(BSet const *iter, uint64_t block_size, BTreeNode const *node) {
@@ -467,7 +1886,7 @@ BSet const *next(BSet const *iter, uint64_t block_size, BTreeNode const *node) {
     // standard next
     _cb += sizeof(*iter) + iter->u64s * BCH_U64S_SIZE;
 
-    _cb += block_size - (uint64_t)_cb % block_size +
+    _cb += (block_size - (uint64_t)_cb % block_size) % block_size +
            // skip btree_node_entry csum
            sizeof(struct bch_csum);
 
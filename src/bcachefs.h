@@ -4,12 +4,24 @@
 
 #include "cbcachefs.h"
 #include "logger.h"
+#include "metrics.h"
+#include "node_pool.h"
 
+#include <condition_variable>
+#include <initializer_list>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include <sys/uio.h>
+
 #define INT(x) ((uint64_t)(x))
 
 template <typename V>
@@ -20,10 +32,17 @@ using Superblock = struct bch_sb;
 
 using SuperBlockFieldType  = enum bch_sb_field_type;
 using SuperBlockFieldBase  = struct bch_sb_field;
-using SuperBlockFieldClean = struct bch_sb_field_clean;
+using SuperBlockFieldClean     = struct bch_sb_field_clean;
+using SuperBlockFieldJournal   = struct bch_sb_field_journal;
+using SuperBlockFieldMembers   = struct bch_sb_field_members;
+using SuperBlockFieldBlacklist = struct bch_sb_field_journal_seq_blacklist;
+using Member                   = struct bch_member;
 
 using JournalSetEntryType = enum bch_jset_entry_type;
 using JournalSetEntry     = struct jset_entry;
+using JournalSet          = struct jset;
+using JournalBlacklist    = struct jset_entry_blacklist;
+using JournalBlacklistV2  = struct jset_entry_blacklist_v2;
 using BTreeType           = enum btree_id;
 
 using BTreePtr   = struct bch_btree_ptr_v2;
@@ -31,7 +50,14 @@ using BKeyType   = enum bch_bkey_type;
 using BKey       = struct bkey;
 using BValue     = struct bch_val;
 using BDirEnt    = struct bch_dirent;
+using BInode     = struct bch_inode;
 using BExtendPtr = struct bch_extent_ptr;
+using BPos       = struct bpos;
+
+using BReflinkP           = struct bch_reflink_p;
+using BReflinkV           = struct bch_reflink_v;
+using BIndirectInlineData = struct bch_indirect_inline_data;
+using BSnapshot           = struct bch_snapshot;
 
 using BTreeNode = struct btree_node;
 using BSet      = struct bset;
@@ -41,19 +67,291 @@ inline uint64_t extract_bitflag(const uint64_t bitfield, uint8_t first_bit, uint
 }
 
 struct BTreeIterator;
+struct DirectoryCursor;
+struct Extend;
+struct Inode;
+
+// Keys that only hide the older versions of their position, they are never returned
+// discard is the whiteout the kernel leaves in a snapshot when a key of an ancestor is removed
+inline bool bkey_is_deletion(uint8_t type) {
+    return type == KEY_TYPE_deleted || type == KEY_TYPE_discard || type == KEY_TYPE_hash_whiteout;
+}
+
+// Smallest position after p, p must not be SPOS_MAX
+inline BPos bpos_successor(BPos p) {
+    if (++p.snapshot == 0 && ++p.offset == 0) {
+        ++p.inode;
+    }
+    return p;
+}
+
+struct BPosLess {
+    bool operator()(BPos const &a, BPos const &b) const { return bpos_cmp(a, b) < 0; }
+};
+
+// A key found by a point lookup, it keeps the node it lives in alive
+// node is null if the key comes from the journal
+struct BTreeKey {
+    NodeRef           node;
+    uint64_t          key_offset = 0; // offset of the key on disk in bytes
+    BKey const *      key        = nullptr;
+    struct bkey_local local;
+
+    operator bool() const { return key != nullptr; }
+};
+
+// A slice of the key space of a btree, see BCacheFSReader::partition
+struct KeyRange {
+    BPos     min;
+    BPos     max;
+    uint64_t bytes  = 0; // bytes written in the leaves of the range
+    uint64_t leaves = 0;
+};
+
+// A decoded key handed out by the span scans, valid until the node holding it is released
+struct KeyView {
+    BKey const *      key;
+    BValue const *    value;
+    struct bkey_local local;
+    uint64_t          offset; // offset of the key on disk in bytes
+};
+
+using KeySpan = std::span<KeyView const>;
+
+// Filter pushed down into the scans, subtrees outside of the inode range are not loaded
+// and the keys of other types are skipped before being decoded
+struct KeyFilter {
+    uint64_t types     = ~0ULL; // bit t keeps the keys of type t
+    uint64_t min_inode = 0;
+    uint64_t max_inode = ~0ULL;
+
+    KeyFilter() = default;
+
+    // an empty list keeps every type
+    KeyFilter(std::initializer_list<BKeyType> only, uint64_t min = 0, uint64_t max = ~0ULL):
+        types(only.size() == 0 ? ~0ULL : 0), min_inode(min), max_inode(max) {
+        for (auto type: only) {
+            types |= 1ULL << type;
+        }
+    }
+
+    bool accepts(uint8_t type) const { return type < 64 && ((types >> type) & 1) != 0; }
+};
+
+static_assert(KEY_TYPE_MAX <= 64, "key types do not fit in KeyFilter::types");
+
+// Checksum of the data of an extent, it covers the whole region that was written with the extent:
+// the region starts before the data of a front trimmed extent and ends after the data of a back trimmed one
+struct ExtentChecksum {
+    uint64_t        offset = 0; // offset of the region on disk in bytes
+    uint64_t        size   = 0; // size of the region in bytes
+    struct bch_csum csum   = {};
+    uint8_t         type   = BCH_CSUM_none;
+};
+
+// An indirect extent living in the reflink btree
+// [start, end) is the range of the extent in the reflink btree in sectors
+struct IndirectExtent {
+    uint64_t       start;
+    uint64_t       end;
+    uint64_t       offset; // offset of the data on disk in bytes
+    uint64_t       size;   // size of the data on disk in bytes
+    ExtentChecksum checksum;
+};
+
+// LRU cache of the resolved indirect extents
+// Reflinked files usually share most of their extents so we avoid
+// walking the reflink btree for every reflink_p key
+struct ReflinkCache {
+    public:
+    ReflinkCache(std::size_t capacity = 4096): _capacity(capacity) {}
+
+    // Find the indirect extent holding the sector idx
+    bool find(uint64_t idx, IndirectExtent &out);
+
+    void insert(IndirectExtent const &ext);
+
+    private:
+    struct Entry {
+        IndirectExtent                 extent;
+        std::list<uint64_t>::iterator  age;
+    };
+
+    std::mutex                _mutex;
+    std::size_t               _capacity;
+    std::map<uint64_t, Entry> _extents; // indexed by the end of the extent
+    std::list<uint64_t>       _ages;    // most recently used first
+};
+
+// LRU cache of btree nodes shared by the iterators of a batch of scans
+// interior nodes are read by every scan and neighbouring scans often end in the same leaf,
+// a node being loaded by a thread is waited for instead of being read twice
+struct NodeCache {
+    public:
+    NodeCache(std::size_t capacity = 256): _capacity(capacity) {}
+
+    // true with the cached node, waits while another thread loads it
+    // false if the node is not cached, the caller loads it and must insert it
+    bool find(uint64_t offset, NodeRef &out);
+
+    // node is null if the load failed, the next find of the offset loads it again
+    void insert(uint64_t offset, NodeRef const &node);
+
+    private:
+    struct Entry {
+        NodeRef                       node;
+        bool                          loading = true;
+        std::list<uint64_t>::iterator age;
+    };
+
+    std::mutex                          _mutex;
+    std::condition_variable             _loaded;
+    std::size_t                         _capacity;
+    std::unordered_map<uint64_t, Entry> _nodes; // indexed by the offset of the node on disk
+    std::list<uint64_t>                 _ages;  // loaded nodes, most recently used first
+};
+
+// Keeps only the version of each key that is visible from a snapshot
+// a key is visible if it was written in the snapshot or one of its ancestors,
+// when multiple versions are visible the one from the closest ancestor wins
+struct SnapshotFilter {
+    // ancestors: the snapshot and all its ancestors
+    SnapshotFilter(Array<uint32_t> ancestors);
+
+    bool is_visible(uint32_t snapshot) const;
+
+    // true if one of the ancestors is inside [min, max]
+    bool overlaps(uint32_t min, uint32_t max) const;
+
+    // Returns true if the key should be returned,
+    // keys must be presented in sorted order
+    bool accept(BKey const *key, struct bkey_local const &local);
+
+    // Returns true if the node holding the keys inside [min, max] can be skipped
+    bool skip(BPos const &min, BPos const &max) const;
+
+    private:
+    Array<uint32_t> _ancestors; // sorted
+
+    // last position seen, older versions are hidden
+    bool     _has_last    = false;
+    uint64_t _last_inode  = 0;
+    uint64_t _last_offset = 0;
+};
+
+// A key replayed from the journal
+struct JournalKey {
+    BKey const *key;
+    uint64_t    offset; // offset of the key on disk in bytes
+    uint64_t    seq;    // seq of the jset holding the key
+};
+
+// Keys written to the journal that did not make it to the btree nodes yet
+// iterators merge them with the keys read from the nodes
+struct JournalOverlay {
+    using Keys = std::map<BPos, JournalKey, BPosLess>;
+
+    Array<Array<uint8_t>>          buckets; // journal buckets, keys point inside them
+    Array<Keys>                    keys  = Array<Keys>(BTREE_ID_NR);
+    Array<JournalSetEntry const *> roots = Array<JournalSetEntry const *>(BTREE_ID_NR);
+    uint64_t                       seq   = 0; // newest journal entry replayed
+
+    Keys const *find(BTreeType type) const { return keys[type].empty() ? nullptr : &keys[type]; }
+};
+
+#define FIND_INODES_GAP 256 // inodes further apart than this get their own scan in find_inodes
 
 struct BCacheFSReader {
     public:
-    BCacheFSReader(String const &file);
+    // Images that were not cleanly unmounted do not have BCH_SB_FIELD_clean,
+    // the btree roots and the keys not yet written to the nodes are then replayed from the journal
+    BCacheFSReader(String const &file, bool replay_journal = false);
 
     ~BCacheFSReader();
 
+    // false when the image could not be opened, has no valid superblock or no btree root was found
+    // in the clean section nor in the journal, nothing can be read
+    bool valid() const { return _valid; }
+
     BTreeIterator iterator(BTreeType type) const;
 
+    // Iterate over the keys inside [min, max], nodes outside of the range are not loaded
+    // if snapshot is not 0 only the keys visible from that snapshot are returned
+    BTreeIterator iterator(BTreeType type, BPos const &min, BPos const &max, uint32_t snapshot = 0) const;
+
+    // Iterate over the keys matching the filter, the inode range applies to p.offset in the inodes btree
+    BTreeIterator iterator(BTreeType type, KeyFilter const &filter, uint32_t snapshot = 0) const;
+
+    // The snapshot and all its ancestors
+    Array<uint32_t> snapshot_ancestors(uint32_t snapshot) const;
+
+    // Find the smallest key with a position greater or equal to pos
+    BTreeKey find(BTreeType type, BPos const &pos) const;
+
+    // Resolve a range of the reflink btree into the extents holding its data
+    Array<Extend> resolve_reflink(uint64_t inode, uint64_t idx, uint64_t sectors, uint64_t file_offset) const;
+
+    // Size in bytes stored in the inode of a file, 0 if the inode is not found or its size cannot be decoded
+    uint64_t file_size(uint64_t inode, uint32_t snapshot = 0) const;
+
+    // Extents of a file sorted by file offset, reflink pointers are resolved
+    // if snapshot is not 0 the file is read as it is in that snapshot
+    // the extents are sector aligned, they are trimmed to the size of the file
+    Array<Extend> file_extents(uint64_t inode, uint32_t snapshot = 0) const;
+
+    // size receives the size of the file, the end of its last extent when the inode does not give it
+    Array<Extend> file_extents(uint64_t inode, uint32_t snapshot, uint64_t &size) const;
+
+    // Same with the size taken from inode instead of being looked up, for the callers that already found it
+    Array<Extend> file_extents(Inode const &inode, uint32_t snapshot, uint64_t &size) const;
+
+    // Inodes of a batch, out[i] is the inode of inodes[i] with a size of 0 if it is not found
+    // close inodes share a scan of the inodes btree instead of a lookup each
+    Array<Inode> find_inodes(Array<uint64_t> const &inodes, uint32_t snapshot = 0) const;
+
+    // Read the content of a file, holes are left zeroed
+    Array<uint8_t> read_file(uint64_t inode, uint32_t snapshot = 0) const;
+
+    // Push style scan of the keys inside [min, max], fun receives a KeySpan with the keys of each leaf
+    // and can return false to stop the scan
+    template <typename Fun>
+    void for_each_key(BTreeType type, BPos const &min, BPos const &max, Fun &&fun, uint32_t snapshot = 0) const;
+
+    template <typename Fun>
+    void for_each_key(BTreeType type, Fun &&fun) const {
+        for_each_key(type, POS_MIN, SPOS_MAX, std::forward<Fun>(fun));
+    }
+
+    template <typename Fun>
+    void for_each_key(BTreeType type, KeyFilter const &filter, Fun &&fun, uint32_t snapshot = 0) const;
+
+    // Physical extents holding the data of an extent, inline_data or reflink_p key
+    Array<Extend> extends(KeyView const &view) const;
+
+    // Entries of a directory in hash order, only the nodes holding the dirents of dir are read
+    // the listing starts at offset, pass DirectoryCursor::offset() to resume an interrupted listing
+    // the nodes are shared through cache when listing many directories
+    DirectoryCursor
+    readdir(uint64_t dir, uint64_t offset = 0, uint32_t snapshot = 0, NodeCache *cache = nullptr) const;
+
+    // Split the key space of a btree into at most n contiguous ranges holding about the same number of bytes,
+    // the ranges cover [POS_MIN, SPOS_MAX]. Only the interior nodes are read, a leaf is weighted by the
+    // sectors_written of its pointer
+    Array<KeyRange> partition(BTreeType type, uint64_t n) const;
+
+    // The buffer comes from the node pool and goes back to it with the last handle
+    // with a cache the node is only read if it is not already cached
+    NodeRef load_btree_node(BTreePtr const *ptr, NodeCache *cache = nullptr) const;
+
+    // Read size bytes at offset, safe to call from multiple threads
+    uint64_t read(uint64_t offset, void *buffer, uint64_t size) const;
+
+    // Scatter the bytes starting at offset into the buffers, returns the number of bytes read
+    uint64_t read_vector(uint64_t offset, struct iovec *iov, int count) const;
+
     private:
-    // Load the superblock in 2 phases
-    //  - first phase reads only enough to be able to extract the full size of the superblock
-    //  - second phase reallocate the superblock using its full size
+    // Read all the copies of the superblock listed in the layout and keep the newest valid one
+    // null if none is valid
     Superblock *read_superblock();
 
     SuperBlockFieldBase const *find_superblock_field(SuperBlockFieldType type) const;
@@ -62,6 +360,31 @@ struct BCacheFSReader {
 
     BTreePtr const *find_btree_root(JournalSetEntry const *entry) const;
 
+    // Smallest key of the nodes with a position greater or equal to pos, deletions included
+    BTreeKey find_in_nodes(BTreePtr const *root, BPos const &pos) const;
+
+    // Load the snapshot tree, id -> parent
+    void load_snapshots();
+
+    // Read the journal buckets and replay the valid jsets into _journal
+    void replay_journal();
+
+    // Extents of a file sorted by file offset, not trimmed to its size
+    Array<Extend> collect_extents(uint64_t inode, uint32_t snapshot) const;
+
+    // Leaves below an interior node as found in the pointers of their parent
+    void collect_leaves(BTreePtr const *ptr, Array<KeyRange> &leaves) const;
+
+    BTreeIterator make_iterator(BTreeType  type,
+                                BPos const &min,
+                                BPos const &max,
+                                uint32_t    snapshot,
+                                uint64_t    types,
+                                NodeCache * cache = nullptr) const;
+
+    template <typename Fun>
+    static void scan(BTreeIterator &iter, Fun &fun);
+
     public:
     // extract the size of a btree node
     uint64_t btree_node_size() const {
@@ -70,10 +393,19 @@ struct BCacheFSReader {
 
     uint64_t btree_block_size() const { return (uint64_t)_sblock->block_size * BCH_SECTOR_SIZE; }
 
+    // counters and latencies of all the threads using the reader
+    MetricsSnapshot metrics() const { return _metrics.snapshot(); }
+
     public:
     FILE *                         _file   = nullptr;
     Superblock *                   _sblock = nullptr;
-    Array<JournalSetEntry const *> _btree_roots;
+    Array<JournalSetEntry const *> _btree_roots = Array<JournalSetEntry const *>(BTREE_ID_NR);
+    bool                           _valid       = false;
+    mutable ReflinkCache           _reflink_cache;
+    std::map<uint32_t, uint32_t>   _snapshot_parents;
+    JournalOverlay                 _journal;
+    mutable Metrics                _metrics;
+    std::unique_ptr<NodePool>      _nodes; // buffers of the nodes being read
 
     friend struct BTreeIterator;
 };
@@ -147,6 +479,22 @@ struct FieldIterator {
 
 BValue const *get_value(BTreeNode const *node, const BKey *key);
 
+struct bkey_local parse_bkey(const struct bkey *bkey, const struct bkey_format *format);
+
+// crc entry of an extent, it describes the data of the pointers that follow it
+struct ExtentCrc {
+    uint64_t        compressed_size   = 0; // in sectors, size of the data on disk
+    uint64_t        uncompressed_size = 0; // in sectors
+    uint64_t        offset            = 0; // sectors of the uncompressed data before the data of the extent
+    uint8_t         csum_type         = BCH_CSUM_none;
+    uint8_t         compression_type  = 0;
+    struct bch_csum csum              = {};
+};
+
+// Find the first pointer inside a list of extent entries
+// crc receives the crc entry that applies to it, it is left untouched when there is none
+BExtendPtr const *find_extent_ptr(uint8_t const *start, uint8_t const *end, ExtentCrc *crc = nullptr);
+
 // Iterates over all the BKeys inside a BSet
 struct BKeyIterator {
     BKeyIterator() {}
@@ -175,25 +523,48 @@ struct BSetIterator {
 struct DirectoryEntry {
     uint64_t       parent_inode;
     uint64_t       inode;
+    uint64_t       offset; // hash of the name, position of the entry inside its directory
     uint8_t        type;
     const uint8_t *name;
+    uint32_t       name_size; // the name is only NUL terminated when it does not fill the value
+
+    std::string_view filename() const { return std::string_view((const char *)name, name_size); }
 };
 
 inline std::ostream &operator<<(std::ostream &out, DirectoryEntry const &dir) {
     out << "p:" << dir.parent_inode << " ";
     out << "i:" << dir.inode << " ";
     out << "t:" << (unsigned int)(dir.type) << " ";
-    out << "s:" << (const char *)dir.name << " ";
+    out << "s:" << dir.filename() << " ";
     return out;
 }
 
-struct Extend {
+struct Inode {
     uint64_t inode;
-    uint64_t file_offset;
-    uint64_t offset;
-    uint64_t size;
+    uint16_t mode;
+    uint64_t size; // 0 if the fields could not be decoded
+};
+
+inline std::ostream &operator<<(std::ostream &out, Inode const &inode) {
+    out << "i:" << inode.inode << " ";
+    out << "m:" << std::oct << inode.mode << std::dec << " ";
+    out << "s:" << inode.size;
+    return out;
+}
+
+struct Extend {
+    uint64_t       inode;
+    uint64_t       file_offset;
+    uint64_t       offset;
+    uint64_t       size;
+    ExtentChecksum checksum; // unchanged when the extent is split
 };
 
+DirectoryEntry decode_dirent(KeyView const &view);
+
+// only the varint encoding is supported, size is 0 otherwise
+Inode decode_inode(KeyView const &view);
+
 inline std::ostream &operator<<(std::ostream &out, Extend const &ext) {
 
     out << "f:" << ext.file_offset << " ";
@@ -216,61 +587,218 @@ inline std::ostream &operator<<(std::ostream &out, BKey const &bkey) {
 //      Set BKey + BValue
 //   Node - Chunk in the FS (fread - file)
 //
+// The iterator keeps one cursor per level of the btree, from the root to
+// the node holding the current key, in a fixed size array: walking the
+// tree does not recurse nor allocate and the size of the iterator does
+// not depend on the shape of the tree.
+//
+#define BTREE_ITER_MAX_DEPTH 8 // bcachefs btrees have at most 4 levels
+#define BTREE_ITER_MAX_BSETS 8 // bsets merged without allocating, bcachefs keeps at most 3 per node in memory
+
+// Next key of a bset when the bsets of a node are merged
+struct BSetCursor {
+    BKey const * key = nullptr; // null once the bset is done
+    BPos         pos;
+    BKeyIterator keys;
+};
+
+// Position of an iterator inside one node
+struct BTreeCursor {
+    NodeRef         node;
+    BTreePtr const *ptr   = nullptr; // pointer to the node, lives in the parent or the journal
+    uint32_t        level = 0;
+    BSetIterator    bsets;
+    BKeyIterator    keys;
+
+    // sorted iteration, the heads of the bsets, nodes with many bsets overflow to the heap
+    bool              merging      = false;
+    uint32_t          source_count = 0;
+    BSetCursor        inline_sources[BTREE_ITER_MAX_BSETS];
+    Array<BSetCursor> overflow;
+
+    BSetCursor *sources() { return overflow.empty() ? inline_sources : overflow.data(); }
+};
+
 struct BTreeIterator {
     public:
-    BTreeIterator(BCacheFSReader const &reader, const BTreePtr *root_ptr, BTreeType type);
+    // The bsets of a node are merged so only the newest version of a key is returned, without sorted
+    // they are read in disk order and the overwritten versions are returned too
+    BTreeIterator(BCacheFSReader const &reader,
+                  const BTreePtr *      root_ptr,
+                  BTreeType             type,
+                  BPos const &          min      = POS_MIN,
+                  BPos const &          max      = SPOS_MAX,
+                  std::shared_ptr<SnapshotFilter> snapshot = nullptr,
+                  JournalOverlay::Keys const *    overlay  = nullptr,
+                  bool                            sorted   = true,
+                  uint64_t                        types    = ~0ULL,
+                  NodeCache *                     cache    = nullptr);
 
     ~BTreeIterator() {}
 
     BValue const *next() { return next_value(); }
 
-    BKey const *next_key() { return _next_key(); }
+    BKey const *next_key();
+
+    // Keys of the next node (of the next bset when the bsets are not merged), empty at the end
+    // the keys stay valid until the next call, do not mix with next_key
+    KeySpan next_span();
+
+    // Decode the key returned by next_key
+    struct bkey_local local(BKey const *key);
+
+    // Value of the key returned by next_key
+    BValue const *value(BKey const *key);
 
     DirectoryEntry directory(BKey const *key);
 
+    Inode inode(BKey const *key);
+
+    // reflink pointers are resolved to the first extent they point to
     Extend extend(BKey const *key);
 
+    // Physical extents holding the data of the key, reflink pointers can span multiple extents
+    Array<Extend> extends(BKey const *key);
+
+    // The journal key returned by next_key, null if the key comes from a node
+    JournalKey const *journal_key(BKey const *key) const {
+        return _current != nullptr && _current->key == key ? _current : nullptr;
+    }
+
     private:
     BValue const *next_value() {
-        auto key = _next_key();
-        return get_value(_iter.get(), key);
+        auto key = next_key();
+        return key != nullptr ? value(key) : nullptr;
     }
 
     BKey const *_next_key();
 
-    std::shared_ptr<BTreeNode> load_btree_node(BTreePtr const *ptr);
+    // merge the keys replayed from the journal with the keys of the nodes
+    BKey const *next_merged_key();
 
-    bool has_children() const { return _children.size() > 0; }
+    // node holding the key, null if the key comes from the journal
+    BTreeNode const *node(BKey const *key);
 
-    // get top level iterator
-    BTreeIterator &iterator() {
-        if (has_children()) {
-            return _children[_children.size()];
-        }
-        return *this;
+    KeyView view(BKey const *key);
+
+    // spans built from next_key when journal keys are merged
+    KeySpan next_merged_span();
+
+    // load a node below the current one
+    bool push_node(BTreePtr const *ptr);
+
+    // next key of a node, the bsets are merged unless the iterator is not sorted
+    BKey const *next_node_key(BTreeCursor &cursor);
+
+    // smallest key of the merged bsets, newer bsets override older ones for the same position
+    BKey const *next_merged_node_key(BTreeCursor &cursor);
+
+    void start_merge(BTreeCursor &cursor);
+
+    // true if the key is inside the range and visible from the snapshot
+    bool in_range(BTreeNode const *node, BKey const *key);
+
+    // without snapshots the type is checked before the key is decoded,
+    // with snapshots after: a whiteout of another type still hides the older versions
+    bool early_type_skip(BKey const *key) const {
+        return !_snapshot && key->type != KEY_TYPE_btree_ptr_v2 && !accepts(key->type);
     }
 
+    bool accepts(uint8_t type) const { return type < 64 && ((_types >> type) & 1) != 0; }
+
+    // cursor of the node we are currently in
+    BTreeCursor &top() { return _levels[_depth - 1]; }
+
     private:
     BCacheFSReader const &_reader;
     BTreeType const       _type;
-    const BTreePtr *      _ptr;
+    BPos const            _min;
+    BPos const            _max;
+    bool const            _ranged;
+
+    std::shared_ptr<SnapshotFilter> _snapshot;
+    bool const                      _sort;
+    uint64_t const                  _types; // see KeyFilter
+    NodeCache *const                _cache; // nodes shared with other iterators, can be null
+
+    // Journal keys
+    JournalOverlay::Keys const *         _overlay = nullptr;
+    JournalOverlay::Keys::const_iterator _overlay_iter;
+    JournalKey const *                   _current    = nullptr; // last key returned if it comes from the journal
+    BKey const *                         _disk_key   = nullptr; // next key of the nodes
+    BPos                                 _disk_pos   = POS_MIN;
+    bool                                 _disk_ready = false;
+
+    // nodes from the root to the current leaf, node buffers are recycled by the node pool of the reader
+    BTreeCursor _levels[BTREE_ITER_MAX_DEPTH];
+    uint32_t    _depth = 0;
+
+    // keys of the last span
+    Array<KeyView> _span;
+    NodeRef        _span_node;         // node of the keys of the span when they come from next_key
+    BKey const *   _pending = nullptr; // first key of the next span
+
+    // keys returned, added to the metrics when a node is done
+    DeferredCounter _keys_decoded;
+};
+
+// Resumable listing of a directory, see BCacheFSReader::readdir
+struct DirectoryCursor {
+    public:
+    DirectoryCursor(BTreeIterator iter, uint64_t dir, uint64_t offset):
+        _iter(std::move(iter)), _dir(dir), _offset(offset) {}
+
+    // false once every entry was returned, the name points inside a node and stays valid until the next call
+    bool next(DirectoryEntry &entry);
 
-    // Memory we need to read a node
-    // we allocate one that we reuse for the different node we traverse
-    std::shared_ptr<BTreeNode> _iter = nullptr;
+    uint64_t directory() const { return _dir; }
 
-    // Iterators
-    BSetIterator         _bset_iterator;
-    BKeyIterator         _key_iterator;
-    Array<BTreeIterator> _children;
+    // offset of the next entry
+    uint64_t offset() const { return _offset; }
+
+    private:
+    BTreeIterator _iter;
+    uint64_t      _dir;
+    uint64_t      _offset;
 };
 
+template <typename Fun>
+void BCacheFSReader::for_each_key(BTreeType type, BPos const &min, BPos const &max, Fun &&fun, uint32_t snapshot) const {
+    if (_btree_roots[type] != nullptr) {
+        auto iter = iterator(type, min, max, snapshot);
+        scan(iter, fun);
+    }
+}
+
+template <typename Fun>
+void BCacheFSReader::for_each_key(BTreeType type, KeyFilter const &filter, Fun &&fun, uint32_t snapshot) const {
+    if (_btree_roots[type] != nullptr) {
+        auto iter = iterator(type, filter, snapshot);
+        scan(iter, fun);
+    }
+}
+
+template <typename Fun>
+void BCacheFSReader::scan(BTreeIterator &iter, Fun &fun) {
+    for (auto span = iter.next_span(); !span.empty(); span = iter.next_span()) {
+        if constexpr (std::is_same_v<std::invoke_result_t<Fun &, KeySpan>, bool>) {
+            if (!fun(span)) {
+                return;
+            }
+        } else {
+            fun(span);
+        }
+    }
+}
+
 union Value {
     struct bch_dirent       dirent;
     struct bch_inode        inode;
     struct bch_extent       extend;
     struct bch_btree_ptr_v2 btree;
     struct bch_inline_data  inlinedata;
+    struct bch_reflink_p    reflink_p;
+    struct bch_reflink_v    reflink_v;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include "bcachefs_c.h"
+#include "batch.h"
+#include "bcachefs.h"
+#include "logger.h"
+#include "manifest.h"
+
+#include <atomic>
+#include <exception>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct bcachefs_image {
+    std::atomic<uint64_t>           refs{1};
+    std::unique_ptr<BCacheFSReader> reader;
+    std::unique_ptr<Manifest>       manifest;
+    uint8_t const *                 map  = nullptr;
+    uint64_t                        size = 0;
+
+    ~bcachefs_image() {
+        if (map != nullptr) {
+            munmap((void *)map, size);
+        }
+    }
+};
+
+struct bcachefs_buffer {
+    std::atomic<uint64_t> refs{1};
+    bcachefs_image *      image = nullptr;
+    uint8_t const *       data  = nullptr;
+    uint64_t              size  = 0;
+    Array<uint8_t>        owned; // empty if data points into the mmap
+};
+
+static void retain_image(bcachefs_image *image) { image->refs.fetch_add(1, std::memory_order_relaxed); }
+
+static void release_image(bcachefs_image *image) {
+    if (image->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete image;
+    }
+}
+
+// Exceptions must not cross the C boundary, they are logged and fallback is returned instead
+template <typename T, typename Fun>
+static T guard(char const *name, T fallback, Fun fun) noexcept {
+    try {
+        return fun();
+    } catch (std::exception const &err) {
+        error("{}: {}", name, err.what());
+    } catch (...) {
+        error("{}: unknown exception", name);
+    }
+    return fallback;
+}
+
+int bcachefs_abi_version(void) { return BCACHEFS_ABI_VERSION; }
+
+static bcachefs_image *open_image(char const *path, char const *manifest) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error("could not open {}", path);
+        return nullptr;
+    }
+
+    struct stat st;
+    void *      map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        error("could not map {}", path);
+        return nullptr;
+    }
+
+    auto image  = std::make_unique<bcachefs_image>();
+    image->map  = (uint8_t const *)map;
+    image->size = (uint64_t)st.st_size;
+
+    image->reader = std::make_unique<BCacheFSReader>(path);
+
+    if (!image->reader->valid()) {
+        error("{} is not a valid image", path);
+        return nullptr;
+    }
+
+    if (manifest != nullptr) {
+        image->manifest = std::make_unique<Manifest>(manifest);
+
+        if (!image->manifest->valid() || image->manifest->is_stale(*image->reader)) {
+            error("manifest {} cannot be used with {}", manifest, path);
+            return nullptr;
+        }
+    }
+
+    return image.release();
+}
+
+bcachefs_image *bcachefs_open(char const *path, char const *manifest) {
+    return guard("bcachefs_open", (bcachefs_image *)nullptr, [&]() { return open_image(path, manifest); });
+}
+
+void bcachefs_close(bcachefs_image *image) {
+    guard("bcachefs_close", 0, [&]() {
+        if (image != nullptr) {
+            release_image(image);
+        }
+        return 0;
+    });
+}
+
+// Read files given by their extents
+// a file stored in a single extent is not copied, the others are read together
+template <typename Lookup>
+static size_t read_buffers(bcachefs_image *image, size_t count, bcachefs_buffer **out, Lookup lookup) {
+    Array<BatchSegment> segments;
+    Array<Extend>       extents;
+    size_t              found = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t size = 0;
+
+        extents.clear();
+        if (!lookup(i, extents, size)) {
+            continue;
+        }
+
+        auto buffer   = new bcachefs_buffer;
+        buffer->image = image;
+        buffer->size  = size;
+        retain_image(image);
+        out[i] = buffer;
+
+        if (size == 0) {
+            buffer->data = nullptr;
+        } else if (extents.size() == 1 && extents[0].file_offset == 0 && extents[0].size >= size &&
+                   extents[0].offset + size <= image->size) {
+            buffer->data = image->map + extents[0].offset;
+        } else {
+            buffer->owned.assign(size, 0);
+            buffer->data = buffer->owned.data();
+
+            for (auto &ext: extents) {
+                if (ext.file_offset < size) {
+                    auto bytes = std::min(ext.size, size - ext.file_offset);
+                    segments.push_back({ext.offset, bytes, buffer->owned.data() + ext.file_offset});
+                }
+            }
+        }
+        found += 1;
+    }
+
+    if (!segments.empty()) {
+        read_segments(*image->reader, segments);
+    }
+    return found;
+}
+
+// the buffers of a batch that failed are released, every file gets NULL
+template <typename Lookup>
+static size_t read_files(char const *name, bcachefs_image *image, size_t count, bcachefs_buffer **out,
+                         Lookup lookup) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = nullptr;
+    }
+
+    auto found = guard(name, BCACHEFS_ERROR, [&]() { return read_buffers(image, count, out, lookup); });
+
+    if (found == BCACHEFS_ERROR) {
+        for (size_t i = 0; i < count; ++i) {
+            bcachefs_release(out[i]);
+            out[i] = nullptr;
+        }
+    }
+    return found;
+}
+
+size_t bcachefs_read_many(bcachefs_image *image, uint64_t const *inodes, size_t count, bcachefs_buffer **out) {
+    Array<Inode> found;
+    auto         lookup = [&](size_t i, Array<Extend> &extents, uint64_t &size) {
+        // the inodes of the batch are found together on the first lookup
+        if (found.empty()) {
+            found = image->reader->find_inodes(Array<uint64_t>(inodes, inodes + count));
+        }
+        extents = image->reader->file_extents(found[i], 0, size);
+        return !extents.empty() || size != 0;
+    };
+    return read_files("bcachefs_read_many", image, count, out, lookup);
+}
+
+size_t bcachefs_read_many_paths(bcachefs_image *image, char const *const *paths, size_t count,
+                                bcachefs_buffer **out) {
+    auto manifest = image->manifest.get();
+
+    if (manifest == nullptr) {
+        error("image was opened without a manifest");
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = nullptr;
+        }
+        return 0;
+    }
+
+    auto lookup = [&](size_t i, Array<Extend> &extents, uint64_t &size) {
+        auto file = manifest->find(paths[i]);
+        if (file < 0) {
+            return false;
+        }
+
+        auto &entry = manifest->file(file);
+        size        = entry.size;
+
+        for (auto ext = manifest->extents_begin(file); ext != manifest->extents_end(file); ++ext) {
+            extents.push_back({entry.inode, ext->file_offset, ext->offset, ext->size});
+        }
+        return !extents.empty() || size == 0;
+    };
+    return read_files("bcachefs_read_many_paths", image, count, out, lookup);
+}
+
+void bcachefs_retain(bcachefs_buffer *buffer) { buffer->refs.fetch_add(1, std::memory_order_relaxed); }
+
+void bcachefs_release(bcachefs_buffer *buffer) {
+    guard("bcachefs_release", 0, [&]() {
+        if (buffer == nullptr || buffer->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return 0;
+        }
+
+        auto image = buffer->image;
+        delete buffer;
+        release_image(image);
+        return 0;
+    });
+}
+
+void const *bcachefs_buffer_data(bcachefs_buffer const *buffer) { return buffer->data; }
+
+uint64_t bcachefs_buffer_size(bcachefs_buffer const *buffer) { return buffer->size; }
+
+int bcachefs_buffer_is_mapped(bcachefs_buffer const *buffer) { return buffer->size > 0 && buffer->owned.empty(); }
@@ -0,0 +1,72 @@
+#ifndef BCACHE_FS_SRC_BCACHEFS_C_HEADER
+#define BCACHE_FS_SRC_BCACHEFS_C_HEADER
+
+/*
+ * C API
+ * -------------------------------------------------------------------
+ *  Stable interface for embedding the reader in other languages.
+ *  Every type is opaque, adding features only adds functions.
+ *
+ *  Buffers returned by bcachefs_read_many point directly into a read only
+ *  mmap of the image when the file is stored in a single extent, so they
+ *  can be exposed without copy (e.g. with the python buffer protocol).
+ *  Buffers and images are reference counted, a buffer keeps its image
+ *  mapped until it is released.
+ *
+ *  No function throws, errors are logged and reported by the return value.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCACHEFS_ABI_VERSION 1
+
+#define BCACHEFS_API __attribute__((visibility("default")))
+
+/* Returned instead of a count when a batch failed */
+#define BCACHEFS_ERROR ((size_t)-1)
+
+typedef struct bcachefs_image  bcachefs_image;
+typedef struct bcachefs_buffer bcachefs_buffer;
+
+/* BCACHEFS_ABI_VERSION the library was built with */
+BCACHEFS_API int bcachefs_abi_version(void);
+
+/* Open an image, manifest can be NULL if files are only read by inode
+ * returns NULL if the image cannot be read or the manifest does not match it */
+BCACHEFS_API bcachefs_image *bcachefs_open(char const *image, char const *manifest);
+
+/* Drop the reference returned by bcachefs_open */
+BCACHEFS_API void bcachefs_close(bcachefs_image *image);
+
+/* Read count files by inode, out[i] receives a new reference to the content of inodes[i]
+ * returns the number of files read, files that could not be read get NULL
+ * returns BCACHEFS_ERROR if the batch failed, every file gets NULL */
+BCACHEFS_API size_t bcachefs_read_many(bcachefs_image *image, uint64_t const *inodes, size_t count,
+                                       bcachefs_buffer **out);
+
+/* Same as bcachefs_read_many using the paths of the manifest */
+BCACHEFS_API size_t bcachefs_read_many_paths(bcachefs_image *image, char const *const *paths, size_t count,
+                                             bcachefs_buffer **out);
+
+BCACHEFS_API void bcachefs_retain(bcachefs_buffer *buffer);
+
+/* Drop a reference to the buffer, NULL is ignored */
+BCACHEFS_API void bcachefs_release(bcachefs_buffer *buffer);
+
+BCACHEFS_API void const *bcachefs_buffer_data(bcachefs_buffer const *buffer);
+
+BCACHEFS_API uint64_t bcachefs_buffer_size(bcachefs_buffer const *buffer);
+
+/* Non zero if the buffer points into the image mmap */
+BCACHEFS_API int bcachefs_buffer_is_mapped(bcachefs_buffer const *buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,6 +25,8 @@ typedef unsigned int uint32_t;
 typedef __uint64_t uint64_t;
 
 #define BCH_SB_SECTOR           8
+#define BCH_SB_LAYOUT_SECTOR    7
+#define BCH_SB_MAX_SIZE_BITS    11  /* default superblock size, 1MB */
 #define BCH_SB_LABEL_SIZE       32
 #define BCH_SECTOR_SIZE         512
 #define BCH_U64S_SIZE           8
@@ -62,7 +64,9 @@ typedef __uint64_t uint64_t;
     x(alloc,            4)          \
     x(quotas,           5)          \
     x(stripes,          6)          \
-    x(reflink,          7)
+    x(reflink,          7)          \
+    x(subvolumes,       8)          \
+    x(snapshots,        9)
 
 /*
  * - DELETED keys are used internally to mark keys that should be ignored but
@@ -102,7 +106,9 @@ typedef __uint64_t uint64_t;
     x(inline_data,      17)         \
     x(btree_ptr_v2,     18)         \
     x(indirect_inline_data, 19)     \
-    x(alloc_v2,         20)
+    x(alloc_v2,         20)         \
+    x(subvolume,        21)         \
+    x(snapshot,         22)
 
 #define BCH_EXTENT_ENTRY_TYPES()    \
     x(ptr,              0)          \
@@ -171,6 +177,23 @@ enum bch_bkey_type {
     KEY_TYPE_MAX,
 };
 
+#define BCH_CSUM_TYPES()            \
+    x(none,                 0)      \
+    x(crc32c_nonzero,       1)      \
+    x(crc64_nonzero,        2)      \
+    x(chacha20_poly1305_80, 3)      \
+    x(chacha20_poly1305_128,4)      \
+    x(crc32c,               5)      \
+    x(crc64,                6)      \
+    x(xxhash,               7)
+
+enum bch_csum_type {
+#define x(t, n) BCH_CSUM_##t = n,
+    BCH_CSUM_TYPES()
+#undef x
+    BCH_CSUM_NR
+};
+
 enum bch_extent_entry_type {
 #define x(f, n) BCH_EXTENT_ENTRY_##f = n,
     BCH_EXTENT_ENTRY_TYPES()
@@ -222,6 +245,12 @@ struct bch_sb_field {
     uint32_t        type;
 };
 
+/* bcachefs_metadata_version_min, older metadata is not supported */
+#define BCH_METADATA_VERSION_MIN 9
+
+/* bcachefs_metadata_version_inode_btree_change, inodes are indexed by p.offset from this version */
+#define BCH_METADATA_VERSION_INODE_BTREE_CHANGE 11
+
 /* // sb = superblock 
  * @offset  - sector where this sb was written
  * @version - on disk format version
@@ -304,6 +333,26 @@ static inline struct bpos SPOS(uint64_t inode, uint64_t offset, uint32_t snapsho
     };
 }
 
+static inline struct bpos POS(uint64_t inode, uint64_t offset)
+{
+    return SPOS(inode, offset, 0);
+}
+
+#define POS_MIN     SPOS(0, 0, 0)
+#define SPOS_MAX    SPOS(~0ULL, ~0ULL, ~0U)
+
+/* Compare two positions, inode first then offset then snapshot */
+static inline int bpos_cmp(struct bpos l, struct bpos r)
+{
+    if (l.inode != r.inode)
+        return l.inode < r.inode ? -1 : 1;
+    if (l.offset != r.offset)
+        return l.offset < r.offset ? -1 : 1;
+    if (l.snapshot != r.snapshot)
+        return l.snapshot < r.snapshot ? -1 : 1;
+    return 0;
+}
+
 /* Empty placeholder struct, for container_of() */
 struct bch_val {
     uint64_t        __nothing[0];
@@ -445,6 +494,87 @@ struct jset_entry {
     };
 };
 
+/* BCH_SB_FIELD_journal: buckets holding the journal */
+struct bch_sb_field_journal {
+    struct bch_sb_field field;
+    uint64_t    buckets[0];
+};
+
+/* BCH_SB_FIELD_members: */
+struct bch_member {
+    struct uuid     uuid;
+    uint64_t    nbuckets;   /* device size */
+    uint16_t    first_bucket;   /* index of first bucket used */
+    uint16_t    bucket_size;    /* sectors */
+    uint32_t    pad;
+    uint64_t    last_mount; /* time_t */
+
+    uint64_t    flags[2];
+} __attribute__((packed, aligned(8)));
+
+struct bch_sb_field_members {
+    struct bch_sb_field field;
+    struct bch_member   members[0];
+};
+
+/* BCH_SB_FIELD_journal_seq_blacklist: jsets inside [start, end) must not be replayed */
+struct journal_seq_blacklist_entry {
+    uint64_t    start;
+    uint64_t    end;
+};
+
+struct bch_sb_field_journal_seq_blacklist {
+    struct bch_sb_field field;
+    struct journal_seq_blacklist_entry start[0];
+};
+
+/* BCH_JSET_ENTRY_blacklist: a single seq */
+struct jset_entry_blacklist {
+    struct jset_entry   entry;
+    uint64_t    seq;
+};
+
+/* BCH_JSET_ENTRY_blacklist_v2: end is included */
+struct jset_entry_blacklist_v2 {
+    struct jset_entry   entry;
+    uint64_t    start;
+    uint64_t    end;
+};
+
+/*
+ * Journal
+ *
+ * On disk format for a journal entry:
+ * seq is monotonically increasing; every journal entry has its own unique
+ * sequence number.
+ *
+ * last_seq is the oldest journal entry that still has keys the btree hasn't
+ * flushed to disk yet.
+ */
+struct jset {
+    struct bch_csum     csum;
+
+    uint64_t    magic;
+    uint64_t    seq;
+    uint32_t    version;
+    uint32_t    flags;
+
+    uint32_t    u64s; /* size of d[] in u64s */
+
+    uint8_t     encrypted_start[0];
+
+    uint16_t    _read_clock; /* no longer used */
+    uint16_t    _write_clock;
+
+    /* Sequence number of oldest dirty journal entry */
+    uint64_t    last_seq;
+
+    union {
+        struct jset_entry start[0];
+        uint64_t    _data[0];
+    };
+} __attribute__((packed, aligned(8)));
+
 struct bch_sb_field_clean {
     struct bch_sb_field field;
 
@@ -559,6 +689,51 @@ struct bch_extent {
     uint64_t    _data[0];
 } __attribute__((packed, aligned(8)));
 
+/* Reflink: */
+
+struct bch_reflink_p {
+    struct bch_val      v;
+    uint64_t    idx;
+    /*
+     * A reflink pointer might point to an indirect extent which is then
+     * later split (by copygc or rebalance). If we only pointed to part of
+     * the original indirect extent, and then one of the fragments is
+     * outside the range we point to, we'd leak a refcount: so when creating
+     * reflink pointers, we need to store pad values to remember the full
+     * range we were taking a reference on.
+     */
+    uint32_t    front_pad;
+    uint32_t    back_pad;
+} __attribute__((packed, aligned(8)));
+
+struct bch_reflink_v {
+    struct bch_val      v;
+    uint64_t    refcount;
+    union bch_extent_entry  start[0];
+    uint64_t    _data[0];
+} __attribute__((packed, aligned(8)));
+
+struct bch_indirect_inline_data {
+    struct bch_val      v;
+    uint64_t    refcount;
+    uint8_t     data[0];
+};
+
+/* Snapshots */
+
+/*
+ * Snapshot ids are allocated in decreasing order, a child
+ * always has a smaller id than its parent
+ */
+struct bch_snapshot {
+    struct bch_val      v;
+    uint32_t    flags;
+    uint32_t    parent;
+    uint32_t    children[2];
+    uint32_t    subvol;
+    uint32_t    pad;
+} __attribute__((packed, aligned(8)));
+
 /* Inodes */
 
 #define BCACHEFS_ROOT_INO   4096
@@ -0,0 +1,84 @@
+#include "checksum.h"
+#include "logger.h"
+
+#include <array>
+
+static std::array<uint32_t, 256> make_crc32c_table() {
+    std::array<uint32_t, 256> table{};
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (0x82F63B78U & (0U - (crc & 1U)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+static std::array<uint64_t, 256> make_crc64_table() {
+    std::array<uint64_t, 256> table{};
+
+    for (uint64_t i = 0; i < 256; ++i) {
+        uint64_t crc = i << 56;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc << 1) ^ (0x42F0E1EBA9EA3693ULL & (0ULL - (crc >> 63)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+uint32_t crc32c(uint32_t crc, void const *data, std::size_t size) {
+    static const auto table = make_crc32c_table();
+
+    auto bytes = (uint8_t const *)data;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+uint64_t crc64_be(uint64_t crc, void const *data, std::size_t size) {
+    static const auto table = make_crc64_table();
+
+    auto bytes = (uint8_t const *)data;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[((crc >> 56) ^ bytes[i]) & 0xFF] ^ (crc << 8);
+    }
+    return crc;
+}
+
+bool compute_checksum(unsigned type, void const *data, std::size_t size, struct bch_csum &out) {
+    out = bch_csum{0, 0};
+
+    switch (type) {
+    case BCH_CSUM_none:
+        return true;
+    case BCH_CSUM_crc32c_nonzero:
+        out.lo = crc32c(~0U, data, size) ^ ~0U;
+        return true;
+    case BCH_CSUM_crc32c:
+        out.lo = crc32c(0, data, size);
+        return true;
+    case BCH_CSUM_crc64_nonzero:
+        out.lo = crc64_be(~0ULL, data, size) ^ ~0ULL;
+        return true;
+    case BCH_CSUM_crc64:
+        out.lo = crc64_be(0, data, size);
+        return true;
+    }
+
+    return false;
+}
+
+bool verify_checksum(unsigned type, struct bch_csum const &expected, void const *data, std::size_t size) {
+    struct bch_csum csum;
+
+    if (!compute_checksum(type, data, size, csum)) {
+        warn("checksum type {} is not supported", type);
+        return false;
+    }
+
+    return csum.lo == expected.lo && csum.hi == expected.hi;
+}
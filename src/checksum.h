@@ -0,0 +1,22 @@
+#ifndef BCACHE_FS_SRC_CHECKSUM_HEADER
+#define BCACHE_FS_SRC_CHECKSUM_HEADER
+
+#include "cbcachefs.h"
+
+#include <cstddef>
+
+// Castagnoli crc32, same as the kernel crc32c: no inversion of the seed or the result
+uint32_t crc32c(uint32_t crc, void const *data, std::size_t size);
+
+// ECMA-182 big endian crc64, same as the kernel crc64_be
+uint64_t crc64_be(uint64_t crc, void const *data, std::size_t size);
+
+// Compute the checksum of a buffer like bcachefs does
+// returns false if the checksum type is not supported
+bool compute_checksum(unsigned type, void const *data, std::size_t size, struct bch_csum &out);
+
+// Returns true if the checksum matches, a type that is not supported (xxhash, chacha20/poly1305)
+// cannot be verified and is rejected
+bool verify_checksum(unsigned type, struct bch_csum const &expected, void const *data, std::size_t size);
+
+#endif
@@ -0,0 +1,1006 @@
+#include "image_writer.h"
+#include "checksum.h"
+#include "logger.h"
+
+#include <algorithm>
+
+#include <cstddef>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+constexpr uint64_t WRITE_BUFFER_SIZE = 8 * 1024 * 1024;
+
+// a bset can not hold more than U16_MAX u64s, leave room for one more key
+constexpr uint64_t BSET_MAX_U64S = 0xFFFF - 0xFF;
+
+uint64_t round_up(uint64_t value, uint64_t align) { return (value + align - 1) / align * align; }
+
+uint64_t next_random(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// the reader only decodes fields that are a power of two number of bytes
+uint8_t field_bits(uint64_t value) {
+    if (value == 0) {
+        return 0;
+    }
+    if (value <= 0xFF) {
+        return 8;
+    }
+    if (value <= 0xFFFF) {
+        return 16;
+    }
+    if (value <= 0xFFFFFFFFULL) {
+        return 32;
+    }
+    return 64;
+}
+
+// bch2_varint_encode: the number of trailing 1 bits of the first byte is the length of the integer
+int encode_varint(uint8_t *out, uint64_t v) {
+    unsigned bits  = 64 - (unsigned)__builtin_clzll(v | 1);
+    unsigned bytes = (bits + 6) / 7;
+
+    if (bytes < 9) {
+        v <<= bytes;
+        v |= ~(~0ULL << (bytes - 1));
+        memcpy(out, &v, bytes);
+        return (int)bytes;
+    }
+
+    *out = 0xFF;
+    memcpy(out + 1, &v, sizeof(v));
+    return 9;
+}
+
+// u64s left for the keys of a node once the headers of its bsets and their padding are accounted for
+int64_t node_capacity(ImageOptions const &options, uint32_t bsets) {
+    auto headers = offsetof(BTreeNode, keys) + sizeof(BSet) +
+                   (bsets - 1) * (options.block_size + sizeof(struct bch_csum) + sizeof(BSet));
+
+    auto capacity = ((int64_t)options.node_size - (int64_t)headers) / (int64_t)BCH_U64S_SIZE;
+    return std::min<int64_t>(capacity, bsets * BSET_MAX_U64S);
+}
+
+uint32_t node_bsets(ImageOptions const &options) {
+    auto needed = (options.node_size / BCH_U64S_SIZE + BSET_MAX_U64S - 1) / BSET_MAX_U64S;
+    return std::max<uint32_t>(options.bsets, (uint32_t)needed);
+}
+
+struct BTreePtrValue {
+    BTreePtr   ptr;
+    BExtendPtr extent;
+};
+
+static_assert(sizeof(BTreePtrValue) == 6 * BCH_U64S_SIZE, "btree_ptr_v2 with a single pointer is 6 u64s");
+
+// A key waiting for its node to be written
+struct PendingKey {
+    BPos     p;
+    uint32_t size;
+    uint8_t  type;
+    uint8_t  value_u64s;
+    uint32_t value_start; // in u64s
+};
+} // namespace
+
+// A node written to disk
+struct ChildNode {
+    BPos     min_key;
+    BPos     max_key;
+    uint64_t offset; // in bytes
+    uint64_t seq;
+    uint16_t sectors_written;
+};
+
+// BTreeBuilder
+// -------------------------------------------------------------------
+//  Keys are accumulated until the next one does not fit in a node, the
+//  leaf is then written and only a pointer to it is kept.
+//  A node covers [min_key, max_key] without gaps, the first node starts
+//  at POS_MIN and the last one ends at SPOS_MAX.
+struct BTreeBuilder {
+    public:
+    BTreeBuilder(ImageWriter &image, BTreeType btree):
+        _image(image), _btree(btree), _bsets(node_bsets(image._options)),
+        _capacity((uint64_t)node_capacity(image._options, _bsets)), _node(image._options.node_size) {}
+
+    bool add(BPos const &p, uint8_t type, uint32_t size, void const *value, uint64_t value_size, bool older) {
+        auto sorted = !_has_last || bpos_cmp(p, _last) > 0;
+        if (older && !_older.empty()) {
+            sorted = sorted && bpos_cmp(p, _older.back().p) > 0;
+        }
+
+        if (!sorted) {
+            error("keys of btree {} are not sorted", _btree);
+            return false;
+        }
+
+        auto value_u64s = round_up(value_size, BCH_U64S_SIZE) / BCH_U64S_SIZE;
+        if (BKEY_U64s + value_u64s > 0xFF) {
+            error("value of {} bytes does not fit in a key", value_size);
+            return false;
+        }
+
+        auto key = PendingKey{p, size, type, (uint8_t)value_u64s, 0};
+
+        // the older keys share the first bset
+        auto older_u64s = _older_values.size() + (_older.size() + 1) * BKEY_U64s + value_u64s;
+        auto full       = pending_u64s(&key) > _capacity || (older && older_u64s > BSET_MAX_U64S);
+
+        if (!_keys.empty() && full) {
+            _leaves.push_back(write_pending(0, _last));
+        }
+
+        if (older) {
+            push(_older, _older_values, key, value, value_size);
+            return true;
+        }
+
+        push(_keys, _values, key, value, value_size);
+        _last     = p;
+        _has_last = true;
+        return true;
+    }
+
+    // Write the last leaf and the interior nodes, returns the root
+    ChildNode finish(uint8_t &level) {
+        auto children = std::move(_leaves);
+        children.push_back(write_pending(0, SPOS_MAX));
+
+        auto depth = _image._options.depth;
+        level      = 0;
+
+        while (children.size() > 1 || level + 1u < depth) {
+            level += 1;
+
+            // split the children evenly between the levels left
+            uint64_t fanout = ~0ULL;
+            if (level < depth) {
+                fanout = 1;
+                while (pow(fanout, depth - level) < children.size()) {
+                    fanout += 1;
+                }
+            } else if (level == depth) {
+                warn("btree {} does not fit in {} levels", _btree, depth);
+            }
+
+            Array<ChildNode> nodes;
+            uint64_t         count = 0;
+
+            for (auto &child: children) {
+                auto key = PendingKey{child.max_key, 0, KEY_TYPE_btree_ptr_v2, 6, 0};
+
+                if (!_keys.empty() && (count >= fanout || pending_u64s(&key) > _capacity)) {
+                    nodes.push_back(write_pending(level, _keys.back().p));
+                    count = 0;
+                }
+
+                auto value                = BTreePtrValue{};
+                value.ptr.seq             = child.seq;
+                value.ptr.sectors_written = child.sectors_written;
+                value.ptr.min_key         = child.min_key;
+                value.extent.type         = 1 << BCH_EXTENT_ENTRY_ptr;
+                value.extent.offset       = child.offset / BCH_SECTOR_SIZE;
+
+                push(_keys, _values, key, &value, sizeof(value));
+                count += 1;
+            }
+
+            nodes.push_back(write_pending(level, SPOS_MAX));
+            children = std::move(nodes);
+        }
+
+        return children[0];
+    }
+
+    private:
+    static uint64_t pow(uint64_t base, uint32_t exp) {
+        uint64_t out = 1;
+        for (uint32_t i = 0; i < exp && out < ~0U; ++i) {
+            out *= base;
+        }
+        return out;
+    }
+
+    // keys are packed unless the format can not represent them
+    bool is_unpacked(PendingKey const &key) const {
+        switch (_image._options.format) {
+        case KeyFormat::CURRENT:
+            return true;
+        case KeyFormat::SHORT:
+            return key.size != 0;
+        case KeyFormat::PACKED:
+            return false;
+        }
+        return true;
+    }
+
+    struct bkey_format format(uint64_t const *max) const {
+        struct bkey_format out = {};
+
+        switch (_image._options.format) {
+        case KeyFormat::CURRENT:
+            out = bkey_format{BKEY_U64s, BKEY_NR_FIELDS, {64, 64, 32, 32, 32, 64}, {0}};
+            break;
+        case KeyFormat::SHORT:
+            out = BKEY_FORMAT_SHORT;
+            break;
+        case KeyFormat::PACKED: {
+            // version fields are always 0
+            unsigned bytes = 3; // u64s, format and type
+            out.nr_fields  = BKEY_NR_FIELDS;
+
+            for (int i = 0; i <= BKEY_FIELD_SIZE; ++i) {
+                out.bits_per_field[i] = field_bits(max[i]);
+                bytes += out.bits_per_field[i] / 8;
+            }
+            out.key_u64s = (uint8_t)((bytes + BCH_U64S_SIZE - 1) / BCH_U64S_SIZE);
+            break;
+        }
+        }
+        return out;
+    }
+
+    // u64s of the pending keys with an extra key
+    uint64_t pending_u64s(PendingKey const *extra) const {
+        uint64_t max[4]   = {_max[0], _max[1], _max[2], _max[3]};
+        uint64_t values   = _values.size() + _older_values.size();
+        uint64_t count    = _keys.size() + _older.size();
+        uint64_t unpacked = _unpacked;
+
+        if (extra != nullptr) {
+            max[BKEY_FIELD_INODE]    = std::max(max[BKEY_FIELD_INODE], extra->p.inode);
+            max[BKEY_FIELD_OFFSET]   = std::max(max[BKEY_FIELD_OFFSET], extra->p.offset);
+            max[BKEY_FIELD_SNAPSHOT] = std::max<uint64_t>(max[BKEY_FIELD_SNAPSHOT], extra->p.snapshot);
+            max[BKEY_FIELD_SIZE]     = std::max<uint64_t>(max[BKEY_FIELD_SIZE], extra->size);
+            values += extra->value_u64s;
+            count += 1;
+            unpacked += is_unpacked(*extra);
+        }
+
+        return values + unpacked * BKEY_U64s + (count - unpacked) * format(max).key_u64s;
+    }
+
+    void push(Array<PendingKey> &keys, Array<uint64_t> &values, PendingKey key, void const *value,
+              uint64_t value_size) {
+        key.value_start = (uint32_t)values.size();
+        values.resize(values.size() + key.value_u64s, 0);
+        if (value_size > 0) {
+            memcpy(values.data() + key.value_start, value, value_size);
+        }
+        keys.push_back(key);
+
+        _max[BKEY_FIELD_INODE]    = std::max(_max[BKEY_FIELD_INODE], key.p.inode);
+        _max[BKEY_FIELD_OFFSET]   = std::max(_max[BKEY_FIELD_OFFSET], key.p.offset);
+        _max[BKEY_FIELD_SNAPSHOT] = std::max<uint64_t>(_max[BKEY_FIELD_SNAPSHOT], key.p.snapshot);
+        _max[BKEY_FIELD_SIZE]     = std::max<uint64_t>(_max[BKEY_FIELD_SIZE], key.size);
+        _unpacked += is_unpacked(key);
+    }
+
+    uint8_t *write_key(uint8_t *                 out,
+                       PendingKey const &        key,
+                       Array<uint64_t> const &   values,
+                       struct bkey_format const &format) const {
+        if (is_unpacked(key)) {
+            BKey bkey   = {};
+            bkey.u64s   = (uint8_t)(BKEY_U64s + key.value_u64s);
+            bkey.format = KEY_FORMAT_CURRENT;
+            bkey.type   = key.type;
+            bkey.size   = key.size;
+            bkey.p      = key.p;
+
+            memcpy(out, &bkey, sizeof(bkey));
+            out += sizeof(bkey);
+        } else {
+            out[0] = (uint8_t)(format.key_u64s + key.value_u64s);
+            out[1] = KEY_FORMAT_LOCAL_BTREE;
+            out[2] = key.type;
+
+            // fields are stored backwards from the end of the key, see parse_bkey
+            uint64_t fields[BKEY_NR_FIELDS] = {key.p.inode, key.p.offset, key.p.snapshot, key.size, 0, 0};
+            auto     end                    = out + format.key_u64s * BCH_U64S_SIZE;
+
+            for (int i = 0; i < BKEY_NR_FIELDS; ++i) {
+                end -= format.bits_per_field[i] / 8;
+                memcpy(end, &fields[i], format.bits_per_field[i] / 8);
+            }
+            out += format.key_u64s * BCH_U64S_SIZE;
+        }
+
+        // values is empty when no key of the node has a value
+        if (key.value_u64s > 0) {
+            memcpy(out, values.data() + key.value_start, key.value_u64s * BCH_U64S_SIZE);
+        }
+        return out + key.value_u64s * BCH_U64S_SIZE;
+    }
+
+    // Write the pending keys as a node of the given level
+    // the older keys of the node go in the first bset, the other keys are split evenly between the next ones
+    ChildNode write_pending(uint8_t level, BPos const &max_key) {
+        auto &options = _image._options;
+        auto  fmt     = format(_max);
+        auto  seq     = next_random(_image._rng) | 1;
+
+        // older versions of the keys of the next node wait for it
+        std::size_t older = 0;
+        while (older < _older.size() && bpos_cmp(_older[older].p, max_key) <= 0) {
+            older += 1;
+        }
+
+        std::fill(_node.begin(), _node.end(), 0);
+        auto node = (BTreeNode *)_node.data();
+
+        node->magic   = __bset_magic(&_image._sb);
+        node->flags   = (uint64_t)_btree | ((uint64_t)level << 4);
+        node->min_key = _min;
+        node->max_key = max_key;
+        node->format  = fmt;
+
+        auto total = pending_u64s(nullptr);
+        auto first = older > 0 ? 1u : 0u;
+        auto bsets = first + (uint32_t)std::clamp<uint64_t>(_keys.size(), 1, _bsets - first);
+
+        uint64_t    pos  = offsetof(BTreeNode, keys);
+        uint64_t    done = 0;
+        std::size_t k    = 0;
+
+        for (uint32_t b = 0; b < bsets; ++b) {
+            // the following bsets start on a block, after the checksum of their btree_node_entry
+            uint64_t entry = pos;
+            if (b > 0) {
+                entry = round_up(pos, options.block_size);
+                pos   = entry + sizeof(struct bch_csum);
+            }
+
+            auto bset         = (BSet *)(_node.data() + pos);
+            bset->seq         = seq;
+            bset->journal_seq = _image._journal_seq;
+            bset->flags       = options.csum_type; // BSET_CSUM_TYPE
+            bset->version     = IMAGE_METADATA_VERSION;
+
+            auto start  = (uint8_t *)bset + sizeof(BSet);
+            auto out    = start;
+            auto target = total * (b + 1 - first) / (bsets - first);
+
+            if (b < first) {
+                for (std::size_t i = 0; i < older; ++i) {
+                    out = write_key(out, _older[i], _older_values, fmt);
+                }
+                total -= (uint64_t)(out - start) / BCH_U64S_SIZE;
+            }
+
+            while (b >= first && k < _keys.size() && (done < target || b + 1 == bsets)) {
+                auto next = write_key(out, _keys[k], _values, fmt);
+                done += (uint64_t)(next - out) / BCH_U64S_SIZE;
+                out = next;
+                k += 1;
+            }
+
+            bset->u64s = (uint16_t)((out - start) / BCH_U64S_SIZE);
+            pos        = (uint64_t)(out - _node.data());
+
+            // the checksum covers the header of the node or the entry and the keys of the bset
+            auto csum = (struct bch_csum *)(_node.data() + entry);
+            compute_checksum(options.csum_type, (uint8_t *)csum + sizeof(*csum), pos - entry - sizeof(*csum), *csum);
+        }
+
+        auto used   = round_up(pos, options.block_size);
+        auto offset = _image.write_node(_node.data(), used);
+
+        auto out = ChildNode{_min, max_key, offset, seq, (uint16_t)(used / BCH_SECTOR_SIZE)};
+
+        auto kept        = Array<PendingKey>(_older.begin() + (std::ptrdiff_t)older, _older.end());
+        auto kept_values = std::move(_older_values);
+
+        _keys.clear();
+        _values.clear();
+        _older.clear();
+        _older_values.clear();
+        std::fill(std::begin(_max), std::end(_max), 0);
+        _unpacked = 0;
+        _min      = bpos_successor(max_key);
+
+        for (auto &key: kept) {
+            push(_older, _older_values, key, kept_values.data() + key.value_start, key.value_u64s * BCH_U64S_SIZE);
+        }
+
+        return out;
+    }
+
+    private:
+    ImageWriter &  _image;
+    BTreeType      _btree;
+    uint32_t       _bsets;
+    uint64_t       _capacity; // u64s available for the keys of a node
+    Array<uint8_t> _node;
+
+    Array<PendingKey> _keys;
+    Array<uint64_t>   _values;
+    Array<PendingKey> _older; // overwritten by the keys that follow, see ImageWriter::set_older
+    Array<uint64_t>   _older_values;
+    uint64_t          _max[4]   = {0}; // largest inode, offset, snapshot and size of the pending keys
+    uint64_t          _unpacked = 0;
+    BPos              _min      = POS_MIN;
+    BPos              _last     = POS_MIN;
+    bool              _has_last = false;
+
+    Array<ChildNode> _leaves;
+};
+
+// ImageWriter
+// -------------------------------------------------------------------
+ImageWriter::ImageWriter(String const &path, ImageOptions const &options): _options(options), _rng(options.seed) {
+    struct bch_csum csum;
+
+    if (options.block_size < BCH_SECTOR_SIZE || (options.block_size & (options.block_size - 1)) != 0 ||
+        options.block_size / BCH_SECTOR_SIZE > 0xFFFF) {
+        error("block size {} is not a power of two of at least a sector", options.block_size);
+        return;
+    }
+
+    if (options.node_size % options.block_size != 0 || options.node_size / BCH_SECTOR_SIZE > 0xFFFF) {
+        error("node size {} is not a multiple of the block size or is too big", options.node_size);
+        return;
+    }
+
+    if (options.bsets == 0 || node_capacity(options, node_bsets(options)) < 0xFF) {
+        error("nodes of {} bytes are too small to hold {} bsets", options.node_size, options.bsets);
+        return;
+    }
+
+    if (!options.clean && options.journal_buckets == 0) {
+        error("an image without the clean field needs a journal");
+        return;
+    }
+
+    if (!compute_checksum(options.csum_type, nullptr, 0, csum)) {
+        error("checksum type {} is not supported", options.csum_type);
+        return;
+    }
+
+    _bucket_size = round_up(std::max<uint64_t>(options.node_size, 512 * 1024), options.node_size);
+    if (_bucket_size / BCH_SECTOR_SIZE > 0xFFFF) {
+        error("buckets of {} bytes are too big", _bucket_size);
+        return;
+    }
+
+    _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+        error("could not open {}", path);
+        return;
+    }
+
+    // the superblock and its backup are followed by the journal
+    auto sb_end   = (BCH_SB_SECTOR + 2 * (1ULL << IMAGE_SB_SIZE_BITS)) * BCH_SECTOR_SIZE;
+    _first_bucket = (sb_end + _bucket_size - 1) / _bucket_size;
+    _cursor       = (_first_bucket + options.journal_buckets) * _bucket_size;
+    _buffer_start = _cursor;
+    _buffer.reserve(WRITE_BUFFER_SIZE);
+
+    memset(&_sb, 0, sizeof(_sb));
+    for (auto uuid: {&_sb.uuid, &_sb.user_uuid}) {
+        for (int i = 0; i < 2; ++i) {
+            auto v = next_random(_rng);
+            memcpy(uuid->bytes + i * 8, &v, sizeof(v));
+        }
+    }
+
+    memcpy(&_sb.magic, &BCACHE_MAGIC, sizeof(BCACHE_MAGIC));
+    memcpy(_sb.label, "synthetic", sizeof("synthetic"));
+
+    _sb.version        = IMAGE_METADATA_VERSION;
+    _sb.version_min    = IMAGE_METADATA_VERSION;
+    _sb.seq            = 1;
+    _sb.block_size     = (uint16_t)(options.block_size / BCH_SECTOR_SIZE);
+    _sb.dev_idx        = 0;
+    _sb.nr_devices     = 1;
+    _sb.time_precision = 1;
+
+    // initialized, checksum type, btree node size, metadata checksum type and one replica
+    _sb.flags[0] = 1ULL | ((uint64_t)options.csum_type << 2) | ((options.node_size / BCH_SECTOR_SIZE) << 12) |
+                   ((uint64_t)options.csum_type << 40) | (1ULL << 48) | (1ULL << 52);
+
+    // atomic_nlink, inline_data, new_extent_overwrite, btree_ptr_v2,
+    // extents_above_btree_updates, btree_updates_journalled and new_varint
+    _sb.features[0] = (1ULL << 3) | (1ULL << 8) | (1ULL << 9) | (1ULL << 11) | (1ULL << 12) | (1ULL << 13) |
+                      (1ULL << 15);
+
+    memcpy(&_sb.layout.magic, &BCACHE_MAGIC, sizeof(BCACHE_MAGIC));
+    _sb.layout.layout_type      = 0;
+    _sb.layout.sb_max_size_bits = IMAGE_SB_SIZE_BITS;
+    _sb.layout.nr_superblocks   = 2;
+    _sb.layout.sb_offset[0]     = BCH_SB_SECTOR;
+    _sb.layout.sb_offset[1]     = BCH_SB_SECTOR + (1ULL << IMAGE_SB_SIZE_BITS);
+
+    // the reader needs these three
+    _btrees.resize(BTREE_ID_NR);
+    for (auto btree: {BTREE_ID_extents, BTREE_ID_inodes, BTREE_ID_dirents}) {
+        _btrees[btree] = std::make_unique<BTreeBuilder>(*this, btree);
+    }
+}
+
+ImageWriter::~ImageWriter() {
+    if (_fd >= 0) {
+        flush();
+        close(_fd);
+    }
+}
+
+void ImageWriter::write_at(uint64_t offset, void const *data, uint64_t size) {
+    auto bytes = (uint8_t const *)data;
+
+    while (size > 0) {
+        auto n = pwrite(_fd, bytes, size, (off_t)offset);
+        if (n <= 0) {
+            error("write of {} bytes at {} failed", size, offset);
+            _failed = true;
+            return;
+        }
+        bytes += n;
+        offset += (uint64_t)n;
+        size -= (uint64_t)n;
+    }
+}
+
+void ImageWriter::flush() {
+    if (!_buffer.empty()) {
+        write_at(_buffer_start, _buffer.data(), _buffer.size());
+        _buffer.clear();
+    }
+    _buffer_start = _cursor;
+}
+
+uint64_t ImageWriter::append(void const *data, uint64_t size, uint64_t align) {
+    auto offset = round_up(_cursor, align);
+
+    if (_buffer.size() + (offset - _cursor) + size > WRITE_BUFFER_SIZE) {
+        flush();
+    }
+
+    // big writes skip the buffer
+    if (size >= WRITE_BUFFER_SIZE) {
+        write_at(offset, data, size);
+        _cursor       = offset + size;
+        _buffer_start = _cursor;
+        return offset;
+    }
+
+    if (_buffer.empty()) {
+        _buffer_start = offset;
+    } else {
+        _buffer.resize(_buffer.size() + (offset - _cursor), 0);
+    }
+
+    _buffer.insert(_buffer.end(), (uint8_t const *)data, (uint8_t const *)data + size);
+    _cursor = offset + size;
+    return offset;
+}
+
+uint64_t ImageWriter::reserve(uint64_t size, uint64_t align) {
+    auto offset = round_up(_cursor, align);
+
+    flush();
+    _cursor       = offset + size;
+    _buffer_start = _cursor;
+    return offset;
+}
+
+uint64_t ImageWriter::write_node(void const *data, uint64_t used) {
+    // the reader loads the whole node, the end of the node has to read as zeros
+    auto offset = append(data, used, _options.node_size);
+    reserve(_options.node_size - used);
+    return offset;
+}
+
+bool ImageWriter::add_key(BTreeType btree, BPos const &p, uint8_t type, uint32_t size, void const *value,
+                          uint64_t value_size) {
+    if (!_btrees[btree]) {
+        _btrees[btree] = std::make_unique<BTreeBuilder>(*this, btree);
+    }
+    return _btrees[btree]->add(p, type, size, value, value_size, _older);
+}
+
+void ImageWriter::set_older(bool older) {
+    if (older && _options.bsets < 2) {
+        error("older keys need at least 2 bsets per node");
+        _failed = true;
+        return;
+    }
+    _older = older;
+}
+
+bool ImageWriter::add_dirent(uint64_t dir, uint64_t offset, uint64_t inode, uint8_t d_type, std::string_view name) {
+    if (name.empty() || name.size() > 255) {
+        error("invalid dirent name of {} bytes", name.size());
+        return false;
+    }
+
+    // names are NUL terminated, the rest of the value is padding
+    Array<uint8_t> value(round_up(offsetof(BDirEnt, d_name) + name.size() + 1, BCH_U64S_SIZE), 0);
+
+    auto dirent    = (BDirEnt *)value.data();
+    dirent->d_inum = inode;
+    dirent->d_type = d_type;
+    memcpy(dirent->d_name, name.data(), name.size());
+
+    return add_key(BTREE_ID_dirents, POS(dir, offset), KEY_TYPE_dirent, 0, value.data(), value.size());
+}
+
+bool ImageWriter::add_inode(uint64_t inode, uint16_t mode, uint64_t size, uint32_t nlink) {
+    alignas(8) uint8_t value[256] = {0};
+
+    // the link count is stored minus the links every inode has
+    uint32_t bias = S_ISDIR(mode) ? 2 : 1;
+
+    // atime, ctime, mtime, otime (96 bits, 2 varints each), size, sectors, uid, gid, nlink
+    uint64_t fields[] = {0, 0, 0, 0, 0, 0, 0, 0, size, round_up(size, BCH_SECTOR_SIZE) / BCH_SECTOR_SIZE, 0, 0,
+                         nlink > bias ? nlink - bias : 0};
+
+    auto bi          = (BInode *)value;
+    bi->bi_hash_seed = next_random(_rng);
+    bi->bi_flags     = (1U << 31) | (9U << 24); // new_varint, 9 fields
+    bi->bi_mode      = mode;
+
+    auto out = value + offsetof(BInode, fields);
+    for (auto field: fields) {
+        out += encode_varint(out, field);
+    }
+
+    return add_key(BTREE_ID_inodes, POS(0, inode), KEY_TYPE_inode, 0, value, (uint64_t)(out - value));
+}
+
+bool ImageWriter::add_extent(uint64_t inode, uint64_t file_offset, uint64_t offset, uint64_t size) {
+    if (file_offset % BCH_SECTOR_SIZE != 0 || offset % BCH_SECTOR_SIZE != 0) {
+        error("extent of inode {} is not sector aligned", inode);
+        return false;
+    }
+
+    auto sectors = round_up(size, BCH_SECTOR_SIZE) / BCH_SECTOR_SIZE;
+    if (sectors == 0 || sectors > 0xFFFFFFFFULL) {
+        error("invalid extent size {}", size);
+        return false;
+    }
+
+    auto ptr   = BExtendPtr{};
+    ptr.type   = 1 << BCH_EXTENT_ENTRY_ptr;
+    ptr.offset = offset / BCH_SECTOR_SIZE;
+
+    // extents are indexed by their end
+    auto p = POS(inode, file_offset / BCH_SECTOR_SIZE + sectors);
+    return add_key(BTREE_ID_extents, p, KEY_TYPE_extent, (uint32_t)sectors, &ptr, sizeof(ptr));
+}
+
+bool ImageWriter::add_inline_data(uint64_t inode, void const *data, uint64_t size) {
+    auto sectors = round_up(size, BCH_SECTOR_SIZE) / BCH_SECTOR_SIZE;
+    if (sectors == 0) {
+        error("empty inline data");
+        return false;
+    }
+
+    return add_key(BTREE_ID_extents, POS(inode, sectors), KEY_TYPE_inline_data, (uint32_t)sectors, data, size);
+}
+
+bool ImageWriter::add_reflink_p(uint64_t inode, uint64_t file_offset, uint64_t reflink_offset, uint64_t size) {
+    if (file_offset % BCH_SECTOR_SIZE != 0 || reflink_offset % BCH_SECTOR_SIZE != 0 || size % BCH_SECTOR_SIZE != 0) {
+        error("reflink pointer of inode {} is not sector aligned", inode);
+        return false;
+    }
+
+    auto sectors = size / BCH_SECTOR_SIZE;
+    if (sectors == 0 || sectors > 0xFFFFFFFFULL) {
+        error("invalid reflink pointer size {}", size);
+        return false;
+    }
+
+    auto value = BReflinkP{};
+    value.idx  = reflink_offset / BCH_SECTOR_SIZE;
+
+    auto p = POS(inode, file_offset / BCH_SECTOR_SIZE + sectors);
+    return add_key(BTREE_ID_extents, p, KEY_TYPE_reflink_p, (uint32_t)sectors, &value, sizeof(value));
+}
+
+bool ImageWriter::add_indirect_extent(uint64_t reflink_offset, uint64_t offset, uint64_t size) {
+    if (reflink_offset % BCH_SECTOR_SIZE != 0 || offset % BCH_SECTOR_SIZE != 0) {
+        error("indirect extent at {} is not sector aligned", reflink_offset);
+        return false;
+    }
+
+    auto sectors = round_up(size, BCH_SECTOR_SIZE) / BCH_SECTOR_SIZE;
+    if (sectors == 0 || sectors > 0xFFFFFFFFULL) {
+        error("invalid indirect extent size {}", size);
+        return false;
+    }
+
+    // refcount followed by the extent entries
+    struct {
+        BReflinkV  v;
+        BExtendPtr ptr;
+    } value = {};
+
+    value.v.refcount = 1;
+    value.ptr.type   = 1 << BCH_EXTENT_ENTRY_ptr;
+    value.ptr.offset = offset / BCH_SECTOR_SIZE;
+
+    // indirect extents are indexed by their end, like extents
+    auto p = POS(0, reflink_offset / BCH_SECTOR_SIZE + sectors);
+    return add_key(BTREE_ID_reflink, p, KEY_TYPE_reflink_v, (uint32_t)sectors, &value, sizeof(value));
+}
+
+bool ImageWriter::add_indirect_inline_data(uint64_t reflink_offset, void const *data, uint64_t size) {
+    auto sectors = round_up(size, BCH_SECTOR_SIZE) / BCH_SECTOR_SIZE;
+    if (reflink_offset % BCH_SECTOR_SIZE != 0 || sectors == 0) {
+        error("invalid indirect inline data at {}", reflink_offset);
+        return false;
+    }
+
+    Array<uint8_t> value(sizeof(BIndirectInlineData) + size, 0);
+    ((BIndirectInlineData *)value.data())->refcount = 1;
+    if (size > 0) {
+        memcpy(value.data() + sizeof(BIndirectInlineData), data, size);
+    }
+
+    auto p = POS(0, reflink_offset / BCH_SECTOR_SIZE + sectors);
+    return add_key(BTREE_ID_reflink, p, KEY_TYPE_indirect_inline_data, (uint32_t)sectors, value.data(), value.size());
+}
+
+bool ImageWriter::add_journal_key(BTreeType btree, BPos const &p, uint8_t type, uint32_t size, void const *value,
+                                  uint64_t value_size) {
+    if (!valid()) {
+        return false;
+    }
+    if (_options.journal_buckets == 0) {
+        error("the image has no journal");
+        return false;
+    }
+
+    auto value_u64s = round_up(value_size, BCH_U64S_SIZE) / BCH_U64S_SIZE;
+    if (BKEY_U64s + value_u64s > 0xFF) {
+        error("journal key of {} bytes is too big", value_size);
+        return false;
+    }
+
+    // unpacked key following its entry header
+    auto entry     = JournalSetEntry{};
+    entry.u64s     = (uint16_t)(BKEY_U64s + value_u64s);
+    entry.btree_id = (uint8_t)btree;
+    entry.level    = 0;
+    entry.type     = BCH_JSET_ENTRY_btree_keys;
+
+    auto key   = BKey{};
+    key.u64s   = (uint8_t)(BKEY_U64s + value_u64s);
+    key.format = KEY_FORMAT_CURRENT;
+    key.type   = type;
+    key.size   = size;
+    key.p      = p;
+
+    auto &jset  = _journal.back();
+    auto  start = jset.size();
+    jset.resize(start + 1 + BKEY_U64s + value_u64s, 0);
+
+    memcpy(&jset[start], &entry, sizeof(entry));
+    memcpy(&jset[start + 1], &key, sizeof(key));
+    if (value_size > 0) {
+        memcpy(&jset[start + 1 + BKEY_U64s], value, value_size);
+    }
+    return true;
+}
+
+void ImageWriter::next_jset() { _journal.emplace_back(); }
+
+void ImageWriter::blacklist_journal(uint64_t start, uint64_t end) {
+    _blacklist.push_back(start);
+    _blacklist.push_back(end);
+}
+
+bool ImageWriter::finish() {
+    if (!valid()) {
+        return false;
+    }
+
+    // jset entries of the btree roots
+    Array<uint64_t> roots;
+
+    for (int btree = 0; btree < BTREE_ID_NR; ++btree) {
+        if (!_btrees[btree]) {
+            continue;
+        }
+
+        uint8_t level = 0;
+        auto    root  = _btrees[btree]->finish(level);
+
+        struct {
+            JournalSetEntry entry;
+            BKey            key;
+            BTreePtrValue   value;
+        } item;
+
+        memset(&item, 0, sizeof(item));
+        item.entry.u64s     = (uint16_t)(BKEY_U64s + sizeof(BTreePtrValue) / BCH_U64S_SIZE);
+        item.entry.btree_id = (uint8_t)btree;
+        item.entry.level    = level;
+        item.entry.type     = BCH_JSET_ENTRY_btree_root;
+
+        item.key.u64s   = (uint8_t)(BKEY_U64s + sizeof(BTreePtrValue) / BCH_U64S_SIZE);
+        item.key.format = KEY_FORMAT_CURRENT;
+        item.key.type   = KEY_TYPE_btree_ptr_v2;
+        item.key.p      = SPOS_MAX;
+
+        item.value.ptr.seq             = root.seq;
+        item.value.ptr.sectors_written = root.sectors_written;
+        item.value.ptr.min_key         = POS_MIN;
+        item.value.extent.type         = 1 << BCH_EXTENT_ENTRY_ptr;
+        item.value.extent.offset       = root.offset / BCH_SECTOR_SIZE;
+
+        auto words = (uint64_t const *)&item;
+        roots.insert(roots.end(), words, words + sizeof(item) / BCH_U64S_SIZE);
+
+        debug("btree {} has {} levels, root at {}", btree, level + 1, root.offset);
+    }
+
+    flush();
+
+    write_journal(roots);
+    write_superblocks(roots);
+
+    // the last node has to be readable in full
+    auto total = round_up(_cursor, _bucket_size);
+    if (ftruncate(_fd, (off_t)total) != 0) {
+        error("could not resize the image to {} bytes", total);
+        _failed = true;
+    }
+
+    info("image of {} bytes written", total);
+    return valid();
+}
+
+void ImageWriter::write_journal(Array<uint64_t> const &roots) {
+    if (_options.journal_buckets == 0) {
+        return;
+    }
+
+    uint64_t bucket = 0;
+    uint64_t offset = 0; // inside the bucket
+
+    for (uint64_t i = 0; i < _journal.size(); ++i) {
+        auto &entries = _journal[i];
+        auto  u64s    = roots.size() + entries.size();
+        auto  bytes   = round_up(sizeof(JournalSet) + u64s * BCH_U64S_SIZE, _options.block_size);
+
+        // a jset never crosses a bucket
+        if (offset + bytes > _bucket_size) {
+            bucket += 1;
+            offset = 0;
+        }
+        if (bucket >= _options.journal_buckets || bytes > _bucket_size) {
+            error("the journal does not fit in {} buckets", _options.journal_buckets);
+            _failed = true;
+            return;
+        }
+
+        Array<uint64_t> buffer(bytes / BCH_U64S_SIZE, 0);
+
+        auto jset      = (JournalSet *)buffer.data();
+        jset->magic    = __jset_magic(&_sb);
+        jset->seq      = _journal_seq + i;
+        jset->last_seq = _journal_seq;
+        jset->version  = IMAGE_METADATA_VERSION;
+        jset->flags    = _options.csum_type; // JSET_CSUM_TYPE
+        jset->u64s     = (uint32_t)u64s;
+        if (!roots.empty()) {
+            memcpy(jset->_data, roots.data(), roots.size() * BCH_U64S_SIZE);
+        }
+        if (!entries.empty()) {
+            memcpy(jset->_data + roots.size(), entries.data(), entries.size() * BCH_U64S_SIZE);
+        }
+
+        compute_checksum(_options.csum_type, &jset->magic,
+                         sizeof(JournalSet) + u64s * BCH_U64S_SIZE - sizeof(struct bch_csum), jset->csum);
+
+        auto at = (_first_bucket + bucket) * _bucket_size + offset;
+        write_at(at, buffer.data(), bytes);
+        _jset_offsets.push_back(at);
+        offset += bytes;
+    }
+}
+
+void ImageWriter::write_superblocks(Array<uint64_t> const &roots) {
+    Array<uint64_t> fields;
+
+    auto add_field = [&](SuperBlockFieldType type, Array<uint64_t> const &data) {
+        auto header = SuperBlockFieldBase{};
+        header.u64s = (uint32_t)(1 + data.size());
+        header.type = type;
+
+        uint64_t word;
+        memcpy(&word, &header, sizeof(word));
+        fields.push_back(word);
+        fields.insert(fields.end(), data.begin(), data.end());
+    };
+
+    // journal
+    {
+        Array<uint64_t> buckets;
+        for (uint64_t i = 0; i < _options.journal_buckets; ++i) {
+            buckets.push_back(_first_bucket + i);
+        }
+        add_field(BCH_SB_FIELD_journal, buckets);
+    }
+
+    // members
+    {
+        auto member         = Member{};
+        member.nbuckets     = (round_up(_cursor, _bucket_size)) / _bucket_size;
+        member.first_bucket = (uint16_t)_first_bucket;
+        member.bucket_size  = (uint16_t)(_bucket_size / BCH_SECTOR_SIZE);
+        memcpy(&member.uuid, &_sb.uuid, sizeof(member.uuid));
+
+        Array<uint64_t> data(sizeof(member) / BCH_U64S_SIZE);
+        memcpy(data.data(), &member, sizeof(member));
+        add_field(BCH_SB_FIELD_members, data);
+    }
+
+    if (!_blacklist.empty()) {
+        add_field(BCH_SB_FIELD_journal_seq_blacklist, _blacklist);
+    }
+
+    // clean: the journal is empty and the btree roots are up to date
+    if (_options.clean) {
+        auto clean        = SuperBlockFieldClean{};
+        clean.journal_seq = _journal_seq + _journal.size() - 1;
+
+        Array<uint64_t> data((sizeof(clean) - sizeof(SuperBlockFieldBase)) / BCH_U64S_SIZE);
+        memcpy(data.data(), (uint8_t const *)&clean + sizeof(SuperBlockFieldBase), data.size() * BCH_U64S_SIZE);
+
+        data.insert(data.end(), roots.begin(), roots.end());
+        add_field(BCH_SB_FIELD_clean, data);
+    }
+
+    Array<uint64_t> buffer((sizeof(Superblock) + fields.size() * BCH_U64S_SIZE) / BCH_U64S_SIZE);
+    auto            sb = (Superblock *)buffer.data();
+
+    memcpy(sb, &_sb, sizeof(Superblock));
+    memcpy(sb->_data, fields.data(), fields.size() * BCH_U64S_SIZE);
+    sb->u64s = (uint32_t)fields.size();
+
+    auto size = buffer.size() * BCH_U64S_SIZE;
+    if (size > (BCH_SECTOR_SIZE << IMAGE_SB_SIZE_BITS)) {
+        error("superblock of {} bytes is too big", size);
+        _failed = true;
+        return;
+    }
+
+    write_at(BCH_SB_LAYOUT_SECTOR * BCH_SECTOR_SIZE, &_sb.layout, sizeof(_sb.layout));
+
+    for (int i = 0; i < _sb.layout.nr_superblocks; ++i) {
+        sb->offset = _sb.layout.sb_offset[i];
+
+        // the checksum covers everything after the csum field
+        compute_checksum(_options.csum_type, (uint8_t *)sb + sizeof(struct bch_csum), size - sizeof(struct bch_csum),
+                         sb->csum);
+
+        write_at(sb->offset * BCH_SECTOR_SIZE, sb, size);
+    }
+}
+
+uint64_t dirent_hash(std::string_view name) {
+    // FNV-1a followed by a finalizer so similar names are spread out
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (auto c: name) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return std::max<uint64_t>(h >> 1, 2);
+}
@@ -0,0 +1,199 @@
+#ifndef BCACHE_FS_SRC_IMAGE_WRITER_HEADER
+#define BCACHE_FS_SRC_IMAGE_WRITER_HEADER
+
+#include "bcachefs.h"
+
+#include <algorithm>
+#include <string_view>
+
+// Image writer
+// -------------------------------------------------------------------
+//  Writes a bcachefs image without going through the kernel.
+//  The file data is appended first then the keys of every btree are
+//  streamed in sorted order: a leaf is written as soon as it is full and
+//  only the pointers to the leaves are kept in memory, the interior nodes
+//  are built bottom up when the image is finished.
+//
+//  Disk layout:
+//
+//      sector 7            bch_sb_layout
+//      sector 8            superblock, followed by its backup
+//      first bucket        journal buckets, block aligned jsets written back to back,
+//                          every jset holds the btree roots
+//      ...                 data and btree nodes in the order they were appended
+//
+//  Nodes are node_size aligned so they never cross a bucket, the space
+//  a node does not use is left as a hole.
+//
+#define IMAGE_METADATA_VERSION 11 // bcachefs_metadata_version_inode_btree_change, inodes are indexed by p.offset
+#define IMAGE_SB_SIZE_BITS     7  // 64KiB per superblock copy
+
+enum class KeyFormat
+{
+    CURRENT, // unpacked keys
+    SHORT,   // BKEY_FORMAT_SHORT, keys with a size (extents) are left unpacked
+    PACKED   // each node gets a format sized after the largest fields of its keys
+};
+
+struct ImageOptions {
+    uint64_t  node_size       = 256 * 1024;
+    uint64_t  block_size      = 4096;
+    KeyFormat format          = KeyFormat::PACKED;
+    uint32_t  bsets           = 1; // bsets per node, the keys are split evenly between them, see set_older
+    uint32_t  depth           = 0; // levels of every btree, 0 uses as few levels as possible
+    uint32_t  journal_buckets = 4;
+    bool      clean           = true; // without BCH_SB_FIELD_clean the roots are only found in the journal
+    unsigned  csum_type       = BCH_CSUM_crc32c_nonzero; // checksum of the superblock, nodes and journal
+    uint64_t  seed            = 0;
+};
+
+struct BTreeBuilder;
+
+struct ImageWriter {
+    public:
+    ImageWriter(String const &path, ImageOptions const &options = {});
+
+    ~ImageWriter();
+
+    ImageWriter(ImageWriter const &) = delete;
+    ImageWriter &operator=(ImageWriter const &) = delete;
+
+    bool valid() const { return _fd >= 0 && !_failed; }
+
+    // Append data at the end of the image, returns its offset in bytes
+    uint64_t append(void const *data, uint64_t size, uint64_t align = 1);
+
+    // Skip size bytes, they read as zeros
+    uint64_t reserve(uint64_t size, uint64_t align = 1);
+
+    // The keys of a btree must be added in sorted order
+    bool add_key(BTreeType btree, BPos const &p, uint8_t type, uint32_t size, void const *value, uint64_t value_size);
+
+    // offset is the hash of the name, see dirent_hash
+    bool add_dirent(uint64_t dir, uint64_t offset, uint64_t inode, uint8_t d_type, std::string_view name);
+
+    bool add_inode(uint64_t inode, uint16_t mode, uint64_t size, uint32_t nlink);
+
+    // file_offset and offset are in bytes and sector aligned
+    bool add_extent(uint64_t inode, uint64_t file_offset, uint64_t offset, uint64_t size);
+
+    // data of a small file stored inside its key
+    bool add_inline_data(uint64_t inode, void const *data, uint64_t size);
+
+    // Reflinked data: the bytes [file_offset, file_offset + size) of the file are found at reflink_offset in the
+    // reflink btree. Offsets and sizes are in bytes and sector aligned
+    bool add_reflink_p(uint64_t inode, uint64_t file_offset, uint64_t reflink_offset, uint64_t size);
+
+    // Indirect extent covering [reflink_offset, reflink_offset + size) of the reflink btree, its data is at offset
+    bool add_indirect_extent(uint64_t reflink_offset, uint64_t offset, uint64_t size);
+
+    // Indirect extent holding its data, it covers the sectors of the data rounded up
+    bool add_indirect_inline_data(uint64_t reflink_offset, void const *data, uint64_t size);
+
+    // The keys added while older is set are previous versions of the keys added after them at the same position,
+    // they are written in the first bset of their node and the next bsets overwrite them. Needs 2 bsets per node
+    void set_older(bool older);
+
+    // Key that only lives in the journal, it goes in the current jset at level 0 and overrides the btree keys at
+    // the same position. The keys are not sorted, the image should not be clean so the journal is replayed
+    bool add_journal_key(BTreeType btree, BPos const &p, uint8_t type, uint32_t size, void const *value,
+                         uint64_t value_size);
+
+    // Start a new jset, its keys are newer than the keys of the previous ones
+    void next_jset();
+
+    // The jsets inside [start, end) must not be replayed, the seq of the first jset is 1
+    void blacklist_journal(uint64_t start, uint64_t end);
+
+    // Write the interior nodes, the journal and the superblocks
+    bool finish();
+
+    ImageOptions const &options() const { return _options; }
+
+    uint64_t size() const { return _cursor; }
+
+    uint64_t bucket_size() const { return _bucket_size; }
+
+    // Offsets in bytes of the jsets written by finish, in seq order
+    Array<uint64_t> const &jsets() const { return _jset_offsets; }
+
+    private:
+    void flush();
+
+    void write_at(uint64_t offset, void const *data, uint64_t size);
+
+    // write a node, returns its offset in bytes
+    uint64_t write_node(void const *data, uint64_t used);
+
+    void write_journal(Array<uint64_t> const &roots);
+
+    void write_superblocks(Array<uint64_t> const &roots);
+
+    private:
+    ImageOptions _options;
+    int          _fd     = -1;
+    bool         _failed = false;
+    bool         _older  = false;
+
+    Superblock     _sb;
+    uint64_t       _bucket_size  = 0; // in bytes
+    uint64_t       _first_bucket = 0;
+    uint64_t       _journal_seq  = 1; // seq of the first jset
+    uint64_t       _rng          = 0;
+    uint64_t       _cursor       = 0; // end of the image
+    uint64_t       _buffer_start = 0; // offset of the pending writes
+    Array<uint8_t> _buffer;
+
+    Array<Array<uint64_t>>               _journal = Array<Array<uint64_t>>(1); // jset entries, one array per jset
+    Array<uint64_t>                      _jset_offsets;
+    Array<uint64_t>                      _blacklist; // start and end of each range
+    Array<std::unique_ptr<BTreeBuilder>> _btrees;
+
+    friend struct BTreeBuilder;
+};
+
+// Offset of the dirent of a name inside its directory, 0 and 1 are reserved for . and ..
+// names that collide are moved to the next free offset
+uint64_t dirent_hash(std::string_view name);
+
+// Add the count dirents of a directory described by name(j), inode(j) and d_type(j)
+// they are sorted by the hash of their name, colliding names take the next free offset.
+// When older(j) is not 0 the dirent overwrites an older version pointing to that inode
+template <typename Name, typename Inode, typename Type, typename Older>
+bool add_directory(ImageWriter &image, uint64_t dir, uint64_t count, Name name, Inode inode, Type d_type, Older older) {
+    Array<std::pair<uint64_t, uint64_t>> entries(count);
+
+    for (uint64_t j = 0; j < count; ++j) {
+        entries[j] = {dirent_hash(name(j)), j};
+    }
+    std::sort(entries.begin(), entries.end());
+
+    uint64_t last = 0;
+    for (auto &[hash, j]: entries) {
+        auto offset = std::max(hash, last + 1);
+        auto stale  = older(j);
+
+        if (stale != 0) {
+            image.set_older(true);
+            auto ok = image.add_dirent(dir, offset, stale, d_type(j), name(j));
+            image.set_older(false);
+
+            if (!ok) {
+                return false;
+            }
+        }
+
+        if (!image.add_dirent(dir, offset, inode(j), d_type(j), name(j))) {
+            return false;
+        }
+        last = offset;
+    }
+    return true;
+}
+
+template <typename Name, typename Inode, typename Type>
+bool add_directory(ImageWriter &image, uint64_t dir, uint64_t count, Name name, Inode inode, Type d_type) {
+    return add_directory(image, dir, count, name, inode, d_type, [](uint64_t) { return 0; });
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include "bcachefs.h"
+#include "checksum.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <thread>
+
+// Journal replay
+// -------------------------------------------------------------------
+//  The journal is a list of buckets, each bucket holds a sequence of jsets
+//  each jset is padded to the block size. A jset contains jset_entry with
+//  the btree roots and the keys that were inserted in the btrees.
+//
+//  Only the jsets newer than the last_seq of the newest jset need to be replayed,
+//  the older ones were already written to the btree nodes.
+//
+//  A jset is only trusted if its checksum and version are valid, the first
+//  invalid jset of a bucket ends it. The jsets from last_seq up to the newest
+//  one must all be there, when one is missing the writes after it were torn
+//  and the journal ends before it. Blacklisted jsets are never replayed and
+//  are not missing.
+
+struct JournalSetRef {
+    uint64_t          seq;
+    JournalSet const *jset;
+    uint64_t          offset; // offset of the jset on disk in bytes
+};
+
+// Journal seqs inside [start, end)
+struct SeqRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+// Written by a version we can read and with a checksum covering everything after the csum field
+static bool jset_is_valid(JournalSet const *jset, uint64_t bytes, unsigned version) {
+    if (jset->version < BCH_METADATA_VERSION_MIN || jset->version > version) {
+        return false;
+    }
+
+    auto type = (unsigned)extract_bitflag(jset->flags, 0, 4); // JSET_CSUM_TYPE
+    return verify_checksum(type, jset->csum, &jset->magic, bytes - sizeof(struct bch_csum));
+}
+
+// first seq of [start, end) that is not blacklisted, end if they all are
+static uint64_t first_missing(Array<SeqRange> const &blacklist, uint64_t start, uint64_t end) {
+    auto seq = start;
+
+    while (seq < end) {
+        auto range = std::find_if(blacklist.begin(), blacklist.end(),
+                                  [seq](SeqRange const &r) { return r.start <= seq && seq < r.end; });
+
+        if (range == blacklist.end()) {
+            return seq;
+        }
+        seq = range->end;
+    }
+    return end;
+}
+
+static unsigned worker_count(std::size_t tasks) {
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+    return (unsigned)std::max<std::size_t>(1, std::min<std::size_t>(threads, tasks));
+}
+
+void BCacheFSReader::replay_journal() {
+    auto journal = (SuperBlockFieldJournal const *)find_superblock_field(BCH_SB_FIELD_journal);
+    auto members = (SuperBlockFieldMembers const *)find_superblock_field(BCH_SB_FIELD_members);
+
+    if (journal == nullptr || members == nullptr) {
+        error("superblock does not have a journal");
+        return;
+    }
+
+    auto magic       = __jset_magic(_sblock);
+    auto block_size  = btree_block_size();
+    auto bucket_size = (uint64_t)members->members[_sblock->dev_idx].bucket_size * BCH_SECTOR_SIZE;
+    auto count       = (std::size_t)(journal->field.u64s - sizeof(SuperBlockFieldJournal) / BCH_U64S_SIZE);
+
+    debug("replaying {} journal buckets of {} bytes", count, bucket_size);
+
+    // Read and scan the buckets in parallel
+    // ---------------------------------------------------------------
+    _journal.buckets.resize(count);
+    Array<Array<JournalSetRef>> found(count);
+
+    auto scan_bucket = [&](std::size_t i) {
+        auto  offset = journal->buckets[i] * bucket_size;
+        auto &buffer = _journal.buckets[i];
+
+        buffer.resize(bucket_size);
+        auto size = read(offset, buffer.data(), bucket_size);
+
+        uint64_t pos  = 0;
+        uint64_t last = 0;
+
+        while (pos + sizeof(JournalSet) <= size) {
+            auto jset  = (JournalSet const *)(buffer.data() + pos);
+            auto bytes = sizeof(JournalSet) + (uint64_t)jset->u64s * BCH_U64S_SIZE;
+
+            // the rest of the bucket is empty or holds stale entries
+            if (jset->magic != magic || pos + bytes > size || jset->seq < last) {
+                break;
+            }
+
+            // a torn write, what follows was written after it
+            if (!jset_is_valid(jset, bytes, _sblock->version)) {
+                warn("jset {} at {} is invalid, ignoring the rest of its bucket", jset->seq, offset + pos);
+                break;
+            }
+
+            found[i].push_back(JournalSetRef{jset->seq, jset, offset + pos});
+            last = jset->seq;
+            pos += (bytes + block_size - 1) / block_size * block_size;
+        }
+    };
+
+    {
+        auto               workers = worker_count(count);
+        Array<std::thread> threads;
+
+        for (unsigned w = 0; w < workers; ++w) {
+            threads.emplace_back([&, w]() {
+                for (std::size_t i = w; i < count; i += workers) {
+                    scan_bucket(i);
+                }
+            });
+        }
+
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
+
+    Array<JournalSetRef> jsets;
+    for (auto &bucket: found) {
+        jsets.insert(jsets.end(), bucket.begin(), bucket.end());
+    }
+
+    // the same jset can be written multiple times
+    std::sort(jsets.begin(), jsets.end(), [](JournalSetRef const &a, JournalSetRef const &b) { return a.seq < b.seq; });
+    jsets.erase(std::unique(jsets.begin(), jsets.end(),
+                            [](JournalSetRef const &a, JournalSetRef const &b) { return a.seq == b.seq; }),
+                jsets.end());
+
+    // Drop the blacklisted and torn jsets
+    // ---------------------------------------------------------------
+    Array<SeqRange> blacklist;
+
+    auto field = (SuperBlockFieldBlacklist const *)find_superblock_field(BCH_SB_FIELD_journal_seq_blacklist);
+    if (field != nullptr) {
+        auto entries = (field->field.u64s * BCH_U64S_SIZE - sizeof(SuperBlockFieldBlacklist)) /
+                       sizeof(struct journal_seq_blacklist_entry);
+
+        for (uint64_t i = 0; i < entries; ++i) {
+            blacklist.push_back(SeqRange{field->start[i].start, field->start[i].end});
+        }
+    }
+
+    for (auto &ref: jsets) {
+        auto iter = FieldIterator<JournalSetEntry const>((uint8_t const *)ref.jset->start);
+        auto end  = FieldIterator<JournalSetEntry const>((uint8_t const *)ref.jset->_data +
+                                                        (uint64_t)ref.jset->u64s * BCH_U64S_SIZE);
+
+        for (; iter < end; ++iter) {
+            if (iter->type == BCH_JSET_ENTRY_blacklist) {
+                auto entry = (JournalBlacklist const *)*iter;
+                blacklist.push_back(SeqRange{entry->seq, entry->seq + 1});
+            } else if (iter->type == BCH_JSET_ENTRY_blacklist_v2) {
+                auto entry = (JournalBlacklistV2 const *)*iter;
+                blacklist.push_back(SeqRange{entry->start, entry->end + 1});
+            }
+        }
+    }
+
+    jsets.erase(std::remove_if(jsets.begin(), jsets.end(),
+                               [&](JournalSetRef const &ref) {
+                                   return first_missing(blacklist, ref.seq, ref.seq + 1) != ref.seq;
+                               }),
+                jsets.end());
+
+    // the newest jset is only trusted if none is missing since its last_seq
+    while (!jsets.empty()) {
+        auto        expected = jsets.back().jset->last_seq;
+        std::size_t torn     = jsets.size();
+
+        for (std::size_t i = 0; i < jsets.size(); ++i) {
+            if (jsets[i].seq < expected) {
+                continue;
+            }
+
+            auto missing = first_missing(blacklist, expected, jsets[i].seq);
+            if (missing != jsets[i].seq) {
+                warn("jset {} is missing, the jsets after it are not replayed", missing);
+                torn = i;
+                break;
+            }
+            expected = jsets[i].seq + 1;
+        }
+
+        if (torn == jsets.size()) {
+            break;
+        }
+        jsets.resize(torn);
+    }
+
+    if (jsets.empty()) {
+        error("no valid jset found in the journal");
+        return;
+    }
+
+    auto last_seq = jsets.back().jset->last_seq;
+    _journal.seq  = jsets.back().seq;
+
+    debug("journal holds {} jsets, replaying from {} to {}", jsets.size(), last_seq, _journal.seq);
+
+    // Collect the keys of each btree in order
+    // ---------------------------------------------------------------
+    Array<Array<JournalKey>> btree_keys(BTREE_ID_NR);
+
+    for (auto &ref: jsets) {
+        if (ref.seq < last_seq) {
+            continue;
+        }
+
+        auto iter = FieldIterator<JournalSetEntry const>((uint8_t const *)ref.jset->start);
+        auto end  = FieldIterator<JournalSetEntry const>((uint8_t const *)ref.jset->_data +
+                                                        (uint64_t)ref.jset->u64s * BCH_U64S_SIZE);
+
+        for (; iter < end; ++iter) {
+            if (iter->btree_id >= BTREE_ID_NR) {
+                continue;
+            }
+
+            if (iter->type == BCH_JSET_ENTRY_btree_root) {
+                _journal.roots[iter->btree_id] = *iter;
+                continue;
+            }
+
+            // keys with a level > 0 are updates of the interior nodes
+            if (iter->type != BCH_JSET_ENTRY_btree_keys || iter->level != 0) {
+                continue;
+            }
+
+            auto key     = FieldIterator<BKey const>((uint8_t const *)iter->start);
+            auto key_end = FieldIterator<BKey const>((uint8_t const *)*iter + get_u64s(*iter) * BCH_U64S_SIZE);
+
+            for (; key < key_end && key->u64s > 0; ++key) {
+                auto offset = ref.offset + INT(*key) - INT(ref.jset);
+                btree_keys[iter->btree_id].push_back(JournalKey{*key, offset, ref.seq});
+            }
+        }
+    }
+
+    // Build the overlay of each btree in parallel
+    // ---------------------------------------------------------------
+    //  newer keys override older ones at the same position
+    Array<std::thread> threads;
+
+    for (int id = 0; id < BTREE_ID_NR; ++id) {
+        if (btree_keys[id].empty()) {
+            continue;
+        }
+
+        threads.emplace_back([&, id]() {
+            auto &overlay = _journal.keys[id];
+
+            for (auto &key: btree_keys[id]) {
+                // journal keys are never packed
+                overlay[key.key->p] = key;
+            }
+        });
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+}
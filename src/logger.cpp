@@ -1,12 +1,16 @@
 #include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/details/pattern_formatter.h>
 #include <spdlog/spdlog.h>
 
 #include "logger.h"
+#include "queue.h"
 
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 // Linux signal handling & stack trace printing
@@ -63,6 +67,186 @@ std::vector<std::string> get_backtrace(size_t size) { return std::vector<std::st
 #endif
 // ==============================================================
 
+static constexpr spdlog::level::level_enum log_level_spd[] = {
+    spdlog::level::level_enum::trace, spdlog::level::level_enum::debug, spdlog::level::level_enum::info,
+    spdlog::level::level_enum::warn,  spdlog::level::level_enum::err,   spdlog::level::level_enum::critical,
+    spdlog::level::level_enum::off,
+};
+
+// Async sink
+// ==============================================================
+// Longer messages are truncated
+constexpr std::size_t LOG_SLOT_SIZE = 480;
+
+struct LogSlot {
+    spdlog::level::level_enum       level = spdlog::level::level_enum::off;
+    spdlog::log_clock::time_point   time;
+    std::size_t                     thread_id = 0;
+    uint32_t                        size      = 0;
+    char                            payload[LOG_SLOT_SIZE];
+};
+
+class AsyncSink: public spdlog::sinks::sink {
+    public:
+    AsyncSink(AsyncLogOptions const &options):
+        _options(options), _ring(options.capacity),
+        _formatter(std::make_unique<spdlog::pattern_formatter>()) {
+        _thread = std::thread([this]() { drain(); });
+    }
+
+    ~AsyncSink() override {
+        _ring.close();
+        _thread.join();
+    }
+
+    void log(spdlog::details::log_msg const &msg) override {
+        LogSlot slot;
+        slot.level     = msg.level;
+        slot.time      = msg.time;
+        slot.thread_id = msg.thread_id;
+        slot.size      = (uint32_t)std::min(msg.payload.size(), LOG_SLOT_SIZE);
+        memcpy(slot.payload, msg.payload.data(), slot.size);
+
+        if (_options.block) {
+            _ring.push(slot);
+        } else if (!_ring.try_push(slot)) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // flushing is done by the background thread
+    void flush() override {}
+
+    void set_pattern(std::string const &pattern) override {
+        set_formatter(std::make_unique<spdlog::pattern_formatter>(pattern));
+    }
+
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override {
+        std::lock_guard<std::mutex> lock(_formatter_mutex);
+        _formatter = std::move(formatter);
+    }
+
+    private:
+    void drain() {
+        LogSlot                 slot;
+        spdlog::memory_buf_t    batch;
+        std::size_t             unflushed = 0;
+        auto const              flush_level = log_level_spd[int(_options.flush_level)];
+
+        while (_ring.pop(slot)) {
+            bool flush   = false;
+            bool drained = false;
+
+            {
+                std::lock_guard<std::mutex> lock(_formatter_mutex);
+
+                // format everything that is ready in one write
+                do {
+                    spdlog::details::log_msg msg(
+                        spdlog::string_view_t(), slot.level, spdlog::string_view_t(slot.payload, slot.size));
+                    msg.time      = slot.time;
+                    msg.thread_id = slot.thread_id;
+
+                    _formatter->format(msg, batch);
+                    unflushed += 1;
+                    flush |= slot.level >= flush_level;
+
+                    if (batch.size() >= 64 * 1024) {
+                        break;
+                    }
+                    drained = !_ring.try_pop(slot);
+                } while (!drained);
+            }
+
+            write(batch);
+
+            // once the ring is drained there is nothing left to batch with
+            if (flush || drained || unflushed >= _options.flush_every) {
+                fflush(stdout);
+                unflushed = 0;
+            }
+        }
+
+        // messages dropped after the last batch
+        write(batch);
+        fflush(stdout);
+    }
+
+    void write(spdlog::memory_buf_t &batch) {
+        auto dropped = _dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            fmt::format_to(std::back_inserter(batch), "[W] {} log messages dropped\n", dropped);
+        }
+
+        fwrite(batch.data(), 1, batch.size(), stdout);
+        batch.clear();
+    }
+
+    private:
+    AsyncLogOptions          _options;
+    BoundedQueue<LogSlot>    _ring;
+    std::atomic<uint64_t>    _dropped{0};
+    std::mutex               _formatter_mutex;
+    std::unique_ptr<spdlog::formatter> _formatter;
+    std::thread              _thread;
+};
+
+// Sends the messages to the synchronous stdout sink or to the async sink when it is enabled
+class RouterSink: public spdlog::sinks::sink {
+    public:
+    RouterSink(spdlog::sink_ptr sync):
+        _formatter(std::make_unique<spdlog::pattern_formatter>()), _sync(std::move(sync)), _target(_sync) {}
+
+    void log(spdlog::details::log_msg const &msg) override { _target.load()->log(msg); }
+
+    void flush() override { _target.load()->flush(); }
+
+    void set_pattern(std::string const &pattern) override {
+        set_formatter(std::make_unique<spdlog::pattern_formatter>(pattern));
+    }
+
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sync->set_formatter(formatter->clone());
+
+        if (_async) {
+            _async->set_formatter(formatter->clone());
+        }
+        _formatter = std::move(formatter);
+    }
+
+    void enable_async(AsyncLogOptions const &options) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_async) {
+            return;
+        }
+
+        _async = std::make_shared<AsyncSink>(options);
+        _async->set_formatter(_formatter->clone());
+        _target.store(_async);
+    }
+
+    void disable_async() {
+        std::shared_ptr<AsyncSink> async;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _target.store(_sync);
+            async = std::move(_async);
+        }
+
+        // the last thread still logging into it releases it, which drains the ring
+    }
+
+    private:
+    std::mutex                                    _mutex;
+    std::unique_ptr<spdlog::formatter>            _formatter;
+    spdlog::sink_ptr                              _sync;
+    std::shared_ptr<AsyncSink>                    _async;
+    std::atomic<std::shared_ptr<spdlog::sinks::sink>> _target;
+};
+
+static std::shared_ptr<RouterSink> router_sink;
+
 // Logging
 using Logger = std::shared_ptr<spdlog::logger>;
 
@@ -73,8 +257,9 @@ Logger new_logger(char const *name) {
     spdlog::enable_backtrace(32);
 
     auto stdout_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+    router_sink      = std::make_shared<RouterSink>(stdout_sink);
 
-    auto console = std::make_shared<spdlog::logger>(name, stdout_sink);
+    auto console = std::make_shared<spdlog::logger>(name, router_sink);
 
     console->set_level(spdlog::level::level_enum::trace);
     console->flush_on(spdlog::level::level_enum::trace);
@@ -94,15 +279,26 @@ Logger root() {
     return log;
 }
 
-static constexpr spdlog::level::level_enum log_level_spd[] = {
-    spdlog::level::level_enum::trace, spdlog::level::level_enum::debug, spdlog::level::level_enum::info,
-    spdlog::level::level_enum::warn,  spdlog::level::level_enum::err,   spdlog::level::level_enum::critical,
-    spdlog::level::level_enum::off,
-};
-
 void show_log_backtrace() { spdlog::dump_backtrace(); }
 
-void spdlog_log(LogLevel level, std::string const &msg) { root()->log(log_level_spd[int(level)], msg); }
+
+void spdlog_log(LogLevel level, std::string_view msg) {
+    root()->log(log_level_spd[int(level)], spdlog::string_view_t(msg.data(), msg.size()));
+}
+
+std::atomic<int> runtime_log_level{int(LogLevel::INFO)};
+
+void set_log_level(LogLevel level) { runtime_log_level.store(int(level), std::memory_order_relaxed); }
+
+void enable_async_logging(AsyncLogOptions const &options) {
+    root();
+    router_sink->enable_async(options);
+}
+
+void disable_async_logging() {
+    root();
+    router_sink->disable_async();
+}
 
 const char *Exception::what() const noexcept {
     show_backtrace();
@@ -1,11 +1,13 @@
 #ifndef BCACHE_FS_SRC_LOGGER_HEADER
 #define BCACHE_FS_SRC_LOGGER_HEADER
 
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <vector>
 // Do not include spdlog directly
 // only use the fmt header
-#include <spdlog/fmt/bundled/core.h>
+#include <spdlog/fmt/bundled/format.h>
 
 #include "version.h"
 
@@ -16,17 +18,31 @@ constexpr char __source_dir[] = _SOURCE_DIRECTORY;
 // Length of the path so we can cut unimportant folders
 constexpr int __size_src_dir = sizeof(_SOURCE_DIRECTORY) / sizeof(char);
 
-struct CodeLocation {
-    CodeLocation(std::string const &file, std::string const &fun, int line, std::string const &fun_long):
-        filename(file.substr(__size_src_dir + 4)), function_name(fun), line(line), function_long(fun_long) {}
+// Remove the path to the repository and the src folder, done at compile time
+consteval char const *trim_source_path(char const *file) {
+    for (int i = 0; i < __size_src_dir - 1; ++i) {
+        if (file[i] != __source_dir[i]) {
+            return file;
+        }
+    }
+
+    auto trimmed = file + __size_src_dir;
+    if (std::string_view(trimmed).starts_with("src/")) {
+        trimmed += 4;
+    }
+    return trimmed;
+}
 
-    std::string filename;
-    std::string function_name;
+// Only points to string literals, building one does not allocate
+struct CodeLocation {
+    char const *filename;
+    char const *function_name;
     int         line;
-    std::string function_long;
+    char const *function_long;
 };
 
-#define LOC bcachefs::CodeLocation(__FILE__, __FUNCTION__, __LINE__, __PRETTY_FUNCTION__)
+#define LOC                                                                                                            \
+    bcachefs::CodeLocation { bcachefs::trim_source_path(__FILE__), __FUNCTION__, __LINE__, __PRETTY_FUNCTION__ }
 
 enum class LogLevel
 {
@@ -48,21 +64,68 @@ void show_backtrace();
 // retrieve backtrace using execinfo
 std::vector<std::string> get_backtrace(size_t size);
 
-void spdlog_log(LogLevel level, const std::string &msg);
+void spdlog_log(LogLevel level, std::string_view msg);
+
+// Logs below this level are removed at compile time
+#ifndef BCACHEFS_LOG_LEVEL
+#    ifdef NDEBUG
+#        define BCACHEFS_LOG_LEVEL 2
+#    else
+#        define BCACHEFS_LOG_LEVEL 0
+#    endif
+#endif
+
+// Logs below this level are skipped before anything is formatted, INFO by default
+extern std::atomic<int> runtime_log_level;
+
+void set_log_level(LogLevel level);
+
+// Asynchronous logging
+//  Messages are copied to a preallocated lock free ring and written to stdout
+//  in batches by a background thread, logging threads never wait on stdout.
+struct AsyncLogOptions {
+    std::size_t capacity = 8192; // messages in the ring
+    bool        block    = false; // wait for room when the ring is full instead of dropping the message
+
+    // stdout is flushed when the ring is drained, after flush_every messages
+    // or right away for messages at or above flush_level
+    std::size_t flush_every = 1024;
+    LogLevel    flush_level = LogLevel::ERROR;
+};
+
+void enable_async_logging(AsyncLogOptions const &options = {});
+
+// write the pending messages and go back to synchronous logging
+void disable_async_logging();
+
+inline bool is_log_enabled(LogLevel level) {
+    return int(level) >= BCACHEFS_LOG_LEVEL && int(level) >= runtime_log_level.load(std::memory_order_relaxed);
+}
 
 template <typename... Args>
 void log(LogLevel level, CodeLocation const &loc, const char *fmt, const Args &...args) {
-    auto msg = fmt::format("{}:{} {} - {}", loc.filename, loc.line, loc.function_name, fmt::format(fmt, args...));
+    fmt::memory_buffer msg;
+
+    fmt::format_to(std::back_inserter(msg), "{}:{} {} - ", loc.filename, loc.line, loc.function_name);
+    fmt::format_to(std::back_inserter(msg), fmt, args...);
 
-    spdlog_log(level, msg);
+    spdlog_log(level, std::string_view(msg.data(), msg.size()));
 }
 
 #define BCACHEFS_LOGS 1
 
+// the arguments are not evaluated when the level is disabled, the formatting is kept off the hot path
 #if BCACHEFS_LOGS
-#    define BCACHEFS_LOG_HELPER(level, ...) log(level, LOC, __VA_ARGS__)
+#    define BCACHEFS_LOG_HELPER(level, ...)                                                                            \
+        do {                                                                                                           \
+            if (__builtin_expect(bcachefs::is_log_enabled(level), 0)) {                                                \
+                bcachefs::log(level, LOC, __VA_ARGS__);                                                                \
+            }                                                                                                          \
+        } while (0)
 #else
-#    define BCACHEFS_LOG_HELPER(level, ...)
+#    define BCACHEFS_LOG_HELPER(level, ...)                                                                            \
+        do {                                                                                                           \
+        } while (0)
 #endif
 
 #define info(...)     BCACHEFS_LOG_HELPER(bcachefs::LogLevel::INFO, __VA_ARGS__)
@@ -7,15 +7,22 @@
 #include <cstdio>
 #include <iostream>
 
-int main() {
+#include <dirent.h>
+
+int main(int argc, char **argv) {
     info("version hash  : {}", _HASH);
     info("version date  : {}", _DATE);
     info("version branch: {}", _BRANCH);
 
-    BCacheFSReader reader("dataset.img");
+    BCacheFSReader reader(argc > 1 ? argv[1] : "dataset.img");
+    if (!reader.valid()) {
+        return 1;
+    }
 
     {
-        BTreeIterator iter = reader.iterator(BTREE_ID_extents);
+        // only the keys pointing to data, the others are skipped without being decoded
+        auto          data = KeyFilter{KEY_TYPE_extent, KEY_TYPE_inline_data, KEY_TYPE_reflink_p};
+        BTreeIterator iter = reader.iterator(BTREE_ID_extents, data);
 
         auto bkey = iter.next_key();
 
@@ -30,18 +37,23 @@ int main() {
     }
 
     {
-        //
-        BTreeIterator iter = reader.iterator(BTREE_ID_dirents);
+        // the root and its subdirectories, only their dirents are read
+        auto           root = reader.readdir(BCACHEFS_ROOT_INO);
+        DirectoryEntry entry;
 
-        auto bkey = iter.next_key();
+        while (root.next(entry)) {
+            std::cout << "    - dirent " << entry << "\n";
 
-        while (bkey != nullptr) {
-            std::cout << *bkey << std::endl;
+            if (entry.type != DT_DIR) {
+                continue;
+            }
 
-            auto dir = iter.directory(bkey);
-            std::cout << "    - dirent " << dir << "\n";
+            auto           children = reader.readdir(entry.inode);
+            DirectoryEntry child;
 
-            bkey = iter.next_key();
+            while (children.next(child)) {
+                std::cout << "        - dirent " << child << "\n";
+            }
         }
     }
 
@@ -0,0 +1,487 @@
+#include "manifest.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <cstdio>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Build
+// -------------------------------------------------------------------
+namespace {
+struct DirentInfo {
+    uint64_t parent;
+    String   name;
+};
+
+struct FileEntry {
+    String   path;
+    uint64_t inode;
+};
+
+// Resolve the path of a directory by walking up its parents
+String const &directory_path(std::unordered_map<uint64_t, DirentInfo> const &directories,
+                             std::unordered_map<uint64_t, String> &         paths,
+                             uint64_t                                       inode,
+                             int                                            depth = 0) {
+    auto cached = paths.find(inode);
+    if (cached != paths.end()) {
+        return cached->second;
+    }
+
+    auto dir = directories.find(inode);
+
+    // the root directory or an orphan
+    if (inode == BCACHEFS_ROOT_INO || dir == directories.end() || depth > 4096) {
+        return paths[inode] = String();
+    }
+
+    auto path = directory_path(directories, paths, dir->second.parent, depth + 1) + "/" + dir->second.name;
+    return paths[inode] = path;
+}
+
+template <typename T>
+void write_section(FILE *file, Array<T> const &data) {
+    fwrite(data.data(), sizeof(T), data.size(), file);
+}
+
+uint64_t align8(uint64_t size) { return (size + 7) / 8 * 8; }
+
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Paths are hashed once, every level derives its position from that hash
+uint64_t hash_path(std::string_view path) {
+    uint64_t    h    = 0x9E3779B97F4A7C15ULL ^ path.size();
+    auto        data = path.data();
+    std::size_t i    = 0;
+
+    for (; i + 8 <= path.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = mix64(h ^ word) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, path.size() - i);
+    return mix64(h ^ tail);
+}
+
+uint64_t hash_position(uint64_t hash, uint32_t level, uint64_t size) {
+    auto x = mix64(hash + (level + 1) * 0x9E3779B97F4A7C15ULL);
+    return (uint64_t)(((unsigned __int128)x * size) >> 64);
+}
+
+struct HashSection {
+    ManifestHash          header;
+    Array<uint64_t>       bits;
+    Array<uint64_t>       ranks;
+    Array<ManifestSlot>   slots;
+};
+
+// gamma = 2 trades some space for fewer levels
+HashSection build_hash(Array<String const *> const &paths) {
+    HashSection out;
+    memset(&out.header, 0, sizeof(out.header));
+
+    Array<uint64_t> hashes(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        hashes[i] = hash_path(*paths[i]);
+    }
+
+    // (file, level, position) of the placed paths
+    struct Placed {
+        uint32_t file;
+        uint32_t level;
+        uint64_t position;
+    };
+
+    Array<Placed>   placed;
+    Array<uint32_t> remaining(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        remaining[i] = (uint32_t)i;
+    }
+
+    uint32_t level = 0;
+    for (; level < MANIFEST_HASH_LEVELS && !remaining.empty(); ++level) {
+        uint64_t size  = (std::max<uint64_t>(64, remaining.size() * 2) + 63) / 64 * 64;
+        uint64_t words = size / 64;
+
+        Array<uint64_t> seen(words, 0);
+        Array<uint64_t> collide(words, 0);
+
+        for (auto i: remaining) {
+            auto p = hash_position(hashes[i], level, size);
+            if (seen[p / 64] & (1ULL << (p % 64))) {
+                collide[p / 64] |= 1ULL << (p % 64);
+            }
+            seen[p / 64] |= 1ULL << (p % 64);
+        }
+
+        Array<uint32_t> next;
+        for (auto i: remaining) {
+            auto p = hash_position(hashes[i], level, size);
+            if (collide[p / 64] & (1ULL << (p % 64))) {
+                next.push_back(i);
+            } else {
+                placed.push_back(Placed{i, level, p});
+            }
+        }
+
+        out.header.level_start[level] = out.bits.size() * 64;
+        out.header.level_size[level]  = size;
+
+        for (uint64_t w = 0; w < words; ++w) {
+            out.bits.push_back(seen[w] & ~collide[w]);
+        }
+        remaining = std::move(next);
+    }
+
+    if (!remaining.empty()) {
+        warn("{} paths did not fit in the perfect hash", remaining.size());
+    }
+
+    out.header.levels     = level;
+    out.header.slot_count = (uint32_t)placed.size();
+    out.header.words      = out.bits.size();
+
+    uint64_t count = 0;
+    for (std::size_t w = 0; w < out.bits.size(); ++w) {
+        if (w % 8 == 0) {
+            out.ranks.push_back(count);
+        }
+        count += (uint64_t)__builtin_popcountll(out.bits[w]);
+    }
+    out.ranks.push_back(count);
+    out.ranks.resize(out.bits.size() / 8 + 1, count);
+
+    out.slots.resize(placed.size());
+    for (auto &item: placed) {
+        auto bit = out.header.level_start[item.level] + item.position;
+
+        // same as Manifest::rank
+        auto r = out.ranks[bit / 512];
+        for (auto w = bit / 512 * 8; w < bit / 64; ++w) {
+            r += (uint64_t)__builtin_popcountll(out.bits[w]);
+        }
+        r += (uint64_t)__builtin_popcountll(out.bits[bit / 64] & ((1ULL << (bit % 64)) - 1));
+
+        out.slots[r] = ManifestSlot{item.file, (uint32_t)(hashes[item.file] >> 32)};
+    }
+
+    return out;
+}
+} // namespace
+
+bool Manifest::build(BCacheFSReader const &reader, String const &path) {
+    std::unordered_map<uint64_t, DirentInfo>    directories;
+    std::unordered_map<uint64_t, uint64_t>      sizes;
+    std::unordered_map<uint64_t, Array<Extend>> extents;
+    Array<FileEntry>                            files;
+    Array<std::pair<uint64_t, DirentInfo>>      regulars;
+
+    if (!reader.valid()) {
+        error("cannot build a manifest from an invalid image");
+        return false;
+    }
+
+    // 1. Directory tree
+    reader.for_each_key(BTREE_ID_dirents, KeyFilter{KEY_TYPE_dirent}, [&](KeySpan keys) {
+        for (auto &key: keys) {
+            auto dir  = decode_dirent(key);
+            auto info = DirentInfo{dir.parent_inode, String(dir.filename())};
+
+            if (dir.type == DT_DIR) {
+                directories[dir.inode] = info;
+            } else if (dir.type == DT_REG) {
+                regulars.emplace_back(dir.inode, info);
+            }
+        }
+    });
+
+    // 2. File sizes
+    reader.for_each_key(BTREE_ID_inodes, KeyFilter{KEY_TYPE_inode}, [&](KeySpan keys) {
+        for (auto &key: keys) {
+            auto inode         = decode_inode(key);
+            sizes[inode.inode] = inode.size;
+        }
+    });
+
+    // 3. Extents
+    auto data = KeyFilter{KEY_TYPE_extent, KEY_TYPE_inline_data, KEY_TYPE_reflink_p};
+
+    reader.for_each_key(BTREE_ID_extents, data, [&](KeySpan keys) {
+        for (auto &key: keys) {
+            for (auto &ext: reader.extends(key)) {
+                extents[ext.inode].push_back(ext);
+            }
+        }
+    });
+
+    // the journal keys can overlap the extents of the nodes, file_extents resolves the files they touch
+    auto overlay = reader._journal.find(BTREE_ID_extents);
+    if (overlay != nullptr) {
+        uint64_t last = 0;
+
+        for (auto &item: *overlay) {
+            if (item.first.inode != last) {
+                last          = item.first.inode;
+                extents[last] = reader.file_extents(last);
+            }
+        }
+    }
+
+    // 4. Full paths
+    std::unordered_map<uint64_t, String> paths;
+    files.reserve(regulars.size());
+
+    for (auto &item: regulars) {
+        auto &parent = directory_path(directories, paths, item.second.parent);
+        files.push_back(FileEntry{parent + "/" + item.second.name, item.first});
+    }
+
+    std::sort(files.begin(), files.end(), [](FileEntry const &a, FileEntry const &b) { return a.path < b.path; });
+
+    // 5. Sections
+    Array<ManifestFile>   manifest_files;
+    Array<ManifestExtent> manifest_extents;
+    String                names;
+
+    manifest_files.reserve(files.size());
+
+    for (auto &entry: files) {
+        auto &exts = extents[entry.inode];
+        std::sort(exts.begin(), exts.end(), [](Extend const &a, Extend const &b) { return a.file_offset < b.file_offset; });
+
+        auto     start    = manifest_extents.size();
+        uint64_t end_size = 0;
+
+        for (auto &ext: exts) {
+            end_size = std::max(end_size, ext.file_offset + ext.size);
+
+            if (manifest_extents.size() > start) {
+                auto &last = manifest_extents.back();
+
+                // merge the extents that are contiguous both in the file and on disk
+                if (last.file_offset + last.size == ext.file_offset && last.offset + last.size == ext.offset) {
+                    last.size += ext.size;
+                    continue;
+                }
+            }
+            manifest_extents.push_back(ManifestExtent{ext.file_offset, ext.offset, ext.size});
+        }
+
+        // the inode size is exact, the extents are rounded to the sector size
+        auto size = sizes[entry.inode];
+        if (size == 0) {
+            size = end_size;
+        }
+
+        manifest_files.push_back(ManifestFile{
+            entry.inode,
+            size,
+            names.size(),
+            (uint32_t)entry.path.size(),
+            (uint32_t)(manifest_extents.size() - start),
+            start,
+        });
+        names += entry.path;
+    }
+
+    ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+
+    header.magic          = MANIFEST_MAGIC;
+    header.version        = MANIFEST_VERSION;
+    header.header_size    = sizeof(ManifestHeader);
+    header.uuid           = reader._sblock->uuid;
+    header.seq            = reader._sblock->seq;
+    header.file_count     = manifest_files.size();
+    header.extent_count   = manifest_extents.size();
+    header.names_size     = names.size();
+    header.files_offset   = sizeof(ManifestHeader);
+    header.extents_offset = header.files_offset + manifest_files.size() * sizeof(ManifestFile);
+    header.names_offset   = header.extents_offset + manifest_extents.size() * sizeof(ManifestExtent);
+    header.hash_offset    = align8(header.names_offset + names.size());
+
+    Array<String const *> hash_paths;
+    hash_paths.reserve(files.size());
+    for (auto &entry: files) {
+        hash_paths.push_back(&entry.path);
+    }
+
+    auto hash = build_hash(hash_paths);
+
+    header.total_size = header.hash_offset + sizeof(ManifestHash) +
+                        (hash.bits.size() + hash.ranks.size()) * sizeof(uint64_t) +
+                        hash.slots.size() * sizeof(ManifestSlot);
+
+    // write to a temporary file so readers never see a partial manifest
+    auto  tmp  = path + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "wb");
+
+    if (file == nullptr) {
+        error("could not open {}", tmp);
+        return false;
+    }
+
+    names.resize(header.hash_offset - header.names_offset, '\0');
+
+    fwrite(&header, sizeof(header), 1, file);
+    write_section(file, manifest_files);
+    write_section(file, manifest_extents);
+    fwrite(names.data(), 1, names.size(), file);
+    fwrite(&hash.header, sizeof(hash.header), 1, file);
+    write_section(file, hash.bits);
+    write_section(file, hash.ranks);
+    write_section(file, hash.slots);
+
+    bool ok = ferror(file) == 0;
+    ok      = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        error("could not write {}", path);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    info("manifest {}: {} files, {} extents", path, manifest_files.size(), manifest_extents.size());
+    return true;
+}
+
+// Read
+// -------------------------------------------------------------------
+Manifest::Manifest(String const &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error("could not open {}", path);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(ManifestHeader)) {
+        error("{} is not a manifest", path);
+        close(fd);
+        return;
+    }
+
+    _size = (uint64_t)st.st_size;
+    _data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (_data == MAP_FAILED) {
+        error("could not map {}", path);
+        _data = nullptr;
+        return;
+    }
+
+    auto header = (ManifestHeader const *)_data;
+    auto base   = (uint8_t const *)_data;
+
+    bool valid = header->magic == MANIFEST_MAGIC && header->version == MANIFEST_VERSION &&
+                 header->header_size == sizeof(ManifestHeader) && header->total_size == _size &&
+                 header->extents_offset == header->files_offset + header->file_count * sizeof(ManifestFile) &&
+                 header->names_offset == header->extents_offset + header->extent_count * sizeof(ManifestExtent) &&
+                 header->names_offset + header->names_size <= header->hash_offset &&
+                 header->hash_offset + sizeof(ManifestHash) <= _size;
+
+    if (valid) {
+        auto hash = (ManifestHash const *)(base + header->hash_offset);
+
+        valid = hash->levels <= MANIFEST_HASH_LEVELS && hash->slot_count <= header->file_count &&
+                header->hash_offset + sizeof(ManifestHash) + (hash->words + hash->words / 8 + 1) * sizeof(uint64_t) +
+                        hash->slot_count * sizeof(ManifestSlot) ==
+                    _size;
+    }
+
+    if (!valid) {
+        error("{} is not a valid manifest (version {})", path, header->version);
+        return;
+    }
+
+    _header  = header;
+    _files   = (ManifestFile const *)(base + header->files_offset);
+    _extents = (ManifestExtent const *)(base + header->extents_offset);
+    _names   = (char const *)(base + header->names_offset);
+    _hash    = (ManifestHash const *)(base + header->hash_offset);
+    _bits    = (uint64_t const *)(_hash + 1);
+    _ranks   = _bits + _hash->words;
+    _slots   = (ManifestSlot const *)(_ranks + _hash->words / 8 + 1);
+}
+
+Manifest::~Manifest() {
+    if (_data != nullptr) {
+        munmap(_data, _size);
+    }
+}
+
+bool Manifest::is_stale(BCacheFSReader const &reader) const {
+    if (!reader.valid()) {
+        return true;
+    }
+    return memcmp(&_header->uuid, &reader._sblock->uuid, sizeof(struct uuid)) != 0 ||
+           _header->seq != reader._sblock->seq;
+}
+
+uint64_t Manifest::rank(uint64_t bit) const {
+    auto r = _ranks[bit / 512];
+
+    for (auto w = bit / 512 * 8; w < bit / 64; ++w) {
+        r += (uint64_t)__builtin_popcountll(_bits[w]);
+    }
+    return r + (uint64_t)__builtin_popcountll(_bits[bit / 64] & ((1ULL << (bit % 64)) - 1));
+}
+
+int64_t Manifest::find(std::string_view name) const {
+    auto hash = hash_path(name);
+
+    for (uint32_t level = 0; level < _hash->levels; ++level) {
+        auto bit = _hash->level_start[level] + hash_position(hash, level, _hash->level_size[level]);
+
+        if ((_bits[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            continue;
+        }
+
+        // the path can only be in this slot
+        auto &slot = _slots[rank(bit)];
+        if (slot.fingerprint == (uint32_t)(hash >> 32) && path(slot.file) == name) {
+            return slot.file;
+        }
+        return -1;
+    }
+
+    return bisect(name);
+}
+
+int64_t Manifest::bisect(std::string_view name) const {
+    uint64_t low  = 0;
+    uint64_t high = size();
+
+    while (low < high) {
+        auto mid = low + (high - low) / 2;
+        auto cmp = path(mid).compare(name);
+
+        if (cmp == 0) {
+            return (int64_t)mid;
+        }
+
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,129 @@
+#ifndef BCACHE_FS_SRC_MANIFEST_HEADER
+#define BCACHE_FS_SRC_MANIFEST_HEADER
+
+#include "bcachefs.h"
+
+#include <string_view>
+
+// Manifest
+// -------------------------------------------------------------------
+//  Flat index of the regular files of an image built after a single scan
+//  of the dirents, inodes and extents btrees. It is meant to be mmap'ed
+//  by every worker so they do not have to walk the btrees.
+//
+//  Layout (little endian, every section is 8 bytes aligned):
+//
+//      ManifestHeader
+//      ManifestFile[file_count]        sorted by path
+//      ManifestExtent[extent_count]    grouped by file, sorted by file offset
+//      char names[names_size]          paths, not NUL terminated
+//      ManifestHash                    minimal perfect hash of the paths
+//      uint64_t bits[words]
+//      uint64_t ranks[words / 8 + 1]   number of bits set before every 512 bits
+//      ManifestSlot slots[slot_count]
+//
+//  The perfect hash is BBHash like: every level is a bit vector, a path
+//  is placed in the first level where its position does not collide with
+//  another path. The rank of its bit is the index of its slot.
+//
+#define MANIFEST_MAGIC       0x46494e414d484342ULL // "BCHMANIF"
+#define MANIFEST_VERSION     2
+#define MANIFEST_HASH_LEVELS 32
+
+struct ManifestHeader {
+    uint64_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;
+    struct uuid uuid; // superblock the manifest was built from
+    uint64_t    seq;
+    uint64_t    file_count;
+    uint64_t    extent_count;
+    uint64_t    names_size;
+    uint64_t    files_offset;
+    uint64_t    extents_offset;
+    uint64_t    names_offset;
+    uint64_t    hash_offset;
+    uint64_t    total_size;
+};
+
+struct ManifestFile {
+    uint64_t inode;
+    uint64_t size;
+    uint64_t name_offset;
+    uint32_t name_size;
+    uint32_t extent_count;
+    uint64_t extent_start;
+};
+
+struct ManifestHash {
+    uint32_t levels;
+    uint32_t slot_count;
+    uint64_t words; // size of the bit vector in u64
+    uint64_t level_start[MANIFEST_HASH_LEVELS];
+    uint64_t level_size[MANIFEST_HASH_LEVELS]; // in bits, multiple of 64
+};
+
+struct ManifestSlot {
+    uint32_t file;
+    uint32_t fingerprint; // high bits of the path hash, rejects most missing paths
+};
+
+// physically contiguous extents are merged
+struct ManifestExtent {
+    uint64_t file_offset;
+    uint64_t offset; // offset on disk in bytes
+    uint64_t size;
+};
+
+struct Manifest {
+    public:
+    // Scan the image and write the manifest to path
+    static bool build(BCacheFSReader const &reader, String const &path);
+
+    // mmap an existing manifest
+    Manifest(String const &path);
+
+    ~Manifest();
+
+    Manifest(Manifest const &) = delete;
+    Manifest &operator=(Manifest const &) = delete;
+
+    bool valid() const { return _header != nullptr; }
+
+    // the image was modified since the manifest was built
+    bool is_stale(BCacheFSReader const &reader) const;
+
+    uint64_t size() const { return _header->file_count; }
+
+    ManifestFile const &file(uint64_t i) const { return _files[i]; }
+
+    std::string_view path(uint64_t i) const {
+        return std::string_view(_names + _files[i].name_offset, _files[i].name_size);
+    }
+
+    ManifestExtent const *extents_begin(uint64_t i) const { return _extents + _files[i].extent_start; }
+    ManifestExtent const *extents_end(uint64_t i) const { return extents_begin(i) + _files[i].extent_count; }
+
+    // index of the file, -1 if not found
+    int64_t find(std::string_view path) const;
+
+    private:
+    // paths that did not fit in the perfect hash are found by bisection
+    int64_t bisect(std::string_view path) const;
+
+    uint64_t rank(uint64_t bit) const;
+
+    private:
+    void *                _data   = nullptr;
+    uint64_t              _size   = 0;
+    ManifestHeader const *_header = nullptr;
+    ManifestFile const *  _files  = nullptr;
+    ManifestExtent const *_extents = nullptr;
+    char const *          _names   = nullptr;
+    ManifestHash const *  _hash    = nullptr;
+    uint64_t const *      _bits    = nullptr;
+    uint64_t const *      _ranks   = nullptr;
+    ManifestSlot const *  _slots   = nullptr;
+};
+
+#endif
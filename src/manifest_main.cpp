@@ -0,0 +1,65 @@
+#include "logger.h"
+#include "version.h"
+
+#include "bcachefs.h"
+#include "manifest.h"
+
+#include <iostream>
+
+int usage() {
+    std::cout << "usage:\n"
+              << "    manifest build <image> <manifest>   scan the image and write its manifest\n"
+              << "    manifest check <image> <manifest>   check that the manifest matches the image\n"
+              << "    manifest find <manifest> <path>     show the extents of a file\n";
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        return usage();
+    }
+
+    String command = argv[1];
+
+    if (command == "build") {
+        BCacheFSReader reader(argv[2]);
+        return reader.valid() && Manifest::build(reader, argv[3]) ? 0 : 1;
+    }
+
+    if (command == "check") {
+        BCacheFSReader reader(argv[2]);
+        Manifest       manifest(argv[3]);
+
+        if (!reader.valid() || !manifest.valid()) {
+            return 1;
+        }
+
+        bool stale = manifest.is_stale(reader);
+        std::cout << (stale ? "stale" : "up to date") << " (" << manifest.size() << " files)\n";
+        return stale ? 2 : 0;
+    }
+
+    if (command == "find") {
+        Manifest manifest(argv[2]);
+
+        if (!manifest.valid()) {
+            return 1;
+        }
+
+        auto index = manifest.find(argv[3]);
+        if (index < 0) {
+            std::cout << "not found\n";
+            return 1;
+        }
+
+        auto &file = manifest.file(index);
+        std::cout << "i:" << file.inode << " s:" << file.size << "\n";
+
+        for (auto ext = manifest.extents_begin(index); ext != manifest.extents_end(index); ++ext) {
+            std::cout << "    - f:" << ext->file_offset << " o:" << ext->offset << " s:" << ext->size << "\n";
+        }
+        return 0;
+    }
+
+    return usage();
+}
@@ -0,0 +1,186 @@
+#include "metrics.h"
+
+#include <unordered_map>
+
+#include <spdlog/fmt/bundled/format.h>
+
+static char const *const btree_names[] = {
+#define x(name, nr) #name,
+    BCH_BTREE_IDS()
+#undef x
+};
+
+// Histogram
+// -------------------------------------------------------------------
+uint64_t HistogramSnapshot::bucket_limit(std::size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    auto bits  = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    auto sub   = bucket % HISTOGRAM_SUB_BUCKETS;
+    auto shift = bits - HISTOGRAM_SUB_BITS;
+    auto lower = (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+
+    auto target = (uint64_t)(p / 100.0 * (double)count + 0.5);
+    target      = std::max<uint64_t>(1, std::min(target, count));
+
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return std::min(bucket_limit(i), max);
+        }
+    }
+    return max;
+}
+
+void Histogram::collect(HistogramSnapshot &out) const {
+    for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        out.buckets[i] += _buckets[i].load(std::memory_order_relaxed);
+    }
+
+    out.count += _count.load(std::memory_order_relaxed);
+    out.sum += _sum.load(std::memory_order_relaxed);
+    out.max = std::max(out.max, _max.load(std::memory_order_relaxed));
+}
+
+// Metrics
+// -------------------------------------------------------------------
+static std::atomic<uint64_t> metrics_ids{1};
+
+Metrics::Metrics(): _id(metrics_ids.fetch_add(1)) {}
+
+MetricsShard &Metrics::find_shard() {
+    thread_local std::unordered_map<uint64_t, MetricsShard *> shards;
+
+    auto &shard = shards[_id];
+    if (shard == nullptr) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shards.push_back(std::make_unique<MetricsShard>());
+        shard = _shards.back().get();
+    }
+    return *shard;
+}
+
+MetricsSnapshot Metrics::snapshot() const {
+    MetricsSnapshot out;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto load = [](std::atomic<uint64_t> const &counter) { return counter.load(std::memory_order_relaxed); };
+
+    for (auto &shard: _shards) {
+        for (int i = 0; i < BTREE_ID_NR; ++i) {
+            out.nodes_loaded[i] += load(shard->nodes_loaded[i]);
+        }
+
+        out.bytes_read += load(shard->bytes_read);
+        out.cache_hits += load(shard->cache_hits);
+        out.cache_misses += load(shard->cache_misses);
+        out.keys_decoded += load(shard->keys_decoded);
+        out.lookups += load(shard->lookups);
+        out.lookup_depth += load(shard->lookup_depth);
+
+        shard->node_read.collect(out.node_read);
+        shard->lookup.collect(out.lookup);
+        shard->file_read.collect(out.file_read);
+    }
+
+    return out;
+}
+
+// Export
+// -------------------------------------------------------------------
+static double const percentiles[] = {50, 90, 99, 99.9};
+
+static void histogram_json(fmt::memory_buffer &out, char const *name, HistogramSnapshot const &histogram) {
+    fmt::format_to(std::back_inserter(out), "\"{}\": {{\"count\": {}, \"sum\": {}, \"max\": {}", name,
+                   histogram.count, histogram.sum, histogram.max);
+
+    for (auto p: percentiles) {
+        fmt::format_to(std::back_inserter(out), ", \"p{:g}\": {}", p, histogram.percentile(p));
+    }
+    fmt::format_to(std::back_inserter(out), "}}");
+}
+
+std::string MetricsSnapshot::json() const {
+    fmt::memory_buffer out;
+    auto               it = std::back_inserter(out);
+
+    fmt::format_to(it, "{{\"nodes_loaded\": {{");
+    for (int i = 0; i < BTREE_ID_NR; ++i) {
+        fmt::format_to(it, "{}\"{}\": {}", i > 0 ? ", " : "", btree_names[i], nodes_loaded[i]);
+    }
+    fmt::format_to(it, "}}, ");
+
+    fmt::format_to(it, "\"bytes_read\": {}, \"cache_hits\": {}, \"cache_misses\": {}, ", bytes_read, cache_hits,
+                   cache_misses);
+    fmt::format_to(it, "\"keys_decoded\": {}, \"lookups\": {}, \"lookup_depth\": {}, ", keys_decoded, lookups,
+                   lookup_depth);
+
+    fmt::format_to(it, "\"latency_ns\": {{");
+    histogram_json(out, "node_read", node_read);
+    fmt::format_to(it, ", ");
+    histogram_json(out, "lookup", lookup);
+    fmt::format_to(it, ", ");
+    histogram_json(out, "file_read", file_read);
+    fmt::format_to(it, "}}}}");
+
+    return fmt::to_string(out);
+}
+
+static void histogram_prometheus(fmt::memory_buffer &out, std::string const &prefix, char const *name,
+                                 HistogramSnapshot const &histogram) {
+    auto it = std::back_inserter(out);
+
+    fmt::format_to(it, "# TYPE {}_{}_seconds histogram\n", prefix, name);
+
+    // cumulative buckets, only the non empty ones are written
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (histogram.buckets[i] == 0) {
+            continue;
+        }
+        seen += histogram.buckets[i];
+        fmt::format_to(it, "{}_{}_seconds_bucket{{le=\"{:.9f}\"}} {}\n", prefix, name,
+                       (double)HistogramSnapshot::bucket_limit(i) * 1e-9, seen);
+    }
+
+    fmt::format_to(it, "{}_{}_seconds_bucket{{le=\"+Inf\"}} {}\n", prefix, name, histogram.count);
+    fmt::format_to(it, "{}_{}_seconds_sum {:.9f}\n", prefix, name, (double)histogram.sum * 1e-9);
+    fmt::format_to(it, "{}_{}_seconds_count {}\n", prefix, name, histogram.count);
+}
+
+std::string MetricsSnapshot::prometheus(std::string const &prefix) const {
+    fmt::memory_buffer out;
+    auto               it = std::back_inserter(out);
+
+    fmt::format_to(it, "# TYPE {}_nodes_loaded_total counter\n", prefix);
+    for (int i = 0; i < BTREE_ID_NR; ++i) {
+        fmt::format_to(it, "{}_nodes_loaded_total{{btree=\"{}\"}} {}\n", prefix, btree_names[i], nodes_loaded[i]);
+    }
+
+    auto counter = [&](char const *name, uint64_t value) {
+        fmt::format_to(it, "# TYPE {}_{} counter\n{}_{} {}\n", prefix, name, prefix, name, value);
+    };
+
+    counter("bytes_read_total", bytes_read);
+    counter("cache_hits_total", cache_hits);
+    counter("cache_misses_total", cache_misses);
+    counter("keys_decoded_total", keys_decoded);
+    counter("lookups_total", lookups);
+    counter("lookup_depth_total", lookup_depth);
+
+    histogram_prometheus(out, prefix, "node_read", node_read);
+    histogram_prometheus(out, prefix, "lookup", lookup);
+    histogram_prometheus(out, prefix, "file_read", file_read);
+
+    return fmt::to_string(out);
+}
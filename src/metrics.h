@@ -0,0 +1,189 @@
+#ifndef BCACHE_FS_SRC_METRICS_HEADER
+#define BCACHE_FS_SRC_METRICS_HEADER
+
+#include "cbcachefs.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Metrics
+// -------------------------------------------------------------------
+//  Every thread updates its own shard, shards are only summed when a
+//  snapshot is taken so recording a value never contends with another
+//  thread. Values are relaxed atomics so a snapshot can read them while
+//  they are updated.
+//
+//  Histograms are HDR like: values are grouped by power of 2 and each
+//  power of 2 is split in HISTOGRAM_SUB_BUCKETS linear buckets, which
+//  bounds the relative error of the percentiles to 1 / HISTOGRAM_SUB_BUCKETS.
+//
+#define HISTOGRAM_SUB_BITS    3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS     (64 * HISTOGRAM_SUB_BUCKETS)
+
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum   = 0;
+    uint64_t max   = 0;
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+
+    // smallest value v such that at least p percent of the values are <= v (approximately)
+    uint64_t percentile(double p) const;
+
+    // upper bound of the values falling in the bucket
+    static uint64_t bucket_limit(std::size_t bucket);
+};
+
+struct Histogram {
+    public:
+    void record(uint64_t value) {
+        auto &bucket = _buckets[bucket_of(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _sum.store(_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+
+        if (value > _max.load(std::memory_order_relaxed)) {
+            _max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // add the values to a snapshot
+    void collect(HistogramSnapshot &out) const;
+
+    static std::size_t bucket_of(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return (std::size_t)value;
+        }
+
+        auto bits = 63 - __builtin_clzll(value);
+        auto sub  = (value >> (bits - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (std::size_t)(bits - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+
+    private:
+    // only written by the owning thread, load + store is enough
+    std::atomic<uint64_t> _buckets[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _sum{0};
+    std::atomic<uint64_t> _max{0};
+};
+
+struct MetricsSnapshot {
+    uint64_t nodes_loaded[BTREE_ID_NR] = {};
+    uint64_t bytes_read                = 0;
+    uint64_t cache_hits                = 0;
+    uint64_t cache_misses              = 0;
+    uint64_t keys_decoded              = 0;
+    uint64_t lookups                   = 0;
+    uint64_t lookup_depth              = 0; // sum of the depth of every lookup
+
+    // latencies in nanoseconds
+    HistogramSnapshot node_read;
+    HistogramSnapshot lookup;
+    HistogramSnapshot file_read;
+
+    std::string json() const;
+
+    // Prometheus text exposition format
+    std::string prometheus(std::string const &prefix = "bcachefs") const;
+};
+
+struct MetricsShard {
+    void add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> nodes_loaded[BTREE_ID_NR] = {};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> cache_hits{0};
+    std::atomic<uint64_t> cache_misses{0};
+    std::atomic<uint64_t> keys_decoded{0};
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> lookup_depth{0};
+
+    Histogram node_read;
+    Histogram lookup;
+    Histogram file_read;
+};
+
+struct Metrics {
+    public:
+    Metrics();
+
+    Metrics(Metrics const &) = delete;
+    Metrics &operator=(Metrics const &) = delete;
+
+    // shard of the calling thread
+    MetricsShard &local() {
+        thread_local uint64_t      cached_id    = 0;
+        thread_local MetricsShard *cached_shard = nullptr;
+
+        if (cached_id != _id) {
+            cached_shard = &find_shard();
+            cached_id    = _id;
+        }
+        return *cached_shard;
+    }
+
+    // sum of all the shards
+    MetricsSnapshot snapshot() const;
+
+    private:
+    // slow path, the thread uses more than one Metrics
+    MetricsShard &find_shard();
+
+    private:
+    uint64_t                                   _id; // unique for the process, never reused
+    mutable std::mutex                         _mutex;
+    std::vector<std::unique_ptr<MetricsShard>> _shards;
+};
+
+// Counter kept outside of the shards, hot loops add to it and the total is added to the shard of the thread
+// that flushes it, on flush or destruction. A copy starts from 0 so a value is never counted twice
+struct DeferredCounter {
+    public:
+    DeferredCounter(Metrics &metrics, std::atomic<uint64_t> MetricsShard::*counter):
+        _metrics(metrics), _counter(counter) {}
+
+    DeferredCounter(DeferredCounter const &other): _metrics(other._metrics), _counter(other._counter) {}
+
+    DeferredCounter &operator=(DeferredCounter const &) = delete;
+
+    ~DeferredCounter() { flush(); }
+
+    void add(uint64_t value) { _pending += value; }
+
+    void flush() {
+        if (_pending != 0) {
+            auto &shard = _metrics.local();
+            shard.add(shard.*_counter, _pending);
+            _pending = 0;
+        }
+    }
+
+    private:
+    Metrics &                           _metrics;
+    std::atomic<uint64_t> MetricsShard::*_counter;
+    uint64_t                            _pending = 0;
+};
+
+// Record the time elapsed between its creation and its destruction
+struct ScopedTimer {
+    ScopedTimer(Histogram &histogram): _histogram(histogram), _start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - _start;
+        _histogram.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    private:
+    Histogram &                           _histogram;
+    std::chrono::steady_clock::time_point _start;
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include "logger.h"
+#include "version.h"
+
+#include "packer.h"
+#include "synthetic.h"
+
+#include <fstream>
+#include <iostream>
+#include <map>
+
+int usage() {
+    std::cout << "usage:\n"
+              << "    mkimage synthetic <image> [--option=value ...]        write an image of generated files\n"
+              << "    mkimage pack <image> <dir> [--option=value ...]       copy the files below dir into an image\n"
+              << "\n"
+              << "image options:\n"
+              << "    --node-size=256K       size of the btree nodes, 1M when packing\n"
+              << "    --block-size=4K\n"
+              << "    --format=packed        key format: current, short or packed\n"
+              << "    --bsets=1              bsets per btree node\n"
+              << "    --depth=0              levels of the btrees, 0 for as few as possible\n"
+              << "    --journal-buckets=4\n"
+              << "    --unclean              do not write the clean field, the roots are only in the journal\n"
+              << "    --seed=0\n"
+              << "\n"
+              << "synthetic options:\n"
+              << "    --files=1000           number of files\n"
+              << "    --files-per-dir=1000   0 puts every file in the root directory\n"
+              << "    --distribution=lognormal  fixed, uniform or lognormal\n"
+              << "    --min-size=0\n"
+              << "    --max-size=1M\n"
+              << "    --median-size=64K      size of every file for the fixed distribution\n"
+              << "    --sigma=1.0            spread of the lognormal distribution\n"
+              << "    --inline-size=0        files up to this size are stored in their key\n"
+              << "    --extent-size=0        split the files into extents of this size\n"
+              << "    --no-fill              leave the data as holes\n"
+              << "    --overwrites           every key overwrites an older version in the first bset, needs --bsets=2\n"
+              << "\n"
+              << "pack options:\n"
+              << "    --order=class          physical order of the files: sorted, class or access\n"
+              << "                           class interleaves the directories and shuffles their files\n"
+              << "    --access=<list>        read order of the files, one path relative to dir per line\n"
+              << "    --list=<list>          only pack these files, one path relative to dir per line\n"
+              << "    --inline-size=1K       files up to this size are stored in their key\n";
+    return 1;
+}
+
+// 4K, 16M, 1G
+uint64_t parse_size(String const &value) {
+    std::size_t end  = 0;
+    auto        size = std::stoull(value, &end);
+
+    if (end < value.size()) {
+        switch (value[end]) {
+        case 'k':
+        case 'K':
+            return size << 10;
+        case 'm':
+        case 'M':
+            return size << 20;
+        case 'g':
+        case 'G':
+            return size << 30;
+        }
+    }
+    return size;
+}
+
+// one path per line, empty lines are ignored
+Array<String> read_lines(String const &path) {
+    std::ifstream file(path);
+    Array<String> lines;
+
+    if (!file) {
+        throw std::runtime_error("could not open " + path);
+    }
+
+    for (String line; std::getline(file, line);) {
+        if (!line.empty()) {
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+// Returns false when name is not an image option
+bool image_option(String const &name, String const &value, ImageOptions &image) {
+    if (name == "node-size") {
+        image.node_size = parse_size(value);
+    } else if (name == "block-size") {
+        image.block_size = parse_size(value);
+    } else if (name == "format") {
+        std::map<String, KeyFormat> formats = {
+            {"current", KeyFormat::CURRENT}, {"short", KeyFormat::SHORT}, {"packed", KeyFormat::PACKED}};
+        image.format = formats.at(value);
+    } else if (name == "bsets") {
+        image.bsets = (uint32_t)std::stoul(value);
+    } else if (name == "depth") {
+        image.depth = (uint32_t)std::stoul(value);
+    } else if (name == "journal-buckets") {
+        image.journal_buckets = (uint32_t)std::stoul(value);
+    } else if (name == "unclean") {
+        image.clean = false;
+    } else if (name == "seed") {
+        image.seed = std::stoull(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool synthetic_option(String const &name, String const &value, SyntheticOptions &options) {
+    if (name == "files") {
+        options.file_count = parse_size(value);
+    } else if (name == "files-per-dir") {
+        options.files_per_dir = parse_size(value);
+    } else if (name == "distribution") {
+        std::map<String, SizeDistribution> distributions = {{"fixed", SizeDistribution::FIXED},
+                                                            {"uniform", SizeDistribution::UNIFORM},
+                                                            {"lognormal", SizeDistribution::LOGNORMAL}};
+        options.distribution = distributions.at(value);
+    } else if (name == "min-size") {
+        options.min_size = parse_size(value);
+    } else if (name == "max-size") {
+        options.max_size = parse_size(value);
+    } else if (name == "median-size") {
+        options.median_size = parse_size(value);
+    } else if (name == "sigma") {
+        options.sigma = std::stod(value);
+    } else if (name == "inline-size") {
+        options.inline_size = parse_size(value);
+    } else if (name == "extent-size") {
+        options.extent_size = parse_size(value);
+    } else if (name == "no-fill") {
+        options.fill = false;
+    } else if (name == "overwrites") {
+        options.overwrites = true;
+    } else {
+        return image_option(name, value, options.image);
+    }
+    return true;
+}
+
+bool pack_option(String const &name, String const &value, PackOptions &options, String &list) {
+    if (name == "order") {
+        std::map<String, PackOrder> orders = {
+            {"sorted", PackOrder::SORTED}, {"class", PackOrder::SHUFFLED_BY_CLASS}, {"access", PackOrder::ACCESS}};
+        options.order = orders.at(value);
+    } else if (name == "access") {
+        options.access = read_lines(value);
+        options.order  = PackOrder::ACCESS;
+    } else if (name == "list") {
+        list = value;
+    } else if (name == "inline-size") {
+        options.inline_size = parse_size(value);
+    } else {
+        return image_option(name, value, options.image);
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    String command    = argc > 1 ? argv[1] : "";
+    int    positional = command == "pack" ? 4 : 3;
+
+    if ((command != "synthetic" && command != "pack") || argc < positional) {
+        return usage();
+    }
+
+    std::map<String, String> args;
+    for (int i = positional; i < argc; ++i) {
+        String arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            return usage();
+        }
+
+        auto eq = arg.find('=');
+        if (eq == String::npos) {
+            args[arg.substr(2)] = "";
+        } else {
+            args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        }
+    }
+
+    SyntheticOptions synthetic;
+    PackOptions      pack;
+    String           list;
+    Array<String>    files;
+
+    try {
+        for (auto &[name, value]: args) {
+            bool known = command == "pack" ? pack_option(name, value, pack, list)
+                                           : synthetic_option(name, value, synthetic);
+            if (!known) {
+                std::cout << "unknown option --" << name << "\n";
+                return usage();
+            }
+        }
+
+        if (command == "pack") {
+            files = list.empty() ? list_files(argv[3]) : read_lines(list);
+        }
+    } catch (std::exception const &e) {
+        std::cout << e.what() << "\n";
+        return usage();
+    }
+
+    if (command == "synthetic") {
+        return write_synthetic_image(argv[2], synthetic) ? 0 : 1;
+    }
+
+    return pack_image(argv[2], argv[3], files, pack) ? 0 : 1;
+}
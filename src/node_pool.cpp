@@ -0,0 +1,108 @@
+#include "node_pool.h"
+#include "logger.h"
+
+#include <algorithm>
+
+#include <sys/mman.h>
+
+namespace {
+uint64_t round_up(uint64_t value, uint64_t align) { return (value + align - 1) / align * align; }
+} // namespace
+
+void NodeRef::reset() {
+    auto buffer = std::exchange(_buffer, nullptr);
+
+    if (buffer != nullptr && buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        buffer->pool->release(buffer);
+    }
+}
+
+NodePool::NodePool(uint64_t node_size): _node_size(round_up(std::max<uint64_t>(node_size, 1), 4096)) {
+    _slab_size  = round_up(_node_size * NODE_POOL_SLAB_NODES, NODE_POOL_SLAB_ALIGN);
+    _slab_nodes = _slab_size / _node_size;
+}
+
+NodePool::~NodePool() {
+    if (_used > 0) {
+        warn("node pool destroyed with {} nodes in use", _used);
+    }
+
+    for (auto &slab: _slabs) {
+        munmap(slab.data, slab.size);
+    }
+}
+
+NodeRef NodePool::acquire() {
+    NodeBuffer *buffer = nullptr;
+    {
+        std::lock_guard lock(_mutex);
+
+        if (_free == nullptr && !grow()) {
+            return NodeRef();
+        }
+
+        buffer = _free;
+        _free  = buffer->next;
+        _used += 1;
+    }
+
+    buffer->next = nullptr;
+    return NodeRef(buffer);
+}
+
+void NodePool::release(NodeBuffer *buffer) {
+    std::lock_guard lock(_mutex);
+
+    buffer->next = _free;
+    _free        = buffer;
+    _used -= 1;
+}
+
+uint64_t NodePool::used() const {
+    std::lock_guard lock(_mutex);
+    return _used;
+}
+
+uint64_t NodePool::capacity() const {
+    std::lock_guard lock(_mutex);
+    return _slabs.size() * _slab_nodes;
+}
+
+bool NodePool::grow() {
+    // over map by the alignment and unmap what sticks out on both sides
+    auto mapped = _slab_size + NODE_POOL_SLAB_ALIGN;
+    auto region = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (region == MAP_FAILED) {
+        error("could not map a slab of {} bytes for the btree nodes", _slab_size);
+        return false;
+    }
+
+    auto start = (uintptr_t)region;
+    auto data  = round_up(start, NODE_POOL_SLAB_ALIGN);
+
+    if (data > start) {
+        munmap(region, data - start);
+    }
+    if (data + _slab_size < start + mapped) {
+        munmap((void *)(data + _slab_size), start + mapped - data - _slab_size);
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise((void *)data, _slab_size, MADV_HUGEPAGE);
+#endif
+
+    Slab slab{(void *)data, _slab_size, std::make_unique<NodeBuffer[]>(_slab_nodes)};
+
+    for (uint64_t i = 0; i < _slab_nodes; ++i) {
+        auto &buffer = slab.buffers[i];
+        buffer.pool  = this;
+        buffer.data  = (struct btree_node *)(data + i * _node_size);
+        buffer.next  = _free;
+        _free        = &buffer;
+    }
+
+    _slabs.push_back(std::move(slab));
+    debug("node pool grew to {} slabs of {} nodes", _slabs.size(), _slab_nodes);
+    return true;
+}
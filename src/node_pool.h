@@ -0,0 +1,124 @@
+#ifndef BCACHE_FS_SRC_NODE_POOL_HEADER
+#define BCACHE_FS_SRC_NODE_POOL_HEADER
+
+#include "cbcachefs.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Node pool
+// -------------------------------------------------------------------
+//  Every btree node has the same size, the buffers they are read into
+//  are carved out of slabs mapped once and recycled through a free list
+//  instead of going through malloc, which maps and unmaps a fresh region
+//  for every node above the mmap threshold.
+//
+//  Slabs are multiples of 2MiB, aligned on 2MiB and advised MADV_HUGEPAGE
+//  so a scan touching many nodes uses few TLB entries. A slab is only
+//  unmapped with the pool, the pool keeps the peak number of live nodes.
+//
+//  NodeRef is an intrusive handle on a NodeBuffer, the descriptors of a
+//  slab (count, free list link) live in an array allocated beside it so
+//  the slab only holds node data. Moving a handle does not touch the
+//  count. Handles must not outlive the pool (the reader).
+//
+#define NODE_POOL_SLAB_ALIGN (2 * 1024 * 1024)
+#define NODE_POOL_SLAB_NODES 8 // minimum number of nodes per slab
+
+struct NodePool;
+
+struct NodeBuffer {
+    std::atomic<uint32_t> refs = 0;
+    NodePool *            pool = nullptr;
+    struct btree_node *   data = nullptr;
+    NodeBuffer *          next = nullptr; // next free buffer
+};
+
+struct NodeRef {
+    public:
+    NodeRef() = default;
+
+    NodeRef(std::nullptr_t) {}
+
+    explicit NodeRef(NodeBuffer *buffer): _buffer(buffer) { acquire(); }
+
+    NodeRef(NodeRef const &other): _buffer(other._buffer) { acquire(); }
+
+    NodeRef(NodeRef &&other) noexcept: _buffer(std::exchange(other._buffer, nullptr)) {}
+
+    NodeRef &operator=(NodeRef other) noexcept {
+        std::swap(_buffer, other._buffer);
+        return *this;
+    }
+
+    ~NodeRef() { reset(); }
+
+    void reset();
+
+    struct btree_node *get() const { return _buffer != nullptr ? _buffer->data : nullptr; }
+
+    struct btree_node *operator->() const { return _buffer->data; }
+
+    struct btree_node &operator*() const { return *_buffer->data; }
+
+    explicit operator bool() const { return _buffer != nullptr; }
+
+    uint32_t use_count() const { return _buffer != nullptr ? _buffer->refs.load(std::memory_order_relaxed) : 0; }
+
+    private:
+    void acquire() {
+        if (_buffer != nullptr) {
+            _buffer->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    NodeBuffer *_buffer = nullptr;
+};
+
+struct NodePool {
+    public:
+    NodePool(uint64_t node_size);
+
+    ~NodePool();
+
+    NodePool(NodePool const &) = delete;
+    NodePool &operator=(NodePool const &) = delete;
+
+    // A free buffer, a new slab is mapped when none is left
+    NodeRef acquire();
+
+    uint64_t node_size() const { return _node_size; }
+
+    // buffers handed out and buffers mapped
+    uint64_t used() const;
+    uint64_t capacity() const;
+
+    private:
+    void release(NodeBuffer *buffer);
+
+    // map a new slab and push its buffers on the free list
+    bool grow();
+
+    struct Slab {
+        void *                        data = nullptr;
+        uint64_t                      size = 0;
+        std::unique_ptr<NodeBuffer[]> buffers;
+    };
+
+    uint64_t           _node_size;
+    uint64_t           _slab_size;
+    uint64_t           _slab_nodes;
+    mutable std::mutex _mutex;
+    NodeBuffer *       _free = nullptr;
+    uint64_t           _used = 0;
+    std::vector<Slab>  _slabs;
+
+    friend struct NodeRef;
+};
+
+#endif
@@ -0,0 +1,350 @@
+#include "packer.h"
+#include "logger.h"
+#include "shuffle.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <numeric>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// "a/b/c" => "a/b", "c" => ""
+std::string_view parent_path(std::string_view path) {
+    auto slash = path.rfind('/');
+    return slash == std::string_view::npos ? std::string_view() : path.substr(0, slash);
+}
+
+std::string_view base_name(std::string_view path) {
+    auto slash = path.rfind('/');
+    return slash == std::string_view::npos ? path : path.substr(slash + 1);
+}
+
+// "/a/b" and "./a/b" => "a/b"
+String normalize(String const &path) {
+    std::size_t start = 0;
+
+    while (start < path.size()) {
+        if (path[start] == '/') {
+            start += 1;
+        } else if (path.compare(start, 2, "./") == 0) {
+            start += 2;
+        } else {
+            break;
+        }
+    }
+    return path.substr(start);
+}
+
+// Read the first size bytes of a file, fun(data, n, offset) is called for every chunk
+template <typename Fun>
+bool copy_file(String const &source, uint64_t size, Array<uint8_t> &chunk, Fun fun) {
+    int fd = ::open(source.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error("could not open {}", source);
+        return false;
+    }
+
+    uint64_t done = 0;
+    while (done < size) {
+        auto n = ::read(fd, chunk.data(), std::min<uint64_t>(chunk.size(), size - done));
+        if (n <= 0) {
+            break;
+        }
+
+        fun(chunk.data(), (uint64_t)n, done);
+        done += n;
+    }
+    ::close(fd);
+
+    if (done < size) {
+        error("{} is shorter than {} bytes", source, size);
+        return false;
+    }
+    return true;
+}
+
+struct PackedFile {
+    uint64_t size   = 0;
+    uint64_t offset = 0; // offset of the data in the image
+    uint16_t mode   = 0;
+};
+
+struct Child {
+    std::string_view name;
+    uint64_t         inode;
+    uint8_t          d_type;
+};
+} // namespace
+
+Array<String> list_files(String const &root) {
+    namespace fs = std::filesystem;
+
+    Array<String>   files;
+    std::error_code ec;
+
+    for (auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator();
+         it.increment(ec)) {
+        if (it->is_regular_file(ec)) {
+            files.push_back(it->path().lexically_relative(root).string());
+        }
+    }
+
+    if (ec) {
+        error("could not list {}: {}", root, ec.message());
+    }
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+Array<uint64_t> pack_order(Array<String> const &files, PackOptions const &options) {
+    Array<uint64_t> order(files.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    auto by_path = [&](uint64_t a, uint64_t b) { return files[a] < files[b]; };
+    std::sort(order.begin(), order.end(), by_path);
+
+    switch (options.order) {
+    case PackOrder::SORTED:
+        break;
+
+    case PackOrder::SHUFFLED_BY_CLASS: {
+        // files are sorted so the files of a class are contiguous
+        Array<std::pair<uint64_t, uint64_t>> classes;
+
+        for (uint64_t i = 0; i < order.size(); ++i) {
+            if (i == 0 || parent_path(files[order[i]]) != parent_path(files[order[i - 1]])) {
+                classes.emplace_back(i, i);
+            }
+            classes.back().second = i + 1;
+        }
+
+        SplitMix64 rng{options.image.seed};
+        for (auto &[begin, end]: classes) {
+            fisher_yates(order.data() + begin, order.data() + end, rng);
+        }
+        fisher_yates(classes.data(), classes.data() + classes.size(), rng);
+
+        Array<uint64_t> dealt;
+        dealt.reserve(order.size());
+
+        while (!classes.empty()) {
+            for (auto &[begin, end]: classes) {
+                dealt.push_back(order[begin++]);
+            }
+
+            auto empty = [](auto const &range) { return range.first == range.second; };
+            classes.erase(std::remove_if(classes.begin(), classes.end(), empty), classes.end());
+        }
+        order = std::move(dealt);
+        break;
+    }
+
+    case PackOrder::ACCESS: {
+        std::unordered_map<std::string_view, uint64_t> index;
+        for (uint64_t i = 0; i < files.size(); ++i) {
+            index[files[i]] = i;
+        }
+
+        Array<bool>     placed(files.size(), false);
+        Array<uint64_t> accessed;
+        uint64_t        missing = 0;
+
+        for (auto const &path: options.access) {
+            auto it = index.find(normalize(path));
+            if (it == index.end()) {
+                missing += 1;
+            } else if (!placed[it->second]) {
+                placed[it->second] = true;
+                accessed.push_back(it->second);
+            }
+        }
+
+        if (missing > 0) {
+            warn("{} paths of the access order are not packed", missing);
+        }
+
+        for (auto i: order) {
+            if (!placed[i]) {
+                accessed.push_back(i);
+            }
+        }
+        order = std::move(accessed);
+        break;
+    }
+    }
+    return order;
+}
+
+bool pack_image(String const &path, String const &root, Array<String> const &files, PackOptions const &options) {
+    auto max_inline = (0xFF - BKEY_U64s) * BCH_U64S_SIZE;
+    if (options.inline_size > max_inline) {
+        error("inline data is limited to {} bytes", max_inline);
+        return false;
+    }
+
+    Array<String> paths(files.size());
+    std::transform(files.begin(), files.end(), paths.begin(), normalize);
+
+    auto source = [&](std::string_view relative) { return fmt::format("{}/{}", root, relative); };
+
+    // 1. Sizes and modes, the files that cannot be read are skipped
+    Array<String>     kept;
+    Array<PackedFile> packed;
+
+    for (auto const &relative: paths) {
+        struct stat st;
+        if (relative.empty() || ::stat(source(relative).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            warn("skipping {}, not a regular file", source(relative));
+            continue;
+        }
+
+        kept.push_back(relative);
+        packed.push_back({(uint64_t)st.st_size, 0, (uint16_t)(S_IFREG | (st.st_mode & 07777))});
+    }
+    paths = std::move(kept);
+
+    auto order = pack_order(paths, options);
+
+    // 2. Directories, every parent of a file, the root is ""
+    std::map<std::string_view, uint64_t> directories;
+    directories[""] = BCACHEFS_ROOT_INO;
+
+    for (auto const &relative: paths) {
+        for (auto dir = parent_path(relative); directories.count(dir) == 0; dir = parent_path(dir)) {
+            directories[dir] = 0;
+        }
+    }
+
+    std::unordered_map<std::string_view, uint64_t> dir_index;
+    uint64_t                                       next_inode = BCACHEFS_ROOT_INO + 1;
+
+    for (auto &[dir, inode]: directories) {
+        if (!dir.empty()) {
+            inode = next_inode++;
+        }
+        dir_index[dir] = inode - BCACHEFS_ROOT_INO;
+    }
+
+    // files follow the directories in physical order
+    Array<uint64_t> file_inode(paths.size());
+    for (uint64_t k = 0; k < order.size(); ++k) {
+        file_inode[order[k]] = next_inode + k;
+    }
+
+    ImageWriter image(path, options.image);
+    if (!image.valid()) {
+        return false;
+    }
+
+    auto           block      = options.image.block_size;
+    auto           is_inline  = [&](uint64_t size) { return size <= options.inline_size; };
+    uint64_t       inlined    = 0;
+    uint64_t       data_bytes = 0;
+    Array<uint8_t> chunk(1024 * 1024);
+
+    // 3. Data, one contiguous block aligned run per file
+    for (auto i: order) {
+        auto &file = packed[i];
+        if (file.size == 0 || is_inline(file.size)) {
+            continue;
+        }
+
+        bool ok = copy_file(source(paths[i]), file.size, chunk, [&](uint8_t const *data, uint64_t n, uint64_t offset) {
+            auto at = image.append(data, n, offset == 0 ? block : 1);
+            if (offset == 0) {
+                file.offset = at;
+            }
+        });
+
+        if (!ok || !image.valid()) {
+            return false;
+        }
+        data_bytes += file.size;
+    }
+
+    // 4. Extents, inodes follow the physical order
+    for (auto i: order) {
+        auto &file  = packed[i];
+        bool  ok    = true;
+        auto  inode = file_inode[i];
+
+        if (file.size == 0) {
+            continue;
+        }
+
+        if (is_inline(file.size)) {
+            Array<uint8_t> data(file.size);
+            ok = copy_file(source(paths[i]), file.size, chunk, [&](uint8_t const *src, uint64_t n, uint64_t offset) {
+                memcpy(data.data() + offset, src, n);
+            });
+            ok      = ok && image.add_inline_data(inode, data.data(), data.size());
+            inlined += 1;
+        } else {
+            ok = image.add_extent(inode, 0, file.offset, file.size);
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    // 5. Inodes, the root and the directories then the files
+    Array<Array<Child>> children(directories.size());
+    Array<uint32_t>     subdirs(directories.size(), 0);
+
+    for (auto &[dir, inode]: directories) {
+        if (!dir.empty()) {
+            auto parent = dir_index[parent_path(dir)];
+            children[parent].push_back({base_name(dir), inode, DT_DIR});
+            subdirs[parent] += 1;
+        }
+    }
+
+    for (auto &[dir, inode]: directories) {
+        struct stat st;
+        uint16_t    mode = S_IFDIR | 0755;
+
+        if (::stat(source(dir).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            mode = S_IFDIR | (st.st_mode & 07777);
+        }
+
+        if (!image.add_inode(inode, mode, 0, 2 + subdirs[dir_index[dir]])) {
+            return false;
+        }
+    }
+
+    for (auto i: order) {
+        if (!image.add_inode(file_inode[i], packed[i].mode, packed[i].size, 1)) {
+            return false;
+        }
+        children[dir_index[parent_path(paths[i])]].push_back({base_name(paths[i]), file_inode[i], DT_REG});
+    }
+
+    // 6. Dirents, directories are visited in inode order
+    for (auto &[dir, inode]: directories) {
+        auto &entries = children[dir_index[dir]];
+
+        bool  ok      = add_directory(
+            image, inode, entries.size(), [&](uint64_t j) { return entries[j].name; },
+            [&](uint64_t j) { return entries[j].inode; }, [&](uint64_t j) { return entries[j].d_type; });
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    if (!image.finish()) {
+        return false;
+    }
+
+    info("packed {} files ({} inline, {} MiB of data) in {} directories", paths.size(), inlined, data_bytes >> 20,
+         directories.size());
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef BCACHE_FS_SRC_PACKER_HEADER
+#define BCACHE_FS_SRC_PACKER_HEADER
+
+#include "image_writer.h"
+
+// Dataset packer
+// -------------------------------------------------------------------
+//  Copies a directory tree into an image laid out for the loader: every
+//  file is a single contiguous extent and the files are written in the
+//  order they will be read. Files up to inline_size are stored in their
+//  key and do not need a read of their own.
+//
+//  The class of a file is its parent directory. SHUFFLED_BY_CLASS shuffles
+//  the files of every class then deals the classes in a round robin, any
+//  run of contiguous files (an EpochShuffler window) mixes all the classes.
+//
+//  Directories get the inodes after the root in path order, the files
+//  follow in physical order so the extents btree is sorted like the data.
+//
+enum class PackOrder
+{
+    SORTED,            // by path
+    SHUFFLED_BY_CLASS, // classes are interleaved, the files of a class are shuffled
+    ACCESS             // the order of PackOptions::access, the files it does not list follow sorted
+};
+
+struct PackOptions {
+    ImageOptions  image       = {1024 * 1024}; // large nodes, walking the btrees takes fewer reads
+    PackOrder     order       = PackOrder::SHUFFLED_BY_CLASS;
+    uint64_t      inline_size = 1024; // files up to this size are stored in their key
+    Array<String> access;             // paths relative to the root, in the order they are read
+};
+
+// Regular files below root, relative to root and sorted
+Array<String> list_files(String const &root);
+
+// Physical order of the files, as indices into files
+Array<uint64_t> pack_order(Array<String> const &files, PackOptions const &options);
+
+// files are relative to root
+bool pack_image(String const &path, String const &root, Array<String> const &files, PackOptions const &options = {});
+
+#endif
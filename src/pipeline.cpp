@@ -0,0 +1,198 @@
+#include "pipeline.h"
+#include "checksum.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <memory>
+
+// a stage waiting here is starved, a stage waiting in push is stalled by backpressure
+static bool wait_pop(BoundedQueue<Sample> &queue, Sample &sample) {
+    TRACE_SPAN("queue_pop");
+    return queue.pop(sample);
+}
+
+static bool wait_push(BoundedQueue<Sample> &queue, Sample &sample) {
+    TRACE_SPAN("queue_push");
+    return queue.push(std::move(sample));
+}
+
+Pipeline::Pipeline(BCacheFSReader const &reader, Array<uint64_t> inodes, PipelineOptions options):
+    _reader(reader), _inodes(std::move(inodes)), _options(std::move(options)), _request_count(_inodes.size()),
+    _found(_options.queue_size), _loaded(_options.queue_size), _ready(_options.queue_size) {
+    start();
+}
+
+Pipeline::Pipeline(BCacheFSReader const &reader, Manifest const &manifest, Array<std::string_view> paths,
+                   PipelineOptions options):
+    _reader(reader),
+    _manifest(&manifest), _paths(std::move(paths)), _options(std::move(options)), _request_count(_paths.size()),
+    _found(_options.queue_size), _loaded(_options.queue_size), _ready(_options.queue_size) {
+    start();
+}
+
+Pipeline::~Pipeline() {
+    // unblock the producers waiting on a full queue
+    _found.close();
+    _loaded.close();
+    _ready.close();
+
+    for (auto &thread: _threads) {
+        thread.join();
+    }
+}
+
+bool Pipeline::next(Sample &sample) { return wait_pop(_ready, sample); }
+
+bool Pipeline::lookup(Sample &sample, Inode const *inode) const {
+    if (_manifest == nullptr) {
+        sample.inode   = inode->inode;
+        sample.extents = _reader.file_extents(*inode, 0, sample.size);
+        return true;
+    }
+
+    auto file = _manifest->find(_paths[sample.index]);
+    if (file < 0) {
+        warn("{} not found in the manifest", _paths[sample.index]);
+        return false;
+    }
+
+    auto &entry  = _manifest->file(file);
+    sample.inode = entry.inode;
+    sample.size  = entry.size;
+
+    for (auto ext = _manifest->extents_begin(file); ext != _manifest->extents_end(file); ++ext) {
+        sample.extents.push_back({entry.inode, ext->file_offset, ext->offset, ext->size});
+    }
+    return true;
+}
+
+bool Pipeline::verify(Sample const &sample, Array<uint8_t> &scratch) const {
+    TRACE_SPAN("verify");
+    ExtentChecksum const *previous = nullptr;
+
+    for (auto &ext: sample.extents) {
+        auto &checksum = ext.checksum;
+        if (checksum.type == BCH_CSUM_none) {
+            continue;
+        }
+
+        // the pieces of a split extent share their checksum
+        if (previous != nullptr && previous->offset == checksum.offset && previous->size == checksum.size) {
+            continue;
+        }
+        previous = &checksum;
+
+        // the checksum covers the whole region of the extent on disk, only check in place when it was read entirely
+        uint8_t const *data = nullptr;
+        if (ext.offset == checksum.offset && ext.size == checksum.size && ext.file_offset + ext.size <= sample.size) {
+            data = sample.data.data() + ext.file_offset;
+        } else {
+            scratch.resize(checksum.size);
+            if (_reader.read(checksum.offset, scratch.data(), checksum.size) != checksum.size) {
+                warn("sample {}: short read of the extent at {}", sample.index, checksum.offset);
+                return false;
+            }
+            data = scratch.data();
+        }
+
+        if (!verify_checksum(checksum.type, checksum.csum, data, checksum.size)) {
+            warn("sample {}: checksum mismatch of the extent at {}", sample.index, checksum.offset);
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Fun>
+void Pipeline::spawn(unsigned count, BoundedQueue<Sample> &output, Fun worker) {
+    count        = std::max(1u, count);
+    auto running = std::make_shared<std::atomic<unsigned>>(count);
+
+    for (unsigned i = 0; i < count; ++i) {
+        _threads.emplace_back([this, running, &output, worker]() {
+            worker();
+
+            if (running->fetch_sub(1) == 1) {
+                output.close();
+            }
+        });
+    }
+}
+
+void Pipeline::start() {
+    debug("pipeline of {} samples, threads: {} lookup, {} read, {} transform", _request_count,
+          _options.lookup_threads, _options.read_threads, _options.transform_threads);
+
+    spawn(_options.lookup_threads, _found, [this]() {
+        Array<Inode> found;
+
+        for (;;) {
+            auto begin = _next_request.fetch_add(PIPELINE_LOOKUP_BATCH, std::memory_order_relaxed);
+            if (begin >= _request_count) {
+                return;
+            }
+            auto end = std::min<uint64_t>(begin + PIPELINE_LOOKUP_BATCH, _request_count);
+
+            // the inodes of the batch share the scans of the inodes btree
+            if (_manifest == nullptr) {
+                found = _reader.find_inodes(Array<uint64_t>(_inodes.begin() + begin, _inodes.begin() + end));
+            }
+
+            for (auto index = begin; index < end; ++index) {
+                Sample sample;
+                sample.index = index;
+
+                auto inode = _manifest == nullptr ? &found[index - begin] : nullptr;
+                if (lookup(sample, inode) && !wait_push(_found, sample)) {
+                    return;
+                }
+            }
+        }
+    });
+
+    spawn(_options.read_threads, _loaded, [this]() {
+        Sample              sample;
+        Array<BatchSegment> segments;
+
+        while (wait_pop(_found, sample)) {
+            sample.data.assign(sample.size, 0);
+            segments.clear();
+
+            // extents are sector aligned, the last one can go past the end of the file
+            for (auto &ext: sample.extents) {
+                if (ext.file_offset < sample.size) {
+                    segments.push_back({ext.offset, std::min(ext.size, sample.size - ext.file_offset),
+                                        sample.data.data() + ext.file_offset});
+                }
+            }
+
+            read_segments(_reader, segments, _options.batch);
+
+            if (!wait_push(_loaded, sample)) {
+                return;
+            }
+        }
+    });
+
+    spawn(_options.transform_threads, _ready, [this]() {
+        Sample         sample;
+        Array<uint8_t> scratch;
+
+        while (wait_pop(_loaded, sample)) {
+            TRACE_SPAN("transform");
+
+            if (_options.verify && !verify(sample, scratch)) {
+                continue;
+            }
+
+            if (_options.transform && !_options.transform(sample)) {
+                debug("sample {} dropped", sample.index);
+                continue;
+            }
+
+            if (!wait_push(_ready, sample)) {
+                return;
+            }
+        }
+    });
+}
@@ -0,0 +1,105 @@
+#ifndef BCACHE_FS_SRC_PIPELINE_HEADER
+#define BCACHE_FS_SRC_PIPELINE_HEADER
+
+#include "batch.h"
+#include "bcachefs.h"
+#include "manifest.h"
+#include "queue.h"
+
+#include <atomic>
+#include <functional>
+#include <string_view>
+#include <thread>
+
+// Sample pipeline
+// -------------------------------------------------------------------
+//  Fetch samples with a fixed number of threads per stage
+//
+//      lookup      find the extents of the sample (btree or manifest)
+//      read        read the extents with merged preadv
+//      transform   verify the crc of the extents, then the user transform
+//      deliver     next() hands the samples to the consumer
+//
+//  Stages are connected by bounded queues, a slow consumer stalls the
+//  stages before it instead of buffering the whole dataset.
+//  Samples are delivered in the order they complete, Sample::index is
+//  their position in the request.
+//
+//  Samples whose data does not match the checksum of their extents are
+//  dropped. Extents found through the manifest carry no checksum and are
+//  not verified.
+//
+#define PIPELINE_LOOKUP_BATCH 64 // requests claimed at once by a lookup thread, their inodes are found together
+
+struct Sample {
+    uint64_t       index = 0;
+    uint64_t       inode = 0;
+    uint64_t       size  = 0;
+    Array<Extend>  extents;
+    Array<uint8_t> data;
+};
+
+struct PipelineOptions {
+    unsigned    lookup_threads    = 1;
+    unsigned    read_threads      = 4;
+    unsigned    transform_threads = 1;
+    std::size_t queue_size        = 256;
+
+    BatchOptions batch;
+
+    // check the crc of the extents before the transform
+    bool verify = true;
+
+    // called by the transform threads, returning false drops the sample
+    std::function<bool(Sample &)> transform;
+};
+
+struct Pipeline {
+    public:
+    // fetch the files by inode
+    Pipeline(BCacheFSReader const &reader, Array<uint64_t> inodes, PipelineOptions options = {});
+
+    // fetch the files by path
+    Pipeline(BCacheFSReader const &reader, Manifest const &manifest, Array<std::string_view> paths,
+             PipelineOptions options = {});
+
+    // stop the threads, samples not delivered yet are discarded
+    ~Pipeline();
+
+    Pipeline(Pipeline const &) = delete;
+    Pipeline &operator=(Pipeline const &) = delete;
+
+    // wait for the next sample, false once every sample was delivered
+    bool next(Sample &sample);
+
+    private:
+    void start();
+
+    // inode is the inode of the sample when fetching by inode, null with a manifest
+    bool lookup(Sample &sample, Inode const *inode) const;
+
+    // false if an extent does not match its checksum
+    bool verify(Sample const &sample, Array<uint8_t> &scratch) const;
+
+    // run worker in count threads, close output once all of them returned
+    template <typename Fun>
+    void spawn(unsigned count, BoundedQueue<Sample> &output, Fun worker);
+
+    private:
+    BCacheFSReader const &  _reader;
+    Manifest const *        _manifest = nullptr;
+    Array<uint64_t>         _inodes;
+    Array<std::string_view> _paths;
+    PipelineOptions         _options;
+
+    std::atomic<uint64_t> _next_request{0};
+    uint64_t              _request_count = 0;
+
+    BoundedQueue<Sample> _found;
+    BoundedQueue<Sample> _loaded;
+    BoundedQueue<Sample> _ready;
+
+    Array<std::thread> _threads;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef BCACHE_FS_SRC_QUEUE_HEADER
+#define BCACHE_FS_SRC_QUEUE_HEADER
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+// Bounded queue
+// -------------------------------------------------------------------
+//  Lock free multi producer multi consumer queue (Dmitry Vyukov's bounded
+//  queue). Every cell carries a sequence number telling if it is ready to
+//  be written or read for the current lap, producers and consumers only
+//  contend on their own position.
+//
+//  push and pop wait while the queue is full or empty which gives the
+//  backpressure between the stages of a pipeline. Once closed, push fails
+//  and pop fails when the queue is empty.
+//
+template <typename T>
+struct BoundedQueue {
+    public:
+    // capacity is rounded up to a power of 2
+    BoundedQueue(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+
+        _mask  = size - 1;
+        _cells = std::make_unique<Cell[]>(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(BoundedQueue const &) = delete;
+    BoundedQueue &operator=(BoundedQueue const &) = delete;
+
+    bool try_push(T &value) {
+        auto  pos = _enqueue.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        for (;;) {
+            cell      = &_cells[pos & _mask];
+            auto seq  = cell->seq.load(std::memory_order_acquire);
+            auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+
+            if (diff == 0) {
+                if (_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = _enqueue.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = std::move(value);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &value) {
+        auto  pos = _dequeue.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        for (;;) {
+            cell      = &_cells[pos & _mask];
+            auto seq  = cell->seq.load(std::memory_order_acquire);
+            auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+
+            if (diff == 0) {
+                if (_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = _dequeue.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->data);
+        cell->seq.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // wait until there is room, false if the queue was closed
+    bool push(T value) {
+        for (int attempt = 0; !_closed.load(std::memory_order_acquire); ++attempt) {
+            if (try_push(value)) {
+                return true;
+            }
+            backoff(attempt);
+        }
+        return false;
+    }
+
+    // wait for a value, false if the queue is closed and empty
+    bool pop(T &value) {
+        for (int attempt = 0;; ++attempt) {
+            if (try_pop(value)) {
+                return true;
+            }
+
+            if (_closed.load(std::memory_order_acquire)) {
+                // a value might have been pushed right before closing
+                return try_pop(value);
+            }
+            backoff(attempt);
+        }
+    }
+
+    void close() { _closed.store(true, std::memory_order_release); }
+
+    bool closed() const { return _closed.load(std::memory_order_acquire); }
+
+    private:
+    // spin a little, then yield, then sleep so idle stages do not burn a core
+    static void backoff(int attempt) {
+        if (attempt < 64) {
+            return;
+        }
+        if (attempt < 128) {
+            std::this_thread::yield();
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    private:
+    struct Cell {
+        std::atomic<std::size_t> seq;
+        T                        data;
+    };
+
+    std::size_t             _mask = 0;
+    std::unique_ptr<Cell[]> _cells;
+
+    alignas(64) std::atomic<std::size_t> _enqueue{0};
+    alignas(64) std::atomic<std::size_t> _dequeue{0};
+    alignas(64) std::atomic<bool> _closed{false};
+};
+
+#endif
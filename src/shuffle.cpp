@@ -0,0 +1,93 @@
+#include "shuffle.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <numeric>
+
+EpochShuffler::EpochShuffler(Array<uint64_t> const &offsets, ShuffleOptions const &options): _options(options) {
+    make_windows(offsets);
+}
+
+EpochShuffler::EpochShuffler(Manifest const &manifest, ShuffleOptions const &options): _options(options) {
+    Array<uint64_t> offsets(manifest.size());
+
+    for (uint64_t i = 0; i < manifest.size(); ++i) {
+        auto ext   = manifest.extents_begin(i);
+        offsets[i] = ext != manifest.extents_end(i) ? ext->offset : 0;
+    }
+
+    make_windows(offsets);
+}
+
+void EpochShuffler::make_windows(Array<uint64_t> const &offsets) {
+    _options.window_size = std::max<uint64_t>(_options.window_size, 1);
+    _options.interleave  = std::max<uint64_t>(_options.interleave, 1);
+
+    _samples.resize(offsets.size());
+    std::iota(_samples.begin(), _samples.end(), 0);
+
+    // stable so samples without data keep their relative order
+    std::stable_sort(_samples.begin(), _samples.end(), [&](uint64_t a, uint64_t b) {
+        return offsets[a] < offsets[b];
+    });
+
+    debug("{} samples in {} windows", _samples.size(),
+          (_samples.size() + _options.window_size - 1) / _options.window_size);
+}
+
+Array<uint64_t> EpochShuffler::epoch(uint64_t epoch) const {
+    auto const window_size = _options.window_size;
+    auto const count       = (_samples.size() + window_size - 1) / window_size;
+
+    SplitMix64 rng{_options.seed ^ (epoch * 0xd1b54a32d192ed03ULL)};
+
+    Array<uint64_t> samples = _samples;
+    Array<uint64_t> windows(count);
+    std::iota(windows.begin(), windows.end(), 0);
+
+    fisher_yates(windows.data(), windows.data() + windows.size(), rng);
+
+    for (uint64_t w = 0; w < count; ++w) {
+        auto begin = samples.data() + w * window_size;
+        auto end   = samples.data() + std::min<uint64_t>((w + 1) * window_size, samples.size());
+        fisher_yates(begin, end, rng);
+    }
+
+    // round robin over the active windows, an exhausted window is replaced by the next one
+    struct Cursor {
+        uint64_t pos;
+        uint64_t end;
+    };
+
+    Array<uint64_t> order;
+    order.reserve(samples.size());
+
+    Array<Cursor> active;
+    uint64_t      next = 0;
+
+    auto open = [&](uint64_t w) {
+        return Cursor{w * window_size, std::min<uint64_t>((w + 1) * window_size, samples.size())};
+    };
+
+    while (next < count && active.size() < _options.interleave) {
+        active.push_back(open(windows[next++]));
+    }
+
+    while (!active.empty()) {
+        for (std::size_t i = 0; i < active.size();) {
+            auto &cursor = active[i];
+            order.push_back(samples[cursor.pos++]);
+
+            if (cursor.pos < cursor.end) {
+                i += 1;
+            } else if (next < count) {
+                cursor = open(windows[next++]);
+                i += 1;
+            } else {
+                active.erase(active.begin() + i);
+            }
+        }
+    }
+
+    return order;
+}
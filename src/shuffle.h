@@ -0,0 +1,72 @@
+#ifndef BCACHE_FS_SRC_SHUFFLE_HEADER
+#define BCACHE_FS_SRC_SHUFFLE_HEADER
+
+#include "bcachefs.h"
+#include "manifest.h"
+
+// Epoch shuffler
+// -------------------------------------------------------------------
+//  Samples are sorted by their offset on disk and cut into windows of
+//  window_size consecutive samples. Windows are fixed counts of samples,
+//  they are not split at the gaps between the samples on disk: a window
+//  can span a large gap and reads through it are not merged. Every epoch
+//  the order of the windows is shuffled as well as the samples inside
+//  each window, then interleave windows are read at the same time in a
+//  round robin. Reads stay mostly sequential while the order is random
+//  enough for SGD.
+//
+//  The order only depends on the seed and the epoch, the shuffle does not
+//  rely on the standard library distributions which differ between
+//  implementations.
+//
+
+// Portable generator, the same seed gives the same sequence everywhere
+struct SplitMix64 {
+    uint64_t state;
+
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z          = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, n), multiply shift (Lemire) without the rejection step
+    uint64_t below(uint64_t n) { return uint64_t(((unsigned __int128)(*this)() * n) >> 64); }
+};
+
+template <typename T>
+void fisher_yates(T *begin, T *end, SplitMix64 &rng) {
+    for (auto n = uint64_t(end - begin); n > 1; --n) {
+        std::swap(begin[n - 1], begin[rng.below(n)]);
+    }
+}
+
+struct ShuffleOptions {
+    uint64_t window_size = 256; // samples per window
+    uint64_t interleave  = 4;   // windows read at the same time
+    uint64_t seed        = 0;
+};
+
+struct EpochShuffler {
+    public:
+    // offsets[i] is the offset on disk of the sample i
+    EpochShuffler(Array<uint64_t> const &offsets, ShuffleOptions const &options = {});
+
+    // samples are the files of the manifest
+    EpochShuffler(Manifest const &manifest, ShuffleOptions const &options = {});
+
+    // order in which the samples should be read during the epoch
+    Array<uint64_t> epoch(uint64_t epoch) const;
+
+    uint64_t size() const { return _samples.size(); }
+
+    private:
+    void make_windows(Array<uint64_t> const &offsets);
+
+    private:
+    ShuffleOptions  _options;
+    Array<uint64_t> _samples; // sorted by disk offset
+};
+
+#endif
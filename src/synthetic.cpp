@@ -0,0 +1,236 @@
+#include "synthetic.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+constexpr uint64_t GOLDEN = 0x9E3779B97F4A7C15ULL;
+
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// uniform in [0, 1)
+double unit(uint64_t x) { return (double)(mix64(x) >> 11) * 0x1.0p-53; }
+
+uint64_t round_up(uint64_t value, uint64_t align) { return (value + align - 1) / align * align; }
+} // namespace
+
+uint64_t synthetic_directory_count(SyntheticOptions const &options) {
+    if (options.files_per_dir == 0) {
+        return 0;
+    }
+    return (options.file_count + options.files_per_dir - 1) / options.files_per_dir;
+}
+
+uint64_t synthetic_file_size(SyntheticOptions const &options, uint64_t i) {
+    auto seed = mix64(options.image.seed ^ (i * GOLDEN + 1));
+    auto min  = std::min(options.min_size, options.max_size);
+    auto max  = options.max_size;
+
+    switch (options.distribution) {
+    case SizeDistribution::FIXED:
+        return options.median_size;
+
+    case SizeDistribution::UNIFORM:
+        return min + (uint64_t)(unit(seed) * (double)(max - min + 1));
+
+    case SizeDistribution::LOGNORMAL: {
+        // Box-Muller
+        auto u1   = unit(seed);
+        auto u2   = unit(seed + GOLDEN);
+        auto z    = std::sqrt(-2.0 * std::log(1.0 - u1)) * std::cos(2.0 * M_PI * u2);
+        auto size = (double)options.median_size * std::exp(options.sigma * z);
+
+        return std::clamp((uint64_t)std::min(size, (double)max), min, max);
+    }
+    }
+    return 0;
+}
+
+uint64_t synthetic_file_inode(SyntheticOptions const &options, uint64_t i) {
+    return BCACHEFS_ROOT_INO + 1 + synthetic_directory_count(options) + i;
+}
+
+String synthetic_file_path(SyntheticOptions const &options, uint64_t i) {
+    if (options.files_per_dir == 0) {
+        return fmt::format("/f{:08}", i);
+    }
+    return fmt::format("/d{:08}/f{:08}", i / options.files_per_dir, i);
+}
+
+void synthetic_file_content(uint64_t inode, uint64_t offset, uint8_t *out, uint64_t size) {
+    uint64_t i = 0;
+
+    while (i < size) {
+        auto word  = mix64(inode * GOLDEN + (offset + i) / 8);
+        auto shift = (offset + i) % 8;
+        auto n     = std::min<uint64_t>(8 - shift, size - i);
+
+        memcpy(out + i, (uint8_t const *)&word + shift, n);
+        i += n;
+    }
+}
+
+bool write_synthetic_image(String const &path, SyntheticOptions const &options) {
+    auto max_inline = (0xFF - BKEY_U64s) * BCH_U64S_SIZE;
+    if (options.inline_size > max_inline) {
+        error("inline data is limited to {} bytes", max_inline);
+        return false;
+    }
+
+    if (options.overwrites && options.image.bsets < 2) {
+        error("overwrites need at least 2 bsets per node");
+        return false;
+    }
+
+    ImageWriter image(path, options.image);
+    if (!image.valid()) {
+        return false;
+    }
+
+    // write the older version of the keys added by add
+    auto older = [&](auto add) {
+        if (!options.overwrites) {
+            return true;
+        }
+        image.set_older(true);
+        auto ok = add();
+        image.set_older(false);
+        return ok;
+    };
+
+    auto block = options.image.block_size;
+    auto dirs  = synthetic_directory_count(options);
+
+    auto is_inline = [&](uint64_t size) { return size <= options.inline_size; };
+
+    Array<uint8_t> chunk(1024 * 1024);
+
+    // 1. Data, files are contiguous and block aligned
+    auto data_start = image.reserve(0, block);
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto size  = synthetic_file_size(options, i);
+        auto inode = synthetic_file_inode(options, i);
+
+        if (size == 0 || is_inline(size)) {
+            continue;
+        }
+
+        if (!options.fill) {
+            image.reserve(size, block);
+            continue;
+        }
+
+        for (uint64_t offset = 0; offset < size; offset += chunk.size()) {
+            auto n = std::min<uint64_t>(chunk.size(), size - offset);
+            synthetic_file_content(inode, offset, chunk.data(), n);
+            image.append(chunk.data(), n, offset == 0 ? block : 1);
+        }
+    }
+
+    // 2. Extents, the offsets of the data are recomputed the same way
+    uint64_t extent_size = options.extent_size > 0 ? round_up(options.extent_size, block) : ~0ULL;
+    auto     offset      = data_start;
+
+    for (uint64_t i = 0; i < options.file_count && image.valid(); ++i) {
+        auto size  = synthetic_file_size(options, i);
+        auto inode = synthetic_file_inode(options, i);
+
+        if (size == 0) {
+            continue;
+        }
+
+        if (is_inline(size)) {
+            synthetic_file_content(inode, 0, chunk.data(), size);
+
+            auto stale = [&]() {
+                Array<uint8_t> data(chunk.begin(), chunk.begin() + (std::ptrdiff_t)size);
+                for (auto &byte: data) {
+                    byte = (uint8_t)~byte;
+                }
+                return image.add_inline_data(inode, data.data(), size);
+            };
+
+            if (!older(stale) || !image.add_inline_data(inode, chunk.data(), size)) {
+                return false;
+            }
+            continue;
+        }
+
+        for (uint64_t file_offset = 0; file_offset < size; file_offset += extent_size) {
+            auto n     = std::min(extent_size, size - file_offset);
+            auto stale = [&]() { return image.add_extent(inode, file_offset, offset + file_offset + block, n); };
+
+            if (!older(stale) || !image.add_extent(inode, file_offset, offset + file_offset, n)) {
+                return false;
+            }
+        }
+        offset += round_up(size, block);
+    }
+
+    // 3. Inodes, the root then the directories and the files
+    auto add_inode = [&](uint64_t inode, uint16_t mode, uint64_t size, uint32_t nlink) {
+        return older([&]() { return image.add_inode(inode, mode, size + 1, nlink); }) &&
+               image.add_inode(inode, mode, size, nlink);
+    };
+
+    bool ok = add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, (uint32_t)(2 + dirs));
+
+    for (uint64_t k = 0; k < dirs && ok; ++k) {
+        ok = add_inode(BCACHEFS_ROOT_INO + 1 + k, S_IFDIR | 0755, 0, 2);
+    }
+
+    for (uint64_t i = 0; i < options.file_count && ok; ++i) {
+        ok = add_inode(synthetic_file_inode(options, i), S_IFREG | 0644, synthetic_file_size(options, i), 1);
+    }
+
+    if (!ok) {
+        return false;
+    }
+
+    // 4. Dirents
+    auto file_name = [&](uint64_t i) { return fmt::format("f{:08}", i); };
+    auto file_ino  = [&](uint64_t i) { return synthetic_file_inode(options, i); };
+    auto dir_ino   = [](uint64_t k) { return BCACHEFS_ROOT_INO + 1 + k; };
+    auto regular   = [](uint64_t) { return DT_REG; };
+
+    // the older dirents point to the next inode
+    auto stale = [&](auto inode) {
+        return [&options, inode](uint64_t j) { return options.overwrites ? inode(j) + 1 : 0; };
+    };
+
+    if (dirs == 0) {
+        ok = add_directory(image, BCACHEFS_ROOT_INO, options.file_count, file_name, file_ino, regular, stale(file_ino));
+    } else {
+        ok = add_directory(
+            image, BCACHEFS_ROOT_INO, dirs, [](uint64_t k) { return fmt::format("d{:08}", k); }, dir_ino,
+            [](uint64_t) { return DT_DIR; }, stale(dir_ino));
+    }
+
+    for (uint64_t k = 0; k < dirs && ok; ++k) {
+        auto first = k * options.files_per_dir;
+        auto count = std::min(options.files_per_dir, options.file_count - first);
+        auto inode = [&](uint64_t j) { return file_ino(first + j); };
+
+        ok = add_directory(
+            image, dir_ino(k), count, [&](uint64_t j) { return file_name(first + j); }, inode, regular, stale(inode));
+    }
+
+    if (!ok || !image.finish()) {
+        return false;
+    }
+
+    info("synthetic image with {} files in {} directories", options.file_count, dirs);
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef BCACHE_FS_SRC_SYNTHETIC_HEADER
+#define BCACHE_FS_SRC_SYNTHETIC_HEADER
+
+#include "image_writer.h"
+
+// Synthetic images
+// -------------------------------------------------------------------
+//  Images with a known content for benchmarks and tests, everything is
+//  derived from the seed and the index of the file so the same options
+//  always produce the same image and nothing is kept in memory per file.
+//
+//  The files are spread over directories below the root:
+//
+//      /d00000000/f00000000
+//      /d00000000/f00000001
+//      ...
+//
+//  Directory k is inode BCACHEFS_ROOT_INO + 1 + k, the files follow the
+//  directories. The data of the files is written in inode order before
+//  the btree nodes.
+//
+//  With overwrites every key is preceded by an older version in the first
+//  bset of its node, as left by updates that were not compacted yet: the
+//  extents point at the data of the next block, the inodes are one byte
+//  bigger and the dirents point to the next inode.
+//
+enum class SizeDistribution
+{
+    FIXED,    // every file is median_size bytes
+    UNIFORM,  // uniform in [min_size, max_size]
+    LOGNORMAL // log-normal around median_size, clamped to [min_size, max_size]
+};
+
+struct SyntheticOptions {
+    ImageOptions     image;
+    uint64_t         file_count    = 1000;
+    uint64_t         files_per_dir = 1000; // 0 puts every file in the root directory
+    SizeDistribution distribution  = SizeDistribution::LOGNORMAL;
+    uint64_t         min_size      = 0;
+    uint64_t         max_size      = 1024 * 1024;
+    uint64_t         median_size   = 64 * 1024;
+    double           sigma         = 1.0;
+    uint64_t         inline_size   = 0;    // files up to this size are stored in their key
+    uint64_t         extent_size   = 0;    // files are split into extents of this size, 0 for one extent per file
+    bool             fill          = true; // write the content of the files, holes are faster to write
+    bool             overwrites    = false; // every key overwrites an older version with a wrong value, needs 2 bsets
+};
+
+uint64_t synthetic_directory_count(SyntheticOptions const &options);
+
+// size in bytes of the file i
+uint64_t synthetic_file_size(SyntheticOptions const &options, uint64_t i);
+
+uint64_t synthetic_file_inode(SyntheticOptions const &options, uint64_t i);
+
+String synthetic_file_path(SyntheticOptions const &options, uint64_t i);
+
+// content of a file, it only depends on its inode and the offset
+void synthetic_file_content(uint64_t inode, uint64_t offset, uint8_t *out, uint64_t size);
+
+bool write_synthetic_image(String const &path, SyntheticOptions const &options);
+
+#endif
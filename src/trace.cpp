@@ -0,0 +1,159 @@
+#include "trace.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> trace_enabled{false};
+
+namespace {
+// written by a single thread, count is published after the event (and its chunk) is written
+// the chunk table never grows so it can be read while events are recorded
+struct TraceBuffer {
+    TraceBuffer(std::size_t capacity, uint64_t generation):
+        chunks((capacity + TRACE_CHUNK_EVENTS - 1) / TRACE_CHUNK_EVENTS), generation(generation) {}
+
+    TraceEvent &event(std::size_t i) { return chunks[i / TRACE_CHUNK_EVENTS][i % TRACE_CHUNK_EVENTS]; }
+
+    std::vector<std::unique_ptr<TraceEvent[]>> chunks;
+    std::atomic<std::size_t>                   count{0};
+    std::atomic<uint64_t>                      dropped{0};
+    uint64_t                                   generation;
+    uint64_t                                   tid = (uint64_t)syscall(SYS_gettid);
+};
+
+struct TraceState {
+    std::mutex                                mutex;
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    std::size_t                               capacity = 0;
+    std::atomic<uint64_t>                     generation{0};
+    std::atomic<int64_t>                      origin{0}; // steady clock in ns
+};
+
+int64_t steady_ns() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+TraceState &state() {
+    static TraceState trace;
+    return trace;
+}
+
+TraceBuffer *local_buffer() {
+    thread_local std::shared_ptr<TraceBuffer> buffer;
+
+    // a new trace was started, the old buffer belongs to the previous one
+    auto &trace      = state();
+    auto  generation = trace.generation.load(std::memory_order_acquire);
+
+    if (!buffer || buffer->generation != generation) {
+        std::lock_guard<std::mutex> lock(trace.mutex);
+        buffer = std::make_shared<TraceBuffer>(trace.capacity, generation);
+        trace.buffers.push_back(buffer);
+    }
+    return buffer.get();
+}
+} // namespace
+
+uint64_t trace_now() {
+    auto elapsed = steady_ns() - state().origin.load(std::memory_order_relaxed);
+
+    // 0 means the span was not started
+    return (uint64_t)std::max<int64_t>(1, elapsed);
+}
+
+void trace_start(std::size_t capacity) {
+    auto &trace = state();
+    {
+        std::lock_guard<std::mutex> lock(trace.mutex);
+        trace.buffers.clear();
+        trace.capacity = capacity;
+        trace.origin.store(steady_ns(), std::memory_order_relaxed);
+    }
+
+    trace.generation.fetch_add(1, std::memory_order_release);
+    trace_enabled.store(true, std::memory_order_release);
+}
+
+void trace_stop() { trace_enabled.store(false, std::memory_order_release); }
+
+void trace_record(char const *name, uint64_t start, uint64_t end) {
+    auto buffer = local_buffer();
+    auto count  = buffer->count.load(std::memory_order_relaxed);
+
+    auto chunk  = count / TRACE_CHUNK_EVENTS;
+
+    if (chunk >= buffer->chunks.size()) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (!buffer->chunks[chunk]) {
+        buffer->chunks[chunk] = std::make_unique<TraceEvent[]>(TRACE_CHUNK_EVENTS);
+    }
+
+    buffer->event(count) = TraceEvent{name, start, end - start};
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+bool trace_dump(std::string const &path) {
+    auto &trace = state();
+
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(trace.mutex);
+        buffers = trace.buffers;
+    }
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        error("could not open {}", path);
+        return false;
+    }
+
+    fmt::memory_buffer out;
+    auto               it      = std::back_inserter(out);
+    bool               first   = true;
+    uint64_t           total   = 0;
+    uint64_t           dropped = 0;
+
+    fmt::format_to(it, "{{\"traceEvents\": [\n");
+
+    for (auto &buffer: buffers) {
+        auto count = buffer->count.load(std::memory_order_acquire);
+        total += count;
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            auto &event = buffer->event(i);
+
+            // complete events, timestamps are in microseconds
+            fmt::format_to(it, "{}{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": {}, \"tid\": {}, ", first ? "" : ",\n",
+                           event.name, getpid(), buffer->tid);
+            fmt::format_to(it, "\"ts\": {:.3f}, \"dur\": {:.3f}}}", (double)event.start * 1e-3,
+                           (double)event.duration * 1e-3);
+            first = false;
+
+            if (out.size() > (1 << 20)) {
+                fwrite(out.data(), 1, out.size(), file);
+                out.clear();
+            }
+        }
+    }
+
+    // events past the capacity are counted next to the events, trace viewers ignore otherData
+    fmt::format_to(it, "\n], \"otherData\": {{\"events\": {}, \"dropped\": {}}}}}\n", total, dropped);
+    fwrite(out.data(), 1, out.size(), file);
+
+    bool ok = ferror(file) == 0;
+    fclose(file);
+
+    info("{} trace events written to {} ({} dropped)", total, path, dropped);
+    return ok;
+}
@@ -0,0 +1,75 @@
+#ifndef BCACHE_FS_SRC_TRACE_HEADER
+#define BCACHE_FS_SRC_TRACE_HEADER
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Tracer
+// -------------------------------------------------------------------
+//  Records spans (name, start, duration) in a buffer owned by each thread
+//  and dumps them in the Chrome trace event format, which can be opened
+//  with chrome://tracing or https://ui.perfetto.dev
+//
+//      trace_start();
+//      ...
+//      trace_stop();
+//      trace_dump("trace.json");
+//
+//  When tracing is disabled a span costs a relaxed load. The buffer of a
+//  thread grows by chunks of TRACE_CHUNK_EVENTS as spans are recorded,
+//  events past the capacity of the trace are dropped, their count is
+//  written in otherData.dropped.
+//
+#define TRACE_CHUNK_EVENTS 4096
+
+struct TraceEvent {
+    char const *name; // string literal
+    uint64_t    start; // ns since trace_start
+    uint64_t    duration;
+};
+
+extern std::atomic<bool> trace_enabled;
+
+// events per thread, rounded up to a whole chunk
+void trace_start(std::size_t capacity = 1 << 20);
+
+void trace_stop();
+
+// write the events recorded since trace_start, returns false if the file could not be written
+bool trace_dump(std::string const &path);
+
+uint64_t trace_now();
+
+void trace_record(char const *name, uint64_t start, uint64_t end);
+
+struct TraceSpan {
+    TraceSpan(char const *name): _name(name) {
+        if (trace_enabled.load(std::memory_order_relaxed)) {
+            _start = trace_now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (_start != 0) {
+            trace_record(_name, _start, trace_now());
+        }
+    }
+
+    TraceSpan(TraceSpan const &) = delete;
+    TraceSpan &operator=(TraceSpan const &) = delete;
+
+    private:
+    char const *_name;
+    uint64_t    _start = 0;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+
+// Trace the rest of the current scope
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(_trace_span_, __LINE__)(name)
+
+#endif
@@ -0,0 +1,168 @@
+#include "walker.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+
+#define NAME_ARENA_CHUNK (1024 * 1024)
+
+std::string_view NameArena::join(std::string_view a, std::string_view b) {
+    auto size = a.empty() ? b.size() : a.size() + 1 + b.size();
+
+    if (size > _left) {
+        // paths longer than a chunk get a chunk of their own
+        auto chunk = std::max<uint64_t>(size, NAME_ARENA_CHUNK);
+        _chunks.push_back(std::make_unique<char[]>(chunk));
+        _cursor = _chunks.back().get();
+        _left   = chunk;
+    }
+
+    auto out = _cursor;
+    if (!a.empty()) {
+        memcpy(_cursor, a.data(), a.size());
+        _cursor[a.size()] = '/';
+        memcpy(_cursor + a.size() + 1, b.data(), b.size());
+    } else {
+        memcpy(_cursor, b.data(), b.size());
+    }
+
+    _cursor += size;
+    _left -= size;
+    _size += size;
+    return std::string_view(out, size);
+}
+
+void NameArena::merge(NameArena &&other) {
+    // moving a chunk does not move its bytes, we keep writing in our current chunk
+    for (auto &chunk: other._chunks) {
+        _chunks.push_back(std::move(chunk));
+    }
+
+    _size += other._size;
+    other._chunks.clear();
+    other._cursor = nullptr;
+    other._left   = 0;
+    other._size   = 0;
+}
+
+namespace {
+struct Directory {
+    std::string_view path;
+    uint64_t         inode;
+};
+
+// Directories left to list, the walk is over once it is empty and no thread is listing
+struct DirectoryStack {
+    public:
+    void push(Array<Directory> &directories) {
+        if (directories.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _directories.insert(_directories.end(), directories.begin(), directories.end());
+        }
+        directories.clear();
+        _ready.notify_all();
+    }
+
+    // the previous directory of the thread is done, false once the walk is over
+    bool pop(Directory &directory, bool done) {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (done) {
+            _active -= 1;
+        }
+
+        _ready.wait(lock, [this]() { return !_directories.empty() || _active == 0; });
+
+        if (_directories.empty()) {
+            lock.unlock();
+            _ready.notify_all();
+            return false;
+        }
+
+        directory = _directories.back();
+        _directories.pop_back();
+        _active += 1;
+        return true;
+    }
+
+    private:
+    std::mutex              _mutex;
+    std::condition_variable _ready;
+    Array<Directory>        _directories;
+    uint64_t                _active = 0; // threads listing a directory
+};
+
+struct Walker {
+    Array<PathEntry> entries;
+    NameArena        names;
+    Array<Directory> found;
+};
+} // namespace
+
+PathTable walk_tree(BCacheFSReader const &reader, WalkOptions const &options) {
+    TRACE_SPAN("walk_tree");
+    auto           threads = std::max(options.threads, 1u);
+    NodeCache      cache(options.nodes);
+    DirectoryStack stack;
+    Array<Walker>  walkers(threads);
+
+    Array<Directory> root = {Directory{std::string_view(), BCACHEFS_ROOT_INO}};
+    stack.push(root);
+
+    auto work = [&](Walker &walker) {
+        Directory      directory;
+        DirectoryEntry entry;
+        bool           done = false;
+
+        while (stack.pop(directory, done)) {
+            auto cursor = reader.readdir(directory.inode, 0, options.snapshot, &cache);
+
+            while (cursor.next(entry)) {
+                auto path = walker.names.join(directory.path, entry.filename());
+                walker.entries.push_back(PathEntry{path, entry.inode, entry.type});
+
+                if (entry.type == DT_DIR) {
+                    walker.found.push_back(Directory{path, entry.inode});
+                }
+            }
+
+            // share the subdirectories once the directory is listed, it takes the lock once
+            stack.push(walker.found);
+            done = true;
+        }
+    };
+
+    Array<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i) {
+        pool.emplace_back(work, std::ref(walkers[i]));
+    }
+    work(walkers[0]);
+
+    for (auto &thread: pool) {
+        thread.join();
+    }
+
+    PathTable   table;
+    std::size_t count = 0;
+    for (auto &walker: walkers) {
+        count += walker.entries.size();
+    }
+
+    table.entries.reserve(count);
+    for (auto &walker: walkers) {
+        table.entries.insert(table.entries.end(), walker.entries.begin(), walker.entries.end());
+        table.names.merge(std::move(walker.names));
+    }
+
+    debug("walked {} entries, {} bytes of paths, {} threads", table.entries.size(), table.names.size(), threads);
+    return table;
+}
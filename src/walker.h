@@ -0,0 +1,60 @@
+#ifndef BCACHE_FS_SRC_WALKER_HEADER
+#define BCACHE_FS_SRC_WALKER_HEADER
+
+#include "bcachefs.h"
+
+#include <memory>
+#include <string_view>
+
+// Directory walker
+// -------------------------------------------------------------------
+//  Lists every entry below BCACHEFS_ROOT_INO with one readdir range scan
+//  per directory. Directories are shared between the threads through a
+//  stack, a thread pushes the subdirectories it finds and pops the next
+//  directory to list so the scans of unrelated directories overlap.
+//
+//  The scans share a NodeCache: the interior nodes are read once and
+//  small directories living in the same leaf do not read it again.
+//
+//  Full paths are written in arenas, one per thread, and moved to the
+//  table once the walk is over. Entries are in no particular order.
+//
+struct WalkOptions {
+    unsigned    threads  = 8;
+    uint32_t    snapshot = 0;
+    std::size_t nodes    = 256; // nodes kept by the cache shared by the scans
+};
+
+struct PathEntry {
+    std::string_view path; // relative to the root, without leading slash
+    uint64_t         inode;
+    uint8_t          type; // DT_*
+};
+
+// Append only storage for strings, the views it returns stay valid until it is destroyed
+struct NameArena {
+    public:
+    // a + "/" + b, b alone if a is empty
+    std::string_view join(std::string_view a, std::string_view b);
+
+    // take the chunks of other, its views stay valid
+    void merge(NameArena &&other);
+
+    // bytes used by the strings
+    uint64_t size() const { return _size; }
+
+    private:
+    Array<std::unique_ptr<char[]>> _chunks;
+    char *                         _cursor = nullptr;
+    uint64_t                       _left   = 0; // bytes left in the last chunk
+    uint64_t                       _size   = 0;
+};
+
+struct PathTable {
+    Array<PathEntry> entries;
+    NameArena        names;
+};
+
+PathTable walk_tree(BCacheFSReader const &reader, WalkOptions const &options = {});
+
+#endif
@@ -0,0 +1,144 @@
+#include "async.h"
+#include "test_image.h"
+
+#include <stdexcept>
+
+namespace {
+Task<int> value(int v) { co_return v; }
+
+Task<int> sum(int n) {
+    int total = 0;
+    for (int i = 1; i <= n; ++i) {
+        total += co_await value(i);
+    }
+    co_return total;
+}
+
+Task<int> fail() {
+    throw std::runtime_error("task failed");
+    co_return 0;
+}
+
+Task<int> offloaded(EventLoop &loop, int v) {
+    co_return co_await loop.offload([v]() { return v * 2; });
+}
+} // namespace
+
+TEST(FrameAllocator, FramesAreRecycledBySizeClass) {
+    auto a = frame_allocate(100);
+    frame_deallocate(a, 100);
+
+    // same size class (128 bytes), the frame comes back from the free list
+    auto b = frame_allocate(120);
+    EXPECT_EQ(a, b);
+
+    // another class does not take it
+    auto c = frame_allocate(300);
+    EXPECT_NE(c, b);
+
+    frame_deallocate(b, 120);
+    frame_deallocate(c, 300);
+
+    // frames bigger than the largest class go to the heap
+    auto big = frame_allocate(1 << 20);
+    ASSERT_NE(big, nullptr);
+    frame_deallocate(big, 1 << 20);
+}
+
+TEST(Task, AwaitsNestedTasks) {
+    EventLoop loop(1);
+    EXPECT_EQ(loop.run(sum(100)), 5050);
+}
+
+TEST(Task, ExceptionsReachTheAwaiter) {
+    EventLoop loop(1);
+
+    auto caught = [&]() -> Task<bool> {
+        try {
+            co_await fail();
+        } catch (std::runtime_error const &) {
+            co_return true;
+        }
+        co_return false;
+    };
+    EXPECT_TRUE(loop.run(caught()));
+
+    // one escaping a spawned task is rethrown by run
+    EXPECT_THROW(loop.run(fail()), std::runtime_error);
+}
+
+TEST(EventLoop, RunsManyCoroutinesOnFewThreads) {
+    EventLoop loop(4);
+
+    int  total = 0;
+    auto task  = [&](int i) -> Task<void> { total += co_await offloaded(loop, i); };
+
+    for (int i = 0; i < 2000; ++i) {
+        loop.spawn(task(i));
+    }
+    loop.run();
+
+    // the coroutines resume on the loop thread, total is not shared with the I/O threads
+    EXPECT_EQ(total, 2000 * 1999);
+}
+
+TEST(EventLoop, IoExceptionsAreRethrownInTheAwaiter) {
+    EventLoop loop(2);
+
+    auto task = [&]() -> Task<int> {
+        co_return co_await loop.offload([]() -> int { throw std::out_of_range("io failed"); });
+    };
+    EXPECT_THROW(loop.run(task()), std::out_of_range);
+
+    // the I/O threads survived
+    EXPECT_EQ(loop.run(offloaded(loop, 21)), 42);
+}
+
+TEST_F(ImageTest, AsyncReaderMatchesTheReader) {
+    auto options       = small_image();
+    options.file_count = 100;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    EventLoop      loop(4);
+    AsyncReader    async(reader, loop);
+
+    Array<Array<uint8_t>> files(options.file_count);
+    auto read = [&](uint64_t i) -> Task<void> {
+        files[i] = co_await async.read_file(synthetic_file_inode(options, i));
+    };
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        loop.spawn(read(i));
+    }
+    loop.run();
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        EXPECT_EQ(files[i], file_content(options, i)) << "file " << i;
+    }
+
+    // lookups
+    auto inode = synthetic_file_inode(options, 3);
+    auto found = loop.run(async.find(BTREE_ID_inodes, POS(0, inode)));
+    ASSERT_TRUE(found);
+    EXPECT_EQ(found.local.p.offset, inode);
+
+    // the cursor returns the keys of the iterator
+    Array<std::pair<uint64_t, uint64_t>> expected;
+    auto                                 iter = reader.iterator(BTREE_ID_extents);
+    for (auto key = iter.next_key(); key != nullptr; key = iter.next_key()) {
+        auto p = iter.local(key).p;
+        expected.emplace_back((uint64_t)p.inode, (uint64_t)p.offset);
+    }
+
+    auto list = [&]() -> Task<Array<std::pair<uint64_t, uint64_t>>> {
+        Array<std::pair<uint64_t, uint64_t>> keys;
+        auto                                 cursor = async.cursor(BTREE_ID_extents);
+
+        for (auto view = co_await cursor.next(); view != nullptr; view = co_await cursor.next()) {
+            keys.emplace_back((uint64_t)view->local.p.inode, (uint64_t)view->local.p.offset);
+        }
+        co_return keys;
+    };
+    EXPECT_EQ(loop.run(list()), expected);
+}
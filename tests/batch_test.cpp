@@ -0,0 +1,142 @@
+#include "batch.h"
+#include "test_image.h"
+
+#include <sys/stat.h>
+
+namespace {
+struct BatchTest: public ImageTest {
+    protected:
+    void SetUp() override {
+        ImageTest::SetUp();
+        ASSERT_TRUE(write_synthetic_image(path, options));
+
+        for (uint64_t i = 0; i < options.file_count; ++i) {
+            inodes.push_back(synthetic_file_inode(options, i));
+        }
+    }
+
+    void expect_content(Array<Array<uint8_t>> const &out) {
+        ASSERT_EQ(out.size(), options.file_count);
+        for (uint64_t i = 0; i < options.file_count; ++i) {
+            EXPECT_EQ(out[i], file_content(options, i)) << "file " << i;
+        }
+    }
+
+    SyntheticOptions options = small_image();
+    Array<uint64_t>  inodes;
+};
+} // namespace
+
+TEST_F(BatchTest, ReadManyReturnsTheFiles) {
+    BCacheFSReader reader(path);
+    ASSERT_TRUE(reader.valid());
+
+    Array<Array<uint8_t>> out;
+    auto                  stats = read_many(reader, inodes, out);
+    expect_content(out);
+
+    // the files are written back to back, most of their extents share a read
+    EXPECT_GT(stats.reads, 0u);
+    EXPECT_LT(stats.reads, options.file_count);
+}
+
+TEST_F(BatchTest, ReadsAreNotMergedAcrossLargeGaps) {
+    BCacheFSReader reader(path);
+
+    BatchOptions options;
+    options.gap = 0;
+
+    Array<Array<uint8_t>> merged;
+    Array<Array<uint8_t>> split;
+    auto                  merged_stats = read_many(reader, inodes, merged);
+    auto                  split_stats  = read_many(reader, inodes, split, options);
+    expect_content(split);
+
+    EXPECT_GT(split_stats.reads, merged_stats.reads);
+    EXPECT_EQ(split_stats.wasted, 0u);
+    EXPECT_EQ(split_stats.bytes - split_stats.wasted, merged_stats.bytes - merged_stats.wasted);
+}
+
+TEST_F(BatchTest, MaxReadBoundsTheMergedReads) {
+    BCacheFSReader reader(path);
+
+    BatchOptions options;
+    options.max_read = 64 * 1024;
+
+    Array<Array<uint8_t>> out;
+    auto                  stats = read_many(reader, inodes, out, options);
+    expect_content(out);
+
+    // a read only goes past max_read when it holds a single extent larger than it
+    EXPECT_GE(stats.reads, stats.bytes / options.max_read);
+}
+
+TEST_F(BatchTest, ReadManyByPathMatchesReadManyByInode) {
+    BCacheFSReader reader(path);
+    auto           manifest_path = path + ".manifest";
+    ASSERT_TRUE(Manifest::build(reader, manifest_path));
+
+    Manifest manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+
+    Array<String>           names;
+    Array<std::string_view> paths;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        names.push_back(synthetic_file_path(options, i));
+    }
+    names.push_back("/missing");
+    for (auto &name: names) {
+        paths.push_back(name);
+    }
+
+    Array<Array<uint8_t>> out;
+    read_many(reader, manifest, paths, out);
+    EXPECT_TRUE(out.back().empty());
+
+    out.pop_back();
+    expect_content(out);
+
+    unlink(manifest_path.c_str());
+}
+
+TEST_F(BatchTest, MissingInodesAreLeftEmpty) {
+    BCacheFSReader reader(path);
+
+    Array<Array<uint8_t>> out;
+    read_many(reader, {inodes[0], inodes.back() + 1000, inodes[1]}, out);
+
+    ASSERT_EQ(out.size(), 3u);
+    EXPECT_EQ(out[0], file_content(options, 0));
+    EXPECT_TRUE(out[1].empty());
+    EXPECT_EQ(out[2], file_content(options, 1));
+}
+
+TEST_F(BatchTest, InodesOfABatchAreFoundTogether) {
+    BCacheFSReader reader(path);
+
+    Array<Array<uint8_t>> out;
+    read_many(reader, inodes, out);
+    expect_content(out);
+
+    // a lookup per file would read the inode leaf once per file
+    auto leaves = reader.metrics().nodes_loaded[BTREE_ID_inodes];
+    EXPECT_GT(leaves, 0u);
+    EXPECT_LT(leaves, options.file_count / 10);
+}
+
+TEST_F(BatchTest, FindInodesMatchesTheLookups) {
+    BCacheFSReader reader(path);
+
+    // unsorted, repeated, missing and far apart inodes
+    Array<uint64_t> wanted = {inodes[7], inodes[0], inodes.back() + 100000, inodes[7], BCACHEFS_ROOT_INO, inodes[3]};
+    auto            found  = reader.find_inodes(wanted);
+    ASSERT_EQ(found.size(), wanted.size());
+
+    for (std::size_t i = 0; i < wanted.size(); ++i) {
+        EXPECT_EQ(found[i].inode, wanted[i]);
+        EXPECT_EQ(found[i].size, reader.file_size(wanted[i])) << wanted[i];
+    }
+    EXPECT_EQ(found[1].size, synthetic_file_size(options, 0));
+    EXPECT_EQ(found[2].size, 0u);
+    EXPECT_TRUE(S_ISDIR(found[4].mode));
+}
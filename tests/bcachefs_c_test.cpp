@@ -0,0 +1,137 @@
+#include "bcachefs_c.h"
+#include "bcachefs.h"
+#include "manifest.h"
+#include "test_image.h"
+
+#include <cstring>
+
+namespace {
+struct CApiTest: public ImageTest {
+    protected:
+    void SetUp() override {
+        ImageTest::SetUp();
+        ASSERT_TRUE(write_synthetic_image(path, options));
+
+        manifest_path = path + ".manifest";
+        BCacheFSReader reader(path);
+        ASSERT_TRUE(Manifest::build(reader, manifest_path));
+    }
+
+    void TearDown() override {
+        unlink(manifest_path.c_str());
+        ImageTest::TearDown();
+    }
+
+    void expect_content(bcachefs_buffer const *buffer, uint64_t i) {
+        ASSERT_NE(buffer, nullptr) << "file " << i;
+
+        auto want = file_content(options, i);
+        auto data = (uint8_t const *)bcachefs_buffer_data(buffer);
+        ASSERT_EQ(bcachefs_buffer_size(buffer), want.size()) << "file " << i;
+        EXPECT_TRUE(want.empty() || memcmp(data, want.data(), want.size()) == 0) << "file " << i;
+    }
+
+    SyntheticOptions options = small_image();
+    String           manifest_path;
+};
+} // namespace
+
+TEST_F(CApiTest, ReadManyReturnsTheFiles) {
+    auto image = bcachefs_open(path.c_str(), nullptr);
+    ASSERT_NE(image, nullptr);
+
+    Array<uint64_t> inodes;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        inodes.push_back(synthetic_file_inode(options, i));
+    }
+    inodes.push_back(inodes.back() + 1000);
+
+    Array<bcachefs_buffer *> out(inodes.size());
+    EXPECT_EQ(bcachefs_read_many(image, inodes.data(), inodes.size(), out.data()), options.file_count);
+    EXPECT_EQ(out.back(), nullptr);
+
+    uint64_t mapped = 0;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        expect_content(out[i], i);
+        mapped += bcachefs_buffer_is_mapped(out[i]);
+    }
+    EXPECT_GT(mapped, 0u);
+
+    for (auto buffer: out) {
+        bcachefs_release(buffer);
+    }
+    bcachefs_close(image);
+}
+
+TEST_F(CApiTest, ReadManyPathsUsesTheManifest) {
+    auto image = bcachefs_open(path.c_str(), manifest_path.c_str());
+    ASSERT_NE(image, nullptr);
+
+    Array<String>       names;
+    Array<char const *> paths;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        names.push_back(synthetic_file_path(options, i));
+    }
+    names.push_back("/missing");
+    for (auto &name: names) {
+        paths.push_back(name.c_str());
+    }
+
+    Array<bcachefs_buffer *> out(paths.size());
+    EXPECT_EQ(bcachefs_read_many_paths(image, paths.data(), paths.size(), out.data()), options.file_count);
+    EXPECT_EQ(out.back(), nullptr);
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        expect_content(out[i], i);
+    }
+
+    for (auto buffer: out) {
+        bcachefs_release(buffer);
+    }
+    bcachefs_close(image);
+}
+
+TEST_F(CApiTest, BuffersKeepTheImageAlive) {
+    auto image = bcachefs_open(path.c_str(), nullptr);
+    ASSERT_NE(image, nullptr);
+
+    uint64_t         inode  = synthetic_file_inode(options, 0);
+    bcachefs_buffer *buffer = nullptr;
+    ASSERT_EQ(bcachefs_read_many(image, &inode, 1, &buffer), 1u);
+
+    bcachefs_close(image);
+    bcachefs_retain(buffer);
+    bcachefs_release(buffer);
+    expect_content(buffer, 0);
+    bcachefs_release(buffer);
+}
+
+TEST_F(CApiTest, PathsNeedAManifest) {
+    auto image = bcachefs_open(path.c_str(), nullptr);
+    ASSERT_NE(image, nullptr);
+
+    auto             name   = synthetic_file_path(options, 0);
+    char const *     paths  = name.c_str();
+    bcachefs_buffer *buffer = nullptr;
+    EXPECT_EQ(bcachefs_read_many_paths(image, &paths, 1, &buffer), 0u);
+    EXPECT_EQ(buffer, nullptr);
+
+    bcachefs_close(image);
+}
+
+TEST_F(CApiTest, OpenFailsOnInvalidInputs) {
+    EXPECT_EQ(bcachefs_open("missing.img", nullptr), nullptr);
+    EXPECT_EQ(bcachefs_open(nullptr, nullptr), nullptr);
+    EXPECT_EQ(bcachefs_open(path.c_str(), "missing.manifest"), nullptr);
+
+    // a file that is not an image can be mapped but has no superblock
+    auto garbage = path + ".garbage";
+    auto file    = fopen(garbage.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    Array<uint8_t> zeros(64 * 1024, 0);
+    fwrite(zeros.data(), 1, zeros.size(), file);
+    fclose(file);
+
+    EXPECT_EQ(bcachefs_open(garbage.c_str(), nullptr), nullptr);
+    unlink(garbage.c_str());
+}
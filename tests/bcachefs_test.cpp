@@ -1,6 +1,730 @@
+#include "bcachefs.h"
+#include "checksum.h"
+#include "manifest.h"
+#include "test_image.h"
+#include "walker.h"
 
-int main(int argc, char **argv)
-{
-    testing::InitGoogleTest(&argc, argv);
-    return RUN_ALL_TESTS();
+#include <cstddef>
+#include <map>
+#include <tuple>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+// a node in memory, keys are unpacked and only carry a position
+struct FakeNode {
+    FakeNode(uint64_t size): words(size / BCH_U64S_SIZE, 0) {}
+
+    BTreeNode *node() { return (BTreeNode *)words.data(); }
+
+    // bset at offset bytes from the start of the node holding count keys
+    BSet *add_bset(uint64_t offset, uint16_t count) {
+        auto bset  = (BSet *)((uint8_t *)words.data() + offset);
+        bset->u64s = (uint16_t)(count * BKEY_U64s);
+
+        auto key = (BKey *)bset->_data;
+        for (uint16_t i = 0; i < count; ++i) {
+            key[i].u64s     = BKEY_U64s;
+            key[i].format   = KEY_FORMAT_CURRENT;
+            key[i].type     = KEY_TYPE_extent;
+            key[i].p.offset = i + 1;
+        }
+        return bset;
+    }
+
+    Array<uint64_t> words;
+};
+} // namespace
+
+TEST(BKeyIterator, StopsAtTheEndOfTheBset) {
+    FakeNode buffer(4096);
+    auto     bset = buffer.add_bset(offsetof(BTreeNode, keys), 2);
+
+    // whatever follows the bset is not a key of the bset
+    auto garbage  = (BKey *)(bset->_data + bset->u64s);
+    garbage->u64s = BKEY_U64s;
+    garbage->type = KEY_TYPE_extent;
+
+    auto     keys  = BKeyIterator(bset);
+    uint64_t count = 0;
+
+    for (auto key = keys.next(); key != nullptr; key = keys.next()) {
+        count += 1;
+        EXPECT_EQ(key->p.offset, count);
+    }
+    EXPECT_EQ(count, 2u);
+}
+
+TEST(BSetIterator, BsetEndingOnABlock) {
+    uint64_t block = 512;
+    uint64_t first = offsetof(BTreeNode, keys);
+
+    // the keys of the first bset end exactly on the first block
+    auto fill = (block - first - sizeof(BSet)) / (BKEY_U64s * BCH_U64S_SIZE);
+    auto pad  = (block - first - sizeof(BSet)) % (BKEY_U64s * BCH_U64S_SIZE);
+    ASSERT_EQ(pad % BCH_U64S_SIZE, 0u);
+
+    FakeNode buffer(4 * block);
+    auto     bset0 = buffer.add_bset(first, (uint16_t)fill);
+    bset0->u64s += (uint16_t)(pad / BCH_U64S_SIZE);
+
+    // the next bset follows the checksum of its btree_node_entry
+    auto bset1 = buffer.add_bset(block + sizeof(struct bch_csum), 3);
+
+    auto bsets = BSetIterator(buffer.node(), 4 * block);
+    EXPECT_EQ(bsets.next(block), bset0);
+    EXPECT_EQ(bsets.next(block), bset1);
+    EXPECT_EQ(bsets.next(block), nullptr);
+}
+
+TEST(BSetIterator, BsetEndingInsideABlock) {
+    uint64_t block = 512;
+
+    FakeNode buffer(4 * block);
+    auto     bset0 = buffer.add_bset(offsetof(BTreeNode, keys), 2);
+    auto     bset1 = buffer.add_bset(block + sizeof(struct bch_csum), 4);
+    auto     bset2 = buffer.add_bset(2 * block + sizeof(struct bch_csum), 1);
+
+    auto bsets = BSetIterator(buffer.node(), 4 * block);
+    EXPECT_EQ(bsets.next(block), bset0);
+    EXPECT_EQ(bsets.next(block), bset1);
+    EXPECT_EQ(bsets.next(block), bset2);
+    EXPECT_EQ(bsets.next(block), nullptr);
+}
+
+TEST_F(ImageTest, ReadsEveryKeyOfMultipleBsets) {
+    auto options        = small_image();
+    options.image.bsets = 3;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+
+    uint64_t inodes = 0;
+    auto     iter   = reader.iterator(BTREE_ID_inodes);
+    for (auto key = iter.next_key(); key != nullptr; key = iter.next_key()) {
+        inodes += key->type == KEY_TYPE_inode;
+    }
+
+    // root, directories and files
+    EXPECT_EQ(inodes, 1 + synthetic_directory_count(options) + options.file_count);
+
+    for (uint64_t i = 0; i < options.file_count; i += 7) {
+        auto data = reader.read_file(synthetic_file_inode(options, i));
+        auto want = file_content(options, i);
+
+        EXPECT_EQ(data, want) << "file " << i;
+    }
+}
+
+TEST_F(ImageTest, OverwritesWriteOlderVersionsInTheFirstBset) {
+    auto options         = small_image();
+    options.file_count   = 20;
+    options.image.bsets  = 3;
+    options.image.depth  = 1;
+    options.image.format = KeyFormat::CURRENT;
+    options.overwrites   = true;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+
+    for (auto btree: {BTREE_ID_extents, BTREE_ID_inodes, BTREE_ID_dirents}) {
+        auto entry = reader._btree_roots[btree];
+        ASSERT_NE(entry, nullptr);
+        ASSERT_EQ(entry->level, 0);
+
+        // the root is the only leaf
+        auto ptr  = (BTreePtr const *)((uint8_t const *)&entry->start->k + BKEY_U64s * BCH_U64S_SIZE);
+        auto node = reader.load_btree_node(ptr);
+        ASSERT_TRUE(node);
+
+        Array<Array<BPos>> positions;
+        auto               bsets = BSetIterator(node.get(), reader.btree_node_size());
+
+        for (auto bset = bsets.next(reader.btree_block_size()); bset != nullptr;
+             bset      = bsets.next(reader.btree_block_size())) {
+            auto keys = BKeyIterator(bset);
+            positions.emplace_back();
+
+            for (auto key = keys.next(); key != nullptr; key = keys.next()) {
+                positions.back().push_back(key->p);
+            }
+        }
+
+        ASSERT_EQ(positions.size(), 3u) << "btree " << btree;
+
+        // every key of the first bset has a newer version in the next ones, and only those
+        Array<BPos> newer(positions[1]);
+        newer.insert(newer.end(), positions[2].begin(), positions[2].end());
+
+        ASSERT_EQ(positions[0].size(), newer.size()) << "btree " << btree;
+        for (std::size_t i = 0; i < newer.size(); ++i) {
+            EXPECT_EQ(bpos_cmp(positions[0][i], newer[i]), 0);
+        }
+    }
+}
+
+namespace {
+SyntheticOptions overwritten_image() {
+    auto options        = small_image();
+    options.image.bsets = 2;
+    options.overwrites  = true;
+    return options;
+}
+} // namespace
+
+TEST_F(ImageTest, OverwrittenFilesReadTheNewestData) {
+    auto options = overwritten_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto inode = synthetic_file_inode(options, i);
+        auto size  = synthetic_file_size(options, i);
+
+        auto extents = reader.file_extents(inode);
+        auto count   = size <= options.inline_size ? 1 : (size + options.extent_size - 1) / options.extent_size;
+        EXPECT_EQ(extents.size(), count) << "file " << i;
+
+        auto data = reader.read_file(inode);
+        auto want = file_content(options, i);
+
+        EXPECT_EQ(data, want) << "file " << i;
+    }
+}
+
+TEST_F(ImageTest, OverwrittenKeysAreReturnedOnce) {
+    auto options = overwritten_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+
+    // pull iteration
+    std::map<uint64_t, uint64_t> sizes;
+    auto                         iter = reader.iterator(BTREE_ID_inodes);
+
+    for (auto key = iter.next_key(); key != nullptr; key = iter.next_key()) {
+        auto inode = iter.inode(key);
+        EXPECT_EQ(sizes.count(inode.inode), 0u) << "inode " << inode.inode;
+        sizes[inode.inode] = inode.size;
+    }
+
+    EXPECT_EQ(sizes.size(), 1 + synthetic_directory_count(options) + options.file_count);
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        EXPECT_EQ(sizes[synthetic_file_inode(options, i)], synthetic_file_size(options, i));
+    }
+
+    // push iteration
+    uint64_t extents = 0;
+    uint64_t want    = 0;
+    BPos     last    = POS_MIN;
+
+    reader.for_each_key(BTREE_ID_extents, [&](KeySpan keys) {
+        for (auto &key: keys) {
+            EXPECT_GT(bpos_cmp(key.local.p, last), 0);
+            last = key.local.p;
+            extents += 1;
+        }
+    });
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto size = synthetic_file_size(options, i);
+        want += size <= options.inline_size ? 1 : (size + options.extent_size - 1) / options.extent_size;
+    }
+    EXPECT_EQ(extents, want);
+}
+
+TEST_F(ImageTest, OverwrittenDirentsPointToTheNewestInode) {
+    auto options = overwritten_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+
+    std::map<String, uint64_t> files;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        files[synthetic_file_path(options, i)] = synthetic_file_inode(options, i);
+    }
+
+    // readdir
+    DirectoryEntry entry;
+    uint64_t       listed = 0;
+
+    for (uint64_t k = 0; k < synthetic_directory_count(options); ++k) {
+        auto cursor = reader.readdir(BCACHEFS_ROOT_INO + 1 + k);
+        auto dir    = fmt::format("/d{:08}/", k);
+
+        while (cursor.next(entry)) {
+            EXPECT_EQ(entry.inode, files[dir + String(entry.filename())]) << entry.filename();
+            listed += 1;
+        }
+    }
+    EXPECT_EQ(listed, options.file_count);
+
+    // walker
+    auto table = walk_tree(reader, WalkOptions{2});
+    EXPECT_EQ(table.entries.size(), synthetic_directory_count(options) + options.file_count);
+
+    for (auto &item: table.entries) {
+        if (item.type == DT_REG) {
+            EXPECT_EQ(item.inode, files["/" + String(item.path)]) << item.path;
+        }
+    }
+
+    // manifest
+    auto manifest_path = path + ".manifest";
+    ASSERT_TRUE(Manifest::build(reader, manifest_path));
+    {
+        Manifest manifest(manifest_path);
+        ASSERT_TRUE(manifest.valid());
+        EXPECT_EQ(manifest.size(), options.file_count);
+
+        for (uint64_t i = 0; i < options.file_count; ++i) {
+            auto index = manifest.find(synthetic_file_path(options, i));
+            ASSERT_GE(index, 0);
+            EXPECT_EQ(manifest.file(index).inode, synthetic_file_inode(options, i));
+            EXPECT_EQ(manifest.file(index).size, synthetic_file_size(options, i));
+        }
+    }
+    unlink(manifest_path.c_str());
+}
+
+TEST_F(ImageTest, DeletionsHideOlderKeys) {
+    ImageOptions options;
+    options.node_size = 16 * 1024;
+    options.bsets     = 2;
+
+    uint64_t inode = BCACHEFS_ROOT_INO + 1;
+    {
+        ImageWriter image(path, options);
+        Array<uint8_t> data(3 * 4096, 0xAB);
+        auto           start = image.append(data.data(), data.size(), 4096);
+
+        // the second block was removed from the file
+        ASSERT_TRUE(image.add_extent(inode, 0, start, 4096));
+        image.set_older(true);
+        ASSERT_TRUE(image.add_extent(inode, 4096, start + 4096, 4096));
+        image.set_older(false);
+        ASSERT_TRUE(image.add_key(BTREE_ID_extents, POS(inode, 16), KEY_TYPE_deleted, 8, nullptr, 0));
+        ASSERT_TRUE(image.add_extent(inode, 8192, start + 8192, 4096));
+
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(inode, S_IFREG | 0644, 3 * 4096, 1));
+        ASSERT_TRUE(image.add_dirent(BCACHEFS_ROOT_INO, dirent_hash("file"), inode, DT_REG, "file"));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+
+    auto extents = reader.file_extents(inode);
+    ASSERT_EQ(extents.size(), 2u);
+    EXPECT_EQ(extents[0].file_offset, 0u);
+    EXPECT_EQ(extents[1].file_offset, 8192u);
+
+    uint64_t keys = 0;
+    reader.for_each_key(BTREE_ID_extents, [&](KeySpan span) { keys += span.size(); });
+    EXPECT_EQ(keys, 2u);
+}
+
+TEST_F(ImageTest, JournalKeysAreReplayed) {
+    ImageOptions options;
+    options.node_size = 16 * 1024;
+    options.clean     = false;
+
+    uint64_t inode = BCACHEFS_ROOT_INO + 1;
+    {
+        ImageWriter image(path, options);
+        Array<uint8_t> data(2 * 4096, 0xAB);
+        auto           start = image.append(data.data(), data.size(), 4096);
+
+        ASSERT_TRUE(image.add_extent(inode, 0, start, 4096));
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(inode, S_IFREG | 0644, 2 * 4096, 1));
+
+        // the second block was appended after the nodes were written
+        auto ptr   = BExtendPtr{};
+        ptr.type   = 1 << BCH_EXTENT_ENTRY_ptr;
+        ptr.offset = (start + 4096) / BCH_SECTOR_SIZE;
+
+        image.next_jset();
+        ASSERT_TRUE(image.add_journal_key(BTREE_ID_extents, POS(inode, 16), KEY_TYPE_extent, 8, &ptr, sizeof(ptr)));
+        ASSERT_TRUE(image.finish());
+        EXPECT_EQ(image.jsets().size(), 2u);
+    }
+
+    BCacheFSReader reader(path, true);
+
+    auto extents = reader.file_extents(inode);
+    ASSERT_EQ(extents.size(), 2u);
+    EXPECT_EQ(extents[1].file_offset, 4096u);
+    EXPECT_EQ(reader.read_file(inode), Array<uint8_t>(2 * 4096, 0xAB));
+}
+
+TEST_F(ImageTest, DecodedKeysAreCountedOnce) {
+    auto options = small_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    auto           before = reader.metrics().keys_decoded;
+
+    uint64_t count = 0;
+    {
+        auto iter = reader.iterator(BTREE_ID_extents);
+        for (int i = 0; i < 10 && iter.next_key() != nullptr; ++i) {
+            count += 1;
+        }
+
+        // the copy continues from the same key, the keys returned before the copy are only counted by the original
+        auto copy = iter;
+        while (copy.next_key() != nullptr) {
+            count += 1;
+        }
+    }
+    EXPECT_GT(count, 10u);
+    EXPECT_EQ(reader.metrics().keys_decoded - before, count);
+}
+
+namespace {
+// keys of the btree inside [min, max]
+uint64_t count_keys(BCacheFSReader const &reader, BTreeType type, BPos const &min, BPos const &max) {
+    auto     iter  = reader.iterator(type, min, max);
+    uint64_t count = 0;
+    while (iter.next_key() != nullptr) {
+        count += 1;
+    }
+    return count;
+}
+} // namespace
+
+TEST_F(ImageTest, PartitionCoversTheBtree) {
+    auto options       = small_image();
+    options.file_count = 3000;
+    options.fill       = false;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    auto           all   = reader.partition(BTREE_ID_extents, 1);
+    auto           total = count_keys(reader, BTREE_ID_extents, POS_MIN, SPOS_MAX);
+    ASSERT_EQ(all.size(), 1u);
+    ASSERT_GT(all[0].leaves, 4u);
+
+    for (uint64_t n: {2, 3, 4, 1000}) {
+        auto ranges = reader.partition(BTREE_ID_extents, n);
+        ASSERT_FALSE(ranges.empty());
+        EXPECT_LE(ranges.size(), n);
+        EXPECT_EQ(bpos_cmp(ranges.front().min, POS_MIN), 0);
+        EXPECT_EQ(bpos_cmp(ranges.back().max, SPOS_MAX), 0);
+
+        uint64_t keys   = 0;
+        uint64_t bytes  = 0;
+        uint64_t leaves = 0;
+        uint64_t widest = 0;
+
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+            auto &range = ranges[i];
+            if (i > 0) {
+                EXPECT_EQ(bpos_cmp(range.min, bpos_successor(ranges[i - 1].max)), 0) << "range " << i;
+            }
+
+            EXPECT_GT(range.leaves, 0u);
+            keys += count_keys(reader, BTREE_ID_extents, range.min, range.max);
+            bytes += range.bytes;
+            leaves += range.leaves;
+            widest = std::max(widest, range.bytes);
+        }
+
+        // every key is found in exactly one range, the ranges are close to their share of the bytes
+        EXPECT_EQ(keys, total) << n << " ranges";
+        EXPECT_EQ(bytes, all[0].bytes);
+        EXPECT_EQ(leaves, all[0].leaves);
+        EXPECT_EQ(ranges.size(), std::min<uint64_t>(n, all[0].leaves));
+        EXPECT_LE(widest, all[0].bytes / ranges.size() + all[0].bytes / all[0].leaves * 4);
+    }
+}
+
+TEST_F(ImageTest, PartitionOfASingleLeaf) {
+    auto options       = small_image();
+    options.file_count = 2;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    EXPECT_TRUE(reader.partition(BTREE_ID_extents, 0).empty());
+
+    auto ranges = reader.partition(BTREE_ID_extents, 4);
+    ASSERT_EQ(ranges.size(), 1u);
+    EXPECT_EQ(bpos_cmp(ranges[0].min, POS_MIN), 0);
+    EXPECT_EQ(bpos_cmp(ranges[0].max, SPOS_MAX), 0);
+    EXPECT_EQ(ranges[0].leaves, 1u);
+
+    uint64_t extents = 0;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto size = synthetic_file_size(options, i);
+        extents += size <= options.inline_size ? 1 : (size + options.extent_size - 1) / options.extent_size;
+    }
+    EXPECT_EQ(count_keys(reader, BTREE_ID_extents, ranges[0].min, ranges[0].max), extents);
+}
+
+namespace {
+// directories spanning several leaves of the dirents btree
+SyntheticOptions large_directories() {
+    auto options          = small_image();
+    options.file_count    = 3000;
+    options.files_per_dir = 1500;
+    options.fill          = false;
+    return options;
+}
+
+Array<std::pair<uint64_t, String>> list_directory(DirectoryCursor &cursor, uint64_t limit = ~0ULL) {
+    Array<std::pair<uint64_t, String>> entries;
+    DirectoryEntry                     entry;
+
+    while (entries.size() < limit && cursor.next(entry)) {
+        EXPECT_EQ(entry.parent_inode, cursor.directory());
+        entries.emplace_back(entry.inode, String(entry.filename()));
+    }
+    return entries;
+}
+} // namespace
+
+TEST_F(ImageTest, ReaddirListsEveryEntryInHashOrder) {
+    auto options = large_directories();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    NodeCache      cache;
+
+    std::map<String, uint64_t> files;
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        files[synthetic_file_path(options, i)] = synthetic_file_inode(options, i);
+    }
+
+    uint64_t listed = 0;
+    for (uint64_t k = 0; k < synthetic_directory_count(options); ++k) {
+        auto           cursor = reader.readdir(BCACHEFS_ROOT_INO + 1 + k, 0, 0, &cache);
+        auto           dir    = fmt::format("/d{:08}/", k);
+        DirectoryEntry entry;
+        uint64_t       last = 0;
+
+        while (cursor.next(entry)) {
+            EXPECT_EQ(entry.inode, files[dir + String(entry.filename())]) << entry.filename();
+            EXPECT_GT(entry.offset, last);
+            EXPECT_GE(entry.offset, dirent_hash(entry.filename())); // colliding names take the next offset
+            EXPECT_EQ(cursor.offset(), entry.offset + 1);
+            last = entry.offset;
+            listed += 1;
+        }
+    }
+    EXPECT_EQ(listed, options.file_count);
+
+    // a file has no entries, nor does an inode that does not exist
+    auto file = reader.readdir(synthetic_file_inode(options, 0));
+    EXPECT_TRUE(list_directory(file).empty());
+
+    auto missing = reader.readdir(synthetic_file_inode(options, options.file_count - 1) + 1);
+    EXPECT_TRUE(list_directory(missing).empty());
+}
+
+TEST_F(ImageTest, ReaddirResumesAnInterruptedListing) {
+    auto options = large_directories();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    auto           dir = BCACHEFS_ROOT_INO + 1;
+
+    auto cursor = reader.readdir(dir);
+    auto all    = list_directory(cursor);
+    ASSERT_EQ(all.size(), options.files_per_dir);
+
+    // stop after every few entries and continue from a new cursor, as a listing split over several calls would
+    for (uint64_t step: {1, 7, 250, 1499}) {
+        Array<std::pair<uint64_t, String>> resumed;
+        uint64_t                           offset = 0;
+
+        while (true) {
+            auto part  = reader.readdir(dir, offset);
+            auto batch = list_directory(part, step);
+            if (batch.empty()) {
+                break;
+            }
+
+            resumed.insert(resumed.end(), batch.begin(), batch.end());
+            offset = part.offset();
+        }
+        EXPECT_EQ(resumed, all) << "step " << step;
+    }
+}
+
+namespace {
+// the file uses blocks [skip, skip + blocks) of a region of region_blocks blocks written with a crc entry
+struct ChecksummedImage {
+    ChecksummedImage(String const &path, uint64_t region_blocks, uint64_t skip, uint64_t blocks,
+                     unsigned compression = 0):
+        region(region_blocks * 4096) {
+        for (uint64_t i = 0; i < region.size(); ++i) {
+            region[i] = (uint8_t)(i / 4096 + 1);
+        }
+
+        ImageWriter image(path);
+        start = image.append(region.data(), region.size(), 4096);
+
+        struct bch_csum csum;
+        compute_checksum(BCH_CSUM_crc32c_nonzero, region.data(), region.size(), csum);
+
+        // sizes are stored minus 1
+        struct {
+            struct bch_extent_crc32 crc;
+            BExtendPtr              ptr;
+        } value = {};
+
+        value.crc.type               = 1 << BCH_EXTENT_ENTRY_crc32;
+        value.crc._compressed_size   = region_blocks * 8 - 1;
+        value.crc._uncompressed_size = region_blocks * 8 - 1;
+        value.crc.offset             = skip * 8;
+        value.crc.csum_type          = BCH_CSUM_crc32c_nonzero;
+        value.crc.compression_type   = compression;
+        value.crc.csum               = (uint32_t)csum.lo;
+        value.ptr.type               = 1 << BCH_EXTENT_ENTRY_ptr;
+        value.ptr.offset             = start / BCH_SECTOR_SIZE;
+
+        EXPECT_TRUE(image.add_key(BTREE_ID_extents, POS(inode, blocks * 8), KEY_TYPE_extent, blocks * 8, &value,
+                                  sizeof(value)));
+        EXPECT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        EXPECT_TRUE(image.add_inode(inode, S_IFREG | 0644, blocks * 4096, 1));
+        EXPECT_TRUE(image.finish());
+    }
+
+    uint64_t       inode = BCACHEFS_ROOT_INO + 1;
+    uint64_t       start = 0;
+    Array<uint8_t> region;
+};
+} // namespace
+
+TEST_F(ImageTest, TrimmedChecksummedExtentsSkipTheirOffset) {
+    ChecksummedImage image(path, 3, 1, 1);
+
+    BCacheFSReader reader(path);
+    auto           extents = reader.file_extents(image.inode);
+    ASSERT_EQ(extents.size(), 1u);
+
+    // the data starts one block inside the region, the checksum covers the whole region
+    auto &ext = extents[0];
+    EXPECT_EQ(ext.offset, image.start + 4096);
+    EXPECT_EQ(ext.size, 4096u);
+    EXPECT_EQ(ext.checksum.type, BCH_CSUM_crc32c_nonzero);
+    EXPECT_EQ(ext.checksum.offset, image.start);
+    EXPECT_EQ(ext.checksum.size, image.region.size());
+
+    Array<uint8_t> region(ext.checksum.size);
+    ASSERT_EQ(reader.read(ext.checksum.offset, region.data(), region.size()), region.size());
+    EXPECT_TRUE(verify_checksum(ext.checksum.type, ext.checksum.csum, region.data(), region.size()));
+
+    EXPECT_EQ(reader.read_file(image.inode), Array<uint8_t>(4096, 2));
+}
+
+TEST_F(ImageTest, CompressedExtentsAreNotRead) {
+    ChecksummedImage image(path, 2, 0, 2, 1);
+
+    BCacheFSReader reader(path);
+    EXPECT_TRUE(reader.file_extents(image.inode).empty());
+
+    // the file reads as a hole instead of the compressed bytes
+    EXPECT_EQ(reader.read_file(image.inode), Array<uint8_t>(2 * 4096, 0));
+}
+
+namespace {
+// type and position of the keys returned by a filtered scan
+Array<std::tuple<uint8_t, uint64_t, uint64_t>> scan_keys(BCacheFSReader const &reader, BTreeType type,
+                                                        KeyFilter const &filter) {
+    Array<std::tuple<uint8_t, uint64_t, uint64_t>> keys;
+    reader.for_each_key(type, filter, [&](KeySpan span) {
+        for (auto &view: span) {
+            keys.emplace_back(view.key->type, (uint64_t)view.local.p.inode, (uint64_t)view.local.p.offset);
+        }
+    });
+    return keys;
+}
+
+SyntheticOptions multi_level_image() {
+    auto options            = small_image();
+    options.image.node_size = 4096;
+    options.file_count      = 3000;
+    options.fill            = false;
+    return options;
+}
+} // namespace
+
+TEST_F(ImageTest, KeyFilterPrunesTheSubtreesOutsideOfTheInodeRange) {
+    auto options = multi_level_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader full_reader(path);
+    auto           all        = scan_keys(full_reader, BTREE_ID_extents, KeyFilter());
+    auto           full_nodes = full_reader.metrics().nodes_loaded[BTREE_ID_extents];
+    ASSERT_GE(full_reader._btree_roots[BTREE_ID_extents]->level, 1);
+    ASSERT_GT(full_nodes, 20u);
+
+    auto min = synthetic_file_inode(options, 1500);
+    auto max = synthetic_file_inode(options, 1509);
+
+    Array<std::tuple<uint8_t, uint64_t, uint64_t>> expected;
+    for (auto &key: all) {
+        if (std::get<1>(key) >= min && std::get<1>(key) <= max) {
+            expected.push_back(key);
+        }
+    }
+    ASSERT_FALSE(expected.empty());
+
+    BCacheFSReader reader(path);
+    EXPECT_EQ(scan_keys(reader, BTREE_ID_extents, KeyFilter({}, min, max)), expected);
+    // the root and the one or two leaves holding the range
+    EXPECT_LE(reader.metrics().nodes_loaded[BTREE_ID_extents], 3u);
+}
+
+TEST_F(ImageTest, KeyFilterSkipsTheOtherTypes) {
+    auto options = multi_level_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    auto           all = scan_keys(reader, BTREE_ID_extents, KeyFilter());
+
+    for (auto type: {KEY_TYPE_inline_data, KEY_TYPE_extent}) {
+        Array<std::tuple<uint8_t, uint64_t, uint64_t>> expected;
+        for (auto &key: all) {
+            if (std::get<0>(key) == type) {
+                expected.push_back(key);
+            }
+        }
+        ASSERT_FALSE(expected.empty());
+        ASSERT_LT(expected.size(), all.size());
+
+        EXPECT_EQ(scan_keys(reader, BTREE_ID_extents, KeyFilter({type})), expected);
+    }
+
+    // both filters at once
+    auto min      = synthetic_file_inode(options, 100);
+    auto max      = synthetic_file_inode(options, 199);
+    auto filtered = scan_keys(reader, BTREE_ID_extents, KeyFilter({KEY_TYPE_inline_data}, min, max));
+    ASSERT_FALSE(filtered.empty());
+    for (auto &key: filtered) {
+        EXPECT_EQ(std::get<0>(key), KEY_TYPE_inline_data);
+        EXPECT_GE(std::get<1>(key), min);
+        EXPECT_LE(std::get<1>(key), max);
+    }
+}
+
+TEST_F(ImageTest, KeyFilterRangeAppliesToTheInodeNumberOfInodes) {
+    auto options = multi_level_image();
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    auto           min  = synthetic_file_inode(options, 42);
+    auto           max  = synthetic_file_inode(options, 57);
+    auto           keys = scan_keys(reader, BTREE_ID_inodes, KeyFilter({KEY_TYPE_inode}, min, max));
+
+    // inodes are indexed by p.offset
+    ASSERT_EQ(keys.size(), max - min + 1);
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        EXPECT_EQ(std::get<0>(keys[i]), KEY_TYPE_inode);
+        EXPECT_EQ(std::get<2>(keys[i]), min + i);
+    }
 }
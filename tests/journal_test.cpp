@@ -0,0 +1,322 @@
+#include "bcachefs.h"
+#include "checksum.h"
+#include "image_writer.h"
+#include "manifest.h"
+#include "test_image.h"
+
+#include <cstdio>
+#include <functional>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+uint64_t const FILE_INODE = BCACHEFS_ROOT_INO + 1;
+
+ImageOptions journal_options() {
+    ImageOptions options;
+    options.node_size = 16 * 1024;
+    options.clean     = false;
+    return options;
+}
+
+// a file of size bytes whose data lives in the nodes, block i of the data is filled with i + 1
+struct JournalImage {
+    JournalImage(String const &path, uint64_t size, ImageOptions const &options = journal_options()):
+        image(path, options) {
+        Array<uint8_t> data(size);
+        for (uint64_t i = 0; i < size; ++i) {
+            data[i] = (uint8_t)(i / 4096 + 1);
+        }
+        start = image.append(data.data(), data.size(), 4096);
+
+        image.add_extent(FILE_INODE, 0, start, size);
+        image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2);
+        image.add_inode(FILE_INODE, S_IFREG | 0644, size, 1);
+        image.add_dirent(BCACHEFS_ROOT_INO, dirent_hash("file"), FILE_INODE, DT_REG, "file");
+    }
+
+    // the bytes [file_offset, file_offset + size) of the file point to the block of the data
+    bool journal_extent(uint64_t file_offset, uint64_t size, uint64_t block) {
+        auto ptr   = BExtendPtr{};
+        ptr.type   = 1 << BCH_EXTENT_ENTRY_ptr;
+        ptr.offset = (start + block * 4096) / BCH_SECTOR_SIZE;
+
+        auto p = POS(FILE_INODE, (file_offset + size) / BCH_SECTOR_SIZE);
+        return image.add_journal_key(BTREE_ID_extents, p, KEY_TYPE_extent, (uint32_t)(size / BCH_SECTOR_SIZE), &ptr,
+                                     sizeof(ptr));
+    }
+
+    bool journal_deletion(uint64_t file_offset, uint64_t size) {
+        auto p = POS(FILE_INODE, (file_offset + size) / BCH_SECTOR_SIZE);
+        return image.add_journal_key(BTREE_ID_extents, p, KEY_TYPE_deleted, (uint32_t)(size / BCH_SECTOR_SIZE), nullptr,
+                                     0);
+    }
+
+    ImageWriter image;
+    uint64_t    start = 0;
+};
+
+Array<uint8_t> read_bytes(String const &path, uint64_t offset, uint64_t size) {
+    Array<uint8_t> data(size);
+    auto           file = fopen(path.c_str(), "rb");
+    fseek(file, (long)offset, SEEK_SET);
+    EXPECT_EQ(fread(data.data(), 1, size, file), size);
+    fclose(file);
+    return data;
+}
+
+void write_bytes(String const &path, uint64_t offset, Array<uint8_t> const &data) {
+    auto file = fopen(path.c_str(), "r+b");
+    fseek(file, (long)offset, SEEK_SET);
+    EXPECT_EQ(fwrite(data.data(), 1, data.size(), file), data.size());
+    fclose(file);
+}
+
+uint64_t jset_bytes(String const &path, uint64_t offset) {
+    auto header = read_bytes(path, offset, sizeof(JournalSet));
+    auto jset   = (JournalSet const *)header.data();
+    return sizeof(JournalSet) + (uint64_t)jset->u64s * BCH_U64S_SIZE;
+}
+
+// change the jset at offset, its checksum is computed again when fix_csum is set
+void edit_jset(String const &path, uint64_t offset, std::function<void(JournalSet *)> edit, bool fix_csum) {
+    auto bytes = jset_bytes(path, offset);
+    auto data  = read_bytes(path, offset, bytes);
+    auto jset  = (JournalSet *)data.data();
+
+    edit(jset);
+    if (fix_csum) {
+        compute_checksum(jset->flags & 0xF, &jset->magic, bytes - sizeof(struct bch_csum), jset->csum);
+    }
+    write_bytes(path, offset, data);
+}
+
+// first byte of each block of the file
+Array<uint8_t> file_blocks(BCacheFSReader const &reader) {
+    auto           data = reader.read_file(FILE_INODE);
+    Array<uint8_t> blocks;
+    for (uint64_t i = 0; i < data.size(); i += 4096) {
+        blocks.push_back(data[i]);
+    }
+    return blocks;
+}
+} // namespace
+
+TEST_F(ImageTest, JournalNewestJsetWins) {
+    {
+        JournalImage image(path, 4 * 4096);
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 2));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 3));
+        ASSERT_TRUE(image.image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    ASSERT_TRUE(reader.valid());
+    EXPECT_EQ(reader._journal.seq, 2u);
+    EXPECT_EQ(file_blocks(reader), Array<uint8_t>({1, 4, 3, 4}));
+}
+
+TEST_F(ImageTest, JournalExtentsTrimTheOlderExtents) {
+    {
+        JournalImage image(path, 4 * 4096);
+
+        // blocks 0 and 3 of the data are reused for the middle of the file then the end is removed
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 0));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(6144, 4096, 3));
+        ASSERT_TRUE(image.journal_deletion(12288, 2048));
+        ASSERT_TRUE(image.image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    auto           extents = reader.file_extents(FILE_INODE);
+
+    Array<std::pair<uint64_t, uint64_t>> ranges;
+    for (auto &ext: extents) {
+        ranges.emplace_back(ext.file_offset, ext.size);
+    }
+
+    // the extent of the nodes is split around the journal extents and the deletion
+    Array<std::pair<uint64_t, uint64_t>> expected = {
+        {0, 4096}, {4096, 2048}, {6144, 4096}, {10240, 2048}, {14336, 2048}};
+    EXPECT_EQ(ranges, expected);
+
+    auto data = reader.read_file(FILE_INODE);
+    ASSERT_EQ(data.size(), 4 * 4096u);
+    EXPECT_EQ(data[0], 1);
+    EXPECT_EQ(data[4096], 1);
+    EXPECT_EQ(data[6144], 4);
+    EXPECT_EQ(data[10240], 3);
+    EXPECT_EQ(data[12288], 0);
+    EXPECT_EQ(data[14336], 4);
+}
+
+TEST_F(ImageTest, JournalExtentsAreResolvedByTheManifest) {
+    {
+        JournalImage image(path, 4 * 4096);
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 3));
+        ASSERT_TRUE(image.image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    auto           manifest_path = path + ".manifest";
+    ASSERT_TRUE(Manifest::build(reader, manifest_path));
+
+    Manifest manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+
+    auto index = manifest.find("/file");
+    ASSERT_GE(index, 0);
+
+    Array<std::pair<uint64_t, uint64_t>> ranges;
+    for (auto ext = manifest.extents_begin(index); ext != manifest.extents_end(index); ++ext) {
+        ranges.emplace_back(ext->file_offset, ext->size);
+    }
+    Array<std::pair<uint64_t, uint64_t>> expected = {{0, 4096}, {4096, 4096}, {8192, 8192}};
+    EXPECT_EQ(ranges, expected);
+
+    unlink(manifest_path.c_str());
+}
+
+TEST_F(ImageTest, CorruptedJsetEndsItsBucket) {
+    Array<uint64_t> jsets;
+    {
+        JournalImage image(path, 4 * 4096);
+        ASSERT_TRUE(image.journal_extent(0, 4096, 1));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 2));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(8192, 4096, 3));
+        ASSERT_TRUE(image.image.finish());
+        jsets = image.image.jsets();
+    }
+    ASSERT_EQ(jsets.size(), 3u);
+
+    // a torn write, the checksum does not match
+    edit_jset(path, jsets[1], [](JournalSet *jset) { jset->_data[jset->u64s - 1] ^= 1; }, false);
+
+    BCacheFSReader reader(path);
+    ASSERT_TRUE(reader.valid());
+    EXPECT_EQ(reader._journal.seq, 1u);
+    EXPECT_EQ(file_blocks(reader), Array<uint8_t>({2, 2, 3, 4}));
+}
+
+TEST_F(ImageTest, JsetFromANewerVersionIsNotReplayed) {
+    Array<uint64_t> jsets;
+    {
+        JournalImage image(path, 2 * 4096);
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(0, 4096, 1));
+        ASSERT_TRUE(image.image.finish());
+        jsets = image.image.jsets();
+    }
+
+    edit_jset(path, jsets[1], [](JournalSet *jset) { jset->version = IMAGE_METADATA_VERSION + 1; }, true);
+
+    BCacheFSReader reader(path);
+    EXPECT_EQ(reader._journal.seq, 1u);
+    EXPECT_EQ(file_blocks(reader), Array<uint8_t>({1, 2}));
+}
+
+TEST_F(ImageTest, MissingJsetEndsTheJournal) {
+    Array<uint64_t> jsets;
+    uint64_t        bucket_size = 0;
+    {
+        JournalImage image(path, 4 * 4096);
+        ASSERT_TRUE(image.journal_extent(0, 4096, 1));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 2));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(8192, 4096, 3));
+        ASSERT_TRUE(image.image.finish());
+        jsets       = image.image.jsets();
+        bucket_size = image.image.bucket_size();
+    }
+
+    // the last jset moves to the next bucket, it is still found once the one before is lost
+    auto bytes = jset_bytes(path, jsets[2]);
+    auto last  = read_bytes(path, jsets[2], bytes);
+    write_bytes(path, jsets[0] + bucket_size, last);
+    write_bytes(path, jsets[2], Array<uint8_t>(bytes, 0));
+    {
+        BCacheFSReader reader(path);
+        EXPECT_EQ(reader._journal.seq, 3u);
+        EXPECT_EQ(file_blocks(reader), Array<uint8_t>({2, 3, 4, 4}));
+    }
+
+    edit_jset(path, jsets[1], [](JournalSet *jset) { jset->csum.lo ^= 1; }, false);
+
+    BCacheFSReader reader(path);
+    EXPECT_EQ(reader._journal.seq, 1u);
+    EXPECT_EQ(file_blocks(reader), Array<uint8_t>({2, 2, 3, 4}));
+}
+
+TEST_F(ImageTest, BlacklistedJsetsAreNotReplayed) {
+    {
+        JournalImage image(path, 4 * 4096);
+        ASSERT_TRUE(image.journal_extent(0, 4096, 1));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(4096, 4096, 2));
+        image.image.next_jset();
+        ASSERT_TRUE(image.journal_extent(8192, 4096, 3));
+        image.image.blacklist_journal(2, 3);
+        ASSERT_TRUE(image.image.finish());
+    }
+
+    // the blacklisted jset is not missing, the newer one is replayed
+    BCacheFSReader reader(path);
+    EXPECT_EQ(reader._journal.seq, 3u);
+    EXPECT_EQ(file_blocks(reader), Array<uint8_t>({2, 2, 4, 4}));
+}
+
+TEST_F(ImageTest, ImageWithoutRootsIsInvalid) {
+    Array<uint64_t> jsets;
+    {
+        JournalImage image(path, 4096);
+        ASSERT_TRUE(image.image.finish());
+        jsets = image.image.jsets();
+    }
+    ASSERT_EQ(jsets.size(), 1u);
+
+    edit_jset(path, jsets[0], [](JournalSet *jset) { jset->csum.lo ^= 1; }, false);
+
+    BCacheFSReader reader(path);
+    EXPECT_FALSE(reader.valid());
+    EXPECT_TRUE(reader.file_extents(FILE_INODE).empty());
+    EXPECT_EQ(reader.iterator(BTREE_ID_inodes).next_key(), nullptr);
+    EXPECT_FALSE(reader.find(BTREE_ID_inodes, POS(0, FILE_INODE)));
+}
+
+TEST_F(ImageTest, DiskKeysAfterTheLastJournalKeyAreReturned) {
+    {
+        JournalImage image(path, 4 * 4096);
+
+        // a second file that only lives in the nodes, after every key of the journal
+        ASSERT_TRUE(image.image.add_extent(FILE_INODE + 1, 0, image.start, 4096));
+        ASSERT_TRUE(image.image.add_inode(FILE_INODE + 1, S_IFREG | 0644, 4096, 1));
+        ASSERT_TRUE(image.journal_extent(0, 4096, 3));
+        ASSERT_TRUE(image.image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    ASSERT_TRUE(reader.valid());
+
+    Array<std::pair<uint64_t, uint64_t>> keys;
+    Array<bool>                          journal;
+
+    auto iter = reader.iterator(BTREE_ID_extents);
+    for (auto key = iter.next_key(); key != nullptr; key = iter.next_key()) {
+        auto p = iter.local(key).p;
+        keys.emplace_back((uint64_t)p.inode, (uint64_t)p.offset);
+        journal.push_back(iter.journal_key(key) != nullptr);
+    }
+
+    Array<std::pair<uint64_t, uint64_t>> expected = {{FILE_INODE, 8}, {FILE_INODE, 32}, {FILE_INODE + 1, 8}};
+    EXPECT_EQ(keys, expected);
+    EXPECT_EQ(journal, Array<bool>({true, false, false}));
+
+    EXPECT_EQ(file_blocks(reader), Array<uint8_t>({4, 2, 3, 4}));
+    EXPECT_EQ(reader.read_file(FILE_INODE + 1), Array<uint8_t>(4096, 1));
+}
@@ -0,0 +1,165 @@
+#include "logger.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <regex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace bcachefs;
+
+namespace {
+// Redirect stdout to a file, the async sink writes there from its own thread
+struct LogCapture {
+    LogCapture() {
+        auto info = testing::UnitTest::GetInstance()->current_test_info();
+        path      = fmt::format("{}.{}.log", info->test_case_name(), info->name());
+
+        fflush(stdout);
+        saved  = dup(STDOUT_FILENO);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    ~LogCapture() {
+        restore();
+        unlink(path.c_str());
+    }
+
+    // stop capturing and return the lines written
+    std::vector<std::string> lines() {
+        restore();
+
+        std::vector<std::string> out;
+        std::ifstream            file(path);
+        for (std::string line; std::getline(file, line);) {
+            out.push_back(line);
+        }
+        return out;
+    }
+
+    void restore() {
+        if (saved >= 0) {
+            fflush(stdout);
+            dup2(saved, STDOUT_FILENO);
+            close(saved);
+            saved = -1;
+        }
+    }
+
+    std::string path;
+    int         saved = -1;
+};
+
+// messages logged by the tests and messages reported as dropped
+struct LogCount {
+    LogCount(std::vector<std::string> const &lines) {
+        std::regex dropped_line(R"(\[W\] (\d+) log messages dropped)");
+
+        for (auto &line: lines) {
+            std::smatch match;
+            if (std::regex_search(line, match, dropped_line)) {
+                dropped += std::stoull(match[1]);
+            } else if (line.find("message ") != std::string::npos) {
+                logged += 1;
+            }
+        }
+    }
+
+    uint64_t logged  = 0;
+    uint64_t dropped = 0;
+};
+
+void log_from_threads(int threads, int messages) {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([t, messages]() {
+            for (int i = 0; i < messages; ++i) {
+                warn("message {} {}", t, i);
+            }
+        });
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+} // namespace
+
+TEST(AsyncLogging, DroppedMessagesAreCountedAndReported) {
+    LogCapture capture;
+
+    AsyncLogOptions options;
+    options.capacity = 2;
+    enable_async_logging(options);
+    log_from_threads(4, 5000);
+    disable_async_logging();
+
+    LogCount count(capture.lines());
+    EXPECT_GT(count.dropped, 0u);
+    EXPECT_EQ(count.logged + count.dropped, 20000u);
+}
+
+TEST(AsyncLogging, BlockingModeLosesNothing) {
+    LogCapture capture;
+
+    AsyncLogOptions options;
+    options.capacity = 2;
+    options.block    = true;
+    enable_async_logging(options);
+    log_from_threads(4, 5000);
+    disable_async_logging();
+
+    LogCount count(capture.lines());
+    EXPECT_EQ(count.dropped, 0u);
+    EXPECT_EQ(count.logged, 20000u);
+}
+
+TEST(AsyncLogging, DisablingDrainsTheRing) {
+    LogCapture capture;
+
+    // the ring holds everything, nothing is written before disabling if the thread is slow
+    AsyncLogOptions options;
+    options.capacity    = 1 << 14;
+    options.flush_every = 1 << 20;
+    enable_async_logging(options);
+    for (int i = 0; i < 10000; ++i) {
+        info("message {}", i);
+    }
+    disable_async_logging();
+
+    // back to synchronous logging
+    info("message after");
+
+    auto lines = capture.lines();
+    ASSERT_EQ(LogCount(lines).logged, 10001u);
+    EXPECT_NE(lines.back().find("message after"), std::string::npos);
+
+    // a single thread logged them, they come out in order
+    for (int i = 0; i < 10000; ++i) {
+        EXPECT_NE(lines[i].find(fmt::format("message {}", i)), std::string::npos) << lines[i];
+    }
+}
+
+TEST(AsyncLogging, LongMessagesAreTruncated) {
+    LogCapture capture;
+
+    enable_async_logging();
+    info("message {}", std::string(1000, 'x'));
+    info("message short");
+    disable_async_logging();
+
+    auto lines = capture.lines();
+    ASSERT_EQ(lines.size(), 2u);
+
+    // the payload starts with the location of the call and holds at most LOG_SLOT_SIZE (480) bytes
+    auto start = lines[0].find(trim_source_path(__FILE__));
+    ASSERT_NE(start, std::string::npos);
+    EXPECT_EQ(lines[0].size() - start, 480u);
+    EXPECT_EQ(lines[0].back(), 'x');
+
+    EXPECT_NE(lines[1].find("message short"), std::string::npos);
+}
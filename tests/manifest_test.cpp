@@ -0,0 +1,164 @@
+#include "bcachefs.h"
+#include "manifest.h"
+#include "test_image.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <unistd.h>
+
+namespace {
+// Tests building a manifest from a generated image, the manifest is removed with the image
+struct ManifestTest: public ImageTest {
+    protected:
+    void SetUp() override {
+        ImageTest::SetUp();
+        manifest_path = path + ".manifest";
+    }
+
+    void TearDown() override {
+        unlink(manifest_path.c_str());
+        ImageTest::TearDown();
+    }
+
+    void build(SyntheticOptions const &options) {
+        ASSERT_TRUE(write_synthetic_image(path, options));
+
+        BCacheFSReader reader(path);
+        ASSERT_TRUE(Manifest::build(reader, manifest_path));
+    }
+
+    String manifest_path;
+};
+
+// content of a file read through the extents of the manifest
+Array<uint8_t> read_extents(BCacheFSReader const &reader, Manifest const &manifest, uint64_t index) {
+    Array<uint8_t> data(manifest.file(index).size);
+
+    for (auto ext = manifest.extents_begin(index); ext != manifest.extents_end(index); ++ext) {
+        if (ext->file_offset >= data.size()) {
+            continue;
+        }
+        auto size = std::min(ext->size, data.size() - ext->file_offset);
+        reader.read(ext->offset, data.data() + ext->file_offset, size);
+    }
+    return data;
+}
+} // namespace
+
+TEST_F(ManifestTest, IndexesEveryFile) {
+    auto options = small_image();
+    build(options);
+
+    BCacheFSReader reader(path);
+    Manifest       manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+    ASSERT_EQ(manifest.size(), options.file_count);
+    EXPECT_FALSE(manifest.is_stale(reader));
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto file_path = synthetic_file_path(options, i);
+        auto index     = manifest.find(file_path);
+        ASSERT_GE(index, 0) << file_path;
+
+        auto &file = manifest.file(index);
+        EXPECT_EQ(manifest.path(index), file_path);
+        EXPECT_EQ(file.inode, synthetic_file_inode(options, i));
+        EXPECT_EQ(file.size, synthetic_file_size(options, i));
+        EXPECT_EQ(read_extents(reader, manifest, index), file_content(options, i)) << file_path;
+    }
+}
+
+TEST_F(ManifestTest, MergesContiguousExtents) {
+    auto options        = small_image();
+    options.inline_size = 0;
+    build(options);
+
+    // the extents of a file are written back to back, a file is a single extent in the manifest
+    Manifest manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+
+    for (uint64_t i = 0; i < manifest.size(); ++i) {
+        EXPECT_EQ(manifest.file(i).extent_count, 1u) << manifest.path(i);
+    }
+}
+
+TEST_F(ManifestTest, IsStaleOnceTheImageChanges) {
+    auto options = small_image();
+    build(options);
+
+    Manifest manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+
+    options.image.seed += 1;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    EXPECT_TRUE(manifest.is_stale(reader));
+}
+
+TEST_F(ManifestTest, RejectsInvalidFiles) {
+    build(small_image());
+
+    EXPECT_FALSE(Manifest(manifest_path + ".missing").valid());
+
+    // a partial manifest
+    ASSERT_EQ(truncate(manifest_path.c_str(), sizeof(ManifestHeader) + 16), 0);
+    EXPECT_FALSE(Manifest(manifest_path).valid());
+
+    // a manifest written by another version
+    build(small_image());
+    ManifestHeader header;
+    auto           file = fopen(manifest_path.c_str(), "r+b");
+    ASSERT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+    header.version += 1;
+    fseek(file, 0, SEEK_SET);
+    ASSERT_EQ(fwrite(&header, sizeof(header), 1, file), 1u);
+    fclose(file);
+
+    EXPECT_FALSE(Manifest(manifest_path).valid());
+}
+
+TEST_F(ManifestTest, PerfectHashFindsEveryPath) {
+    auto options          = small_image();
+    options.file_count    = 5000;
+    options.files_per_dir = 0;
+    options.max_size      = 1024;
+    build(options);
+
+    Manifest manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+    ASSERT_EQ(manifest.size(), options.file_count);
+
+    Array<bool> seen(options.file_count, false);
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto index = manifest.find(synthetic_file_path(options, i));
+        ASSERT_GE(index, 0);
+        EXPECT_EQ(manifest.path(index), synthetic_file_path(options, i));
+
+        // the hash is minimal, every path has a slot of its own
+        EXPECT_FALSE(seen[index]);
+        seen[index] = true;
+    }
+}
+
+TEST_F(ManifestTest, PerfectHashRejectsMissingPaths) {
+    auto options = small_image();
+    build(options);
+
+    Manifest manifest(manifest_path);
+    ASSERT_TRUE(manifest.valid());
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        auto file_path = synthetic_file_path(options, i);
+
+        EXPECT_EQ(manifest.find(file_path + "x"), -1);
+        EXPECT_EQ(manifest.find(file_path.substr(0, file_path.size() - 1)), -1);
+        EXPECT_EQ(manifest.find(file_path.substr(1)), -1);
+    }
+
+    // directories are not indexed
+    EXPECT_EQ(manifest.find("/d00000000"), -1);
+    EXPECT_EQ(manifest.find(""), -1);
+}
@@ -0,0 +1,208 @@
+#include "bcachefs.h"
+#include "metrics.h"
+#include "test_image.h"
+#include "test_json.h"
+
+#include <cmath>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <thread>
+
+TEST(Histogram, BucketsHoldTheirValues) {
+    Array<uint64_t> values;
+    for (uint64_t v = 0; v < 4096; ++v) {
+        values.push_back(v);
+    }
+    for (int bits = 12; bits < 64; ++bits) {
+        auto power = (uint64_t)1 << bits;
+        values.insert(values.end(), {power - 1, power, power + 1, power + power / 3});
+    }
+    values.push_back(~0ULL);
+
+    for (auto value: values) {
+        auto bucket = Histogram::bucket_of(value);
+        ASSERT_LT(bucket, (std::size_t)HISTOGRAM_BUCKETS) << value;
+
+        // the value is above the previous bucket and below the limit of its own
+        EXPECT_GE(HistogramSnapshot::bucket_limit(bucket), value);
+        if (bucket > 0) {
+            EXPECT_LT(HistogramSnapshot::bucket_limit(bucket - 1), value);
+        }
+
+        // the width of a bucket is at most 1 / HISTOGRAM_SUB_BUCKETS of its values
+        auto lower = bucket > 0 ? HistogramSnapshot::bucket_limit(bucket - 1) + 1 : 0;
+        auto width = HistogramSnapshot::bucket_limit(bucket) - lower;
+        EXPECT_LE(width, std::max<uint64_t>(lower / HISTOGRAM_SUB_BUCKETS, 1));
+    }
+
+    // small values have a bucket each
+    for (uint64_t v = 0; v < HISTOGRAM_SUB_BUCKETS; ++v) {
+        EXPECT_EQ(Histogram::bucket_of(v), v);
+    }
+}
+
+TEST(Histogram, PercentilesOfAUniformDistribution) {
+    Histogram histogram;
+    for (uint64_t v = 1; v <= 10000; ++v) {
+        histogram.record(v);
+    }
+
+    HistogramSnapshot snapshot;
+    histogram.collect(snapshot);
+    EXPECT_EQ(snapshot.count, 10000u);
+    EXPECT_EQ(snapshot.sum, 10000u * 10001u / 2);
+    EXPECT_EQ(snapshot.max, 10000u);
+
+    // the percentile is the limit of the bucket holding the value, at most 1 / HISTOGRAM_SUB_BUCKETS above it
+    for (double p: {1.0, 25.0, 50.0, 90.0, 99.0, 99.9}) {
+        auto exact  = (uint64_t)(p * 100);
+        auto result = snapshot.percentile(p);
+        EXPECT_GE(result, exact) << p;
+        EXPECT_LE(result, exact + exact / HISTOGRAM_SUB_BUCKETS) << p;
+    }
+    EXPECT_EQ(snapshot.percentile(100), 10000u);
+    EXPECT_EQ(HistogramSnapshot().percentile(50), 0u);
+}
+
+TEST(Histogram, ConstantValueGivesItsPercentiles) {
+    Histogram histogram;
+    for (int i = 0; i < 100; ++i) {
+        histogram.record(1000);
+    }
+
+    HistogramSnapshot snapshot;
+    histogram.collect(snapshot);
+
+    // capped by the max
+    for (double p: {0.1, 50.0, 99.9}) {
+        EXPECT_EQ(snapshot.percentile(p), 1000u);
+    }
+}
+
+TEST(Metrics, ShardsOfEveryThreadAreSummed) {
+    Metrics metrics;
+
+    Array<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&metrics]() {
+            for (int i = 0; i < 1000; ++i) {
+                auto &shard = metrics.local();
+                shard.add(shard.bytes_read, 2);
+                shard.lookup.record(i);
+            }
+
+            DeferredCounter keys(metrics, &MetricsShard::keys_decoded);
+            keys.add(5);
+            auto copy = keys;
+            copy.add(1);
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    auto snapshot = metrics.snapshot();
+    EXPECT_EQ(snapshot.bytes_read, 16000u);
+    EXPECT_EQ(snapshot.lookup.count, 8000u);
+    EXPECT_EQ(snapshot.keys_decoded, 48u);
+}
+
+namespace {
+// snapshot of a reader that read every file of a small image
+MetricsSnapshot reader_snapshot(String const &path) {
+    auto options = small_image();
+    EXPECT_TRUE(write_synthetic_image(path, options));
+
+    BCacheFSReader reader(path);
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        reader.read_file(synthetic_file_inode(options, i));
+    }
+    reader.find(BTREE_ID_inodes, POS(0, synthetic_file_inode(options, 0)));
+    return reader.metrics();
+}
+} // namespace
+
+TEST_F(ImageTest, MetricsJsonIsWellFormed) {
+    auto snapshot = reader_snapshot(path);
+    ASSERT_GT(snapshot.file_read.count, 0u);
+
+    Json json;
+    ASSERT_TRUE(Json::parse(snapshot.json(), json)) << snapshot.json();
+    ASSERT_EQ(json.type, Json::OBJECT);
+
+    EXPECT_EQ(json["nodes_loaded"]["extents"].number, (double)snapshot.nodes_loaded[BTREE_ID_extents]);
+    EXPECT_EQ(json["nodes_loaded"]["inodes"].number, (double)snapshot.nodes_loaded[BTREE_ID_inodes]);
+    EXPECT_EQ(json["bytes_read"].number, (double)snapshot.bytes_read);
+    EXPECT_EQ(json["keys_decoded"].number, (double)snapshot.keys_decoded);
+    EXPECT_EQ(json["lookups"].number, (double)snapshot.lookups);
+
+    for (auto name: {"node_read", "lookup", "file_read"}) {
+        auto &histogram = json["latency_ns"][name];
+        for (auto field: {"count", "sum", "max", "p50", "p90", "p99", "p99.9"}) {
+            EXPECT_EQ(histogram[field].type, Json::NUMBER) << name << " " << field;
+        }
+        EXPECT_LE(histogram["p50"].number, histogram["p99"].number);
+        EXPECT_LE(histogram["p99.9"].number, histogram["max"].number);
+    }
+    EXPECT_EQ(json["latency_ns"]["file_read"]["count"].number, (double)snapshot.file_read.count);
+}
+
+TEST_F(ImageTest, MetricsPrometheusIsWellFormed) {
+    auto snapshot = reader_snapshot(path);
+    auto text     = snapshot.prometheus("test");
+
+    std::regex type_line(R"(# TYPE (test_[a-z_]+) (counter|histogram))");
+    std::regex sample_line(R"re((test_[a-z_]+)(\{([a-z]+)="([^"]*)"\})? ([0-9.e+-]+))re");
+
+    std::map<std::string, std::string> types;
+    std::map<std::string, double>      values;
+    std::map<std::string, double>      last_bucket; // le and count of the previous bucket of each histogram
+    std::map<std::string, double>      last_le;
+
+    std::istringstream lines(text);
+    for (std::string line; std::getline(lines, line);) {
+        std::smatch match;
+        if (std::regex_match(line, match, type_line)) {
+            EXPECT_EQ(types.count(match[1]), 0u) << "declared twice: " << line;
+            types[match[1]] = match[2];
+            continue;
+        }
+
+        ASSERT_TRUE(std::regex_match(line, match, sample_line)) << line;
+        std::string name  = match[1];
+        double      value = std::stod(match[5]);
+
+        if (name.ends_with("_bucket")) {
+            auto family = name.substr(0, name.size() - 7);
+            ASSERT_EQ(types[family], "histogram") << line;
+            ASSERT_EQ(match[3], "le") << line;
+
+            // buckets are cumulative and sorted by their limit
+            auto le = match[4] == "+Inf" ? INFINITY : std::stod(match[4]);
+            if (last_le.count(family)) {
+                EXPECT_GT(le, last_le[family]) << line;
+                EXPECT_GE(value, last_bucket[family]) << line;
+            }
+            last_le[family]     = le;
+            last_bucket[family] = value;
+        } else if (name.ends_with("_sum") || name.ends_with("_count")) {
+            auto family = name.substr(0, name.rfind('_'));
+            ASSERT_EQ(types[family], "histogram") << line;
+            values[name] = value;
+        } else {
+            ASSERT_EQ(types[name], "counter") << line;
+            values[match[0].str().substr(0, match[0].str().rfind(' '))] = value;
+        }
+    }
+
+    EXPECT_EQ(values["test_bytes_read_total"], (double)snapshot.bytes_read);
+    EXPECT_EQ(values["test_nodes_loaded_total{btree=\"extents\"}"], (double)snapshot.nodes_loaded[BTREE_ID_extents]);
+    EXPECT_EQ(values["test_lookups_total"], (double)snapshot.lookups);
+
+    // the +Inf bucket holds every value
+    EXPECT_EQ(last_le["test_file_read_seconds"], INFINITY);
+    EXPECT_EQ(last_bucket["test_file_read_seconds"], (double)snapshot.file_read.count);
+    EXPECT_EQ(values["test_file_read_seconds_count"], (double)snapshot.file_read.count);
+    EXPECT_NEAR(values["test_file_read_seconds_sum"], (double)snapshot.file_read.sum * 1e-9, 1e-6);
+}
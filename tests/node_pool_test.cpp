@@ -0,0 +1,164 @@
+#include "bcachefs.h"
+#include "node_pool.h"
+#include "test_image.h"
+
+#include <cstring>
+#include <set>
+#include <thread>
+
+#include <sys/stat.h>
+
+TEST(NodePool, ReleasedBuffersAreRecycled) {
+    NodePool pool(16 * 1024);
+
+    auto first = pool.acquire();
+    ASSERT_TRUE(first);
+    auto data = first.get();
+    EXPECT_EQ(pool.used(), 1u);
+
+    first.reset();
+    EXPECT_EQ(pool.used(), 0u);
+
+    // the free list hands back the last released buffer
+    auto second = pool.acquire();
+    EXPECT_EQ(second.get(), data);
+    EXPECT_EQ(pool.capacity(), NODE_POOL_SLAB_ALIGN / pool.node_size());
+}
+
+TEST(NodePool, LastHandleReleasesTheBuffer) {
+    NodePool pool(16 * 1024);
+
+    auto node = pool.acquire();
+    EXPECT_EQ(node.use_count(), 1u);
+    {
+        auto copy = node;
+        EXPECT_EQ(node.use_count(), 2u);
+        EXPECT_EQ(copy.get(), node.get());
+
+        // moving a handle does not change the count
+        auto moved = std::move(copy);
+        EXPECT_FALSE(copy);
+        EXPECT_EQ(node.use_count(), 2u);
+    }
+    EXPECT_EQ(node.use_count(), 1u);
+    EXPECT_EQ(pool.used(), 1u);
+
+    node = nullptr;
+    EXPECT_EQ(pool.used(), 0u);
+}
+
+TEST(NodePool, GrowsBySlabs) {
+    NodePool pool(256 * 1024);
+    auto     per_slab = pool.capacity();
+    EXPECT_EQ(per_slab, 0u);
+
+    Array<NodeRef>                nodes;
+    std::set<struct btree_node *> buffers;
+    for (int i = 0; i < 20; ++i) {
+        nodes.push_back(pool.acquire());
+        ASSERT_TRUE(nodes.back());
+        buffers.insert(nodes.back().get());
+
+        // the buffers are node_size apart and aligned on the slab
+        EXPECT_EQ((uintptr_t)nodes.back().get() % pool.node_size(), 0u);
+    }
+    EXPECT_EQ(buffers.size(), 20u);
+
+    // 2MiB slabs of 8 nodes of 256KiB
+    EXPECT_EQ(pool.capacity(), 24u);
+    EXPECT_EQ(pool.used(), 20u);
+
+    // the buffers are writable
+    for (auto &node: nodes) {
+        memset(node.get(), 0xff, pool.node_size());
+    }
+
+    nodes.clear();
+    EXPECT_EQ(pool.used(), 0u);
+    EXPECT_EQ(pool.capacity(), 24u);
+}
+
+TEST(NodePool, HandlesAreSharedAcrossThreads) {
+    NodePool pool(16 * 1024);
+    auto     node = pool.acquire();
+
+    Array<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([node]() {
+            for (int i = 0; i < 10000; ++i) {
+                auto copy = node;
+                ASSERT_TRUE(copy);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(node.use_count(), 1u);
+    EXPECT_EQ(pool.used(), 1u);
+}
+
+namespace {
+BTreePtr const *root_ptr(BCacheFSReader const &reader, BTreeType btree) {
+    auto entry = reader._btree_roots[btree];
+    return (BTreePtr const *)((uint8_t const *)&entry->start->k + BKEY_U64s * BCH_U64S_SIZE);
+}
+} // namespace
+
+TEST_F(ImageTest, NodeCacheSharesTheNodeAcrossThreads) {
+    ASSERT_TRUE(write_synthetic_image(path, small_image()));
+
+    BCacheFSReader reader(path);
+    auto           ptr = root_ptr(reader, BTREE_ID_extents);
+    {
+        NodeCache cache;
+
+        Array<struct btree_node *> loaded(8);
+        Array<std::thread>         threads;
+        for (std::size_t t = 0; t < loaded.size(); ++t) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < 100; ++i) {
+                    auto node = reader.load_btree_node(ptr, &cache);
+                    ASSERT_TRUE(node);
+                    loaded[t] = node.get();
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        // the node was read once, every thread got the same buffer
+        EXPECT_EQ(reader.metrics().nodes_loaded[BTREE_ID_extents], 1u);
+        for (auto node: loaded) {
+            EXPECT_EQ(node, loaded[0]);
+        }
+        EXPECT_EQ(reader._nodes->used(), 1u);
+    }
+
+    // the cache held the last handle
+    EXPECT_EQ(reader._nodes->used(), 0u);
+}
+
+TEST_F(ImageTest, ShortNodeReadsAreDropped) {
+    ASSERT_TRUE(write_synthetic_image(path, small_image()));
+
+    struct stat info;
+    ASSERT_EQ(stat(path.c_str(), &info), 0);
+
+    BCacheFSReader reader(path);
+
+    // a pointer to the last sector of the image, the node goes past its end
+    Array<uint64_t> words(sizeof(BTreePtr) / BCH_U64S_SIZE + 2, 0);
+    auto            ptr = (BTreePtr *)words.data();
+    memcpy(ptr, root_ptr(reader, BTREE_ID_extents), sizeof(BTreePtr) + sizeof(struct bch_extent_ptr));
+    ptr->start->offset = (uint64_t)info.st_size / BCH_SECTOR_SIZE - 1;
+
+    EXPECT_FALSE(reader.load_btree_node(ptr));
+    EXPECT_EQ(reader._nodes->used(), 0u);
+
+    NodeCache cache;
+    EXPECT_FALSE(reader.load_btree_node(ptr, &cache));
+    EXPECT_EQ(reader._nodes->used(), 0u);
+}
@@ -0,0 +1,165 @@
+#include "packer.h"
+#include "test_image.h"
+#include "walker.h"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+
+#include <dirent.h>
+
+namespace {
+// a tree of 3 classes, every class holds inline, single block and multi block files
+struct PackerTest: public ImageTest {
+    protected:
+    void SetUp() override {
+        ImageTest::SetUp();
+        root = path + ".src";
+
+        uint64_t sizes[] = {0, 10, 1024, 1025, 4096, 5000, 3 * 4096 + 7, 64 * 1024};
+        for (auto dir: {"a", "b", "c/d"}) {
+            std::filesystem::create_directories(root + "/" + dir);
+
+            for (uint64_t i = 0; i < std::size(sizes); ++i) {
+                auto           relative = fmt::format("{}/f{}", dir, i);
+                Array<uint8_t> data(sizes[i]);
+                for (uint64_t j = 0; j < data.size(); ++j) {
+                    data[j] = (uint8_t)(j * 31 + i * 7 + relative.size());
+                }
+
+                std::ofstream(root + "/" + relative, std::ios::binary).write((char const *)data.data(), data.size());
+                content[relative] = std::move(data);
+            }
+        }
+        files = list_files(root);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(root);
+        ImageTest::TearDown();
+    }
+
+    // pack the tree, check every file and return the files sorted by the offset of their data
+    Array<String> pack(PackOptions const &options) {
+        EXPECT_TRUE(pack_image(path, root, files, options));
+
+        BCacheFSReader reader(path);
+        EXPECT_TRUE(reader.valid());
+
+        std::map<String, uint64_t> inodes;
+        auto                       table = walk_tree(reader);
+        for (auto &entry: table.entries) {
+            if (entry.type == DT_REG) {
+                inodes[String(entry.path)] = entry.inode;
+            }
+        }
+        EXPECT_EQ(inodes.size(), content.size());
+
+        Array<std::pair<uint64_t, String>> placed;
+        Array<std::pair<uint64_t, String>> by_inode;
+        for (auto &[relative, data]: content) {
+            auto inode = inodes[relative];
+            EXPECT_EQ(reader.read_file(inode), data) << relative;
+            by_inode.emplace_back(inode, relative);
+
+            // tiny files live in their key, the others in a single block aligned extent
+            Array<uint8_t> types;
+            reader.for_each_key(BTREE_ID_extents, KeyFilter({}, inode, inode), [&](KeySpan span) {
+                for (auto &view: span) {
+                    types.push_back(view.key->type);
+                }
+            });
+
+            if (data.empty()) {
+                EXPECT_TRUE(types.empty()) << relative;
+            } else if (data.size() <= options.inline_size) {
+                EXPECT_EQ(types, Array<uint8_t>{KEY_TYPE_inline_data}) << relative;
+            } else {
+                auto extents = reader.file_extents(inode);
+                EXPECT_EQ(types, Array<uint8_t>{KEY_TYPE_extent}) << relative;
+                EXPECT_EQ(extents.size(), 1u) << relative;
+                EXPECT_EQ(extents[0].offset % options.image.block_size, 0u) << relative;
+                placed.emplace_back(extents[0].offset, relative);
+            }
+        }
+
+        // the inodes follow the physical order as well
+        std::sort(placed.begin(), placed.end());
+        std::sort(by_inode.begin(), by_inode.end());
+
+        auto          order = pack_order(files, options);
+        Array<String> expected;
+        Array<String> physical;
+        for (auto i: order) {
+            if (content[files[i]].size() > options.inline_size) {
+                expected.push_back(files[i]);
+            }
+        }
+        for (auto &[offset, relative]: placed) {
+            physical.push_back(relative);
+        }
+        EXPECT_EQ(physical, expected);
+
+        for (uint64_t k = 0; k < order.size(); ++k) {
+            EXPECT_EQ(by_inode[k].second, files[order[k]]);
+        }
+        return physical;
+    }
+
+    String                           root;
+    Array<String>                    files;
+    std::map<String, Array<uint8_t>> content;
+};
+} // namespace
+
+TEST_F(PackerTest, SortedOrderFollowsThePaths) {
+    PackOptions options;
+    options.order = PackOrder::SORTED;
+
+    auto physical = pack(options);
+    EXPECT_TRUE(std::is_sorted(physical.begin(), physical.end()));
+}
+
+TEST_F(PackerTest, ShuffledOrderInterleavesTheClasses) {
+    PackOptions options;
+    options.order      = PackOrder::SHUFFLED_BY_CLASS;
+    options.image.seed = 3;
+
+    pack(options);
+
+    // the classes have the same size, every round of the deal holds each of them once
+    auto order = pack_order(files, options);
+    ASSERT_EQ(order.size(), 24u);
+    for (uint64_t round = 0; round < 8; ++round) {
+        std::set<String> classes;
+        for (uint64_t k = round * 3; k < round * 3 + 3; ++k) {
+            classes.insert(files[order[k]].substr(0, files[order[k]].rfind('/')));
+        }
+        EXPECT_EQ(classes, (std::set<String>{"a", "b", "c/d"}));
+    }
+
+    // the files of a class are shuffled
+    Array<String> first_class;
+    for (auto i: order) {
+        if (files[i].starts_with("a/")) {
+            first_class.push_back(files[i]);
+        }
+    }
+    EXPECT_FALSE(std::is_sorted(first_class.begin(), first_class.end()));
+}
+
+TEST_F(PackerTest, AccessOrderPlacesTheListedFilesFirst) {
+    PackOptions options;
+    options.order  = PackOrder::ACCESS;
+    options.access = {"c/d/f7", "/a/f6", "./b/f5", "missing", "c/d/f7"};
+
+    auto physical = pack(options);
+    ASSERT_GE(physical.size(), 3u);
+    EXPECT_EQ(physical[0], "c/d/f7");
+    EXPECT_EQ(physical[1], "a/f6");
+    EXPECT_EQ(physical[2], "b/f5");
+
+    // the files that are not listed follow sorted
+    EXPECT_TRUE(std::is_sorted(physical.begin() + 3, physical.end()));
+}
@@ -0,0 +1,295 @@
+#include "checksum.h"
+#include "image_writer.h"
+#include "pipeline.h"
+#include "test_image.h"
+
+#include <set>
+
+TEST(BoundedQueue, KeepsTheOrderOfASingleProducer) {
+    BoundedQueue<int> queue(8);
+
+    std::thread producer([&]() {
+        for (int i = 0; i < 10000; ++i) {
+            queue.push(i);
+        }
+        queue.close();
+    });
+
+    int expected = 0;
+    int value;
+    while (queue.pop(value)) {
+        EXPECT_EQ(value, expected++);
+    }
+    producer.join();
+    EXPECT_EQ(expected, 10000);
+}
+
+TEST(BoundedQueue, DeliversEveryValueToManyConsumers) {
+    BoundedQueue<int> queue(16);
+
+    int constexpr producers    = 4;
+    int constexpr per_producer = 5000;
+
+    Array<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, p]() {
+            for (int i = 0; i < per_producer; ++i) {
+                queue.push(p * per_producer + i);
+            }
+        });
+    }
+
+    Array<Array<int>>  received(4);
+    Array<std::thread> consumers;
+    for (auto &values: received) {
+        consumers.emplace_back([&queue, &values]() {
+            int value;
+            while (queue.pop(value)) {
+                values.push_back(value);
+            }
+        });
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    queue.close();
+    for (auto &thread: consumers) {
+        thread.join();
+    }
+
+    std::set<int> seen;
+    for (auto &values: received) {
+        // a consumer sees the values of a producer in order
+        for (std::size_t i = 1; i < values.size(); ++i) {
+            if (values[i] / per_producer == values[i - 1] / per_producer) {
+                EXPECT_GT(values[i], values[i - 1]);
+            }
+        }
+        seen.insert(values.begin(), values.end());
+    }
+    EXPECT_EQ(seen.size(), std::size_t(producers * per_producer));
+}
+
+TEST(BoundedQueue, PushWaitsWhileTheQueueIsFull) {
+    BoundedQueue<int> queue(4);
+
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(queue.try_push(i));
+    }
+    int value = 4;
+    EXPECT_FALSE(queue.try_push(value));
+
+    std::atomic<bool> pushed{false};
+    std::thread       producer([&]() {
+        queue.push(4);
+        pushed = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_FALSE(pushed);
+
+    ASSERT_TRUE(queue.pop(value));
+    EXPECT_EQ(value, 0);
+    producer.join();
+    EXPECT_TRUE(pushed);
+
+    for (int expected = 1; expected <= 4; ++expected) {
+        ASSERT_TRUE(queue.try_pop(value));
+        EXPECT_EQ(value, expected);
+    }
+}
+
+TEST(BoundedQueue, CloseUnblocksAndDrains) {
+    BoundedQueue<int> queue(2);
+    queue.push(1);
+    queue.push(2);
+
+    // a producer waiting on the full queue gives up
+    std::thread producer([&]() { EXPECT_FALSE(queue.push(3)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    queue.close();
+    producer.join();
+
+    // the values pushed before closing are still delivered
+    int value;
+    EXPECT_TRUE(queue.pop(value));
+    EXPECT_EQ(value, 1);
+    EXPECT_TRUE(queue.pop(value));
+    EXPECT_EQ(value, 2);
+    EXPECT_FALSE(queue.pop(value));
+    EXPECT_FALSE(queue.push(4));
+}
+
+namespace {
+struct PipelineTest: public ImageTest {
+    protected:
+    void SetUp() override {
+        ImageTest::SetUp();
+        ASSERT_TRUE(write_synthetic_image(path, options));
+
+        for (uint64_t i = 0; i < options.file_count; ++i) {
+            inodes.push_back(synthetic_file_inode(options, i));
+        }
+    }
+
+    SyntheticOptions options = small_image();
+    Array<uint64_t>  inodes;
+};
+} // namespace
+
+TEST_F(PipelineTest, DeliversEverySampleOnce) {
+    BCacheFSReader reader(path);
+
+    PipelineOptions pipeline_options;
+    pipeline_options.lookup_threads    = 2;
+    pipeline_options.read_threads      = 4;
+    pipeline_options.transform_threads = 2;
+    pipeline_options.queue_size        = 8;
+
+    Pipeline pipeline(reader, inodes, pipeline_options);
+
+    Array<bool> delivered(options.file_count, false);
+    Sample      sample;
+    while (pipeline.next(sample)) {
+        ASSERT_LT(sample.index, options.file_count);
+        EXPECT_FALSE(delivered[sample.index]) << "sample " << sample.index;
+        delivered[sample.index] = true;
+
+        EXPECT_EQ(sample.inode, inodes[sample.index]);
+        EXPECT_EQ(sample.data, file_content(options, sample.index)) << "sample " << sample.index;
+    }
+
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        EXPECT_TRUE(delivered[i]) << "sample " << i;
+    }
+}
+
+TEST_F(PipelineTest, SlowConsumerStallsTheStages) {
+    BCacheFSReader reader(path);
+
+    std::atomic<uint64_t> transformed{0};
+    PipelineOptions       pipeline_options;
+    pipeline_options.queue_size = 2;
+    pipeline_options.transform  = [&](Sample &) {
+        transformed += 1;
+        return true;
+    };
+
+    Pipeline pipeline(reader, inodes, pipeline_options);
+
+    // two samples fill the output queue and a third waits to be pushed
+    for (int i = 0; i < 1000 && transformed < 3; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(transformed, 3u);
+
+    uint64_t count = 0;
+    Sample   sample;
+    while (pipeline.next(sample)) {
+        count += 1;
+    }
+    EXPECT_EQ(count, options.file_count);
+    EXPECT_EQ(transformed, options.file_count);
+}
+
+TEST_F(PipelineTest, DestroyingStopsTheStages) {
+    BCacheFSReader reader(path);
+
+    PipelineOptions pipeline_options;
+    pipeline_options.queue_size = 2;
+
+    // the stages are blocked on full queues, the destructor must not wait for them
+    auto   pipeline = std::make_unique<Pipeline>(reader, inodes, pipeline_options);
+    Sample sample;
+    ASSERT_TRUE(pipeline->next(sample));
+    pipeline.reset();
+}
+
+TEST_F(PipelineTest, TransformCanDropSamples) {
+    BCacheFSReader reader(path);
+
+    PipelineOptions pipeline_options;
+    pipeline_options.transform = [](Sample &sample) { return sample.index % 2 == 0; };
+
+    Pipeline pipeline(reader, inodes, pipeline_options);
+
+    uint64_t count = 0;
+    Sample   sample;
+    while (pipeline.next(sample)) {
+        EXPECT_EQ(sample.index % 2, 0u);
+        count += 1;
+    }
+    EXPECT_EQ(count, (options.file_count + 1) / 2);
+}
+
+namespace {
+// a file of blocks [skip, skip + blocks) of a region of region_blocks blocks written with a crc entry,
+// corrupt changes the region after computing its checksum
+uint64_t add_checksummed_file(ImageWriter &image, uint64_t inode, uint64_t region_blocks, uint64_t skip,
+                              uint64_t blocks, bool corrupt) {
+    Array<uint8_t> region(region_blocks * 4096);
+    for (uint64_t i = 0; i < region.size(); ++i) {
+        region[i] = (uint8_t)(inode + i / 4096);
+    }
+
+    struct bch_csum csum;
+    compute_checksum(BCH_CSUM_crc32c_nonzero, region.data(), region.size(), csum);
+    if (corrupt) {
+        region[region.size() - 1] ^= 1;
+    }
+    auto start = image.append(region.data(), region.size(), 4096);
+
+    // sizes are stored minus 1
+    struct {
+        struct bch_extent_crc32 crc;
+        BExtendPtr              ptr;
+    } value = {};
+
+    value.crc.type               = 1 << BCH_EXTENT_ENTRY_crc32;
+    value.crc._compressed_size   = region_blocks * 8 - 1;
+    value.crc._uncompressed_size = region_blocks * 8 - 1;
+    value.crc.offset             = skip * 8;
+    value.crc.csum_type          = BCH_CSUM_crc32c_nonzero;
+    value.crc.csum               = (uint32_t)csum.lo;
+    value.ptr.type               = 1 << BCH_EXTENT_ENTRY_ptr;
+    value.ptr.offset             = start / BCH_SECTOR_SIZE;
+
+    EXPECT_TRUE(image.add_key(BTREE_ID_extents, POS(inode, blocks * 8), KEY_TYPE_extent, blocks * 8, &value,
+                              sizeof(value)));
+    EXPECT_TRUE(image.add_inode(inode, S_IFREG | 0644, blocks * 4096, 1));
+    return start;
+}
+} // namespace
+
+TEST_F(ImageTest, PipelineDropsSamplesFailingTheirChecksum) {
+    uint64_t base = BCACHEFS_ROOT_INO + 1;
+    {
+        ImageWriter image(path);
+        EXPECT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+
+        add_checksummed_file(image, base + 0, 2, 0, 2, false); // verified in place
+        add_checksummed_file(image, base + 1, 3, 1, 1, false); // trimmed, the region is read again
+        add_checksummed_file(image, base + 2, 2, 0, 2, true);
+        add_checksummed_file(image, base + 3, 3, 1, 1, true);
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    auto           deliver = [&](bool verify) {
+        PipelineOptions options;
+        options.verify = verify;
+
+        Pipeline           pipeline(reader, {base, base + 1, base + 2, base + 3}, options);
+        std::set<uint64_t> inodes;
+        Sample             sample;
+        while (pipeline.next(sample)) {
+            inodes.insert(sample.inode);
+        }
+        return inodes;
+    };
+
+    EXPECT_EQ(deliver(true), (std::set<uint64_t>{base, base + 1}));
+    EXPECT_EQ(deliver(false), (std::set<uint64_t>{base, base + 1, base + 2, base + 3}));
+}
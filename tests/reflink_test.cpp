@@ -0,0 +1,130 @@
+#include "bcachefs.h"
+#include "image_writer.h"
+#include "test_image.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+uint64_t const FIRST_FILE = BCACHEFS_ROOT_INO + 1;
+
+// block i of the data is filled with i + 1
+Array<uint8_t> blocks(uint64_t count) {
+    Array<uint8_t> data(count * 4096);
+    for (uint64_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t)(i / 4096 + 1);
+    }
+    return data;
+}
+
+Array<std::pair<uint64_t, uint64_t>> ranges(Array<Extend> const &extents, uint64_t start) {
+    Array<std::pair<uint64_t, uint64_t>> out;
+    for (auto &ext: extents) {
+        out.emplace_back(ext.file_offset, ext.offset - start);
+    }
+    return out;
+}
+} // namespace
+
+TEST_F(ImageTest, ReflinkPointerSpansTwoIndirectExtents) {
+    uint64_t start = 0;
+    {
+        ImageWriter image(path);
+        auto        data = blocks(4);
+        start            = image.append(data.data(), data.size(), 4096);
+
+        // the pointer starts in the middle of the first indirect extent and ends in the middle of the second
+        ASSERT_TRUE(image.add_reflink_p(FIRST_FILE, 0, 2048, 6144));
+        ASSERT_TRUE(image.add_indirect_extent(0, start, 4096));
+        ASSERT_TRUE(image.add_indirect_extent(4096, start + 2 * 4096, 8192));
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(FIRST_FILE, S_IFREG | 0644, 6144, 1));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    auto           extents = reader.file_extents(FIRST_FILE);
+
+    ASSERT_EQ(extents.size(), 2u);
+    EXPECT_EQ(ranges(extents, start), (Array<std::pair<uint64_t, uint64_t>>{{0, 2048}, {2048, 2 * 4096}}));
+    EXPECT_EQ(extents[0].size, 2048u);
+    EXPECT_EQ(extents[1].size, 4096u);
+
+    auto data = reader.read_file(FIRST_FILE);
+    ASSERT_EQ(data.size(), 6144u);
+    EXPECT_EQ(Array<uint8_t>(data.begin(), data.begin() + 2048), Array<uint8_t>(2048, 1));
+    EXPECT_EQ(Array<uint8_t>(data.begin() + 2048, data.end()), Array<uint8_t>(4096, 3));
+}
+
+TEST_F(ImageTest, SharedIndirectExtentsAreCached) {
+    uint64_t start = 0;
+    {
+        ImageWriter image(path);
+        auto        data = blocks(2);
+        start            = image.append(data.data(), data.size(), 4096);
+
+        // both files share the same indirect extent, the second one starts one block into it
+        ASSERT_TRUE(image.add_reflink_p(FIRST_FILE, 0, 0, 8192));
+        ASSERT_TRUE(image.add_reflink_p(FIRST_FILE + 1, 0, 4096, 4096));
+        ASSERT_TRUE(image.add_indirect_extent(0, start, 8192));
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(FIRST_FILE, S_IFREG | 0644, 8192, 1));
+        ASSERT_TRUE(image.add_inode(FIRST_FILE + 1, S_IFREG | 0644, 4096, 1));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    auto           before = reader.metrics();
+
+    EXPECT_EQ(reader.read_file(FIRST_FILE), blocks(2));
+    EXPECT_EQ(reader.read_file(FIRST_FILE + 1), Array<uint8_t>(4096, 2));
+
+    auto extents = reader.file_extents(FIRST_FILE + 1);
+    ASSERT_EQ(extents.size(), 1u);
+    EXPECT_EQ(extents[0].offset, start + 4096);
+
+    // only the first lookup walks the reflink btree
+    auto after = reader.metrics();
+    EXPECT_EQ(after.cache_misses - before.cache_misses, 1u);
+    EXPECT_EQ(after.cache_hits - before.cache_hits, 2u);
+}
+
+TEST_F(ImageTest, ReflinkPointerToIndirectInlineData) {
+    Array<uint8_t> data(300);
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t)(i * 7);
+    }
+    {
+        ImageWriter image(path);
+        ASSERT_TRUE(image.add_reflink_p(FIRST_FILE, 0, 0, 512));
+        ASSERT_TRUE(image.add_indirect_inline_data(0, data.data(), data.size()));
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(FIRST_FILE, S_IFREG | 0644, data.size(), 1));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    EXPECT_EQ(reader.read_file(FIRST_FILE), data);
+}
+
+TEST_F(ImageTest, MissingIndirectExtentIsAHole) {
+    {
+        ImageWriter image(path);
+        auto        data  = blocks(1);
+        auto        start = image.append(data.data(), data.size(), 4096);
+
+        // the second block of the pointer has no indirect extent
+        ASSERT_TRUE(image.add_reflink_p(FIRST_FILE, 0, 0, 8192));
+        ASSERT_TRUE(image.add_indirect_extent(0, start, 4096));
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(FIRST_FILE, S_IFREG | 0644, 8192, 1));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    EXPECT_EQ(reader.file_extents(FIRST_FILE).size(), 1u);
+
+    auto expected = blocks(1);
+    expected.resize(8192, 0);
+    EXPECT_EQ(reader.read_file(FIRST_FILE), expected);
+}
@@ -0,0 +1,131 @@
+#include "shuffle.h"
+#include "test_image.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+// offsets of count samples in a random order, with a few samples sharing an offset
+Array<uint64_t> random_offsets(uint64_t count) {
+    SplitMix64      rng{7};
+    Array<uint64_t> offsets(count);
+    for (auto &offset: offsets) {
+        offset = rng.below(count / 2) * 4096;
+    }
+    return offsets;
+}
+
+// window of every sample: its rank by offset divided by the window size
+Array<uint64_t> windows(Array<uint64_t> const &offsets, uint64_t window_size) {
+    Array<uint64_t> sorted(offsets.size());
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::stable_sort(sorted.begin(), sorted.end(), [&](uint64_t a, uint64_t b) { return offsets[a] < offsets[b]; });
+
+    Array<uint64_t> out(offsets.size());
+    for (uint64_t rank = 0; rank < sorted.size(); ++rank) {
+        out[sorted[rank]] = rank / window_size;
+    }
+    return out;
+}
+} // namespace
+
+TEST(SplitMix64, MatchesTheReferenceSequence) {
+    SplitMix64 rng{0};
+    EXPECT_EQ(rng(), 0xe220a8397b1dcdafULL);
+    EXPECT_EQ(rng(), 0x6e789e6aa1b965f4ULL);
+    EXPECT_EQ(rng(), 0x06c45d188009454fULL);
+
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_LT(rng.below(10), 10u);
+    }
+}
+
+TEST(EpochShuffler, SameSeedGivesTheSameOrder) {
+    auto offsets = random_offsets(1000);
+
+    ShuffleOptions options;
+    options.window_size = 32;
+    options.seed        = 1234;
+
+    EpochShuffler a(offsets, options);
+    EpochShuffler b(offsets, options);
+    EXPECT_EQ(a.epoch(0), b.epoch(0));
+    EXPECT_EQ(a.epoch(5), b.epoch(5));
+
+    // other epochs and other seeds give other orders
+    EXPECT_NE(a.epoch(0), a.epoch(1));
+
+    options.seed = 4321;
+    EpochShuffler c(offsets, options);
+    EXPECT_NE(a.epoch(0), c.epoch(0));
+}
+
+TEST(EpochShuffler, EpochIsAPermutation) {
+    for (uint64_t count: {0, 1, 31, 1000}) {
+        auto offsets = random_offsets(count);
+
+        ShuffleOptions options;
+        options.window_size = 32;
+        options.interleave  = 3;
+
+        EpochShuffler shuffler(offsets, options);
+        ASSERT_EQ(shuffler.size(), count);
+
+        for (uint64_t epoch = 0; epoch < 3; ++epoch) {
+            auto order = shuffler.epoch(epoch);
+            ASSERT_EQ(order.size(), count);
+
+            std::sort(order.begin(), order.end());
+            for (uint64_t i = 0; i < count; ++i) {
+                EXPECT_EQ(order[i], i);
+            }
+        }
+    }
+}
+
+TEST(EpochShuffler, SamplesStayInTheirWindow) {
+    auto offsets = random_offsets(1000);
+
+    ShuffleOptions options;
+    options.window_size = 32;
+    options.interleave  = 4;
+    options.seed        = 99;
+
+    auto          window = windows(offsets, options.window_size);
+    auto          count  = (offsets.size() + options.window_size - 1) / options.window_size;
+    EpochShuffler shuffler(offsets, options);
+
+    for (uint64_t epoch = 0; epoch < 4; ++epoch) {
+        auto order = shuffler.epoch(epoch);
+
+        // a window is read in one stretch: once its last sample is read it never comes back
+        Array<uint64_t> first(count, order.size());
+        Array<uint64_t> last(count, 0);
+        Array<uint64_t> seen(count, 0);
+        for (uint64_t i = 0; i < order.size(); ++i) {
+            auto w   = window[order[i]];
+            first[w] = std::min(first[w], i);
+            last[w]  = i;
+            seen[w] += 1;
+        }
+
+        for (uint64_t w = 0; w < count; ++w) {
+            EXPECT_EQ(seen[w], std::min<uint64_t>(options.window_size, offsets.size() - w * options.window_size));
+        }
+
+        // at most interleave windows are read at the same time
+        for (uint64_t i = 0; i < order.size(); ++i) {
+            uint64_t open = 0;
+            for (uint64_t w = 0; w < count; ++w) {
+                open += first[w] <= i && i <= last[w];
+            }
+            EXPECT_LE(open, options.interleave) << "position " << i;
+        }
+
+        // the windows are shuffled, they are not read in disk order
+        Array<uint64_t> starts(count);
+        std::iota(starts.begin(), starts.end(), 0);
+        std::sort(starts.begin(), starts.end(), [&](uint64_t a, uint64_t b) { return first[a] < first[b]; });
+        EXPECT_FALSE(std::is_sorted(starts.begin(), starts.end()));
+    }
+}
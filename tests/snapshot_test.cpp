@@ -0,0 +1,168 @@
+#include "bcachefs.h"
+#include "image_writer.h"
+#include "test_image.h"
+
+#include <sys/stat.h>
+
+namespace {
+// snapshot 10 is the root, 5 and 4 are its children
+#define ROOT_SNAPSHOT 10
+#define CHILD_SNAPSHOT 5
+#define WHITEOUT_SNAPSHOT 4
+
+uint64_t const FILE_INODE = BCACHEFS_ROOT_INO + 1;
+
+bool add_snapshot(ImageWriter &image, uint32_t id, uint32_t parent) {
+    auto snapshot   = BSnapshot{};
+    snapshot.parent = parent;
+    return image.add_key(BTREE_ID_snapshots, POS(0, id), KEY_TYPE_snapshot, 0, &snapshot, sizeof(snapshot));
+}
+
+bool add_extent(ImageWriter &image, uint64_t block, uint64_t offset, uint32_t snapshot, bool journal = false) {
+    auto ptr   = BExtendPtr{};
+    ptr.type   = 1 << BCH_EXTENT_ENTRY_ptr;
+    ptr.offset = offset / BCH_SECTOR_SIZE;
+
+    // extents are indexed by their end
+    auto p = SPOS(FILE_INODE, (block + 1) * 8, snapshot);
+    if (journal) {
+        return image.add_journal_key(BTREE_ID_extents, p, KEY_TYPE_extent, 8, &ptr, sizeof(ptr));
+    }
+    return image.add_key(BTREE_ID_extents, p, KEY_TYPE_extent, 8, &ptr, sizeof(ptr));
+}
+
+bool add_whiteout(ImageWriter &image, uint64_t block, uint32_t snapshot, bool journal = false) {
+    auto p = SPOS(FILE_INODE, (block + 1) * 8, snapshot);
+    if (journal) {
+        return image.add_journal_key(BTREE_ID_extents, p, KEY_TYPE_discard, 8, nullptr, 0);
+    }
+    return image.add_key(BTREE_ID_extents, p, KEY_TYPE_discard, 8, nullptr, 0);
+}
+
+// the first block of the file is rewritten in the child and removed in the other child
+// with journal, the versions of the children only live in the journal
+void write_snapshots(String const &path, bool journal) {
+    ImageOptions options;
+    options.node_size = 16 * 1024;
+    options.clean     = !journal;
+
+    ImageWriter image(path, options);
+
+    // blocks filled with 1, 2 and 3
+    uint64_t data[3];
+    for (uint8_t i = 0; i < 3; ++i) {
+        Array<uint8_t> block(4096, (uint8_t)(i + 1));
+        data[i] = image.append(block.data(), block.size(), 4096);
+    }
+
+    // sorted by snapshot inside a position, children have the smallest ids
+    if (!journal) {
+        ASSERT_TRUE(add_whiteout(image, 0, WHITEOUT_SNAPSHOT));
+        ASSERT_TRUE(add_extent(image, 0, data[1], CHILD_SNAPSHOT));
+    }
+    ASSERT_TRUE(add_extent(image, 0, data[0], ROOT_SNAPSHOT));
+    ASSERT_TRUE(add_extent(image, 1, data[2], ROOT_SNAPSHOT));
+
+    for (auto snapshot: {WHITEOUT_SNAPSHOT, CHILD_SNAPSHOT, ROOT_SNAPSHOT}) {
+        ASSERT_TRUE(image.add_key(BTREE_ID_inodes, SPOS(0, FILE_INODE, snapshot), KEY_TYPE_inode, 0, nullptr, 0));
+    }
+
+    ASSERT_TRUE(add_snapshot(image, WHITEOUT_SNAPSHOT, ROOT_SNAPSHOT));
+    ASSERT_TRUE(add_snapshot(image, CHILD_SNAPSHOT, ROOT_SNAPSHOT));
+    ASSERT_TRUE(add_snapshot(image, ROOT_SNAPSHOT, 0));
+
+    if (journal) {
+        ASSERT_TRUE(add_extent(image, 0, data[1], CHILD_SNAPSHOT, true));
+        ASSERT_TRUE(add_whiteout(image, 0, WHITEOUT_SNAPSHOT, true));
+    }
+    ASSERT_TRUE(image.finish());
+}
+
+// first byte of each extent, the blocks are filled with a single value
+Array<uint8_t> extent_blocks(BCacheFSReader const &reader, uint32_t snapshot) {
+    Array<uint8_t> blocks;
+    for (auto &ext: reader.file_extents(FILE_INODE, snapshot)) {
+        uint8_t byte = 0;
+        reader.read(ext.offset, &byte, 1);
+        blocks.push_back(byte);
+    }
+    return blocks;
+}
+} // namespace
+
+TEST_F(ImageTest, SnapshotsReadTheirClosestVersion) {
+    write_snapshots(path, false);
+    BCacheFSReader reader(path);
+
+    EXPECT_EQ(reader.snapshot_ancestors(CHILD_SNAPSHOT), Array<uint32_t>({0, CHILD_SNAPSHOT, ROOT_SNAPSHOT}));
+    EXPECT_EQ(extent_blocks(reader, ROOT_SNAPSHOT), Array<uint8_t>({1, 3}));
+    EXPECT_EQ(extent_blocks(reader, CHILD_SNAPSHOT), Array<uint8_t>({2, 3}));
+}
+
+TEST_F(ImageTest, WhiteoutsHideTheVersionsOfTheAncestors) {
+    write_snapshots(path, false);
+    BCacheFSReader reader(path);
+
+    EXPECT_EQ(extent_blocks(reader, WHITEOUT_SNAPSHOT), Array<uint8_t>({3}));
+
+    // without a snapshot every version is returned but the whiteout
+    uint64_t keys = 0;
+    reader.for_each_key(BTREE_ID_extents, [&](KeySpan span) {
+        for (auto &view: span) {
+            EXPECT_NE(view.key->type, KEY_TYPE_discard);
+        }
+        keys += span.size();
+    });
+    EXPECT_EQ(keys, 3u);
+}
+
+TEST_F(ImageTest, JournalSnapshotsReadTheirClosestVersion) {
+    write_snapshots(path, true);
+    BCacheFSReader reader(path, true);
+
+    EXPECT_EQ(extent_blocks(reader, ROOT_SNAPSHOT), Array<uint8_t>({1, 3}));
+    EXPECT_EQ(extent_blocks(reader, CHILD_SNAPSHOT), Array<uint8_t>({2, 3}));
+    EXPECT_EQ(extent_blocks(reader, WHITEOUT_SNAPSHOT), Array<uint8_t>({3}));
+
+    uint64_t keys = 0;
+    reader.for_each_key(
+        BTREE_ID_extents, POS(FILE_INODE, 0), SPOS(FILE_INODE, ~0ULL, ~0U), [&](KeySpan span) { keys += span.size(); },
+        CHILD_SNAPSHOT);
+    EXPECT_EQ(keys, 2u);
+}
+
+TEST_F(ImageTest, FindSkipsDeletions) {
+    write_snapshots(path, false);
+    BCacheFSReader reader(path);
+
+    // the first key of the file is the whiteout
+    auto key = reader.find(BTREE_ID_extents, POS(FILE_INODE, 0));
+    ASSERT_TRUE(key);
+    EXPECT_EQ(key.key->type, KEY_TYPE_extent);
+    EXPECT_EQ(key.local.p.snapshot, (uint32_t)CHILD_SNAPSHOT);
+}
+
+TEST_F(ImageTest, FindSkipsJournalDeletions) {
+    ImageOptions options;
+    options.node_size = 16 * 1024;
+    options.clean     = false;
+    {
+        ImageWriter image(path, options);
+        Array<uint8_t> block(4096, 1);
+        auto           offset = image.append(block.data(), block.size(), 4096);
+
+        ASSERT_TRUE(image.add_extent(FILE_INODE, 0, offset, 4096));
+        ASSERT_TRUE(image.add_extent(FILE_INODE, 4096, offset, 4096));
+        ASSERT_TRUE(image.add_inode(FILE_INODE, S_IFREG | 0644, 2 * 4096, 1));
+
+        // the first block is removed, the second one becomes a whiteout
+        ASSERT_TRUE(image.add_journal_key(BTREE_ID_extents, POS(FILE_INODE, 8), KEY_TYPE_deleted, 8, nullptr, 0));
+        ASSERT_TRUE(image.add_journal_key(BTREE_ID_extents, POS(FILE_INODE, 16), KEY_TYPE_discard, 8, nullptr, 0));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path, true);
+
+    EXPECT_FALSE(reader.find(BTREE_ID_extents, POS(FILE_INODE, 0)));
+    EXPECT_TRUE(reader.file_extents(FILE_INODE).empty());
+}
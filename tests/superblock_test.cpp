@@ -0,0 +1,92 @@
+#include "bcachefs.h"
+#include "image_writer.h"
+#include "test_image.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+
+namespace {
+// sectors of the superblock copies written by ImageWriter
+uint64_t const PRIMARY = BCH_SB_SECTOR;
+uint64_t const BACKUP  = BCH_SB_SECTOR + (1ULL << IMAGE_SB_SIZE_BITS);
+
+void write_image(String const &path) {
+    auto options       = small_image();
+    options.file_count = 20;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+}
+
+// change the first flags of a copy without updating its checksum
+void edit_flags(String const &path, uint64_t sector, uint64_t mask, uint64_t value) {
+    auto     file   = fopen(path.c_str(), "r+b");
+    auto     offset = (long)(sector * BCH_SECTOR_SIZE + offsetof(Superblock, flags));
+    uint64_t flags  = 0;
+
+    fseek(file, offset, SEEK_SET);
+    ASSERT_EQ(fread(&flags, sizeof(flags), 1, file), 1u);
+
+    flags = (flags & ~mask) | (value & mask);
+    fseek(file, offset, SEEK_SET);
+    ASSERT_EQ(fwrite(&flags, sizeof(flags), 1, file), 1u);
+    fclose(file);
+}
+
+// the node size is doubled, the checksum does not match anymore
+void corrupt(String const &path, uint64_t sector) { edit_flags(path, sector, 1ULL << 12, ~0ULL); }
+
+void expect_readable(BCacheFSReader const &reader) {
+    auto options       = small_image();
+    options.file_count = 20;
+
+    ASSERT_TRUE(reader.valid());
+    EXPECT_EQ(reader.btree_node_size(), options.image.node_size);
+
+    auto data     = reader.read_file(synthetic_file_inode(options, 0));
+    auto expected = file_content(options, 0);
+    EXPECT_EQ(data, expected);
+}
+} // namespace
+
+TEST(Superblock, MissingImageIsInvalid) {
+    BCacheFSReader reader("missing.img");
+
+    EXPECT_FALSE(reader.valid());
+    EXPECT_EQ(reader.iterator(BTREE_ID_extents).next_key(), nullptr);
+    EXPECT_TRUE(reader.read_file(BCACHEFS_ROOT_INO + 1).empty());
+}
+
+TEST_F(ImageTest, CorruptedPrimarySuperblockUsesTheBackup) {
+    write_image(path);
+    corrupt(path, PRIMARY);
+
+    BCacheFSReader reader(path);
+    expect_readable(reader);
+}
+
+TEST_F(ImageTest, CorruptedSuperblocksAreInvalid) {
+    write_image(path);
+    corrupt(path, PRIMARY);
+    corrupt(path, BACKUP);
+
+    BCacheFSReader reader(path);
+    EXPECT_FALSE(reader.valid());
+    EXPECT_EQ(reader.iterator(BTREE_ID_extents).next_key(), nullptr);
+}
+
+TEST_F(ImageTest, UnsupportedChecksumIsRejected) {
+    write_image(path);
+
+    // xxhash cannot be verified, the copy is not trusted
+    uint64_t mask = ((1ULL << 6) - 1) << 2;
+    edit_flags(path, PRIMARY, mask, (uint64_t)BCH_CSUM_xxhash << 2);
+    {
+        BCacheFSReader reader(path);
+        expect_readable(reader);
+    }
+
+    edit_flags(path, BACKUP, mask, (uint64_t)BCH_CSUM_chacha20_poly1305_128 << 2);
+
+    BCacheFSReader reader(path);
+    EXPECT_FALSE(reader.valid());
+}
@@ -0,0 +1,47 @@
+#ifndef BCACHE_FS_TESTS_TEST_IMAGE_HEADER
+#define BCACHE_FS_TESTS_TEST_IMAGE_HEADER
+
+#include "synthetic.h"
+
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+// a few small files in a few directories, every file gets a couple of extents
+inline SyntheticOptions small_image() {
+    SyntheticOptions options;
+    options.image.node_size  = 16 * 1024;
+    options.image.block_size = 4096;
+    options.image.seed       = 42;
+    options.file_count       = 300;
+    options.files_per_dir    = 50;
+    options.distribution     = SizeDistribution::UNIFORM;
+    options.min_size         = 1;
+    options.max_size         = 20 * 1024;
+    options.inline_size      = 512;
+    options.extent_size      = 8 * 1024;
+    return options;
+}
+
+// expected content of the file i
+inline Array<uint8_t> file_content(SyntheticOptions const &options, uint64_t i) {
+    Array<uint8_t> data(synthetic_file_size(options, i));
+    synthetic_file_content(synthetic_file_inode(options, i), 0, data.data(), data.size());
+    return data;
+}
+
+// Tests working on an image written by the generator
+// the image is named after the test and removed once it is over
+struct ImageTest: public testing::Test {
+    protected:
+    void SetUp() override {
+        auto info = testing::UnitTest::GetInstance()->current_test_info();
+        path      = fmt::format("{}.{}.img", info->test_case_name(), info->name());
+    }
+
+    void TearDown() override { unlink(path.c_str()); }
+
+    String path;
+};
+
+#endif
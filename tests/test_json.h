@@ -0,0 +1,184 @@
+#ifndef BCACHE_FS_TESTS_TEST_JSON_HEADER
+#define BCACHE_FS_TESTS_TEST_JSON_HEADER
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Minimal JSON parser to check the documents written by the library
+// numbers are doubles, escapes other than \" and \\ are kept as is
+struct Json {
+    enum Type
+    {
+        NUL,
+        BOOLEAN,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+
+    Type                        type    = NUL;
+    bool                        boolean = false;
+    double                      number  = 0;
+    std::string                 string;
+    std::vector<Json>           array;
+    std::map<std::string, Json> object;
+
+    bool has(std::string const &key) const { return type == OBJECT && object.count(key) != 0; }
+
+    Json const &operator[](std::string const &key) const { return object.at(key); }
+
+    // false if the text is not a single well formed value
+    static bool parse(std::string_view text, Json &out) {
+        std::size_t pos = 0;
+        return parse_value(text, pos, out) && (skip_space(text, pos), pos == text.size());
+    }
+
+    private:
+    static void skip_space(std::string_view text, std::size_t &pos) {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\t' || text[pos] == '\r')) {
+            pos += 1;
+        }
+    }
+
+    static bool parse_string(std::string_view text, std::size_t &pos, std::string &out) {
+        if (pos >= text.size() || text[pos] != '"') {
+            return false;
+        }
+
+        for (pos += 1; pos < text.size(); ++pos) {
+            if (text[pos] == '"') {
+                pos += 1;
+                return true;
+            }
+            if (text[pos] == '\\') {
+                pos += 1;
+                if (pos == text.size()) {
+                    return false;
+                }
+                if (text[pos] != '"' && text[pos] != '\\') {
+                    out.push_back('\\');
+                }
+            } else if ((unsigned char)text[pos] < 0x20) {
+                return false;
+            }
+            out.push_back(text[pos]);
+        }
+        return false;
+    }
+
+    static bool parse_value(std::string_view text, std::size_t &pos, Json &out) {
+        skip_space(text, pos);
+        if (pos >= text.size()) {
+            return false;
+        }
+
+        auto literal = [&](std::string_view word) {
+            if (text.substr(pos, word.size()) != word) {
+                return false;
+            }
+            pos += word.size();
+            return true;
+        };
+
+        switch (text[pos]) {
+        case '{':
+            out.type = OBJECT;
+            pos += 1;
+            skip_space(text, pos);
+            if (pos < text.size() && text[pos] == '}') {
+                pos += 1;
+                return true;
+            }
+
+            while (true) {
+                std::string key;
+                skip_space(text, pos);
+                if (!parse_string(text, pos, key)) {
+                    return false;
+                }
+
+                skip_space(text, pos);
+                if (pos >= text.size() || text[pos] != ':' || out.object.count(key) != 0) {
+                    return false;
+                }
+                pos += 1;
+
+                if (!parse_value(text, pos, out.object[key])) {
+                    return false;
+                }
+
+                skip_space(text, pos);
+                if (pos < text.size() && text[pos] == ',') {
+                    pos += 1;
+                } else if (pos < text.size() && text[pos] == '}') {
+                    pos += 1;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+
+        case '[':
+            out.type = ARRAY;
+            pos += 1;
+            skip_space(text, pos);
+            if (pos < text.size() && text[pos] == ']') {
+                pos += 1;
+                return true;
+            }
+
+            while (true) {
+                out.array.emplace_back();
+                if (!parse_value(text, pos, out.array.back())) {
+                    return false;
+                }
+
+                skip_space(text, pos);
+                if (pos < text.size() && text[pos] == ',') {
+                    pos += 1;
+                } else if (pos < text.size() && text[pos] == ']') {
+                    pos += 1;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+
+        case '"':
+            out.type = STRING;
+            return parse_string(text, pos, out.string);
+
+        case 't':
+            out.type    = BOOLEAN;
+            out.boolean = true;
+            return literal("true");
+
+        case 'f':
+            out.type = BOOLEAN;
+            return literal("false");
+
+        case 'n': return literal("null");
+
+        default: {
+            std::string number(text.substr(pos, 64));
+            char *      end = nullptr;
+            out.type        = NUMBER;
+            out.number      = strtod(number.c_str(), &end);
+
+            // strtod also takes hexadecimal, infinities and nan
+            auto size = (std::size_t)(end - number.c_str());
+            if (size == 0 || number.substr(0, size).find_first_not_of("0123456789+-.eE") != std::string::npos) {
+                return false;
+            }
+            pos += size;
+            return true;
+        }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include "bcachefs.h"
+#include "image_writer.h"
+#include "test_image.h"
+#include "test_json.h"
+#include "trace.h"
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include <sys/stat.h>
+
+namespace {
+uint64_t const FIRST_FILE = BCACHEFS_ROOT_INO + 1;
+
+Json read_trace(String const &path) {
+    std::ifstream     file(path);
+    std::stringstream text;
+    text << file.rdbuf();
+
+    Json trace;
+    EXPECT_TRUE(Json::parse(text.str(), trace)) << text.str().substr(0, 200);
+    unlink(path.c_str());
+    return trace;
+}
+
+// every event is a complete event with its timing
+void expect_events(Json const &trace) {
+    ASSERT_TRUE(trace.has("traceEvents"));
+    ASSERT_EQ(trace["traceEvents"].type, Json::ARRAY);
+
+    for (auto &event: trace["traceEvents"].array) {
+        ASSERT_EQ(event.type, Json::OBJECT);
+        EXPECT_EQ(event["name"].type, Json::STRING);
+        EXPECT_EQ(event["ph"].string, "X");
+        EXPECT_EQ(event["pid"].number, (double)getpid());
+        EXPECT_GT(event["tid"].number, 0);
+        EXPECT_GE(event["ts"].number, 0);
+        EXPECT_GE(event["dur"].number, 0);
+    }
+
+    ASSERT_TRUE(trace.has("otherData"));
+    EXPECT_EQ(trace["otherData"]["events"].number, (double)trace["traceEvents"].array.size());
+}
+
+std::set<std::string> names(Json const &trace) {
+    std::set<std::string> out;
+    for (auto &event: trace["traceEvents"].array) {
+        out.insert(event["name"].string);
+    }
+    return out;
+}
+
+void record_spans(int count) {
+    for (int i = 0; i < count; ++i) {
+        TRACE_SPAN("test_span");
+    }
+}
+} // namespace
+
+TEST_F(ImageTest, TraceHoldsTheSpansOfTheReader) {
+    {
+        ImageOptions options;
+        options.clean = false;
+
+        ImageWriter    image(path, options);
+        Array<uint8_t> data(3 * 4096, 7);
+        auto           start = image.append(data.data(), data.size(), 4096);
+
+        ASSERT_TRUE(image.add_reflink_p(FIRST_FILE, 0, 0, 8192));
+        ASSERT_TRUE(image.add_indirect_extent(0, start, 8192));
+        ASSERT_TRUE(image.add_inode(BCACHEFS_ROOT_INO, S_IFDIR | 0755, 0, 2));
+        ASSERT_TRUE(image.add_inode(FIRST_FILE, S_IFREG | 0644, 3 * 4096, 1));
+
+        // the last block comes from the journal
+        auto ptr   = BExtendPtr{};
+        ptr.type   = 1 << BCH_EXTENT_ENTRY_ptr;
+        ptr.offset = (start + 2 * 4096) / BCH_SECTOR_SIZE;
+        ASSERT_TRUE(image.add_journal_key(BTREE_ID_extents, POS(FIRST_FILE, 3 * 8), KEY_TYPE_extent, 8, &ptr,
+                                          sizeof(ptr)));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    ASSERT_TRUE(reader.valid());
+
+    trace_start();
+    EXPECT_EQ(reader.read_file(FIRST_FILE), Array<uint8_t>(3 * 4096, 7));
+
+    uint64_t keys = 0;
+    reader.for_each_key(BTREE_ID_extents, [&](KeySpan span) { keys += span.size(); });
+    EXPECT_EQ(keys, 2u);
+    trace_stop();
+
+    auto trace_path = path + ".json";
+    ASSERT_TRUE(trace_dump(trace_path));
+
+    auto trace = read_trace(trace_path);
+    expect_events(trace);
+    EXPECT_EQ(trace["otherData"]["dropped"].number, 0);
+
+    auto found = names(trace);
+    for (auto name: {"read_file", "file_extents", "load_btree_node", "merge_journal", "merge_bsets",
+                      "resolve_reflink"}) {
+        EXPECT_TRUE(found.count(name)) << name;
+    }
+}
+
+TEST_F(ImageTest, TraceReportsTheDroppedEvents) {
+    auto trace_path = path + ".json";
+
+    // one chunk per thread
+    trace_start(1);
+    std::thread first([]() { record_spans(TRACE_CHUNK_EVENTS + 100); });
+    std::thread second([]() { record_spans(10); });
+    first.join();
+    second.join();
+    trace_stop();
+
+    // spans are not recorded once stopped
+    record_spans(10);
+
+    ASSERT_TRUE(trace_dump(trace_path));
+    auto trace = read_trace(trace_path);
+    expect_events(trace);
+
+    EXPECT_EQ(trace["traceEvents"].array.size(), TRACE_CHUNK_EVENTS + 10u);
+    EXPECT_EQ(trace["otherData"]["dropped"].number, 100);
+}
+
+TEST_F(ImageTest, TraceStartForgetsThePreviousTrace) {
+    auto trace_path = path + ".json";
+
+    trace_start();
+    record_spans(50);
+    trace_start();
+    record_spans(5);
+    trace_stop();
+
+    ASSERT_TRUE(trace_dump(trace_path));
+    auto trace = read_trace(trace_path);
+    expect_events(trace);
+    EXPECT_EQ(trace["traceEvents"].array.size(), 5u);
+}
+
+TEST(Json, RejectsMalformedDocuments) {
+    Json value;
+    EXPECT_TRUE(Json::parse(R"({"a": [1, -2.5e3, "x\"y", true, false, null], "b": {}})", value));
+    EXPECT_EQ(value["a"].array.size(), 6u);
+    EXPECT_EQ(value["a"].array[1].number, -2500);
+    EXPECT_EQ(value["a"].array[2].string, "x\"y");
+
+    for (auto text: {"", "{", "[1,]", "{\"a\" 1}", "{\"a\": 1,}", "[1] 2", "nan", "{\"a\": 1, \"a\": 2}"}) {
+        Json bad;
+        EXPECT_FALSE(Json::parse(text, bad)) << text;
+    }
+}
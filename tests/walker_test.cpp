@@ -0,0 +1,117 @@
+#include "test_image.h"
+#include "walker.h"
+
+#include <map>
+#include <tuple>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+using Listing = std::map<String, std::pair<uint64_t, uint8_t>>;
+
+Listing listing(PathTable const &table) {
+    Listing out;
+    for (auto &entry: table.entries) {
+        EXPECT_TRUE(out.emplace(String(entry.path), std::make_pair(entry.inode, entry.type)).second) << entry.path;
+    }
+    return out;
+}
+} // namespace
+
+TEST(NameArena, ViewsSurviveNewChunksAndMerges) {
+    NameArena               arena;
+    NameArena               other;
+    Array<std::string_view> views;
+    Array<String>           expected;
+    String                  long_name(100 * 1024, 'x');
+
+    for (int i = 0; i < 20000; ++i) {
+        auto &target = i % 2 == 0 ? arena : other;
+        auto  dir    = fmt::format("d{}", i % 7);
+        auto  name   = i % 5000 == 0 ? long_name : fmt::format("f{}", i);
+
+        views.push_back(target.join(i % 3 == 0 ? "" : dir, name));
+        expected.push_back(i % 3 == 0 ? name : dir + "/" + name);
+    }
+
+    auto size = arena.size() + other.size();
+    arena.merge(std::move(other));
+    EXPECT_EQ(arena.size(), size);
+    EXPECT_EQ(other.size(), 0u);
+
+    for (std::size_t i = 0; i < views.size(); ++i) {
+        EXPECT_EQ(views[i], expected[i]) << i;
+    }
+}
+
+TEST_F(ImageTest, WalkerListsEveryFile) {
+    auto options          = small_image();
+    options.file_count    = 3000;
+    options.files_per_dir = 200;
+    options.fill          = false;
+    ASSERT_TRUE(write_synthetic_image(path, options));
+
+    Listing expected;
+    for (uint64_t k = 0; k < synthetic_directory_count(options); ++k) {
+        expected[fmt::format("d{:08}", k)] = {BCACHEFS_ROOT_INO + 1 + k, DT_DIR};
+    }
+    for (uint64_t i = 0; i < options.file_count; ++i) {
+        expected[synthetic_file_path(options, i).substr(1)] = {synthetic_file_inode(options, i), DT_REG};
+    }
+
+    BCacheFSReader reader(path);
+
+    // the result does not depend on how the directories are spread between the threads
+    for (unsigned threads: {1, 3, 16}) {
+        WalkOptions walk;
+        walk.threads = threads;
+        walk.nodes   = 8;
+
+        auto table = walk_tree(reader, walk);
+        EXPECT_EQ(listing(table), expected) << threads << " threads";
+    }
+}
+
+TEST_F(ImageTest, WalkerFollowsNestedDirectories) {
+    ImageOptions options;
+    options.node_size = 16 * 1024;
+
+    auto root = BCACHEFS_ROOT_INO;
+    {
+        ImageWriter image(path, options);
+        ASSERT_TRUE(image.add_inode(root, S_IFDIR | 0755, 0, 4));
+        ASSERT_TRUE(image.add_inode(root + 1, S_IFDIR | 0755, 0, 3)); // a
+        ASSERT_TRUE(image.add_inode(root + 2, S_IFDIR | 0755, 0, 2)); // b, empty
+        ASSERT_TRUE(image.add_inode(root + 3, S_IFDIR | 0755, 0, 2)); // a/c
+        ASSERT_TRUE(image.add_inode(root + 4, S_IFREG | 0644, 0, 1)); // a/x
+        ASSERT_TRUE(image.add_inode(root + 5, S_IFREG | 0644, 0, 1)); // a/c/y
+
+        using Entry = std::tuple<String, uint64_t, uint8_t>; // name, inode, d_type
+
+        auto add = [&](uint64_t dir, Array<Entry> const &entries) {
+            auto name  = [&](uint64_t j) { return std::string_view(std::get<0>(entries[j])); };
+            auto inode = [&](uint64_t j) { return std::get<1>(entries[j]); };
+            auto type  = [&](uint64_t j) { return std::get<2>(entries[j]); };
+            return add_directory(image, dir, entries.size(), name, inode, type);
+        };
+        ASSERT_TRUE(add(root, {{"a", root + 1, DT_DIR}, {"b", root + 2, DT_DIR}}));
+        ASSERT_TRUE(add(root + 1, {{"c", root + 3, DT_DIR}, {"x", root + 4, DT_REG}}));
+        ASSERT_TRUE(add(root + 3, {{"y", root + 5, DT_REG}}));
+        ASSERT_TRUE(image.finish());
+    }
+
+    BCacheFSReader reader(path);
+    ASSERT_TRUE(reader.valid());
+
+    Listing expected = {
+        {"a", {root + 1, DT_DIR}},   {"b", {root + 2, DT_DIR}},     {"a/c", {root + 3, DT_DIR}},
+        {"a/x", {root + 4, DT_REG}}, {"a/c/y", {root + 5, DT_REG}},
+    };
+    EXPECT_EQ(listing(walk_tree(reader, WalkOptions{4})), expected);
+}
+
+TEST(Walker, InvalidImageHasNoEntries) {
+    BCacheFSReader reader("missing.img");
+    EXPECT_TRUE(walk_tree(reader).entries.empty());
+}